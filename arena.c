@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define HEADER_SIZE ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static _Thread_local Arena thread_arena;
+
+
+static size_t align_size(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static char* block_data(ArenaBlock *b) {
+    return (char*)b + HEADER_SIZE;
+}
+
+static void new_block(Arena *a, size_t size) {
+    ArenaBlock *b = malloc(HEADER_SIZE + size);
+    if (b == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    b->next = a->blocks;
+    b->size = size;
+    b->used = 0;
+    a->blocks = b;
+}
+
+
+void* arena_alloc(Arena *a, size_t size) {
+    ArenaBlock *b = a->blocks;
+    size_t grown;
+
+    size = align_size(size > 0 ? size : 1);
+    if (b == NULL || b->size - b->used < size) {
+        grown = b != NULL ? b->size * 2 : ARENA_BLOCK_SIZE;
+        new_block(a, grown > size ? grown : size);
+        b = a->blocks;
+    }
+    a->last = block_data(b) + b->used;
+    b->used += size;
+    return a->last;
+}
+
+void* arena_grow(Arena *a, void *ptr, size_t old_size, size_t new_size) {
+    ArenaBlock *b = a->blocks;
+    char *start;
+    void *grown;
+
+    if (ptr != NULL && ptr == a->last) {
+        start = a->last;
+        if (align_size(new_size) <= b->size - (size_t)(start - block_data(b))) {
+            b->used = (size_t)(start - block_data(b)) + align_size(new_size > 0 ? new_size : 1);
+            return ptr;
+        }
+    }
+    grown = arena_alloc(a, new_size);
+    if (ptr != NULL) {
+        memcpy(grown, ptr, old_size < new_size ? old_size : new_size);
+    }
+    return grown;
+}
+
+char* arena_strndup(Arena *a, const char *str, size_t length) {
+    char *copy = arena_alloc(a, length + 1);
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+ArenaMark arena_mark(const Arena *a) {
+    ArenaMark mark;
+    mark.block = a->blocks;
+    mark.used = a->blocks != NULL ? a->blocks->used : 0;
+    return mark;
+}
+
+void arena_rewind(Arena *a, ArenaMark mark) {
+    if (a->blocks != NULL && a->blocks == mark.block) {
+        a->blocks->used = mark.used;
+        a->last = NULL;
+    }
+}
+
+void reset_arena(Arena *a) {
+    ArenaBlock *b, *next;
+    size_t total = 0;
+
+    a->last = NULL;
+    if (a->blocks == NULL) {
+        return;
+    }
+    if (a->blocks->next == NULL && a->blocks->size <= ARENA_KEEP_SIZE) {
+        a->blocks->used = 0;
+        return;
+    }
+    /* One block as large as them all, so the same command next time fits in it */
+    for (b = a->blocks; b != NULL; b = next) {
+        next = b->next;
+        total += b->size;
+        free(b);
+    }
+    a->blocks = NULL;
+    new_block(a, total < ARENA_KEEP_SIZE ? total : ARENA_KEEP_SIZE);
+}
+
+void free_arena(Arena *a) {
+    ArenaBlock *b, *next;
+
+    for (b = a->blocks; b != NULL; b = next) {
+        next = b->next;
+        free(b);
+    }
+    a->blocks = NULL;
+    a->last = NULL;
+}
+
+Arena* command_arena(void) {
+    return &thread_arena;
+}
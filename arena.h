@@ -0,0 +1,107 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE (64 * 1024)  /* First block; each new block doubles */
+#define ARENA_KEEP_SIZE (1 << 20)     /* Most memory kept from one command to the next */
+#define ARENA_ALIGN 16
+
+/**
+ * @brief A block of arena memory; the allocations follow the header.
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;  /* The block filled before this one */
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+/**
+ * @brief Bump allocator for memory that lives until the end of a command.
+ *
+ * Allocating takes the next bytes of the current block; nothing is freed
+ * on its own. reset_arena empties it, merging the blocks into one so that
+ * the next command needs no malloc. A zero-initialized Arena is valid.
+ */
+typedef struct {
+    ArenaBlock *blocks;  /* Newest first */
+    void *last;          /* The latest allocation, which arena_grow extends in place */
+} Arena;
+
+/**
+ * @brief A point to rewind an arena to, from arena_mark.
+ */
+typedef struct {
+    ArenaBlock *block;
+    size_t used;
+} ArenaMark;
+
+/**
+ * @brief Allocate memory from an arena.
+ * @param a The arena.
+ * @param size Bytes wanted.
+ * @return The memory, aligned to ARENA_ALIGN; valid until the arena is reset.
+ */
+void* arena_alloc(Arena *a, size_t size);
+
+/**
+ * @brief Resize an allocation, like realloc.
+ *
+ * The latest allocation grows in place while its block has room; any other
+ * is copied to a new allocation.
+ * @param a The arena.
+ * @param ptr The allocation, or NULL.
+ * @param old_size Its size.
+ * @param new_size The size wanted.
+ * @return The allocation, holding the first old_size bytes of ptr.
+ */
+void* arena_grow(Arena *a, void *ptr, size_t old_size, size_t new_size);
+
+/**
+ * @brief Copy a string into an arena.
+ * @param a The arena.
+ * @param str The string.
+ * @param length Bytes of str to copy; a null terminator is added.
+ * @return The copy.
+ */
+char* arena_strndup(Arena *a, const char *str, size_t length);
+
+/**
+ * @brief Remember the current top of an arena.
+ * @param a The arena.
+ * @return The mark, for arena_rewind.
+ */
+ArenaMark arena_mark(const Arena *a);
+
+/**
+ * @brief Release the allocations made since a mark.
+ *
+ * If a new block was started since, the memory is only released by reset_arena.
+ * @param a The arena.
+ * @param mark A mark of this arena taken since it was last reset.
+ */
+void arena_rewind(Arena *a, ArenaMark mark);
+
+/**
+ * @brief Release every allocation of an arena.
+ *
+ * The blocks are merged into one, up to ARENA_KEEP_SIZE, which is kept.
+ * @param a The arena.
+ */
+void reset_arena(Arena *a);
+
+/**
+ * @brief Release an arena and its memory.
+ * @param a The arena.
+ */
+void free_arena(Arena *a);
+
+/**
+ * @brief Get the calling thread's arena for the temporaries of a command.
+ *
+ * Whatever runs commands resets it after each one.
+ * @return The arena.
+ */
+Arena* command_arena(void);
+
+#endif /* ARENA_H */
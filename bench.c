@@ -0,0 +1,1274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "parser.h"
+#include "input.h"
+#include "registry.h"
+#include "kernels.h"
+#include "fixed.h"
+#include "parallel.h"
+#include "stats.h"
+#include "set.h"
+#include "cset.h"
+#include "rank.h"
+#include "snapshot.h"
+#include "persist.h"
+#include "similarity.h"
+#include "view.h"
+#include "commands.h"
+#include "schedule.h"
+#include "arena.h"
+#include "protocol.h"
+#include "validations.h"
+
+
+/*
+ * File Name: bench.c
+ * Description:
+ * Microbenchmarks for the set management program. Results are written to
+ * standard output as CSV, one row per measurement:
+ *
+ *   benchmark,variant,size,density,ns_per_op,ops_per_sec,gb_per_sec
+ *
+ * size is the universe in members for set benchmarks, the number of
+ * commands for parser benchmarks, the number of members for read_set
+ * lines and frames, the universe for add_range, rank, select, snapshot
+ * and view_update, the universe of each of the sets for load, and the
+ * number of sets for similar. The fixed-width rows time one
+ * operation on sets of exactly size members. For similar, density holds
+ * the recall of the top SIMILAR_K against the exact scan instead. gb_per_sec counts the bytes an operation
+ * reads and writes: dense bitmap bytes for set operations (also for the
+ * compressed variant, so the two compare directly), input bytes for
+ * read_set and the parsers (frame bytes for the binary variants). The thread scaling curve goes up to the
+ * number of online CPUs, or to the first argument.
+ */
+
+#define COMMAND_COUNT 100000
+#define COMMAND_LENGTH 256
+#define SCALING_WORDS (1L << 22)
+#define INGEST_MEMBERS 1000000
+#define INGEST_UNIVERSE (1L << 24)
+#define RANGE_FIRST 1000003L   /* Neither word nor chunk aligned */
+#define RANGE_MEMBERS 4000000L
+#define RANK_UNIVERSE (1L << 24)
+#define RANK_QUERIES 256
+#define SNAPSHOT_UNIVERSE (1L << 27)   /* 16 MiB, 256 chunks */
+#define LOAD_SETS 4
+#define LOAD_UNIVERSE (1L << 27)       /* Per set: a 64 MiB file */
+#define LOAD_PATH "/tmp/myset_bench.db"
+#define VIEW_UNIVERSE (1L << 24)
+#define VIEW_UPDATE_MEMBERS 64  /* Members each update of a view's source changes */
+#define SCHEDULE_CHAINS 8     /* Independent chains of commands in the script */
+#define SCHEDULE_COMMANDS SCHEDULE_WINDOW
+#define SCHEDULE_UNIVERSE (1L << 20)
+#define SIMILAR_SETS 4000
+#define SIMILAR_CLUSTER 8      /* Sets derived from each random base set */
+#define SIMILAR_MEMBERS 500
+#define SIMILAR_UNIVERSE (1L << 16)
+#define SIMILAR_QUERIES 100
+#define SIMILAR_K 5         /* Fewer than the other sets of a cluster */
+#define FIXED_REPEAT 1000    /* Operations per timed call of the fixed-width benchmarks */
+#define MIN_BENCH_NS 20e6   /* Repeat each measurement for at least 20 ms */
+#define MIN_BENCH_CALLS 3
+
+static const long universes[] = {1L << 12, 1L << 16, 1L << 20, 1L << 24};
+static const double densities[] = {0.001, 0.01, 0.1, 0.5};
+static const char *op_names[] = {"union_set", "intersect_set", "sub_set", "symdiff_set"};
+static const long fixed_widths[] = {128, 256, 1024};
+
+typedef void (*bench_fn)(void *ctx);
+
+/* Operands and scratch of the set benchmarks */
+typedef struct {
+    int *members;
+    int count;
+    long universe;
+    Set a, b, target;
+    CompressedSet ca, cb, ctarget;
+    SetOperation op;
+} SetBench;
+
+/* A command stream and the per-command scratch of the parser benchmarks */
+typedef struct {
+    char (*commands)[COMMAND_LENGTH];
+    int count;
+    Registry registry;
+    ParsedCommand cmd;
+} ParseBench;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Mean time of one call of fn, repeated until the total is long enough to trust */
+static double measure(bench_fn fn, void *ctx) {
+    double start = now_ns();
+    double elapsed;
+    long calls = 0;
+
+    do {
+        fn(ctx);
+        calls++;
+        elapsed = now_ns() - start;
+    } while (elapsed < MIN_BENCH_NS || calls < MIN_BENCH_CALLS);
+    return elapsed / calls;
+}
+
+static void report(const char *benchmark, const char *variant, long size, double density,
+                   double ns_per_op, double bytes_per_op) {
+    printf("%s,%s,%ld,%g,%.2f,%.0f,%.3f\n", benchmark, variant, size, density, ns_per_op,
+           1e9 / ns_per_op, bytes_per_op / ns_per_op);
+}
+
+static void* bench_alloc(size_t size) {
+    void *ptr = malloc(size > 0 ? size : 1);
+    if (ptr == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+/* Fill a set with random words, about half of its universe */
+static void random_set(Set *s, long universe) {
+    size_t w;
+
+    create_set(s, universe);
+    for (w = 0; w < s->nwords; w++) {
+        s->words[w] = (uint64_t)rand() << 32 | (uint64_t)rand();
+    }
+}
+
+
+/* ---- Set benchmarks ---- */
+
+static void run_create(void *ctx) {
+    SetBench *b = ctx;
+    Set s;
+    create_set(&s, b->universe);
+    free_set(&s);
+}
+
+static void run_read(void *ctx) {
+    SetBench *b = ctx;
+    read_set(b->members, &b->target, b->count);
+}
+
+static void run_print(void *ctx) {
+    SetBench *b = ctx;
+    print_set(b->a);
+}
+
+static void run_op(void *ctx) {
+    SetBench *b = ctx;
+    operate_sets(b->op, &b->a, &b->b, &b->target);
+}
+
+static void run_cset_op(void *ctx) {
+    SetBench *b = ctx;
+    operate_csets(b->op, &b->ca, &b->cb, &b->ctarget);
+}
+
+static void run_intersect_count(void *ctx) {
+    SetBench *b = ctx;
+    long shared;
+    count_overlap(&b->a, &b->b, &shared, NULL);
+}
+
+/* What intersect_count replaces: a temporary intersection, then a count */
+static void run_intersect_then_count(void *ctx) {
+    SetBench *b = ctx;
+    intersect_sets(&b->a, &b->b, &b->target);
+    count_set(&b->target);
+}
+
+static void run_cset_intersect_count(void *ctx) {
+    SetBench *b = ctx;
+    long shared;
+    count_cset_overlap(&b->ca, &b->cb, &shared, NULL);
+}
+
+static void run_jaccard(void *ctx) {
+    SetBench *b = ctx;
+    long shared, either;
+    count_overlap(&b->a, &b->b, &shared, &either);
+}
+
+/* A set equals itself only after every word is compared, the slowest case */
+static void run_equal(void *ctx) {
+    SetBench *b = ctx;
+    test_sets(TEST_EQUAL, &b->a, &b->a);
+}
+
+static void random_members(int *members, int count, long universe) {
+    int i;
+    for (i = 0; i < count; i++) {
+        members[i] = (int)(((long)rand() * (RAND_MAX + 1L) + rand()) % universe);
+    }
+}
+
+/* print_set writes to stdout, which carries the CSV, so send it elsewhere */
+static double measure_print(SetBench *b) {
+    int saved, null_fd;
+    double ns;
+
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    ns = measure(run_print, b);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(null_fd);
+    return ns;
+}
+
+static void bench_sets(void) {
+    const SetKernels *const *kernels;
+    const char *selected = set_kernels->name;
+    SetBench b;
+    double ns, bitmap_bytes;
+    int nkernels, u, d, k, op;
+
+    kernels = available_kernels(&nkernels);
+    set_thread_count(1);  /* Kernels alone; bench_scaling covers the thread pool */
+    srand(3);
+    for (u = 0; u < (int)(sizeof(universes) / sizeof(universes[0])); u++) {
+        for (d = 0; d < (int)(sizeof(densities) / sizeof(densities[0])); d++) {
+            memset(&b, 0, sizeof(b));
+            b.universe = universes[u];
+            b.count = (int)(b.universe * densities[d]) > 0 ? (int)(b.universe * densities[d]) : 1;
+            b.members = bench_alloc(b.count * sizeof(int));
+            bitmap_bytes = (double)b.universe / 8;
+
+            random_members(b.members, b.count, b.universe);
+            read_set(b.members, &b.a, b.count);
+            set_to_cset(&b.a, &b.ca);
+            random_members(b.members, b.count, b.universe);
+            read_set(b.members, &b.b, b.count);
+            set_to_cset(&b.b, &b.cb);
+
+            ns = measure(run_create, &b);
+            report("create_set", selected, b.universe, densities[d], ns, bitmap_bytes);
+            ns = measure(run_read, &b);
+            report("read_set", selected, b.universe, densities[d], ns, b.count * sizeof(int));
+            ns = measure_print(&b);
+            report("print_set", selected, b.universe, densities[d], ns, bitmap_bytes);
+
+            for (op = OP_UNION; op <= OP_SYMDIFF; op++) {
+                b.op = op;
+                for (k = 0; k < nkernels; k++) {
+                    force_kernels(kernels[k]->name);
+                    ns = measure(run_op, &b);
+                    report(op_names[op], kernels[k]->name, b.universe, densities[d], ns, 3 * bitmap_bytes);
+                }
+                force_kernels(selected);
+                ns = measure(run_cset_op, &b);
+                report(op_names[op], "compressed", b.universe, densities[d], ns, 3 * bitmap_bytes);
+            }
+
+            for (k = 0; k < nkernels; k++) {
+                force_kernels(kernels[k]->name);
+                ns = measure(run_intersect_count, &b);
+                report("intersect_count", kernels[k]->name, b.universe, densities[d], ns, 2 * bitmap_bytes);
+                ns = measure(run_jaccard, &b);
+                report("jaccard_set", kernels[k]->name, b.universe, densities[d], ns, 2 * bitmap_bytes);
+                ns = measure(run_equal, &b);
+                report("equal_set", kernels[k]->name, b.universe, densities[d], ns, 2 * bitmap_bytes);
+            }
+            force_kernels(selected);
+            ns = measure(run_intersect_then_count, &b);
+            report("intersect_count", "temporary", b.universe, densities[d], ns, 2 * bitmap_bytes);
+            ns = measure(run_cset_intersect_count, &b);
+            report("intersect_count", "compressed", b.universe, densities[d], ns, 2 * bitmap_bytes);
+
+            free(b.members);
+            free_set(&b.a);
+            free_set(&b.b);
+            free_set(&b.target);
+            free_cset(&b.ca);
+            free_cset(&b.cb);
+            free_cset(&b.ctarget);
+        }
+    }
+}
+
+
+/* ---- Fixed widths ---- */
+
+/* Keep the compiler from merging or dropping the repeated operations */
+#define FIXED_BARRIER(p) __asm__ volatile("" : : "r"(p) : "memory")
+
+/* What a small union cost before: the selected kernel through the thread pool's size check */
+static void run_generic_union(void *ctx) {
+    SetBench *b = ctx;
+    int i;
+    for (i = 0; i < FIXED_REPEAT; i++) {
+        parallel_words(set_kernels->or_words, b->target.words, b->a.words, b->b.words, b->a.nwords);
+        FIXED_BARRIER(b->target.words);
+    }
+}
+
+static void run_fixed_union(void *ctx) {
+    SetBench *b = ctx;
+    int i;
+    for (i = 0; i < FIXED_REPEAT; i++) {
+        fixed_operate(OP_UNION, b->target.words, b->a.words, b->b.words, b->a.nwords);
+        FIXED_BARRIER(b->target.words);
+    }
+}
+
+/* Equal sets are equal only after every word is compared; target holds a copy of a */
+static void run_generic_equal(void *ctx) {
+    SetBench *b = ctx;
+    int i;
+    for (i = 0; i < FIXED_REPEAT; i++) {
+        b->count += set_kernels->any_xor_words(b->a.words, b->target.words, b->a.nwords);
+        FIXED_BARRIER(b->a.words);
+    }
+}
+
+static void run_fixed_equal(void *ctx) {
+    SetBench *b = ctx;
+    int i, found = 0;
+    for (i = 0; i < FIXED_REPEAT; i++) {
+        fixed_test(TEST_EQUAL, b->a.words, b->target.words, b->a.nwords, &found);
+        b->count += found;
+        FIXED_BARRIER(b->a.words);
+    }
+}
+
+static void bench_fixed(void) {
+    SetBench b;
+    double bitmap_bytes;
+    int w;
+
+    srand(5);
+    for (w = 0; w < (int)(sizeof(fixed_widths) / sizeof(fixed_widths[0])); w++) {
+        memset(&b, 0, sizeof(b));
+        b.universe = fixed_widths[w];
+        b.count = (int)(b.universe / 2);
+        b.members = bench_alloc(b.count * sizeof(int));
+        create_set(&b.a, b.universe);
+        create_set(&b.b, b.universe);
+        create_set(&b.target, b.universe);
+        random_members(b.members, b.count, b.universe);
+        read_set(b.members, &b.a, b.count);
+        random_members(b.members, b.count, b.universe);
+        read_set(b.members, &b.b, b.count);
+        bitmap_bytes = (double)b.universe / 8;
+
+        report("fixed_union", "generic", b.universe, 0.5, measure(run_generic_union, &b) / FIXED_REPEAT,
+               3 * bitmap_bytes);
+        report("fixed_union", "unrolled", b.universe, 0.5, measure(run_fixed_union, &b) / FIXED_REPEAT,
+               3 * bitmap_bytes);
+        memcpy(b.target.words, b.a.words, b.a.nwords * sizeof(uint64_t));
+        report("fixed_equal", "generic", b.universe, 0.5, measure(run_generic_equal, &b) / FIXED_REPEAT,
+               2 * bitmap_bytes);
+        report("fixed_equal", "unrolled", b.universe, 0.5, measure(run_fixed_equal, &b) / FIXED_REPEAT,
+               2 * bitmap_bytes);
+
+        free(b.members);
+        free_set(&b.a);
+        free_set(&b.b);
+        free_set(&b.target);
+    }
+}
+
+
+/* ---- Parser benchmarks ---- */
+
+/* A synthetic command stream: mostly valid commands of every kind, some errors */
+static char (*make_commands(int count))[COMMAND_LENGTH] {
+    static const char *templates[] = {
+        "union_set SETA, SETB, SETC",
+        "intersect_set SETD,SETE ,SETF",
+        "sub_set SETA, SETB, SETA",
+        "symdiff_set SETC, SETD, SETE",
+        "print_set SETB",
+        "union_set SETA, SETB SETC",
+        "print_set SETG"
+    };
+    char (*commands)[COMMAND_LENGTH] = bench_alloc((size_t)count * COMMAND_LENGTH);
+    int i, j, length;
+
+    srand(1);
+    for (i = 0; i < count; i++) {
+        if (i % 4 == 0) {
+            length = sprintf(commands[i], "read_set SET%c", 'A' + rand() % 6);
+            for (j = 0; j < 20; j++) {
+                length += sprintf(commands[i] + length, ", %d", rand() % 100000);
+            }
+            strcpy(commands[i] + length, ", -1");
+        } else {
+            strcpy(commands[i], templates[rand() % 7]);
+        }
+    }
+    return commands;
+}
+
+/* The validation pipeline of validations.c, as main ran it before parse_command */
+static void legacy_parse(const char *line) {
+    char *command = arena_strndup(command_arena(), line, strlen(line));
+    int command_type, *elements;
+
+    manipulate_string(&command);
+    if (validate_command_name(command) == 0 && check_consecutive_commas(command) == 0) {
+        command_type = is_valid_command(command);
+        if (command_type == 1) {
+            if (validate_read_command(command) == 0) {
+                elements = parse_numbers(command);
+                count_numbers(elements);
+            }
+        } else if (command_type == 2) {
+            validate_print_command(command);
+        } else if (command_type != 7) {
+            validate_general_command(command);
+        }
+    }
+    reset_arena(command_arena());
+}
+
+static void run_legacy(void *ctx) {
+    ParseBench *p = ctx;
+    int i;
+    for (i = 0; i < p->count; i++) {
+        legacy_parse(p->commands[i]);
+    }
+}
+
+static void run_parse_command(void *ctx) {
+    ParseBench *p = ctx;
+    int i;
+    for (i = 0; i < p->count; i++) {
+        parse_command(p->commands[i], &p->registry, &p->cmd);
+    }
+}
+
+static void run_manipulate_string(void *ctx) {
+    ParseBench *p = ctx;
+    char *command;
+    int i;
+    for (i = 0; i < p->count; i++) {
+        command = arena_strndup(command_arena(), p->commands[i], strlen(p->commands[i]));
+        manipulate_string(&command);
+        reset_arena(command_arena());
+    }
+}
+
+static void run_consecutive_commas(void *ctx) {
+    ParseBench *p = ctx;
+    int i;
+    for (i = 0; i < p->count; i++) {
+        check_consecutive_commas(p->commands[i]);
+    }
+}
+
+static void run_command_name(void *ctx) {
+    ParseBench *p = ctx;
+    int i;
+    for (i = 0; i < p->count; i++) {
+        validate_command_name(p->commands[i]);
+        reset_arena(command_arena());
+    }
+}
+
+static void run_valid_command(void *ctx) {
+    ParseBench *p = ctx;
+    int i;
+    for (i = 0; i < p->count; i++) {
+        is_valid_command(p->commands[i]);
+    }
+}
+
+/* Only the read_set commands, every fourth line of the stream */
+static void run_read_command(void *ctx) {
+    ParseBench *p = ctx;
+    int i;
+    for (i = 0; i < p->count; i += 4) {
+        validate_read_command(p->commands[i]);
+        reset_arena(command_arena());
+    }
+}
+
+static void run_parse_numbers(void *ctx) {
+    ParseBench *p = ctx;
+    int i;
+    for (i = 0; i < p->count; i += 4) {
+        parse_numbers(p->commands[i]);
+        reset_arena(command_arena());
+    }
+}
+
+static void bench_parser(void) {
+    static const struct {
+        const char *name;
+        bench_fn fn;
+        int stride;   /* Commands of the stream the stage looks at */
+    } stages[] = {
+        {"validations", run_legacy, 1},
+        {"parse_command", run_parse_command, 1},
+        {"manipulate_string", run_manipulate_string, 1},
+        {"check_consecutive_commas", run_consecutive_commas, 1},
+        {"validate_command_name", run_command_name, 1},
+        {"is_valid_command", run_valid_command, 1},
+        {"validate_read_command", run_read_command, 4},
+        {"parse_numbers", run_parse_numbers, 4}
+    };
+    ParseBench p;
+    double bytes = 0, ns;
+    int i, s, commands;
+
+    memset(&p, 0, sizeof(p));
+    p.commands = make_commands(COMMAND_COUNT);
+    p.count = COMMAND_COUNT;
+    init_registry(&p.registry);
+    for (i = 0; i < MAX_SETS; i++) {
+        create_registry_set(&p.registry, VALID_SETS[i], strlen(VALID_SETS[i]));
+    }
+
+    for (s = 0; s < (int)(sizeof(stages) / sizeof(stages[0])); s++) {
+        bytes = 0;
+        for (i = 0; i < COMMAND_COUNT; i += stages[s].stride) {
+            bytes += strlen(p.commands[i]);
+        }
+        commands = (COMMAND_COUNT + stages[s].stride - 1) / stages[s].stride;
+        ns = measure(stages[s].fn, &p);
+        report("parse", stages[s].name, commands, 0, ns / commands, bytes / commands);
+    }
+
+    free_parsed_command(&p.cmd);
+    free_registry(&p.registry);
+    free(p.commands);
+}
+
+
+/* ---- Instrumentation overhead ---- */
+
+/* What run_command adds per command: three clock reads and one record */
+static void run_record(void *ctx) {
+    Stats *stats = ctx;
+    uint64_t ns[STAGE_COUNT];
+    uint64_t clock = stats_now(), start, parsed;
+    int i;
+
+    for (i = 0; i < COMMAND_COUNT; i++) {
+        start = stats_now();
+        ns[STAGE_READ] = start - clock;
+        parsed = stats_now();
+        ns[STAGE_PARSE] = parsed - start;
+        clock = stats_now();
+        ns[STAGE_EXECUTE] = clock - parsed;
+        record_command(stats, 1 + i % (OPCODE_LIMIT - 1), ns, 32);
+    }
+}
+
+#define RECORD_THREADS 8
+
+/* Server workers recording at once; each thread adds to its own shard */
+static void* record_thread(void *ctx) {
+    run_record(ctx);
+    release_stats_shard(ctx);
+    return NULL;
+}
+
+static void run_record_threads(void *ctx) {
+    pthread_t threads[RECORD_THREADS];
+    int i;
+
+    for (i = 0; i < RECORD_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, record_thread, ctx) != 0) {
+            fprintf(stderr, "Cannot start a thread\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < RECORD_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+static void bench_stats(void) {
+    Stats *stats = bench_alloc(sizeof(Stats));
+
+    init_stats(stats);
+    report("stats", "record_command", COMMAND_COUNT, 0, measure(run_record, stats) / COMMAND_COUNT, 0);
+    report("stats", "record_command_8_threads", COMMAND_COUNT * RECORD_THREADS, 0,
+           measure(run_record_threads, stats) / (COMMAND_COUNT * RECORD_THREADS), 0);
+    free_stats(stats);
+    free(stats);
+}
+
+
+/* ---- Long read_set lines ---- */
+
+/* One read_set line in a file, the same members in a binary frame, and the registry they are read into */
+typedef struct {
+    FILE *file;
+    FILE *frame_file;
+    Registry registry;
+    ParsedCommand cmd;
+} IngestBench;
+
+/* Read the whole line, parse it into a member list, then set the bits */
+static void run_buffer_read(void *ctx) {
+    IngestBench *b = ctx;
+    LineReader reader;
+
+    rewind(b->file);
+    open_line_reader(&reader, b->file);
+    if (parse_command(next_line(&reader), &b->registry, &b->cmd) == 0) {
+        read_stored_set(b->cmd.members, registry_set(&b->registry, b->cmd.sets[0]), b->cmd.count);
+    }
+    close_line_reader(&reader);
+}
+
+/* Set each member's bit as the line is read */
+static void run_stream_read(void *ctx) {
+    IngestBench *b = ctx;
+    LineReader reader;
+    Set members;
+    size_t length;
+    int id;
+
+    rewind(b->file);
+    open_line_reader(&reader, b->file);
+    if (stream_read_command(&reader, &b->registry, &id, &members, &length) == 0) {
+        assign_stored_set(registry_set(&b->registry, id), &members);
+    }
+    close_line_reader(&reader);
+}
+
+/* Take a read_set frame, decode its members and set them */
+static void run_frame_read(void *ctx) {
+    IngestBench *b = ctx;
+    LineReader reader;
+    const unsigned char *frame;
+    size_t length;
+
+    rewind(b->frame_file);
+    open_line_reader(&reader, b->frame_file);
+    if (next_frame(&reader, &frame, &length) == 1 && parse_frame(frame, length, &b->registry, &b->cmd) == 0) {
+        if (b->cmd.bitmap != NULL) {
+            read_stored_bitmap(registry_set(&b->registry, b->cmd.sets[0]), b->cmd.bitmap, b->cmd.bitmap_first,
+                               b->cmd.bitmap_words);
+        } else {
+            read_stored_set(b->cmd.members, registry_set(&b->registry, b->cmd.sets[0]), b->cmd.count);
+        }
+    }
+    close_line_reader(&reader);
+}
+
+/* The line again as the last of its input, with no newline and read up to
+ * the end of the input: it must be streamed like any other long line and
+ * give the same set */
+static void check_last_line(IngestBench *b, long bytes) {
+    char *line = bench_alloc(bytes);
+    FILE *whole = b->file;
+    LineReader reader;
+    size_t length;
+    long expected;
+
+    rewind(whole);
+    b->file = tmpfile();
+    if (b->file == NULL || fread(line, 1, bytes, whole) != (size_t)bytes ||
+        fwrite(line, 1, bytes - 1, b->file) != (size_t)bytes - 1) {
+        fprintf(stderr, "Cannot create a temporary file\n");
+        exit(1);
+    }
+    rewind(b->file);
+    open_line_reader(&reader, b->file);
+    peek_bytes(&reader, (size_t)bytes, &length);  /* Past the last byte, so the reader is at the end */
+    if (long_line_ahead(&reader, &length) == NULL) {
+        fprintf(stderr, "A long last line without a newline is not streamed\n");
+        exit(1);
+    }
+    close_line_reader(&reader);
+
+    run_buffer_read(b);
+    expected = count_stored_set(registry_set(&b->registry, 0));
+    run_stream_read(b);
+    if (count_stored_set(registry_set(&b->registry, 0)) != expected) {
+        fprintf(stderr, "Streamed last line differs from the buffered one\n");
+        exit(1);
+    }
+    fclose(b->file);
+    b->file = whole;
+    free(line);
+}
+
+static int compare_members(const void *a, const void *b) {
+    return (*(const int*)a > *(const int*)b) - (*(const int*)a < *(const int*)b);
+}
+
+/* Write read_set SETA as a frame to a new temporary file, the members in
+ * increasing order without repeats; returns its size */
+static long write_read_frame(IngestBench *b, const int *members, int count, int encoding) {
+    unsigned char *frame = bench_alloc(FRAME_HEADER_SIZE + 3 + (size_t)count * VARINT_MAX_SIZE + INGEST_UNIVERSE / 8);
+    size_t length = FRAME_HEADER_SIZE;
+    long previous = -1;
+    int i;
+
+    frame[length++] = CMD_READ_SET;
+    length += put_varint(frame + length, 0);  /* SETA's entry id */
+    frame[length++] = (unsigned char)encoding;
+    if (encoding == FRAME_BITMAP) {
+        length += put_varint(frame + length, 0);
+        memset(frame + length, 0, INGEST_UNIVERSE / 8);
+        for (i = 0; i < count; i++) {
+            frame[length + members[i] / 8] |= 1 << (members[i] % 8);
+        }
+        length += INGEST_UNIVERSE / 8;
+    } else {
+        for (i = 0; i < count; i++) {
+            length += put_varint(frame + length, members[i] - previous - 1);
+            previous = members[i];
+        }
+    }
+    for (i = 0; i < FRAME_HEADER_SIZE; i++) {
+        frame[i] = (unsigned char)((length - FRAME_HEADER_SIZE) >> (8 * i));
+    }
+    b->frame_file = tmpfile();
+    if (b->frame_file == NULL || fwrite(frame, 1, length, b->frame_file) != length) {
+        fprintf(stderr, "Cannot create a temporary file\n");
+        exit(1);
+    }
+    free(frame);
+    return (long)length;
+}
+
+static void bench_ingest(void) {
+    IngestBench b;
+    int *members = bench_alloc(INGEST_MEMBERS * sizeof(int));
+    long bytes;
+    int i, count;
+
+    memset(&b, 0, sizeof(b));
+    init_registry(&b.registry);
+    create_registry_set(&b.registry, "SETA", 4);
+    b.file = tmpfile();
+    if (b.file == NULL) {
+        fprintf(stderr, "Cannot create a temporary file\n");
+        exit(1);
+    }
+    srand(3);
+    fputs("read_set SETA", b.file);
+    for (i = 0; i < INGEST_MEMBERS; i++) {
+        members[i] = (int)(((long)rand() << 16 ^ rand()) % INGEST_UNIVERSE);
+        fprintf(b.file, ", %d", members[i]);
+    }
+    fputs(", -1\n", b.file);
+    bytes = ftell(b.file);
+
+    report("read_set_line", "buffered", INGEST_MEMBERS, (double)INGEST_MEMBERS / INGEST_UNIVERSE,
+           measure(run_buffer_read, &b), bytes);
+    report("read_set_line", "streamed", INGEST_MEMBERS, (double)INGEST_MEMBERS / INGEST_UNIVERSE,
+           measure(run_stream_read, &b), bytes);
+    check_last_line(&b, bytes);
+
+    qsort(members, INGEST_MEMBERS, sizeof(int), compare_members);
+    for (i = 1, count = 1; i < INGEST_MEMBERS; i++) {
+        if (members[i] != members[count - 1]) {
+            members[count++] = members[i];
+        }
+    }
+    bytes = write_read_frame(&b, members, count, FRAME_MEMBERS);
+    report("read_set_line", "frame_varint", INGEST_MEMBERS, (double)INGEST_MEMBERS / INGEST_UNIVERSE,
+           measure(run_frame_read, &b), bytes);
+    fclose(b.frame_file);
+    bytes = write_read_frame(&b, members, count, FRAME_BITMAP);
+    report("read_set_line", "frame_bitmap", INGEST_MEMBERS, (double)INGEST_MEMBERS / INGEST_UNIVERSE,
+           measure(run_frame_read, &b), bytes);
+    fclose(b.frame_file);
+
+    free(members);
+    fclose(b.file);
+    free_parsed_command(&b.cmd);
+    free_registry(&b.registry);
+}
+
+
+/* ---- Ranges ---- */
+
+/* The members RANGE_FIRST .. RANGE_FIRST + RANGE_MEMBERS - 1, listed and as a range */
+typedef struct {
+    int *members;
+    Set dense;
+    CompressedSet packed;
+} RangeBench;
+
+/* What add_range replaces: read_set with every member listed */
+static void run_range_list(void *ctx) {
+    RangeBench *b = ctx;
+    read_set(b->members, &b->dense, RANGE_MEMBERS);
+}
+
+/* Cleared first so every call fills the whole range */
+static void run_range_dense(void *ctx) {
+    RangeBench *b = ctx;
+    remove_range(&b->dense, 0, RANGE_FIRST + RANGE_MEMBERS - 1);
+    add_range(&b->dense, RANGE_FIRST, RANGE_FIRST + RANGE_MEMBERS - 1);
+}
+
+static void run_range_compressed(void *ctx) {
+    RangeBench *b = ctx;
+    free_cset(&b->packed);
+    add_cset_range(&b->packed, RANGE_FIRST, RANGE_FIRST + RANGE_MEMBERS - 1);
+}
+
+static void bench_ranges(void) {
+    RangeBench b;
+    long universe = RANGE_FIRST + RANGE_MEMBERS;
+    double density = (double)RANGE_MEMBERS / universe;
+    long i;
+
+    b.members = bench_alloc(RANGE_MEMBERS * sizeof(int));
+    for (i = 0; i < RANGE_MEMBERS; i++) {
+        b.members[i] = (int)(RANGE_FIRST + i);
+    }
+    init_set(&b.dense);
+    init_cset(&b.packed);
+    report("add_range", "member_list", universe, density, measure(run_range_list, &b),
+           RANGE_MEMBERS * sizeof(int));
+    report("add_range", "dense", universe, density, measure(run_range_dense, &b),
+           RANGE_MEMBERS / 8.0);
+    report("add_range", "compressed", universe, density, measure(run_range_compressed, &b),
+           RANGE_MEMBERS / 8.0);
+
+    free(b.members);
+    free_set(&b.dense);
+    free_cset(&b.packed);
+}
+
+
+/* ---- Rank and select ---- */
+
+/* A half-full set, its rank directory and the positions asked for */
+typedef struct {
+    ChunkedSet s;
+    RankDirectory d;
+    const RankDirectory *use;  /* d, or NULL to scan the words */
+    long queries[RANK_QUERIES];
+    long sink;
+} RankBench;
+
+static void run_rank(void *ctx) {
+    RankBench *b = ctx;
+    int i;
+    for (i = 0; i < RANK_QUERIES; i++) {
+        b->sink += rank_chunked(&b->s, b->use, b->queries[i]);
+    }
+}
+
+static void run_select(void *ctx) {
+    RankBench *b = ctx;
+    int i;
+    for (i = 0; i < RANK_QUERIES; i++) {
+        b->sink += select_chunked(&b->s, b->use, b->queries[i] / 2);  /* About half the members are below */
+    }
+}
+
+static void run_rank_build(void *ctx) {
+    RankBench *b = ctx;
+    build_rank_directory(&b->d, &b->s);
+}
+
+static void bench_rank(void) {
+    RankBench b = {{0}};
+    Set members;
+    int i;
+
+    random_set(&members, RANK_UNIVERSE);
+    assign_chunked(&b.s, &members);
+    free_set(&members);
+    for (i = 0; i < RANK_QUERIES; i++) {
+        b.queries[i] = ((long)rand() << 16 ^ rand()) % RANK_UNIVERSE;
+    }
+    report("rank_directory", "build", RANK_UNIVERSE, 0.5, measure(run_rank_build, &b), RANK_UNIVERSE / 8.0);
+    b.use = NULL;
+    report("rank", "scan", RANK_UNIVERSE, 0.5, measure(run_rank, &b) / RANK_QUERIES, 0);
+    report("select", "scan", RANK_UNIVERSE, 0.5, measure(run_select, &b) / RANK_QUERIES, 0);
+    b.use = &b.d;
+    report("rank", "directory", RANK_UNIVERSE, 0.5, measure(run_rank, &b) / RANK_QUERIES, 0);
+    report("select", "directory", RANK_UNIVERSE, 0.5, measure(run_select, &b) / RANK_QUERIES, 0);
+
+    free_rank_directory(&b.d);
+    free_chunked(&b.s);
+}
+
+
+/* ---- Snapshots ---- */
+
+/* A registry holding one large dense set */
+typedef struct {
+    Registry registry;
+} SnapshotBench;
+
+/* Taking a snapshot only adds a reference to each chunk of the set */
+static void run_snapshot_take(void *ctx) {
+    SnapshotBench *b = ctx;
+    drop_snapshot(&b->registry, take_snapshot(&b->registry));
+}
+
+/* The first write after a snapshot copies the one chunk it touches */
+static void run_snapshot_write(void *ctx) {
+    SnapshotBench *b = ctx;
+    long number = take_snapshot(&b->registry);
+    add_stored_range(registry_set(&b->registry, 0), 0, 0);
+    drop_snapshot(&b->registry, number);
+}
+
+static void bench_snapshot(void) {
+    SnapshotBench b;
+    Set members;
+
+    init_registry(&b.registry);
+    create_registry_set(&b.registry, "SETA", 4);
+    random_set(&members, SNAPSHOT_UNIVERSE);
+    assign_stored_set(registry_set(&b.registry, 0), &members);
+    report("snapshot", "take", SNAPSHOT_UNIVERSE, 0.5, measure(run_snapshot_take, &b), 0);
+    report("snapshot", "first_write", SNAPSHOT_UNIVERSE, 0.5, measure(run_snapshot_write, &b),
+           SET_CHUNK_WORDS * sizeof(uint64_t));
+    free_registry(&b.registry);
+}
+
+
+/* ---- Loading ---- */
+
+static void run_load(void *ctx) {
+    if (load_all_sets(ctx, LOAD_PATH) != 0) {
+        fprintf(stderr, "Cannot load %s\n", LOAD_PATH);
+        exit(1);
+    }
+}
+
+/* Loading checks only the directory unless told to verify every set's data */
+static void bench_load(void) {
+    Registry registry;
+    Set members;
+    int i;
+
+    init_registry(&registry);
+    for (i = 0; i < LOAD_SETS; i++) {
+        create_registry_set(&registry, VALID_SETS[i], strlen(VALID_SETS[i]));
+        random_set(&members, LOAD_UNIVERSE);
+        assign_stored_set(registry_set(&registry, i), &members);
+    }
+    if (save_all_sets(&registry, LOAD_PATH) != 0) {
+        fprintf(stderr, "Cannot save %s\n", LOAD_PATH);
+        exit(1);
+    }
+    report("load", "directory", LOAD_UNIVERSE, 0.5, measure(run_load, &registry), 0);
+    set_load_verification(1);
+    report("load", "verified", LOAD_UNIVERSE, 0.5, measure(run_load, &registry),
+           (double)LOAD_SETS * LOAD_UNIVERSE / 8);
+    set_load_verification(0);
+    free_registry(&registry);
+    remove(LOAD_PATH);
+}
+
+
+/* ---- Views ---- */
+
+/* A view over two large sets, and the spot of one source that changes */
+typedef struct {
+    Registry registry;
+    Expression expr;
+    long member;
+} ViewBench;
+
+/* Flip a few words of SETA, as add_range and remove_range would */
+static void update_source(ViewBench *b) {
+    SetSpan span;
+    StoredSet *s = registry_set(&b->registry, 0);
+
+    capture_span(s, &span);
+    b->member = (b->member + 7919L * SET_WORD_BITS) % (VIEW_UNIVERSE - VIEW_UPDATE_MEMBERS);
+    if (contains_stored_set(s, b->member)) {
+        remove_stored_range(s, b->member, b->member + VIEW_UPDATE_MEMBERS - 1);
+    } else {
+        add_stored_range(s, b->member, b->member + VIEW_UPDATE_MEMBERS - 1);
+    }
+    mark_range_changed(&b->registry, 0, &span, b->member, b->member + VIEW_UPDATE_MEMBERS - 1);
+}
+
+static void run_view_refresh(void *ctx) {
+    ViewBench *b = ctx;
+    update_source(b);
+    refresh_set(&b->registry, b->expr.target);
+}
+
+/* What a view replaces: running the whole expression again after each update */
+static void run_view_eval(void *ctx) {
+    ViewBench *b = ctx;
+    update_source(b);
+    eval_expression(&b->registry, &b->expr);
+}
+
+static void bench_views(void) {
+    ViewBench b;
+    Set members;
+    int i;
+
+    memset(&b, 0, sizeof(b));
+    init_registry(&b.registry);
+    create_registry_set(&b.registry, "SETA", 4);
+    create_registry_set(&b.registry, "SETB", 4);
+    create_registry_set(&b.registry, "SETC", 4);
+    create_registry_set(&b.registry, "VIEW", 4);
+    srand(5);
+    for (i = 0; i < 3; i++) {
+        random_set(&members, VIEW_UNIVERSE);
+        assign_stored_set(registry_set(&b.registry, i), &members);
+    }
+    if (parse_expression("VIEW = (SETA | SETB) & ~SETC", &b.registry, &b.expr) != 0) {
+        fprintf(stderr, "Cannot parse the view expression\n");
+        exit(1);
+    }
+    define_view(&b.registry, &b.expr);
+
+    report("view_update", "refresh", VIEW_UNIVERSE, 0.5, measure(run_view_refresh, &b),
+           VIEW_UPDATE_MEMBERS / 8.0 * 4);
+    report("view_update", "eval", VIEW_UNIVERSE, 0.5, measure(run_view_eval, &b),
+           VIEW_UNIVERSE / 8.0 * 4);
+    free_registry(&b.registry);
+}
+
+
+/* ---- Similarity search ---- */
+
+/* Sets in clusters of similar sets, and the answers of the queries */
+typedef struct {
+    Registry registry;
+    int exact;
+    SimilarSet (*results)[SIMILAR_K];
+    int found[SIMILAR_QUERIES];
+} SimilarBench;
+
+static void run_similar(void *ctx) {
+    SimilarBench *b = ctx;
+    int q;
+    for (q = 0; q < SIMILAR_QUERIES; q++) {
+        b->found[q] = find_similar_sets(&b->registry, q * (SIMILAR_SETS / SIMILAR_QUERIES), SIMILAR_K, b->exact, b->results[q]);
+    }
+}
+
+static void run_index_build(void *ctx) {
+    SimilarBench *b = ctx;
+    free_similarity_index(b->registry.similarity);
+    b->registry.similarity = NULL;
+    enable_similarity_index(&b->registry);
+}
+
+/* Fraction of the exact top sets that a search found */
+static double recall(const SimilarBench *b, SimilarSet (*truth)[SIMILAR_K], const int *truth_found) {
+    int q, i, j, hits = 0, total = 0;
+    for (q = 0; q < SIMILAR_QUERIES; q++) {
+        for (i = 0; i < truth_found[q]; i++) {
+            for (j = 0; j < b->found[q] && b->results[q][j].id != truth[q][i].id; j++) {
+            }
+            hits += j < b->found[q];
+        }
+        total += truth_found[q];
+    }
+    return total > 0 ? (double)hits / total : 1;
+}
+
+static void bench_similar(void) {
+    SimilarBench b;
+    SimilarSet (*truth)[SIMILAR_K] = bench_alloc(SIMILAR_QUERIES * sizeof(*truth));
+    int truth_found[SIMILAR_QUERIES];
+    int base[SIMILAR_MEMBERS];
+    int *members = bench_alloc(2 * SIMILAR_MEMBERS * sizeof(int));
+    char name[32];
+    double ns;
+    int i, j, n, id, keep;
+
+    memset(&b, 0, sizeof(b));
+    b.results = bench_alloc(SIMILAR_QUERIES * sizeof(*b.results));
+    init_registry(&b.registry);
+    srand(5);
+    for (i = 0; i < SIMILAR_SETS; i++) {
+        if (i % SIMILAR_CLUSTER == 0) {
+            random_members(base, SIMILAR_MEMBERS, SIMILAR_UNIVERSE);
+        }
+        keep = 50 + rand() % 51;  /* Keep 50% - 100% of the base set and add a quarter of new members */
+        for (j = 0, n = 0; j < SIMILAR_MEMBERS; j++) {
+            if (rand() % 100 < keep) {
+                members[n++] = base[j];
+            }
+        }
+        random_members(members + n, SIMILAR_MEMBERS / 4, SIMILAR_UNIVERSE);
+        n += SIMILAR_MEMBERS / 4;
+        sprintf(name, "S%d", i);
+        id = create_registry_set(&b.registry, name, strlen(name));
+        read_stored_set(members, registry_set(&b.registry, id), n);
+    }
+
+    ns = measure(run_similar, &b);
+    memcpy(truth, b.results, SIMILAR_QUERIES * sizeof(*truth));
+    memcpy(truth_found, b.found, sizeof(truth_found));
+    report("similar", "scan", SIMILAR_SETS, 1, ns / SIMILAR_QUERIES, 0);
+
+    ns = measure(run_index_build, &b);
+    report("similar_index", "build", SIMILAR_SETS, 0, ns, 0);
+    for (b.exact = 0; b.exact <= 1; b.exact++) {
+        ns = measure(run_similar, &b);
+        report("similar", b.exact ? "lsh_exact" : "lsh", SIMILAR_SETS, recall(&b, truth, truth_found),
+               ns / SIMILAR_QUERIES, 0);
+    }
+
+    free_registry(&b.registry);
+    free(b.results);
+    free(truth);
+    free(members);
+}
+
+
+/* ---- Thread scaling ---- */
+
+static void run_union(void *ctx) {
+    SetBench *b = ctx;
+    union_sets(&b->a, &b->b, &b->target);
+}
+
+/* Union of two large bitmaps on 1 .. N threads; every result must match the serial one */
+static void bench_scaling(int max_threads) {
+    SetBench b;
+    Set serial;
+    char variant[32];
+    double ns;
+    size_t i;
+    int threads;
+
+    memset(&b, 0, sizeof(b));
+    create_set(&b.a, SCALING_WORDS * SET_WORD_BITS);
+    create_set(&b.b, SCALING_WORDS * SET_WORD_BITS);
+    init_set(&serial);
+    srand(2);
+    for (i = 0; i < SCALING_WORDS; i++) {
+        b.a.words[i] = (uint64_t)rand() << 32 | (uint64_t)rand();
+        b.b.words[i] = (uint64_t)rand() << 32 | (uint64_t)rand();
+    }
+    set_thread_count(1);
+    union_sets(&b.a, &b.b, &serial);
+
+    for (threads = 1; threads <= max_threads; threads++) {
+        set_thread_count(threads);
+        run_union(&b);  /* Warm up the pool and the target */
+        if (memcmp(b.target.words, serial.words, SCALING_WORDS * sizeof(uint64_t)) != 0) {
+            fprintf(stderr, "Threaded union differs from serial with %d threads\n", threads);
+            exit(1);
+        }
+        ns = measure(run_union, &b);
+        sprintf(variant, "%d_threads", threads);
+        report("union_scaling", variant, SCALING_WORDS * SET_WORD_BITS, 0.5, ns,
+               3.0 * SCALING_WORDS * sizeof(uint64_t));
+    }
+
+    stop_thread_pool();
+    free_set(&b.a);
+    free_set(&b.b);
+    free_set(&b.target);
+    free_set(&serial);
+}
+
+
+/* ---- Batch scheduling ---- */
+
+/* A script of chains of unions, each chain over its own three sets */
+typedef struct {
+    char (*commands)[COMMAND_LENGTH];
+    Registry registry;
+    ParsedCommand cmd;
+    Scheduler scheduler;
+} ScheduleBench;
+
+static void run_sequential(void *ctx) {
+    ScheduleBench *b = ctx;
+    uint64_t clock = stats_now();
+    int i;
+    for (i = 0; i < SCHEDULE_COMMANDS; i++) {
+        run_command(b->commands[i], &b->registry, &b->cmd, i + 1, &clock);
+    }
+}
+
+static void run_schedule(void *ctx) {
+    ScheduleBench *b = ctx;
+    uint64_t clock = stats_now();
+    int i;
+    for (i = 0; i < SCHEDULE_COMMANDS; i++) {
+        schedule_command(&b->scheduler, b->commands[i], i + 1, &clock);
+    }
+    run_window(&b->scheduler);
+}
+
+/* The script run one command at a time, then by the scheduler on 1 .. N threads */
+static void bench_schedule(int max_threads) {
+    ScheduleBench b;
+    char name[16], variant[32];
+    double bytes = 3.0 * SCHEDULE_UNIVERSE / 8 * SCHEDULE_COMMANDS;
+    Set members;
+    int i, t, threads;
+
+    memset(&b, 0, sizeof(b));
+    init_registry(&b.registry);
+    srand(6);
+    for (i = 0; i < 3 * SCHEDULE_CHAINS; i++) {
+        sprintf(name, "S%d", i);
+        create_registry_set(&b.registry, name, strlen(name));
+        random_set(&members, SCHEDULE_UNIVERSE);
+        assign_stored_set(registry_set(&b.registry, i), &members);
+    }
+    b.commands = bench_alloc(SCHEDULE_COMMANDS * sizeof(*b.commands));
+    for (i = 0; i < SCHEDULE_COMMANDS; i++) {
+        t = 3 * (i % SCHEDULE_CHAINS);
+        sprintf(b.commands[i], "%s S%d, S%d, S%d", op_names[i / SCHEDULE_CHAINS % 4], t, t + 1, t + 2);
+    }
+    set_thread_count(1);  /* Only the scheduler runs commands in parallel */
+
+    report("schedule", "sequential", SCHEDULE_COMMANDS, 0, measure(run_sequential, &b) / SCHEDULE_COMMANDS,
+           bytes / SCHEDULE_COMMANDS);
+    for (threads = 1; threads <= max_threads; threads++) {
+        init_scheduler(&b.scheduler, &b.registry, threads);
+        sprintf(variant, "%d_threads", threads);
+        report("schedule", variant, SCHEDULE_COMMANDS, 0, measure(run_schedule, &b) / SCHEDULE_COMMANDS,
+               bytes / SCHEDULE_COMMANDS);
+        free_scheduler(&b.scheduler);
+    }
+
+    free_registry(&b.registry);
+    free_parsed_command(&b.cmd);
+    free(b.commands);
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : get_thread_count();
+
+    if (max_threads < 1 || max_threads > PARALLEL_MAX_THREADS) {
+        fprintf(stderr, "Usage: %s [max_threads]\n", argv[0]);
+        return 1;
+    }
+    printf("benchmark,variant,size,density,ns_per_op,ops_per_sec,gb_per_sec\n");
+    select_kernels();
+    bench_parser();
+    bench_ingest();
+    bench_ranges();
+    bench_rank();
+    bench_snapshot();
+    bench_load();
+    bench_views();
+    bench_stats();
+    bench_sets();
+    bench_fixed();
+    bench_similar();
+    bench_scaling(max_threads);
+    bench_schedule(max_threads);
+    return 0;
+}
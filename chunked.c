@@ -0,0 +1,598 @@
+#include <string.h>
+#include "chunked.h"
+#include "kernels.h"
+#include "fixed.h"
+#include "parallel.h"
+
+#define CHUNK_BITS ((long)SET_CHUNK_WORDS * SET_WORD_BITS)
+
+/* The words of every chunk with no members */
+static const uint64_t zero_chunk[SET_CHUNK_WORDS];
+
+/* An operation on two sets, run a chunk at a time */
+typedef struct {
+    SetOperation op;
+    const ChunkedSet *s1;
+    const ChunkedSet *s2;
+    size_t n1;             /* Words of s1 and s2 before the target grew, as it may be either */
+    size_t n2;
+    ChunkedSet *target;
+} ChunkOperation;
+
+
+static void* chunk_alloc(size_t size) {
+    void *ptr = malloc(size > 0 ? size : 1);
+    if (ptr == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+/* Number of words needed to hold members 0 .. universe - 1 */
+static size_t words_for(long universe) {
+    return (size_t)(universe + SET_WORD_BITS - 1) / SET_WORD_BITS;
+}
+
+/* Number of chunks covering nwords words */
+static size_t chunks_for(size_t nwords) {
+    return (nwords + SET_CHUNK_WORDS - 1) / SET_CHUNK_WORDS;
+}
+
+/* Words chunk i holds in a set of nwords words, 0 past its end */
+static size_t chunk_length(size_t nwords, size_t i) {
+    size_t start = i * SET_CHUNK_WORDS;
+    if (start >= nwords) {
+        return 0;
+    }
+    return nwords - start < SET_CHUNK_WORDS ? nwords - start : SET_CHUNK_WORDS;
+}
+
+/* A chunk of size words on the heap, not cleared */
+static SetChunk* new_chunk(size_t size) {
+    SetChunk *chunk = chunk_alloc(sizeof(SetChunk) + size * sizeof(uint64_t));
+    chunk->words = (uint64_t*)(chunk + 1);
+    chunk->mapping = NULL;
+    chunk->size = size;
+    chunk->refs = 1;
+    return chunk;
+}
+
+static void retain_chunk(SetChunk *chunk) {
+    if (chunk != NULL) {
+        __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void release_chunk(SetChunk *chunk) {
+    /* Snapshot versions release chunks from any thread */
+    if (chunk != NULL && __atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (chunk->mapping != NULL) {
+            release_mapping(chunk->mapping);
+        }
+        free(chunk);
+    }
+}
+
+/* Whether no other set holds a chunk, so it may be written in place */
+static int exclusive(SetChunk *chunk) {
+    return __atomic_load_n(&chunk->refs, __ATOMIC_ACQUIRE) == 1;
+}
+
+/* Put a chunk the caller holds a reference to (or NULL) at index i, releasing the one there */
+static void install_chunk(ChunkedSet *s, size_t i, SetChunk *chunk) {
+    SetChunk *old = s->chunks[i];
+    s->chunks[i] = chunk;
+    release_chunk(old);
+}
+
+/* Copy of chunk i of s sized to the words s has in it, the new words zero */
+static SetChunk* copy_chunk(const ChunkedSet *s, size_t i) {
+    const SetChunk *chunk = s->chunks[i];
+    SetChunk *copy = new_chunk(chunk_length(s->nwords, i));
+    memcpy(copy->words, chunk->words, chunk->size * sizeof(uint64_t));
+    memset(copy->words + chunk->size, 0, (copy->size - chunk->size) * sizeof(uint64_t));
+    return copy;
+}
+
+/* Chunk i ready to be written in place: allocated if it had no members,
+ * copied if another set holds it */
+static SetChunk* writable_chunk(ChunkedSet *s, size_t i) {
+    SetChunk *chunk = s->chunks[i];
+
+    if (chunk == NULL) {
+        chunk = new_chunk(chunk_length(s->nwords, i));
+        memset(chunk->words, 0, chunk->size * sizeof(uint64_t));
+        s->chunks[i] = chunk;
+    } else if (!exclusive(chunk)) {
+        chunk = copy_chunk(s, i);
+        install_chunk(s, i, chunk);
+    }
+    return chunk;
+}
+
+/* Release every chunk, keeping the universe */
+static void drop_chunks(ChunkedSet *s) {
+    size_t i;
+    for (i = 0; i < s->nchunks; i++) {
+        install_chunk(s, i, NULL);
+    }
+}
+
+
+void init_chunked(ChunkedSet* s) {
+    s->chunks = NULL;
+    s->nchunks = 0;
+    s->nwords = 0;
+}
+
+
+void free_chunked(ChunkedSet* s) {
+    drop_chunks(s);
+    free(s->chunks);
+    init_chunked(s);
+}
+
+
+void share_chunked(const ChunkedSet* s, ChunkedSet* copy) {
+    SetChunk **chunks;
+    size_t i;
+
+    if (copy == s) {
+        return;
+    }
+    chunks = chunk_alloc(s->nchunks * sizeof(SetChunk*));
+    for (i = 0; i < s->nchunks; i++) {
+        chunks[i] = s->chunks[i];
+        retain_chunk(chunks[i]);
+    }
+    free_chunked(copy);
+    copy->chunks = chunks;
+    copy->nchunks = s->nchunks;
+    copy->nwords = s->nwords;
+}
+
+
+void grow_chunked(ChunkedSet* s, long universe) {
+    size_t n = words_for(universe), count = chunks_for(n), last = s->nchunks - 1;
+    SetChunk **chunks, *chunk;
+
+    if (n <= s->nwords) {
+        return;
+    }
+    if (count > s->nchunks) {
+        chunks = realloc(s->chunks, count * sizeof(SetChunk*));
+        if (chunks == NULL) {
+            fprintf(stderr, "Memory reallocation failed\n");
+            exit(1);
+        }
+        memset(chunks + s->nchunks, 0, (count - s->nchunks) * sizeof(SetChunk*));  /* New members start absent */
+        s->chunks = chunks;
+    }
+    chunk = s->nchunks > 0 ? s->chunks[last] : NULL;
+    s->nchunks = count;
+    s->nwords = n;
+
+    /* A chunk always holds every word its set has in it, so the old last one grows */
+    if (chunk == NULL || chunk->size == chunk_length(n, last)) {
+        return;
+    }
+    if (chunk->mapping == NULL && exclusive(chunk)) {
+        chunk = realloc(chunk, sizeof(SetChunk) + chunk_length(n, last) * sizeof(uint64_t));
+        if (chunk == NULL) {
+            fprintf(stderr, "Memory reallocation failed\n");
+            exit(1);
+        }
+        chunk->words = (uint64_t*)(chunk + 1);
+        memset(chunk->words + chunk->size, 0, (chunk_length(n, last) - chunk->size) * sizeof(uint64_t));
+        chunk->size = chunk_length(n, last);
+        s->chunks[last] = chunk;
+    } else {
+        install_chunk(s, last, copy_chunk(s, last));
+    }
+}
+
+
+void map_chunked(ChunkedSet* s, SetMapping* mapping, uint64_t* words, size_t nwords) {
+    SetChunk *chunk;
+    size_t i;
+
+    free_chunked(s);
+    s->nchunks = chunks_for(nwords);
+    s->nwords = nwords;
+    s->chunks = chunk_alloc(s->nchunks * sizeof(SetChunk*));
+    for (i = 0; i < s->nchunks; i++) {
+        chunk = chunk_alloc(sizeof(SetChunk));
+        chunk->words = words + i * SET_CHUNK_WORDS;
+        chunk->mapping = mapping;
+        chunk->size = chunk_length(nwords, i);
+        chunk->refs = 1;
+        __atomic_add_fetch(&mapping->refs, 1, __ATOMIC_RELAXED);
+        s->chunks[i] = chunk;
+    }
+}
+
+
+const uint64_t* chunked_words(const ChunkedSet* s, size_t first, size_t n, uint64_t* buffer) {
+    size_t i = first / SET_CHUNK_WORDS, w, len, have;
+    const SetChunk *chunk;
+
+    /* A window inside one chunk is read in place */
+    if (i == (first + n - 1) / SET_CHUNK_WORDS && (first + n <= s->nwords || first >= s->nwords)) {
+        chunk = first < s->nwords ? s->chunks[i] : NULL;
+        return chunk != NULL ? chunk->words + first % SET_CHUNK_WORDS : zero_chunk;
+    }
+    for (w = first; w < first + n; w += len) {
+        i = w / SET_CHUNK_WORDS;
+        len = (i + 1) * SET_CHUNK_WORDS < first + n ? (i + 1) * SET_CHUNK_WORDS - w : first + n - w;
+        chunk = w < s->nwords ? s->chunks[i] : NULL;
+        have = 0;
+        if (chunk != NULL) {
+            have = s->nwords - w < len ? s->nwords - w : len;
+            memcpy(buffer + (w - first), chunk->words + w % SET_CHUNK_WORDS, have * sizeof(uint64_t));
+        }
+        memset(buffer + (w - first) + have, 0, (len - have) * sizeof(uint64_t));
+    }
+    return buffer;
+}
+
+
+uint64_t* writable_words(ChunkedSet* s, size_t first, size_t n) {
+    (void)n;
+    return writable_chunk(s, first / SET_CHUNK_WORDS)->words + first % SET_CHUNK_WORDS;
+}
+
+
+void assign_chunked(ChunkedSet* s, const Set* members) {
+    const uint64_t *words;
+    size_t i, len;
+
+    drop_chunks(s);
+    grow_chunked(s, (long)(members->nwords * SET_WORD_BITS));  /* read_set never shrinks a set */
+    for (i = 0; i < chunks_for(members->nwords); i++) {
+        words = members->words + i * SET_CHUNK_WORDS;
+        len = chunk_length(members->nwords, i);
+        if (set_kernels->any_and_words(words, words, len)) {
+            memcpy(writable_chunk(s, i)->words, words, len * sizeof(uint64_t));
+        }
+    }
+}
+
+
+void read_chunked(const int* ptr, ChunkedSet* s, int n) {
+    size_t current = (size_t)-1, c;
+    uint64_t *words = NULL;
+    int max = -1;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (ptr[i] > max) {
+            max = ptr[i];  /* Size the set once for the largest member */
+        }
+    }
+    grow_chunked(s, (long)max + 1);
+    drop_chunks(s);  /* Start from an empty set before adding elements */
+    for (i = 0; i < n; i++) {
+        c = (size_t)ptr[i] / SET_WORD_BITS / SET_CHUNK_WORDS;
+        if (c != current) {
+            words = writable_chunk(s, c)->words;
+            current = c;
+        }
+        words[(size_t)ptr[i] / SET_WORD_BITS % SET_CHUNK_WORDS] |= (uint64_t)1 << (ptr[i] % SET_WORD_BITS);
+    }
+}
+
+
+/* Add (fill = 1) or remove the members first .. last, within the set's universe */
+static void change_range(ChunkedSet *s, long first, long last, int fill) {
+    size_t i, len;
+    long base, from, to;
+    Set view;
+
+    for (i = (size_t)(first / CHUNK_BITS); i <= (size_t)(last / CHUNK_BITS); i++) {
+        base = (long)i * CHUNK_BITS;
+        from = first > base ? first - base : 0;
+        to = last - base < CHUNK_BITS ? last - base : CHUNK_BITS - 1;
+        len = chunk_length(s->nwords, i);
+        if (!fill && s->chunks[i] == NULL) {
+            continue;  /* Nothing to remove */
+        }
+        if (from == 0 && to >= (long)(len * SET_WORD_BITS) - 1) {
+            /* The range covers the whole chunk: drop it, or fill a fresh one */
+            if (fill && (s->chunks[i] == NULL || !exclusive(s->chunks[i]))) {
+                install_chunk(s, i, new_chunk(len));
+            }
+            if (fill) {
+                memset(s->chunks[i]->words, 0xFF, len * sizeof(uint64_t));
+            } else {
+                install_chunk(s, i, NULL);
+            }
+            continue;
+        }
+        view.words = writable_chunk(s, i)->words;
+        view.nwords = len;
+        if (fill) {
+            add_range(&view, from, to);
+        } else {
+            remove_range(&view, from, to);
+        }
+    }
+}
+
+
+void add_chunked_range(ChunkedSet* s, long first, long last) {
+    grow_chunked(s, last + 1);
+    change_range(s, first, last, 1);
+}
+
+
+void remove_chunked_range(ChunkedSet* s, long first, long last) {
+    long universe = (long)(s->nwords * SET_WORD_BITS);
+    if (first < universe) {
+        change_range(s, first, last < universe ? last : universe - 1, 0);
+    }
+}
+
+
+void print_chunked(const ChunkedSet* s) {
+    PrintBuffer out;
+    long x;
+
+    init_print_buffer(&out);
+    for (x = next_chunked_member(s, 0); x >= 0; x = next_chunked_member(s, x + 1)) {
+        print_member(&out, x);
+    }
+    end_print_buffer(&out);
+}
+
+
+long count_chunked(const ChunkedSet* s) {
+    long count = 0;
+    size_t i;
+
+    for (i = 0; i < s->nchunks; i++) {
+        if (s->chunks[i] != NULL) {
+            count += (long)set_kernels->count_words(s->chunks[i]->words, s->chunks[i]->size);
+        }
+    }
+    return count;
+}
+
+
+int contains_chunked(const ChunkedSet* s, long x) {
+    size_t w = (size_t)x / SET_WORD_BITS;
+    const SetChunk *chunk;
+
+    if (x < 0 || w >= s->nwords) {
+        return 0;
+    }
+    chunk = s->chunks[w / SET_CHUNK_WORDS];
+    return chunk != NULL && ((chunk->words[w % SET_CHUNK_WORDS] >> (x % SET_WORD_BITS)) & 1);
+}
+
+
+long next_chunked_member(const ChunkedSet* s, long from) {
+    size_t i;
+    long x;
+    Set view;
+
+    if (from < 0) {
+        from = 0;
+    }
+    for (i = (size_t)(from / CHUNK_BITS); i < s->nchunks; i++) {
+        if (s->chunks[i] == NULL) {
+            continue;
+        }
+        view.words = s->chunks[i]->words;
+        view.nwords = s->chunks[i]->size;
+        x = next_member(&view, from > (long)i * CHUNK_BITS ? from - (long)i * CHUNK_BITS : 0);
+        if (x >= 0) {
+            return (long)i * CHUNK_BITS + x;
+        }
+    }
+    return -1;
+}
+
+
+void chunked_span(const ChunkedSet* s, size_t* first, size_t* end) {
+    const SetChunk *chunk;
+    size_t i, w;
+
+    *first = *end = s->nwords;
+    for (i = 0; i < s->nchunks && *first == s->nwords; i++) {
+        if ((chunk = s->chunks[i]) != NULL) {
+            for (w = 0; w < chunk->size && chunk->words[w] == 0; w++) {
+            }
+            if (w < chunk->size) {
+                *first = i * SET_CHUNK_WORDS + w;
+            }
+        }
+    }
+    if (*first == s->nwords) {
+        return;
+    }
+    for (i = s->nchunks; i-- > 0;) {
+        if ((chunk = s->chunks[i]) != NULL) {
+            for (w = chunk->size; w > 0 && chunk->words[w - 1] == 0; w--) {
+            }
+            if (w > 0) {
+                *end = i * SET_CHUNK_WORDS + w;
+                return;
+            }
+        }
+    }
+}
+
+
+/* Compute chunk i of an operation's result into the target */
+static void operate_chunk(void *ctx, size_t i) {
+    const ChunkOperation *o = ctx;
+    ChunkedSet *target = o->target;
+    size_t la = chunk_length(o->n1, i), lb = chunk_length(o->n2, i), lt = chunk_length(target->nwords, i);
+    size_t common = la < lb ? la : lb, end;
+    SetChunk *a = la > 0 ? o->s1->chunks[i] : NULL;
+    SetChunk *b = lb > 0 ? o->s2->chunks[i] : NULL;
+    SetChunk *same = NULL, *chunk;
+    const uint64_t *wa = a != NULL ? a->words : zero_chunk, *wb = b != NULL ? b->words : zero_chunk, *rest;
+    word_kernel kernel = set_kernels->or_words;
+    int empty = 0;
+
+    /* Chunks equal to an input's are shared, and empty ones released */
+    if (a == b) {
+        empty = a == NULL || o->op == OP_SUB || o->op == OP_SYMDIFF;
+        same = a;
+    } else if (a == NULL || b == NULL) {
+        empty = o->op == OP_INTERSECT || (o->op == OP_SUB && a == NULL);
+        same = o->op == OP_SUB ? a : a != NULL ? a : b;
+    }
+    if (empty) {
+        install_chunk(target, i, NULL);
+        return;
+    }
+    if (same != NULL && same->size == lt) {
+        if (target->chunks[i] != same) {
+            retain_chunk(same);
+            install_chunk(target, i, same);
+        }
+        return;
+    }
+
+    chunk = target->chunks[i];
+    if (chunk == NULL || chunk->size != lt || !exclusive(chunk)) {
+        chunk = new_chunk(lt);
+    }
+    switch (o->op) {
+        case OP_UNION:
+            rest = la > lb ? wa : wb;  /* Members only the longer set can hold */
+            end = la > lb ? la : lb;
+            break;
+        case OP_INTERSECT:
+            kernel = set_kernels->and_words;
+            rest = NULL;
+            end = common;
+            break;
+        case OP_SUB:
+            kernel = set_kernels->andnot_words;
+            rest = wa;  /* Beyond s2 nothing is removed */
+            end = la;
+            break;
+        default:
+            kernel = set_kernels->xor_words;
+            rest = la > lb ? wa : wb;
+            end = la > lb ? la : lb;
+            break;
+    }
+    if (!fixed_operate(o->op, chunk->words, wa, wb, common)) {
+        kernel(chunk->words, wa, wb, common);
+    }
+    if (end > common && rest != chunk->words) {
+        memcpy(chunk->words + common, rest + common, (end - common) * sizeof(uint64_t));
+    }
+    memset(chunk->words + end, 0, (lt - end) * sizeof(uint64_t));  /* Clear stale high words */
+    if (chunk != target->chunks[i]) {
+        install_chunk(target, i, chunk);
+    }
+}
+
+
+void operate_chunked(SetOperation op, const ChunkedSet* s1, const ChunkedSet* s2, ChunkedSet* target) {
+    ChunkOperation o;
+    size_t n, i;
+
+    o.op = op;
+    o.s1 = s1;
+    o.s2 = s2;
+    o.n1 = s1->nwords;
+    o.n2 = s2->nwords;
+    o.target = target;
+    n = op == OP_INTERSECT ? (o.n1 < o.n2 ? o.n1 : o.n2) : op == OP_SUB ? o.n1 : (o.n1 > o.n2 ? o.n1 : o.n2);
+    grow_chunked(target, (long)(n * SET_WORD_BITS));
+    parallel_tasks(operate_chunk, &o, chunks_for(n), n);
+    for (i = chunks_for(n); i < target->nchunks; i++) {
+        install_chunk(target, i, NULL);  /* The result has no members past n words */
+    }
+}
+
+
+int test_chunked(SetTest test, const ChunkedSet* s1, const ChunkedSet* s2) {
+    size_t n1 = s1->nwords, n2 = s2->nwords, n, i, la, lb, common;
+    const SetChunk *a, *b;
+    const uint64_t *wa, *wb, *rest;
+    size_t end;
+    int found;
+
+    n = test == TEST_SUBSET ? n1 : test == TEST_EQUAL ? (n1 > n2 ? n1 : n2) : (n1 < n2 ? n1 : n2);
+    for (i = 0; i < chunks_for(n); i++) {
+        la = chunk_length(n1, i);
+        lb = chunk_length(n2, i);
+        a = la > 0 ? s1->chunks[i] : NULL;
+        b = lb > 0 ? s2->chunks[i] : NULL;
+        if ((a == b && (a == NULL || test != TEST_DISJOINT)) ||
+            (test != TEST_EQUAL && (a == NULL || (b == NULL && test == TEST_DISJOINT)))) {
+            continue;  /* Chunks that cannot fail the test */
+        }
+        wa = a != NULL ? a->words : zero_chunk;
+        wb = b != NULL ? b->words : zero_chunk;
+        common = la < lb ? la : lb;
+        if (!fixed_test(test, wa, wb, common, &found)) {
+            found = test == TEST_SUBSET ? set_kernels->any_andnot_words(wa, wb, common) :
+                    test == TEST_EQUAL ? set_kernels->any_xor_words(wa, wb, common) :
+                    set_kernels->any_and_words(wa, wb, common);
+        }
+        if (!found && test != TEST_DISJOINT) {
+            /* Members of the first set (or of either, for equality) beyond the other's words */
+            rest = test == TEST_SUBSET || la > lb ? wa : wb;
+            end = test == TEST_SUBSET ? la : la > lb ? la : lb;
+            found = end > common && set_kernels->any_and_words(rest + common, rest + common, end - common);
+        }
+        if (found) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+void count_chunked_overlap(const ChunkedSet* s1, const ChunkedSet* s2, long* shared, long* either) {
+    size_t n1 = s1->nwords, n2 = s2->nwords, n = n1 > n2 ? n1 : n2, i, la, lb, common;
+    const SetChunk *a, *b, *longer;
+    uint64_t counts[2], both = 0, any = 0;
+
+    for (i = 0; i < chunks_for(n); i++) {
+        la = chunk_length(n1, i);
+        lb = chunk_length(n2, i);
+        a = la > 0 ? s1->chunks[i] : NULL;
+        b = lb > 0 ? s2->chunks[i] : NULL;
+        if (a == NULL || b == NULL || a == b) {
+            /* A chunk in one set only, or shared by both, has no words to combine */
+            longer = a != NULL ? a : b;
+            if (longer != NULL && either != NULL) {
+                any += set_kernels->count_words(longer->words, longer->size);
+            }
+            if (a != NULL && a == b && shared != NULL) {
+                both += set_kernels->count_words(a->words, a->size);
+            }
+            continue;
+        }
+        common = la < lb ? la : lb;
+        if (shared != NULL && either != NULL) {
+            set_kernels->overlap_words(a->words, b->words, common, counts);
+            both += counts[0];
+            any += counts[1];
+        } else if (shared != NULL) {
+            both += set_kernels->count_and_words(a->words, b->words, common);
+        } else if (either != NULL) {
+            any += set_kernels->count_or_words(a->words, b->words, common);
+        }
+        if (either != NULL) {
+            longer = la > lb ? a : b;  /* Members only the longer chunk can hold */
+            any += set_kernels->count_words(longer->words + common, longer->size - common);
+        }
+    }
+    if (shared != NULL) {
+        *shared = (long)both;
+    }
+    if (either != NULL) {
+        *either = (long)any;
+    }
+}
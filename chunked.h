@@ -0,0 +1,209 @@
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "set.h"
+
+#define SET_CHUNK_WORDS 8192   /* 64 KiB of bitmap per chunk */
+
+/**
+ * @brief Words of a dense set shared by every set and snapshot version holding them.
+ *
+ * A chunk is on the heap, its words following it, or points into a file
+ * mapping it keeps a reference to.
+ */
+typedef struct {
+    uint64_t *words;
+    SetMapping *mapping;  /* Non-NULL when words point into a file mapping */
+    size_t size;          /* Words in the chunk, the words its sets have in that chunk */
+    int refs;             /* Sets holding the chunk; updated atomically */
+} SetChunk;
+
+/**
+ * @brief A dense set kept as reference-counted chunks of SET_CHUNK_WORDS words.
+ *
+ * Chunk i holds words i * SET_CHUNK_WORDS up to the next chunk or the end
+ * of the set. Copies share chunks, and a chunk held by more than one set
+ * is copied before it is written, so a copy costs a reference per chunk
+ * and each write after it copies only the chunks it touches. As for a Set
+ * the universe grows on demand, and a zero-initialized ChunkedSet is empty.
+ */
+typedef struct {
+    SetChunk **chunks;  /* NULL for a chunk with no members */
+    size_t nchunks;
+    size_t nwords;
+} ChunkedSet;
+
+/**
+ * @brief Initialize a chunked set as empty, without allocating storage.
+ * @param s Pointer to the set to be initialized.
+ */
+void init_chunked(ChunkedSet* s);
+
+/**
+ * @brief Release the chunks of a chunked set and leave it empty.
+ * @param s Pointer to the set to be freed.
+ */
+void free_chunked(ChunkedSet* s);
+
+/**
+ * @brief Copy a chunked set by sharing its chunks, in O(chunks).
+ *
+ * Neither set copies a shared chunk until it writes it, so the copy keeps
+ * the members s has now. Other threads may copy s at the same time, but
+ * not write it.
+ * @param s The set to copy.
+ * @param copy Pointer to the set receiving the copy; its previous chunks are released.
+ */
+void share_chunked(const ChunkedSet* s, ChunkedSet* copy);
+
+/**
+ * @brief Grow a chunked set so it can hold members 0 .. universe - 1.
+ * @param s Pointer to the set to grow. Existing members are kept.
+ * @param universe Required universe size.
+ */
+void grow_chunked(ChunkedSet* s, long universe);
+
+/**
+ * @brief Make a chunked set use words inside a file mapping, without copying them.
+ *
+ * The mapping is private, so writes never reach the file; a chunk is only
+ * copied to the heap when it grows or another set shares it.
+ * @param s Pointer to the set; its previous chunks are released.
+ * @param mapping The mapping the words belong to.
+ * @param words The first word of the set.
+ * @param nwords Number of words.
+ */
+void map_chunked(ChunkedSet* s, SetMapping* mapping, uint64_t* words, size_t nwords);
+
+/**
+ * @brief Get words first .. first + n - 1 of a chunked set.
+ * @param s The set.
+ * @param first The first word.
+ * @param n Number of words, at least 1.
+ * @param buffer Array of n words they are copied into when they are not inside one chunk
+ *               of the set's words; may be NULL when they are.
+ * @return The words, zero past the end of the set; valid until the set changes.
+ */
+const uint64_t* chunked_words(const ChunkedSet* s, size_t first, size_t n, uint64_t* buffer);
+
+/**
+ * @brief Get words of a chunked set to write in place, copying their chunk first if it is shared.
+ * @param s Pointer to the set.
+ * @param first The first word.
+ * @param n Number of words, all inside one chunk and below s->nwords.
+ * @return The words.
+ */
+uint64_t* writable_words(ChunkedSet* s, size_t first, size_t n);
+
+/**
+ * @brief Replace the members of a chunked set with those of a dense set.
+ *
+ * Only the chunks with members are stored, and like read_set the universe
+ * never shrinks.
+ * @param s Pointer to the chunked set.
+ * @param members The new members.
+ */
+void assign_chunked(ChunkedSet* s, const Set* members);
+
+/**
+ * @brief Read integers into a chunked set, replacing its contents.
+ * @param ptr Pointer to the array of integers to be read.
+ * @param s Pointer to the set to store the integers.
+ * @param n Number of integers to read.
+ */
+void read_chunked(const int* ptr, ChunkedSet* s, int n);
+
+/**
+ * @brief Add the members first .. last to a chunked set.
+ * @param s Pointer to the set; it grows to hold last.
+ * @param first The first member of the range.
+ * @param last The last member of the range, not less than first.
+ */
+void add_chunked_range(ChunkedSet* s, long first, long last);
+
+/**
+ * @brief Remove the members first .. last from a chunked set.
+ *
+ * Chunks the range covers whole are released rather than cleared.
+ * @param s Pointer to the set.
+ * @param first The first member of the range.
+ * @param last The last member of the range, not less than first.
+ */
+void remove_chunked_range(ChunkedSet* s, long first, long last);
+
+/**
+ * @brief Print the contents of a chunked set.
+ * @param s The set to be printed.
+ */
+void print_chunked(const ChunkedSet* s);
+
+/**
+ * @brief Count the members of a chunked set.
+ * @param s Pointer to the set.
+ * @return The number of members.
+ */
+long count_chunked(const ChunkedSet* s);
+
+/**
+ * @brief Check whether a number is a member of a chunked set.
+ * @param s Pointer to the set.
+ * @param x The number to look for.
+ * @return 1 if x is a member, 0 otherwise.
+ */
+int contains_chunked(const ChunkedSet* s, long x);
+
+/**
+ * @brief Find the smallest member of a chunked set not below a number, skipping empty chunks.
+ * @param s Pointer to the set.
+ * @param from The number to start from.
+ * @return The member, or -1 if there is none.
+ */
+long next_chunked_member(const ChunkedSet* s, long from);
+
+/**
+ * @brief Find the words of a chunked set between its first and last non-zero word.
+ * @param s Pointer to the set.
+ * @param first Receives the first non-zero word, s->nwords if there is none.
+ * @param end Receives one past the last non-zero word, s->nwords if there is none.
+ */
+void chunked_span(const ChunkedSet* s, size_t* first, size_t* end);
+
+/**
+ * @brief Perform a binary operation on two chunked sets.
+ *
+ * Results equal to a chunk of either input share it instead of computing
+ * it: a union or difference with a chunk the other set lacks, and chunks
+ * both inputs share. The other chunks are computed into the target's own
+ * chunk when no other set holds it. Large sets are split across the
+ * thread pool a chunk at a time.
+ * @param op The operation to perform.
+ * @param s1 First set.
+ * @param s2 Second set.
+ * @param target Pointer to the set to store the result, may alias s1 or s2.
+ */
+void operate_chunked(SetOperation op, const ChunkedSet* s1, const ChunkedSet* s2, ChunkedSet* target);
+
+/**
+ * @brief Compare two chunked sets, stopping at the first chunk that decides.
+ *
+ * Chunks the sets share, and chunks that cannot change the answer, are
+ * never scanned.
+ * @param test The comparison to make.
+ * @param s1 First set.
+ * @param s2 Second set.
+ * @return 1 if the comparison holds, 0 otherwise.
+ */
+int test_chunked(SetTest test, const ChunkedSet* s1, const ChunkedSet* s2);
+
+/**
+ * @brief Count the members two chunked sets share and the members of either.
+ * @param s1 First set.
+ * @param s2 Second set.
+ * @param shared Receives the size of the intersection, or NULL.
+ * @param either Receives the size of the union, or NULL.
+ */
+void count_chunked_overlap(const ChunkedSet* s1, const ChunkedSet* s2, long* shared, long* either);
+
+#endif /* CHUNKED_H */
@@ -0,0 +1,669 @@
+#include <stdio.h>
+#include <string.h>
+#include "commands.h"
+#include "storage.h"
+#include "expr.h"
+#include "persist.h"
+#include "stats.h"
+#include "snapshot.h"
+#include "similarity.h"
+#include "view.h"
+#include "arena.h"
+#include "protocol.h"
+
+
+/* Mark the rank directories of the sets a command writes out of date */
+static void outdate_written_ranks(Registry *registry, const ParsedCommand *cmd) {
+    int id;
+
+    switch (cmd->opcode) {
+        case CMD_READ_SET:
+        case CMD_LOAD_SET:
+        case CMD_ADD_RANGE:
+        case CMD_REMOVE_RANGE:
+            registry_entry(registry, cmd->sets[0])->rank.built = 0;
+            break;
+        case CMD_UNION_SET:
+        case CMD_INTERSECT_SET:
+        case CMD_SUB_SET:
+        case CMD_SYMDIFF_SET:
+            registry_entry(registry, cmd->sets[2])->rank.built = 0;
+            break;
+        case CMD_EVAL:
+        case CMD_DEFINE_VIEW:
+            registry_entry(registry, cmd->expr.target)->rank.built = 0;
+            break;
+        case CMD_LOAD_ALL:
+            for (id = 0; id < registry->next_id; id++) {
+                if (registry_entry(registry, id)->in_use) {
+                    registry_entry(registry, id)->rank.built = 0;
+                }
+            }
+            break;
+        default:
+            break;  /* Created sets start without a directory, and dropped ones free theirs */
+    }
+}
+
+/* Bring the similarity signatures of the sets a command wrote up to date */
+static void index_written_sets(Registry *registry, const ParsedCommand *cmd) {
+    int id;
+
+    switch (cmd->opcode) {
+        case CMD_READ_SET:
+            if (cmd->nranges == 0 && cmd->bitmap == NULL) {
+                index_member_list(registry, cmd->sets[0], cmd->members, cmd->count);
+            } else {
+                index_set(registry, cmd->sets[0]);
+            }
+            break;
+        case CMD_UNION_SET:
+            if (cmd->versions[0] == NULL && cmd->versions[1] == NULL) {
+                index_union(registry, cmd->sets[2], cmd->sets[0], cmd->sets[1]);
+            } else {
+                index_set(registry, cmd->sets[2]);  /* Snapshot versions have no signature */
+            }
+            break;
+        case CMD_INTERSECT_SET:
+        case CMD_SUB_SET:
+        case CMD_SYMDIFF_SET:
+            index_set(registry, cmd->sets[2]);
+            break;
+        case CMD_EVAL:
+        case CMD_DEFINE_VIEW:
+            index_set(registry, cmd->expr.target);
+            break;
+        case CMD_LOAD_SET:
+        case CMD_ADD_RANGE:
+        case CMD_REMOVE_RANGE:
+            index_set(registry, cmd->sets[0]);
+            break;
+        case CMD_LOAD_ALL:
+            for (id = 0; id < registry->next_id; id++) {
+                if (registry_entry(registry, id)->in_use) {
+                    index_set(registry, id);
+                }
+            }
+            break;
+        default:
+            break;  /* Dropped sets leave the index in the registry */
+    }
+}
+
+/* Bring the views a command reads up to date */
+static void refresh_read_sets(Registry *registry, const ParsedCommand *cmd) {
+    int ids[EXPR_MAX_NODES];
+    int n, i;
+
+    switch (cmd->opcode) {
+        case CMD_EVAL:
+        case CMD_DEFINE_VIEW:
+            n = expression_sets(&cmd->expr, ids);
+            for (i = 0; i < n; i++) {
+                refresh_set(registry, ids[i]);
+            }
+            break;
+        case CMD_SAVE_ALL:
+        case CMD_SNAPSHOT:
+        case CMD_SIMILAR:
+        case CMD_SIMILAR_EXACT:
+            refresh_all_views(registry);
+            break;
+        case CMD_SET_ID:
+            break;  /* Reads no members */
+        default:
+            for (i = 0; i < cmd->nsets; i++) {
+                if (cmd->sets[i] >= 0) {
+                    refresh_set(registry, cmd->sets[i]);
+                }
+            }
+            break;
+    }
+}
+
+/* The set whose members a command changes, or -1 */
+static int written_set(const ParsedCommand *cmd) {
+    switch (cmd->opcode) {
+        case CMD_READ_SET:
+        case CMD_LOAD_SET:
+        case CMD_ADD_RANGE:
+        case CMD_REMOVE_RANGE:
+        case CMD_COMPRESS_SET:     /* The same members, but the words it spans as an operand may change */
+        case CMD_DECOMPRESS_SET:
+            return cmd->sets[0];
+        case CMD_UNION_SET:
+        case CMD_INTERSECT_SET:
+        case CMD_SUB_SET:
+        case CMD_SYMDIFF_SET:
+            return cmd->sets[2];
+        case CMD_EVAL:
+        case CMD_DEFINE_VIEW:
+            return cmd->expr.target;
+        default:
+            return -1;
+    }
+}
+
+/* Mark the words a command changed in the views reading the sets it wrote */
+static void mark_written_sets(Registry *registry, const ParsedCommand *cmd, int written, const SetSpan *before) {
+    int id;
+
+    if (cmd->opcode == CMD_LOAD_ALL) {
+        for (id = 0; id < registry->next_id; id++) {
+            if (registry_entry(registry, id)->in_use) {
+                mark_set_changed(registry, id, 0, SIZE_MAX);
+            }
+        }
+    } else if (cmd->opcode == CMD_ADD_RANGE || cmd->opcode == CMD_REMOVE_RANGE) {
+        mark_range_changed(registry, written, before, cmd->ranges[0], cmd->ranges[1]);
+    } else if (written >= 0) {
+        mark_set_rewritten(registry, written, before);
+    }
+}
+
+/* Print a test's answer: yes or no, or a byte 1 or 0 in binary replies */
+static void print_answer(FILE *out, int answer) {
+    if (output_binary()) {
+        fputc(answer != 0, out);
+    } else {
+        fprintf(out, "%s\n", answer ? "yes" : "no");
+    }
+}
+
+/* Print a count: in decimal, or as a varint in binary replies */
+static void print_count(FILE *out, long count) {
+    unsigned char bytes[VARINT_MAX_SIZE];
+
+    if (output_binary()) {
+        fwrite(bytes, 1, put_varint(bytes, (uint64_t)count), out);
+    } else {
+        fprintf(out, "%ld\n", count);
+    }
+}
+
+/* Print a ratio: with six decimals, or as a little-endian double in binary replies */
+static void print_ratio(FILE *out, double ratio) {
+    uint64_t bits;
+    int i;
+
+    if (output_binary()) {
+        memcpy(&bits, &ratio, sizeof(bits));
+        for (i = 0; i < 8; i++) {
+            fputc((int)(bits >> (8 * i) & 0xff), out);
+        }
+    } else {
+        fprintf(out, "%.6f\n", ratio);
+    }
+}
+
+/* Print the sets most similar to a set with their similarity; binary
+ * replies give each set's registry entry id instead of its name */
+static void print_similar_sets(const Registry *registry, const ParsedCommand *cmd) {
+    FILE *out = output_stream();
+    int k = cmd->members[0] < (int)registry->count ? cmd->members[0] : (int)registry->count;
+    SimilarSet *results = arena_alloc(command_arena(), k * sizeof(SimilarSet));
+    RegistryEntry *entry;
+    int found, i;
+
+    found = find_similar_sets(registry, cmd->sets[0], k, cmd->opcode == CMD_SIMILAR_EXACT, results);
+    for (i = 0; i < found; i++) {
+        if (output_binary()) {
+            print_count(out, results[i].id);
+            print_ratio(out, results[i].similarity);
+            continue;
+        }
+        entry = registry_entry(registry, results[i].id);
+        fprintf(out, "%.*s %.6f\n", entry->length, entry->name, results[i].similarity);
+    }
+}
+
+/* Print rank's count or select's member, answering a live set from its rank directory */
+static void print_position(const Registry *registry, const ParsedCommand *cmd, const StoredSet *s, long line) {
+    RankDirectory *d = NULL;  /* Versions are read once, so no directory */
+    long answer;
+
+    if (cmd->versions[0] == NULL) {
+        d = &registry_entry(registry, cmd->sets[0])->rank;
+    }
+    if (cmd->opcode == CMD_RANK) {
+        answer = rank_stored_set(s, d, cmd->members[0]);
+    } else {
+        answer = select_stored_set(s, d, cmd->members[0]);
+    }
+    if (answer < 0) {
+        print_error(26, line);
+    } else {
+        print_count(output_stream(), answer);
+    }
+}
+
+int command_sets(const ParsedCommand *cmd, SetAccess *sets) {
+    int ids[EXPR_MAX_NODES];
+    SetAccess access;
+    int count = 0, n, i, j;
+
+    switch (cmd->opcode) {
+        case CMD_READ_SET:
+        case CMD_ADD_RANGE:
+        case CMD_REMOVE_RANGE:
+        case CMD_COMPRESS_SET:
+        case CMD_DECOMPRESS_SET:
+        case CMD_LOAD_SET:
+            sets[count].id = cmd->sets[0];
+            sets[count++].write = 1;
+            break;
+        case CMD_PRINT_SET:
+        case CMD_COUNT_SET:
+        case CMD_CONTAINS_SET:
+        case CMD_SAVE_SET:
+            if (cmd->sets[0] >= 0) {  /* Snapshot versions are read without locks */
+                sets[count].id = cmd->sets[0];
+                sets[count++].write = 0;
+            }
+            break;
+        case CMD_RANK:
+        case CMD_SELECT:
+            if (cmd->sets[0] >= 0) {
+                sets[count].id = cmd->sets[0];
+                sets[count++].write = 1;  /* The members stay, but the rank directory may be rebuilt */
+            }
+            break;
+        case CMD_SUBSET_SET:
+        case CMD_EQUAL_SET:
+        case CMD_DISJOINT_SET:
+        case CMD_INTERSECT_COUNT:
+        case CMD_UNION_COUNT:
+        case CMD_JACCARD_SET:
+        case CMD_UNION_SET:
+        case CMD_INTERSECT_SET:
+        case CMD_SUB_SET:
+        case CMD_SYMDIFF_SET:
+            for (i = 0; i < cmd->nsets; i++) {
+                if (cmd->sets[i] >= 0) {
+                    sets[count].id = cmd->sets[i];
+                    sets[count++].write = i == 2;
+                }
+            }
+            break;
+        case CMD_EVAL:
+            n = expression_sets(&cmd->expr, ids);
+            for (i = 0; i < n; i++) {
+                sets[count].id = ids[i];
+                sets[count++].write = 0;
+            }
+            sets[count].id = cmd->expr.target;
+            sets[count++].write = 1;
+            break;
+        default:
+            break;
+    }
+
+    /* Locking in id order keeps server commands from deadlocking each other */
+    for (i = 1; i < count; i++) {
+        access = sets[i];
+        for (j = i; j > 0 && sets[j - 1].id > access.id; j--) {
+            sets[j] = sets[j - 1];
+        }
+        sets[j] = access;
+    }
+    for (i = 0, n = 0; i < count; i++) {
+        if (n > 0 && sets[n - 1].id == sets[i].id) {
+            sets[n - 1].write |= sets[i].write;
+        } else {
+            sets[n++] = sets[i];
+        }
+    }
+    return n;
+}
+
+int is_structural(const Registry *registry, const ParsedCommand *cmd) {
+    SetAccess sets[EXPR_MAX_NODES + 1];
+    Opcode opcode = cmd->opcode;
+    int n, i;
+
+    if (opcode == CMD_CREATE_SET || opcode == CMD_DROP_SET || opcode == CMD_SAVE_ALL || opcode == CMD_LOAD_ALL ||
+        opcode == CMD_SNAPSHOT || opcode == CMD_DROP_SNAPSHOT || opcode == CMD_SIMILAR || opcode == CMD_SIMILAR_EXACT ||
+        opcode == CMD_DEFINE_VIEW || opcode == CMD_DROP_VIEW) {
+        return 1;
+    }
+    if (registry->views == NULL) {
+        return 0;
+    }
+    n = command_sets(cmd, sets);
+    for (i = 0; i < n; i++) {
+        if (in_view(registry, sets[i].id)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int execute_command(Registry *registry, const ParsedCommand *cmd, long line) {
+    StoredSet *sets[3];
+    char path[PERSIST_PATH_MAX];
+    FILE *out = output_stream();
+    SetSpan span;
+    long shared = 0, either = 0;
+    int written = -1;
+    int error;
+    int stop = 0;
+    int i;
+
+    for (i = 0; i < cmd->nsets; i++) {
+        sets[i] = cmd->versions[i] == NULL ? registry_set(registry, cmd->sets[i]) : &cmd->versions[i]->set;
+    }
+    if (registry->views != NULL) {
+        refresh_read_sets(registry, cmd);
+        written = written_set(cmd);
+        if (written >= 0 && in_view(registry, written)) {
+            capture_span(registry_set(registry, written), &span);
+        } else {
+            written = -1;  /* No view reads it */
+        }
+    }
+    outdate_written_ranks(registry, cmd);
+
+    switch (cmd->opcode) {
+        case CMD_READ_SET:
+            if (cmd->bitmap != NULL) {
+                read_stored_bitmap(sets[0], cmd->bitmap, cmd->bitmap_first, cmd->bitmap_words);
+            } else {
+                read_stored_set(cmd->members, sets[0], cmd->count);
+            }
+            for (i = 0; i < cmd->nranges; i++) {
+                add_stored_range(sets[0], cmd->ranges[2 * i], cmd->ranges[2 * i + 1]);
+            }
+            break;
+        case CMD_ADD_RANGE:
+            add_stored_range(sets[0], cmd->ranges[0], cmd->ranges[1]);
+            break;
+        case CMD_REMOVE_RANGE:
+            remove_stored_range(sets[0], cmd->ranges[0], cmd->ranges[1]);
+            break;
+        case CMD_PRINT_SET:
+            print_stored_set(sets[0]);
+            break;
+        case CMD_UNION_SET:
+        case CMD_INTERSECT_SET:
+        case CMD_SUB_SET:
+        case CMD_SYMDIFF_SET:
+            /* The opcodes follow the order of SetOperation */
+            operate_stored_sets((SetOperation)(cmd->opcode - CMD_UNION_SET), sets[0], sets[1], sets[2]);
+            break;
+        case CMD_SUBSET_SET:
+        case CMD_EQUAL_SET:
+        case CMD_DISJOINT_SET:
+            /* The opcodes follow the order of SetTest */
+            error = test_stored_sets((SetTest)(cmd->opcode - CMD_SUBSET_SET), sets[0], sets[1]);
+            print_answer(out, error);
+            break;
+        case CMD_INTERSECT_COUNT:
+        case CMD_UNION_COUNT:
+        case CMD_JACCARD_SET:
+            count_stored_overlap(sets[0], sets[1], cmd->opcode != CMD_UNION_COUNT ? &shared : NULL,
+                                 cmd->opcode != CMD_INTERSECT_COUNT ? &either : NULL);
+            if (cmd->opcode == CMD_JACCARD_SET) {
+                print_ratio(out, either > 0 ? (double)shared / either : 1.0);  /* Two empty sets are identical */
+            } else {
+                print_count(out, cmd->opcode == CMD_INTERSECT_COUNT ? shared : either);
+            }
+            break;
+        case CMD_COUNT_SET:
+            print_count(out, count_stored_set(sets[0]));
+            break;
+        case CMD_CONTAINS_SET:
+            error = contains_stored_set(sets[0], cmd->members[0]);
+            print_answer(out, error);
+            break;
+        case CMD_EVAL:
+            eval_expression(registry, &cmd->expr);
+            break;
+        case CMD_DEFINE_VIEW:
+            define_view(registry, &cmd->expr);
+            break;
+        case CMD_DROP_VIEW:
+            drop_view(registry, cmd->sets[0]);
+            break;
+        case CMD_SAVE_SET:
+        case CMD_LOAD_SET:
+        case CMD_SAVE_ALL:
+        case CMD_LOAD_ALL:
+            memcpy(path, cmd->name, cmd->name_length);
+            path[cmd->name_length] = '\0';
+            if (cmd->opcode == CMD_SAVE_SET) {
+                error = save_sets(registry, cmd->sets, 1, path);
+            } else if (cmd->opcode == CMD_LOAD_SET) {
+                error = load_set(registry, cmd->sets[0], path);
+            } else if (cmd->opcode == CMD_SAVE_ALL) {
+                error = save_all_sets(registry, path);
+            } else {
+                error = load_all_sets(registry, path);
+            }
+            if (error != 0) {
+                print_error(error, line);
+            }
+            break;
+        case CMD_COMPRESS_SET:
+            convert_stored_set(sets[0], 1);
+            break;
+        case CMD_DECOMPRESS_SET:
+            convert_stored_set(sets[0], 0);
+            break;
+        case CMD_CREATE_SET:
+            create_registry_set(registry, cmd->name, cmd->name_length);
+            break;
+        case CMD_DROP_SET:
+            drop_registry_set(registry, cmd->sets[0]);
+            break;
+        case CMD_STATS:
+            print_stats(&command_stats, out);
+            break;
+        case CMD_SNAPSHOT:
+            print_count(out, take_snapshot(registry));
+            break;
+        case CMD_SET_ID:
+            print_count(out, cmd->sets[0]);
+            break;
+        case CMD_RANK:
+        case CMD_SELECT:
+            print_position(registry, cmd, sets[0], line);
+            break;
+        case CMD_DROP_SNAPSHOT:
+            error = drop_snapshot(registry, cmd->members[0]);
+            if (error != 0) {
+                print_error(error, line);
+            }
+            break;
+        case CMD_SIMILAR:
+        case CMD_SIMILAR_EXACT:
+            print_similar_sets(registry, cmd);
+            break;
+        case CMD_STOP:
+            stop = 1;
+            break;
+    }
+    if (written >= 0 || (registry->views != NULL && cmd->opcode == CMD_LOAD_ALL)) {
+        mark_written_sets(registry, cmd, written, &span);
+    }
+    index_written_sets(registry, cmd);
+    return stop;
+}
+
+
+int run_command(const char *command_string, Registry *registry, ParsedCommand *cmd, long line, uint64_t *clock) {
+    uint64_t ns[STAGE_COUNT] = {0};
+    uint64_t start = stats_now();  /* Each stage ends where the next begins, one clock read apiece */
+    int error = parse_command(command_string, registry, cmd);
+    int stop;
+
+    ns[STAGE_READ] = start - *clock;
+    *clock = stats_now();
+    ns[STAGE_PARSE] = *clock - start;
+    if (error != 0) {
+        print_error(error, line);
+        record_command(&command_stats, 0, ns, strlen(command_string));
+        reset_arena(command_arena());
+        return 0;
+    }
+    start = *clock;
+    stop = execute_command(registry, cmd, line);
+    reset_arena(command_arena());  /* command_string may live there, so only now */
+    *clock = stats_now();
+    ns[STAGE_EXECUTE] = *clock - start;
+    record_command(&command_stats, cmd->opcode, ns, strlen(command_string));
+    return stop;
+}
+
+
+int run_frame(const unsigned char *frame, size_t length, Registry *registry, ParsedCommand *cmd, long number,
+              ReplyBuffer *reply, uint64_t *clock) {
+    uint64_t ns[STAGE_COUNT] = {0};
+    uint64_t start = stats_now();
+    int error, stop = 0;
+
+    begin_reply(reply);
+    error = parse_frame(frame, length, registry, cmd);
+    ns[STAGE_READ] = start - *clock;
+    *clock = stats_now();
+    ns[STAGE_PARSE] = *clock - start;
+    if (error != 0) {
+        print_error(error, number);
+        record_command(&command_stats, 0, ns, length);
+    } else {
+        start = *clock;
+        stop = execute_command(registry, cmd, number);
+        *clock = stats_now();
+        ns[STAGE_EXECUTE] = *clock - start;
+        record_command(&command_stats, cmd->opcode, ns, length);
+    }
+    reset_arena(command_arena());  /* Text frames are parsed from a copy there */
+    end_reply(reply);
+    return stop;
+}
+
+
+void run_streamed_read(LineReader *reader, Registry *registry, uint64_t *clock) {
+    uint64_t ns[STAGE_COUNT] = {0};
+    uint64_t start = stats_now();
+    Set members;
+    SetSpan span;
+    size_t length;
+    int id;
+    int error = stream_read_command(reader, registry, &id, &members, &length);
+
+    ns[STAGE_READ] = start - *clock;
+    *clock = stats_now();
+    ns[STAGE_PARSE] = *clock - start;  /* Reading the line is part of parsing it */
+    if (error != 0) {
+        print_error(error, reader->line_number);
+        record_command(&command_stats, 0, ns, length);
+        return;
+    }
+    start = *clock;
+    if (in_view(registry, id)) {
+        capture_span(registry_set(registry, id), &span);
+    }
+    registry_entry(registry, id)->rank.built = 0;
+    assign_stored_set(registry_set(registry, id), &members);
+    if (in_view(registry, id)) {
+        mark_set_rewritten(registry, id, &span);
+    }
+    index_set(registry, id);
+    *clock = stats_now();
+    ns[STAGE_EXECUTE] = *clock - start;
+    record_command(&command_stats, CMD_READ_SET, ns, length);
+}
+
+
+void print_error(int error_code, long line) {
+    FILE *out = output_stream();
+    if (output_binary()) {
+        fail_reply(error_code);  /* The reply's status carries it */
+        return;
+    }
+    if (line > 0) {
+        fprintf(out, "Line %ld: ", line);
+    }
+    switch (error_code) {
+        case 1:
+            fprintf(out, "Invalid set name\n");
+            break;
+        case 2:
+            fprintf(out, "Invalid command name\n");
+            break;
+        case 3:
+            fprintf(out, "Members out of range (0 - %d)\n", SET_MAX_MEMBER);
+            break;
+        case 4:
+            fprintf(out, "Invalid set member - not an integer\n");
+            break;
+        case 5:
+            fprintf(out, "List of set members is not terminated correctly\n");
+            break;
+        case 6:
+            fprintf(out, "Missing space after command name\n");
+            break;
+        case 7:
+            fprintf(out, "Missing parameter\n");
+            break;
+        case 8:
+            fprintf(out, "Extraneous text after end of command\n");
+            break;
+        case 9:
+            fprintf(out, "Multiple consecutive commas\n");
+            break;
+        case 10:
+            fprintf(out, "Missing comma\n");
+            break;
+        case 11:
+            fprintf(out, "Illegal comma\n");
+            break;
+        case 12:
+            fprintf(out, "Set already exists\n");
+            break;
+        case 13:
+            fprintf(out, "Invalid expression\n");
+            break;
+        case 14:
+            fprintf(out, "Expression too long\n");
+            break;
+        case 15:
+            fprintf(out, "Cannot access file\n");
+            break;
+        case 16:
+            fprintf(out, "Invalid set file\n");
+            break;
+        case 17:
+            fprintf(out, "Set not found in file\n");
+            break;
+        case 18:
+            fprintf(out, "No such snapshot\n");
+            break;
+        case 19:
+            fprintf(out, "Invalid range - first member above last\n");
+            break;
+        case 20:
+            fprintf(out, "Set is a view - change its sources or drop_view it\n");
+            break;
+        case 21:
+            fprintf(out, "Set is not a view\n");
+            break;
+        case 22:
+            fprintf(out, "Views cannot read snapshots\n");
+            break;
+        case 23:
+            fprintf(out, "View would depend on itself\n");
+            break;
+        case 24:
+            fprintf(out, "Malformed frame\n");
+            break;
+        case 25:
+            fprintf(out, "Command has no binary form - send it as text\n");
+            break;
+        case 26:
+            fprintf(out, "Set has too few members\n");
+            break;
+        default:
+            break;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,96 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <stdint.h>
+#include "parser.h"
+#include "protocol.h"
+
+/**
+ * @brief A set a command reads or writes.
+ */
+typedef struct {
+    int id;      /* Registry entry id */
+    int write;   /* 1 if the command may change it */
+} SetAccess;
+
+/**
+ * @brief Print error message based on error code.
+ *
+ * In binary output nothing is printed: the code becomes the status of the reply being written.
+ * @param error_code The error code to print a message for.
+ * @param line Line of the script the error is in, or 0 when interactive.
+ */
+void print_error(int error_code, long line);
+
+/**
+ * @brief List the live sets a command reads or writes.
+ *
+ * Snapshot operands are left out, since versions never change. Commands
+ * working on the whole registry (see is_structural) list nothing.
+ * @param cmd The command, as filled by parse_command.
+ * @param sets Array of EXPR_MAX_NODES + 1 entries receiving the sets, sorted by id without duplicates.
+ * @return Number of sets.
+ */
+int command_sets(const ParsedCommand *cmd, SetAccess *sets);
+
+/**
+ * @brief Check whether a command must run with no other command running.
+ *
+ * These are the commands that create or drop sets or snapshots, read or
+ * load every set, define or drop views, and those touching a view or its
+ * sources: reading a view may write it, and writing a source marks the
+ * views reading it.
+ * @param registry The named sets.
+ * @param cmd The command, as filled by parse_command.
+ * @return 1 if it must run alone, 0 otherwise.
+ */
+int is_structural(const Registry *registry, const ParsedCommand *cmd);
+
+/**
+ * @brief Execute a parsed command, writing its output to output_stream().
+ * @param registry The named sets the command operates on.
+ * @param cmd The command, as filled by parse_command.
+ * @param line Line of the script the command is on, or 0 when interactive.
+ * @return 1 if the command was stop, 0 otherwise.
+ */
+int execute_command(Registry *registry, const ParsedCommand *cmd, long line);
+
+/**
+ * @brief Validate and execute one command.
+ * @param command_string The raw command line.
+ * @param registry The named sets the command operates on.
+ * @param cmd Parsed command storage, reused between commands.
+ * @param line Line of the script the command is on, or 0 when interactive.
+ * @param clock For the statistics: on entry the time reading the command
+ *        began, on return the time the command finished.
+ * @return 1 if the command was stop, 0 otherwise.
+ */
+int run_command(const char *command_string, Registry *registry, ParsedCommand *cmd, long line, uint64_t *clock);
+
+/**
+ * @brief Validate and execute one binary command frame, writing its reply.
+ * @param frame The frame after its length header (see parse_frame).
+ * @param length Bytes in the frame.
+ * @param registry The named sets the command operates on.
+ * @param cmd Parsed command storage, reused between commands.
+ * @param number Number of the frame in the input, counted like script lines.
+ * @param reply Buffer receiving the reply frame: its result in binary, or the error code as its status.
+ * @param clock As for run_command.
+ * @return 1 if the command was stop, 0 otherwise.
+ */
+int run_frame(const unsigned char *frame, size_t length, Registry *registry, ParsedCommand *cmd, long number,
+              ReplyBuffer *reply, uint64_t *clock);
+
+/**
+ * @brief Validate and execute a read_set line too long to read whole.
+ *
+ * Members are validated and added to the set as they are read from the
+ * input (see stream_read_command), with the results and statistics of
+ * run_command.
+ * @param reader The reader, positioned at the line.
+ * @param registry The named sets the command operates on.
+ * @param clock As for run_command.
+ */
+void run_streamed_read(LineReader *reader, Registry *registry, uint64_t *clock);
+
+#endif /* COMMANDS_H */
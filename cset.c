@@ -0,0 +1,910 @@
+#include <string.h>
+#include "cset.h"
+#include "kernels.h"
+
+
+static void* cset_alloc(size_t size) {
+    void *ptr = malloc(size > 0 ? size : 1);
+    if (ptr == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+/* Whether op keeps a member present in s1 (in1) and/or s2 (in2) */
+static int op_keeps(SetOperation op, int in1, int in2) {
+    switch (op) {
+        case OP_UNION:
+            return in1 || in2;
+        case OP_INTERSECT:
+            return in1 && in2;
+        case OP_SUB:
+            return in1 && !in2;
+        case OP_SYMDIFF:
+            return in1 != in2;
+    }
+    return 0;
+}
+
+static word_kernel kernel_for(SetOperation op) {
+    switch (op) {
+        case OP_UNION:
+            return set_kernels->or_words;
+        case OP_INTERSECT:
+            return set_kernels->and_words;
+        case OP_SUB:
+            return set_kernels->andnot_words;
+        case OP_SYMDIFF:
+            return set_kernels->xor_words;
+    }
+    return NULL;
+}
+
+static int popcount_words(const uint64_t* words, int n) {
+    return (int)set_kernels->count_words(words, n);
+}
+
+
+/* ---- Representation choice and conversions ---- */
+
+static int runs_in_bitmap(const uint64_t* bitmap) {
+    int runs = 0;
+    uint64_t carry = 0;  /* Top bit of the previous word */
+    int i;
+    for (i = 0; i < CSET_BITMAP_WORDS; i++) {
+        runs += __builtin_popcountll(bitmap[i] & ~((bitmap[i] << 1) | carry));  /* Run starts */
+        carry = bitmap[i] >> 63;
+    }
+    return runs;
+}
+
+static int runs_in_array(const uint16_t* array, int size) {
+    int runs = size > 0;
+    int i;
+    for (i = 1; i < size; i++) {
+        runs += array[i] != array[i - 1] + 1;
+    }
+    return runs;
+}
+
+static ContainerType best_type(int cardinality, int runs) {
+    long array_bytes = 2L * cardinality;
+    long run_bytes = (long)sizeof(CRun) * runs;
+    long bitmap_bytes = CSET_BITMAP_WORDS * sizeof(uint64_t);
+    if (run_bytes < array_bytes && run_bytes < bitmap_bytes) {
+        return CONTAINER_RUN;
+    }
+    return cardinality <= CSET_ARRAY_MAX ? CONTAINER_ARRAY : CONTAINER_BITMAP;
+}
+
+/* Fill bitmap (CSET_BITMAP_WORDS words) with the members of c */
+static void container_to_bitmap(const Container* c, uint64_t* bitmap) {
+    int i;
+    long x;
+    if (c->type == CONTAINER_BITMAP) {
+        memcpy(bitmap, c->data.bitmap, CSET_BITMAP_WORDS * sizeof(uint64_t));
+        return;
+    }
+    memset(bitmap, 0, CSET_BITMAP_WORDS * sizeof(uint64_t));
+    if (c->type == CONTAINER_ARRAY) {
+        for (i = 0; i < c->size; i++) {
+            bitmap[c->data.array[i] >> 6] |= (uint64_t)1 << (c->data.array[i] & 63);
+        }
+    } else {
+        for (i = 0; i < c->size; i++) {
+            for (x = c->data.runs[i].start; x <= (long)c->data.runs[i].start + c->data.runs[i].length; x++) {
+                bitmap[x >> 6] |= (uint64_t)1 << (x & 63);
+            }
+        }
+    }
+}
+
+/* Bitmap of c without copying when c already is one */
+static const uint64_t* bitmap_view(const Container* c, uint64_t* scratch) {
+    if (c->type == CONTAINER_BITMAP) {
+        return c->data.bitmap;
+    }
+    container_to_bitmap(c, scratch);
+    return scratch;
+}
+
+/* Store the members of bitmap in c using the smallest representation.
+ * Takes ownership of bitmap when it was heap allocated (owned). */
+static void container_from_bitmap(Container* c, uint64_t* bitmap, int owned) {
+    int cardinality = popcount_words(bitmap, CSET_BITMAP_WORDS);
+    ContainerType type = best_type(cardinality, runs_in_bitmap(bitmap));
+    int i, n = 0;
+    uint64_t word;
+
+    c->type = type;
+    c->cardinality = cardinality;
+    if (type == CONTAINER_BITMAP) {
+        if (!owned) {
+            c->data.bitmap = cset_alloc(CSET_BITMAP_WORDS * sizeof(uint64_t));
+            memcpy(c->data.bitmap, bitmap, CSET_BITMAP_WORDS * sizeof(uint64_t));
+        } else {
+            c->data.bitmap = bitmap;
+        }
+        c->size = 0;
+        return;
+    }
+    if (type == CONTAINER_ARRAY) {
+        c->data.array = cset_alloc(cardinality * sizeof(uint16_t));
+        for (i = 0; i < CSET_BITMAP_WORDS; i++) {
+            for (word = bitmap[i]; word != 0; word &= word - 1) {
+                c->data.array[n++] = (uint16_t)(i * 64 + __builtin_ctzll(word));
+            }
+        }
+    } else {
+        long x = 0, start;
+        c->data.runs = cset_alloc(runs_in_bitmap(bitmap) * sizeof(CRun));
+        while (x < CSET_CHUNK_SIZE) {
+            if (!(bitmap[x >> 6] >> (x & 63) & 1)) {
+                x++;
+                continue;
+            }
+            start = x;
+            while (x < CSET_CHUNK_SIZE && (bitmap[x >> 6] >> (x & 63) & 1)) {
+                x++;
+            }
+            c->data.runs[n].start = (uint16_t)start;
+            c->data.runs[n].length = (uint16_t)(x - 1 - start);
+            n++;
+        }
+    }
+    c->size = n;
+    if (owned) {
+        free(bitmap);
+    }
+}
+
+/* Re-encode c if another representation is smaller */
+static void container_optimize(Container* c) {
+    uint64_t scratch[CSET_BITMAP_WORDS];
+    int runs;
+    void *old;
+
+    if (c->type == CONTAINER_BITMAP) {
+        container_from_bitmap(c, c->data.bitmap, 1);
+        return;
+    }
+    runs = c->type == CONTAINER_RUN ? c->size : runs_in_array(c->data.array, c->size);
+    if (best_type(c->cardinality, runs) == c->type) {
+        return;
+    }
+    old = c->data.array;
+    container_to_bitmap(c, scratch);
+    container_from_bitmap(c, scratch, 0);
+    free(old);
+}
+
+static void container_copy(const Container* c, Container* copy) {
+    size_t bytes;
+    *copy = *c;
+    if (c->type == CONTAINER_BITMAP) {
+        bytes = CSET_BITMAP_WORDS * sizeof(uint64_t);
+    } else if (c->type == CONTAINER_ARRAY) {
+        bytes = c->size * sizeof(uint16_t);
+    } else {
+        bytes = c->size * sizeof(CRun);
+    }
+    copy->data.array = cset_alloc(bytes);
+    memcpy(copy->data.array, c->data.array, bytes);
+}
+
+
+/* ---- Container-pair kernels; each leaves an optimized container in out ---- */
+
+static void array_array(SetOperation op, const Container* a, const Container* b, Container* out) {
+    uint16_t *result = cset_alloc((a->size + b->size) * sizeof(uint16_t));
+    int i = 0, j = 0, n = 0;
+    int in_a, in_b;
+    uint16_t x;
+
+    while (i < a->size || j < b->size) {
+        if (j >= b->size || (i < a->size && a->data.array[i] < b->data.array[j])) {
+            x = a->data.array[i++];
+            in_a = 1, in_b = 0;
+        } else if (i >= a->size || b->data.array[j] < a->data.array[i]) {
+            x = b->data.array[j++];
+            in_a = 0, in_b = 1;
+        } else {
+            x = a->data.array[i++];
+            j++;
+            in_a = 1, in_b = 1;
+        }
+        if (op_keeps(op, in_a, in_b)) {
+            result[n++] = x;
+        }
+    }
+    out->type = CONTAINER_ARRAY;
+    out->data.array = result;
+    out->size = out->cardinality = n;
+    if (n > CSET_ARRAY_MAX) {  /* Union and xor can outgrow an array */
+        uint64_t *bitmap = cset_alloc(CSET_BITMAP_WORDS * sizeof(uint64_t));
+        container_to_bitmap(out, bitmap);
+        free(result);
+        container_from_bitmap(out, bitmap, 1);
+        return;
+    }
+    container_optimize(out);
+}
+
+static void bitmap_bitmap(SetOperation op, const uint64_t* a, const uint64_t* b, Container* out) {
+    uint64_t *result = cset_alloc(CSET_BITMAP_WORDS * sizeof(uint64_t));
+    kernel_for(op)(result, a, b, CSET_BITMAP_WORDS);
+    container_from_bitmap(out, result, 1);
+}
+
+/* One side an array, the other a bitmap; array_first tells which is s1 */
+static void array_bitmap(SetOperation op, const Container* array, const uint64_t* bitmap, int array_first, Container* out) {
+    int i, n = 0;
+    uint16_t x;
+    uint64_t bit;
+
+    if (op == OP_INTERSECT || (op == OP_SUB && array_first)) {
+        /* The result is a subset of the array: filter it by probing the bitmap */
+        uint16_t *result = cset_alloc(array->size * sizeof(uint16_t));
+        for (i = 0; i < array->size; i++) {
+            x = array->data.array[i];
+            if (((bitmap[x >> 6] >> (x & 63)) & 1) == (op == OP_INTERSECT)) {
+                result[n++] = x;
+            }
+        }
+        out->type = CONTAINER_ARRAY;
+        out->data.array = result;
+        out->size = out->cardinality = n;
+        container_optimize(out);
+        return;
+    }
+
+    /* Otherwise start from the bitmap and apply the array bit by bit */
+    uint64_t *result = cset_alloc(CSET_BITMAP_WORDS * sizeof(uint64_t));
+    memcpy(result, bitmap, CSET_BITMAP_WORDS * sizeof(uint64_t));
+    for (i = 0; i < array->size; i++) {
+        x = array->data.array[i];
+        bit = (uint64_t)1 << (x & 63);
+        if (op == OP_UNION) {
+            result[x >> 6] |= bit;
+        } else if (op == OP_SYMDIFF) {
+            result[x >> 6] ^= bit;
+        } else {
+            result[x >> 6] &= ~bit;  /* bitmap minus array */
+        }
+    }
+    container_from_bitmap(out, result, 1);
+}
+
+/* Sweep the run boundaries of both containers, emitting the segments op keeps */
+static void run_run(SetOperation op, const Container* a, const Container* b, Container* out) {
+    CRun *result = cset_alloc((2 * (a->size + b->size) + 1) * sizeof(CRun));
+    int i = 0, j = 0, n = 0, in_a, in_b;
+    long pos = 0, next_a, next_b, next, cardinality = 0;
+
+    while (pos < CSET_CHUNK_SIZE) {
+        while (i < a->size && (long)a->data.runs[i].start + a->data.runs[i].length < pos) {
+            i++;
+        }
+        while (j < b->size && (long)b->data.runs[j].start + b->data.runs[j].length < pos) {
+            j++;
+        }
+        in_a = i < a->size && a->data.runs[i].start <= pos;
+        in_b = j < b->size && b->data.runs[j].start <= pos;
+        next_a = i >= a->size ? CSET_CHUNK_SIZE
+                 : in_a ? (long)a->data.runs[i].start + a->data.runs[i].length + 1 : a->data.runs[i].start;
+        next_b = j >= b->size ? CSET_CHUNK_SIZE
+                 : in_b ? (long)b->data.runs[j].start + b->data.runs[j].length + 1 : b->data.runs[j].start;
+        next = next_a < next_b ? next_a : next_b;
+        if (op_keeps(op, in_a, in_b)) {
+            if (n > 0 && (long)result[n - 1].start + result[n - 1].length + 1 == pos) {
+                result[n - 1].length = (uint16_t)(next - 1 - result[n - 1].start);  /* Extend the adjacent run */
+            } else {
+                result[n].start = (uint16_t)pos;
+                result[n].length = (uint16_t)(next - 1 - pos);
+                n++;
+            }
+            cardinality += next - pos;
+        }
+        pos = next;
+    }
+    out->type = CONTAINER_RUN;
+    out->data.runs = result;
+    out->size = n;
+    out->cardinality = (int)cardinality;
+    container_optimize(out);
+}
+
+static void combine_containers(SetOperation op, const Container* a, const Container* b, Container* out) {
+    uint64_t scratch_a[CSET_BITMAP_WORDS], scratch_b[CSET_BITMAP_WORDS];
+
+    out->key = a->key;
+    if (a->type == CONTAINER_ARRAY && b->type == CONTAINER_ARRAY) {
+        array_array(op, a, b, out);
+    } else if (a->type == CONTAINER_RUN && b->type == CONTAINER_RUN) {
+        run_run(op, a, b, out);
+    } else if (a->type == CONTAINER_ARRAY) {
+        array_bitmap(op, a, bitmap_view(b, scratch_b), 1, out);
+    } else if (b->type == CONTAINER_ARRAY) {
+        array_bitmap(op, b, bitmap_view(a, scratch_a), 0, out);
+    } else {
+        bitmap_bitmap(op, bitmap_view(a, scratch_a), bitmap_view(b, scratch_b), out);
+    }
+}
+
+
+/* ---- Set level ---- */
+
+static void push_container(CompressedSet* s, const Container* c) {
+    if (s->count == s->capacity) {
+        int capacity = s->capacity > 0 ? s->capacity * 2 : 4;
+        Container *containers = realloc(s->containers, capacity * sizeof(Container));
+        if (containers == NULL) {
+            fprintf(stderr, "Memory reallocation failed\n");
+            exit(1);
+        }
+        s->containers = containers;
+        s->capacity = capacity;
+    }
+    s->containers[s->count++] = *c;
+}
+
+void init_cset(CompressedSet* s) {
+    s->containers = NULL;
+    s->count = 0;
+    s->capacity = 0;
+}
+
+void free_cset(CompressedSet* s) {
+    int i;
+    for (i = 0; i < s->count; i++) {
+        free(s->containers[i].data.array);
+    }
+    free(s->containers);
+    init_cset(s);
+}
+
+void copy_cset(const CompressedSet* s, CompressedSet* copy) {
+    Container c;
+    int i;
+    free_cset(copy);
+    for (i = 0; i < s->count; i++) {
+        container_copy(&s->containers[i], &c);
+        push_container(copy, &c);
+    }
+}
+
+static int compare_ints(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+void read_cset(const int* ptr, CompressedSet* s, int n) {
+    int *sorted = cset_alloc(n * sizeof(int));
+    int i = 0, j, k;
+    Container c;
+
+    memcpy(sorted, ptr, n * sizeof(int));
+    qsort(sorted, n, sizeof(int), compare_ints);
+    free_cset(s);
+    while (i < n) {
+        /* Collect the distinct members of one chunk as an array, then re-encode */
+        c.key = (uint16_t)(sorted[i] >> CSET_CHUNK_BITS);
+        for (j = i; j < n && sorted[j] >> CSET_CHUNK_BITS == c.key; j++) {
+        }
+        c.type = CONTAINER_ARRAY;
+        c.data.array = cset_alloc((j - i) * sizeof(uint16_t));
+        c.size = 0;
+        for (k = i; k < j; k++) {
+            if (k == i || sorted[k] != sorted[k - 1]) {
+                c.data.array[c.size++] = (uint16_t)sorted[k];
+            }
+        }
+        c.cardinality = c.size;
+        if (c.size > CSET_ARRAY_MAX) {
+            uint64_t *bitmap = cset_alloc(CSET_BITMAP_WORDS * sizeof(uint64_t));
+            container_to_bitmap(&c, bitmap);
+            free(c.data.array);
+            container_from_bitmap(&c, bitmap, 1);
+        } else {
+            container_optimize(&c);
+        }
+        push_container(s, &c);
+        i = j;
+    }
+    free(sorted);
+}
+
+void print_cset(const CompressedSet* s) {
+    PrintBuffer out;
+    int i, j;
+    long base, x;
+    const Container *c;
+    uint64_t word;
+
+    init_print_buffer(&out);
+    for (i = 0; i < s->count; i++) {
+        c = &s->containers[i];
+        base = (long)c->key << CSET_CHUNK_BITS;
+        if (c->type == CONTAINER_ARRAY) {
+            for (j = 0; j < c->size; j++) {
+                print_member(&out, base + c->data.array[j]);
+            }
+        } else if (c->type == CONTAINER_RUN) {
+            for (j = 0; j < c->size; j++) {
+                for (x = c->data.runs[j].start; x <= (long)c->data.runs[j].start + c->data.runs[j].length; x++) {
+                    print_member(&out, base + x);
+                }
+            }
+        } else {
+            for (j = 0; j < CSET_BITMAP_WORDS; j++) {
+                for (word = c->data.bitmap[j]; word != 0; word &= word - 1) {
+                    print_member(&out, base + j * 64 + __builtin_ctzll(word));
+                }
+            }
+        }
+    }
+    end_print_buffer(&out);
+}
+
+long count_cset(const CompressedSet* s) {
+    long count = 0;
+    int i;
+    for (i = 0; i < s->count; i++) {
+        count += s->containers[i].cardinality;
+    }
+    return count;
+}
+
+int contains_cset(const CompressedSet* s, long x) {
+    int low = 0, high, middle;
+    long key = x >> CSET_CHUNK_BITS;
+    uint16_t value = (uint16_t)(x & (CSET_CHUNK_SIZE - 1));
+    const Container *c = NULL;
+
+    if (x < 0) {
+        return 0;
+    }
+    high = s->count - 1;
+    while (low <= high && c == NULL) {  /* Find the container by key */
+        middle = (low + high) / 2;
+        if (s->containers[middle].key < key) {
+            low = middle + 1;
+        } else if (s->containers[middle].key > key) {
+            high = middle - 1;
+        } else {
+            c = &s->containers[middle];
+        }
+    }
+    if (c == NULL) {
+        return 0;
+    }
+    if (c->type == CONTAINER_BITMAP) {
+        return (c->data.bitmap[value >> 6] >> (value & 63)) & 1;
+    }
+    low = 0;
+    high = c->size - 1;
+    while (low <= high) {
+        middle = (low + high) / 2;
+        if (c->type == CONTAINER_ARRAY) {
+            if (c->data.array[middle] == value) {
+                return 1;
+            }
+            if (c->data.array[middle] < value) {
+                low = middle + 1;
+            } else {
+                high = middle - 1;
+            }
+        } else {
+            if (value < c->data.runs[middle].start) {
+                high = middle - 1;
+            } else if (value > (long)c->data.runs[middle].start + c->data.runs[middle].length) {
+                low = middle + 1;
+            } else {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Members of a container below value, an offset in its chunk */
+static long container_rank(const Container* c, long value) {
+    int low = 0, high = c->size, middle, i;
+    long count = 0;
+
+    switch (c->type) {
+        case CONTAINER_BITMAP:
+            count = popcount_words(c->data.bitmap, (int)(value >> 6));
+            return count + __builtin_popcountll(c->data.bitmap[value >> 6] & (((uint64_t)1 << (value & 63)) - 1));
+        case CONTAINER_ARRAY:
+            while (low < high) {  /* The first member not below value */
+                middle = (low + high) / 2;
+                if (c->data.array[middle] < value) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            return low;
+        case CONTAINER_RUN:
+            for (i = 0; i < c->size && c->data.runs[i].start < value; i++) {
+                count += value - c->data.runs[i].start < c->data.runs[i].length + 1L ?
+                         value - c->data.runs[i].start : c->data.runs[i].length + 1L;
+            }
+            return count;
+    }
+    return 0;
+}
+
+/* The member of a container with k members of it below, for k < cardinality */
+static long container_select(const Container* c, long k) {
+    uint64_t word;
+    long bits;
+    int i;
+
+    switch (c->type) {
+        case CONTAINER_BITMAP:
+            for (i = 0; i < CSET_BITMAP_WORDS; i++) {
+                bits = __builtin_popcountll(c->data.bitmap[i]);
+                if (k < bits) {
+                    for (word = c->data.bitmap[i]; k > 0; k--) {
+                        word &= word - 1;  /* Drop the lowest bit */
+                    }
+                    return (long)i * SET_WORD_BITS + __builtin_ctzll(word);
+                }
+                k -= bits;
+            }
+            break;
+        case CONTAINER_ARRAY:
+            return c->data.array[k];
+        case CONTAINER_RUN:
+            for (i = 0; i < c->size; i++) {
+                if (k <= c->data.runs[i].length) {
+                    return c->data.runs[i].start + k;
+                }
+                k -= c->data.runs[i].length + 1L;
+            }
+            break;
+    }
+    return -1;
+}
+
+long rank_cset(const CompressedSet* s, long x) {
+    long key = x >> CSET_CHUNK_BITS;
+    long count = 0;
+    int i;
+
+    for (i = 0; i < s->count && s->containers[i].key < key; i++) {
+        count += s->containers[i].cardinality;
+    }
+    if (i < s->count && s->containers[i].key == key) {
+        count += container_rank(&s->containers[i], x & (CSET_CHUNK_SIZE - 1));
+    }
+    return count;
+}
+
+long select_cset(const CompressedSet* s, long k) {
+    int i;
+
+    for (i = 0; i < s->count; i++) {
+        if (k < s->containers[i].cardinality) {
+            return ((long)s->containers[i].key << CSET_CHUNK_BITS) + container_select(&s->containers[i], k);
+        }
+        k -= s->containers[i].cardinality;
+    }
+    return -1;
+}
+
+void operate_csets(SetOperation op, const CompressedSet* s1, const CompressedSet* s2, CompressedSet* target) {
+    CompressedSet result;
+    Container c;
+    int i = 0, j = 0;
+
+    init_cset(&result);
+    while (i < s1->count || j < s2->count) {
+        if (j >= s2->count || (i < s1->count && s1->containers[i].key < s2->containers[j].key)) {
+            if (op_keeps(op, 1, 0)) {  /* Chunk only in s1 */
+                container_copy(&s1->containers[i], &c);
+                push_container(&result, &c);
+            }
+            i++;
+        } else if (i >= s1->count || s2->containers[j].key < s1->containers[i].key) {
+            if (op_keeps(op, 0, 1)) {  /* Chunk only in s2 */
+                container_copy(&s2->containers[j], &c);
+                push_container(&result, &c);
+            }
+            j++;
+        } else {
+            combine_containers(op, &s1->containers[i], &s2->containers[j], &c);
+            if (c.cardinality > 0) {
+                push_container(&result, &c);
+            } else {
+                free(c.data.array);
+            }
+            i++;
+            j++;
+        }
+    }
+    free_cset(target);  /* Inputs are no longer read, so target may alias them */
+    *target = result;
+}
+
+/* The members first .. last as one run container per chunk */
+static void range_cset(long first, long last, CompressedSet* range) {
+    Container c;
+    long key, low, high;
+
+    init_cset(range);
+    for (key = first >> CSET_CHUNK_BITS; key <= last >> CSET_CHUNK_BITS; key++) {
+        low = key == first >> CSET_CHUNK_BITS ? first & (CSET_CHUNK_SIZE - 1) : 0;
+        high = key == last >> CSET_CHUNK_BITS ? last & (CSET_CHUNK_SIZE - 1) : CSET_CHUNK_SIZE - 1;
+        c.key = (uint16_t)key;
+        c.type = CONTAINER_RUN;
+        c.size = 1;
+        c.cardinality = (int)(high - low + 1);
+        c.data.runs = cset_alloc(sizeof(CRun));
+        c.data.runs[0].start = (uint16_t)low;
+        c.data.runs[0].length = (uint16_t)(high - low);
+        push_container(range, &c);
+    }
+}
+
+void add_cset_range(CompressedSet* s, long first, long last) {
+    CompressedSet range;
+    range_cset(first, last, &range);
+    operate_csets(OP_UNION, s, &range, s);
+    free_cset(&range);
+}
+
+void remove_cset_range(CompressedSet* s, long first, long last) {
+    CompressedSet range;
+    range_cset(first, last, &range);
+    operate_csets(OP_SUB, s, &range, s);
+    free_cset(&range);
+}
+
+/* Whether test holds between two containers with the same key */
+static int containers_pass(SetTest test, const Container* a, const Container* b, uint64_t scratch[2][CSET_BITMAP_WORDS]) {
+    const uint64_t *x, *y;
+
+    if ((test == TEST_SUBSET && a->cardinality > b->cardinality) ||
+        (test == TEST_EQUAL && a->cardinality != b->cardinality)) {
+        return 0;  /* Decided by the cardinalities alone */
+    }
+    x = bitmap_view(a, scratch[0]);
+    y = bitmap_view(b, scratch[1]);
+    switch (test) {
+        case TEST_SUBSET:
+            return !set_kernels->any_andnot_words(x, y, CSET_BITMAP_WORDS);
+        case TEST_EQUAL:
+            return !set_kernels->any_xor_words(x, y, CSET_BITMAP_WORDS);
+        case TEST_DISJOINT:
+            return !set_kernels->any_and_words(x, y, CSET_BITMAP_WORDS);
+    }
+    return 0;
+}
+
+int test_csets(SetTest test, const CompressedSet* s1, const CompressedSet* s2) {
+    uint64_t scratch[2][CSET_BITMAP_WORDS];
+    int i = 0, j = 0;
+
+    while (i < s1->count || j < s2->count) {
+        if (j >= s2->count || (i < s1->count && s1->containers[i].key < s2->containers[j].key)) {
+            if (test != TEST_DISJOINT) {
+                return 0;  /* Containers are never empty, so s1 has a member s2 lacks */
+            }
+            i++;
+        } else if (i >= s1->count || s2->containers[j].key < s1->containers[i].key) {
+            if (test == TEST_EQUAL) {
+                return 0;
+            }
+            j++;
+        } else {
+            if (!containers_pass(test, &s1->containers[i], &s2->containers[j], scratch)) {
+                return 0;
+            }
+            i++;
+            j++;
+        }
+    }
+    return 1;
+}
+
+void count_cset_overlap(const CompressedSet* s1, const CompressedSet* s2, long* shared, long* either) {
+    uint64_t scratch[2][CSET_BITMAP_WORDS];
+    long in_both = 0, in_either = 0, common;
+    int i = 0, j = 0;
+
+    while (i < s1->count || j < s2->count) {
+        if (j >= s2->count || (i < s1->count && s1->containers[i].key < s2->containers[j].key)) {
+            in_either += s1->containers[i++].cardinality;
+        } else if (i >= s1->count || s2->containers[j].key < s1->containers[i].key) {
+            in_either += s2->containers[j++].cardinality;
+        } else {
+            common = (long)set_kernels->count_and_words(bitmap_view(&s1->containers[i], scratch[0]),
+                                                        bitmap_view(&s2->containers[j], scratch[1]), CSET_BITMAP_WORDS);
+            in_both += common;
+            in_either += s1->containers[i++].cardinality + s2->containers[j++].cardinality - common;
+        }
+    }
+    if (shared != NULL) {
+        *shared = in_both;
+    }
+    if (either != NULL) {
+        *either = in_either;
+    }
+}
+
+size_t cset_nwords(const CompressedSet* s) {
+    return s->count > 0 ? ((size_t)s->containers[s->count - 1].key + 1) * CSET_BITMAP_WORDS : 0;
+}
+
+/* Set bits first .. last of words */
+static void fill_bits(uint64_t* words, long first, long last) {
+    uint64_t mask;
+    long w;
+
+    for (w = first >> 6; w <= last >> 6; w++) {
+        mask = ~(uint64_t)0;
+        if (w == first >> 6) {
+            mask &= ~(uint64_t)0 << (first & 63);
+        }
+        if (w == last >> 6) {
+            mask &= ~(uint64_t)0 >> (63 - (last & 63));
+        }
+        words[w] |= mask;
+    }
+}
+
+void cset_words(const CompressedSet* s, size_t first, size_t n, uint64_t* out) {
+    const Container *c;
+    size_t base, from, to;
+    long low_bit, high_bit, offset, start, end;
+    int low = 0, high = s->count, middle, i, j;
+
+    memset(out, 0, n * sizeof(uint64_t));
+    while (low < high) {  /* The first container ending after word first */
+        middle = (low + high) / 2;
+        if (((size_t)s->containers[middle].key + 1) * CSET_BITMAP_WORDS <= first) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (i = low; i < s->count && (size_t)s->containers[i].key * CSET_BITMAP_WORDS < first + n; i++) {
+        c = &s->containers[i];
+        base = (size_t)c->key * CSET_BITMAP_WORDS;
+        from = base > first ? base : first;
+        to = base + CSET_BITMAP_WORDS < first + n ? base + CSET_BITMAP_WORDS : first + n;
+        if (c->type == CONTAINER_BITMAP) {
+            memcpy(out + (from - first), c->data.bitmap + (from - base), (to - from) * sizeof(uint64_t));
+            continue;
+        }
+        /* Offsets in the chunk of the words wanted, and where bit 0 of the chunk lands in out */
+        low_bit = (long)(from - base) * SET_WORD_BITS;
+        high_bit = (long)(to - base) * SET_WORD_BITS;
+        offset = ((long)base - (long)first) * SET_WORD_BITS;
+        if (c->type == CONTAINER_ARRAY) {
+            for (j = (int)container_rank(c, low_bit); j < c->size && c->data.array[j] < high_bit; j++) {
+                start = c->data.array[j] + offset;
+                out[start >> 6] |= (uint64_t)1 << (start & 63);
+            }
+            continue;
+        }
+        for (j = 0; j < c->size && c->data.runs[j].start < high_bit; j++) {
+            start = c->data.runs[j].start;
+            end = start + c->data.runs[j].length;
+            if (end >= low_bit) {
+                fill_bits(out, (start > low_bit ? start : low_bit) + offset,
+                          (end < high_bit - 1 ? end : high_bit - 1) + offset);
+            }
+        }
+    }
+}
+
+void set_to_cset(const Set* s, CompressedSet* target) {
+    free_cset(target);
+    append_cset_words(s->words, 0, s->nwords, target);
+}
+
+
+void append_cset_words(const uint64_t* words, size_t first, size_t n, CompressedSet* target) {
+    uint64_t bitmap[CSET_BITMAP_WORDS];
+    size_t base, len;
+    Container c;
+
+    for (base = 0; base < n; base += CSET_BITMAP_WORDS) {
+        len = n - base < CSET_BITMAP_WORDS ? n - base : CSET_BITMAP_WORDS;
+        memset(bitmap, 0, sizeof(bitmap));
+        memcpy(bitmap, words + base, len * sizeof(uint64_t));
+        if (popcount_words(bitmap, CSET_BITMAP_WORDS) == 0) {
+            continue;  /* Empty chunks get no container */
+        }
+        c.key = (uint16_t)((first + base) / CSET_BITMAP_WORDS);
+        container_from_bitmap(&c, bitmap, 0);
+        push_container(target, &c);
+    }
+}
+
+
+/* Bytes of container data, and the words they take once padded */
+static size_t container_bytes(ContainerType type, int size) {
+    if (type == CONTAINER_BITMAP) {
+        return CSET_BITMAP_WORDS * sizeof(uint64_t);
+    }
+    return type == CONTAINER_ARRAY ? size * sizeof(uint16_t) : size * sizeof(CRun);
+}
+
+static size_t padded_words(size_t bytes) {
+    return (bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+}
+
+size_t cset_serialized_words(const CompressedSet* s) {
+    size_t n = 1;
+    int i;
+    for (i = 0; i < s->count; i++) {
+        n += 2 + padded_words(container_bytes(s->containers[i].type, s->containers[i].size));
+    }
+    return n;
+}
+
+void serialize_cset(const CompressedSet* s, uint64_t* out) {
+    const Container *c;
+    size_t bytes;
+    int i;
+
+    *out++ = (uint64_t)s->count;
+    for (i = 0; i < s->count; i++) {
+        c = &s->containers[i];
+        bytes = container_bytes(c->type, c->size);
+        *out++ = (uint64_t)c->key | (uint64_t)c->type << 16 | (uint64_t)c->size << 32;
+        *out++ = (uint64_t)c->cardinality;
+        if (bytes > 0) {
+            out[padded_words(bytes) - 1] = 0;  /* Zero the padding */
+            memcpy(out, c->data.array, bytes);
+        }
+        out += padded_words(bytes);
+    }
+}
+
+int deserialize_cset(const uint64_t* in, size_t nwords, CompressedSet* target) {
+    const uint64_t *end = in + nwords;
+    uint64_t count;
+    size_t bytes;
+    Container c;
+    long previous = -1;
+
+    free_cset(target);
+    if (nwords == 0 || (count = *in++) > CSET_CHUNK_SIZE) {
+        return -1;
+    }
+    for (; count > 0; count--) {
+        if (end - in < 2) {
+            break;
+        }
+        c.key = (uint16_t)(in[0] & 0xffff);
+        c.type = (ContainerType)((in[0] >> 16) & 0xffff);
+        c.size = (int)(in[0] >> 32);
+        c.cardinality = (int)in[1];
+        in += 2;
+        if ((long)c.key <= previous || c.type > CONTAINER_RUN || c.size < 0 || c.size > CSET_CHUNK_SIZE ||
+            c.cardinality <= 0 || c.cardinality > CSET_CHUNK_SIZE) {
+            break;  /* Keys out of order or impossible sizes */
+        }
+        bytes = container_bytes(c.type, c.size);
+        if ((size_t)(end - in) < padded_words(bytes)) {
+            break;
+        }
+        c.data.array = cset_alloc(bytes);
+        memcpy(c.data.array, in, bytes);
+        in += padded_words(bytes);
+        push_container(target, &c);
+        previous = c.key;
+    }
+    if (count > 0) {
+        free_cset(target);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,237 @@
+#ifndef CSET_H
+#define CSET_H
+
+#include <stdint.h>
+#include "set.h"
+
+#define CSET_CHUNK_BITS 16
+#define CSET_CHUNK_SIZE (1L << CSET_CHUNK_BITS)
+#define CSET_BITMAP_WORDS (CSET_CHUNK_SIZE / SET_WORD_BITS)
+#define CSET_ARRAY_MAX 4096
+
+/**
+ * @brief Storage kinds of a container, picked per chunk to use the least memory.
+ */
+typedef enum {
+    CONTAINER_ARRAY,   /* sorted 16-bit members, up to CSET_ARRAY_MAX */
+    CONTAINER_BITMAP,  /* CSET_BITMAP_WORDS words covering the whole chunk */
+    CONTAINER_RUN      /* sorted runs of consecutive members */
+} ContainerType;
+
+/**
+ * @brief A run of consecutive members start .. start + length.
+ */
+typedef struct {
+    uint16_t start;
+    uint16_t length;
+} CRun;
+
+/**
+ * @brief The members of one 64K chunk of the universe.
+ */
+typedef struct {
+    uint16_t key;      /* member >> CSET_CHUNK_BITS */
+    ContainerType type;
+    int size;          /* members of an array, runs of a run container */
+    int cardinality;
+    union {
+        uint16_t *array;
+        uint64_t *bitmap;
+        CRun *runs;
+    } data;
+} Container;
+
+/**
+ * @brief A compressed set: non-empty containers sorted by key.
+ *
+ * A zero-initialized CompressedSet is a valid empty set.
+ */
+typedef struct {
+    Container *containers;
+    int count;
+    int capacity;
+} CompressedSet;
+
+/**
+ * @brief Initialize a compressed set as empty.
+ * @param s Pointer to the set to be initialized.
+ */
+void init_cset(CompressedSet* s);
+
+/**
+ * @brief Release the storage of a compressed set and leave it empty.
+ * @param s Pointer to the set to be freed.
+ */
+void free_cset(CompressedSet* s);
+
+/**
+ * @brief Copy a compressed set.
+ * @param s The set to copy.
+ * @param copy Pointer to the set receiving the copy; its previous contents are released.
+ */
+void copy_cset(const CompressedSet* s, CompressedSet* copy);
+
+/**
+ * @brief Read integers into a compressed set, replacing its contents.
+ * @param ptr Pointer to the array of integers to be read.
+ * @param s Pointer to the set to store the integers.
+ * @param n Number of integers to read.
+ */
+void read_cset(const int* ptr, CompressedSet* s, int n);
+
+/**
+ * @brief Print the contents of a compressed set.
+ * @param s The set to be printed.
+ */
+void print_cset(const CompressedSet* s);
+
+/**
+ * @brief Count the members of a compressed set.
+ * @param s Pointer to the set.
+ * @return The number of members.
+ */
+long count_cset(const CompressedSet* s);
+
+/**
+ * @brief Check whether a number is a member of a compressed set.
+ * @param s Pointer to the set.
+ * @param x The number to look for.
+ * @return 1 if x is a member, 0 otherwise.
+ */
+int contains_cset(const CompressedSet* s, long x);
+
+/**
+ * @brief Count the members of a compressed set below a number.
+ *
+ * Chunks before x's count by cardinality; only x's own container is searched.
+ * @param s Pointer to the set.
+ * @param x The number.
+ * @return The number of members less than x.
+ */
+long rank_cset(const CompressedSet* s, long x);
+
+/**
+ * @brief Find the member of a compressed set with a given number of members below it.
+ * @param s Pointer to the set.
+ * @param k Position of the member, 0 for the smallest.
+ * @return The member, or -1 if the set has k members or fewer.
+ */
+long select_cset(const CompressedSet* s, long k);
+
+/**
+ * @brief Perform a binary operation on two compressed sets.
+ *
+ * Each pair of containers with the same key is combined by a kernel
+ * specific to the two container types, and the result container is
+ * stored in whichever representation is smallest.
+ * @param op The operation to perform.
+ * @param s1 First set.
+ * @param s2 Second set.
+ * @param target Pointer to the set to store the result, may alias s1 or s2.
+ */
+void operate_csets(SetOperation op, const CompressedSet* s1, const CompressedSet* s2, CompressedSet* target);
+
+/**
+ * @brief Add the members first .. last to a compressed set.
+ *
+ * The range is a run container per chunk, merged in by union, so chunks it
+ * covers whole become a single run and partly covered ones stay runs when
+ * that is smallest.
+ * @param s Pointer to the set.
+ * @param first The first member of the range.
+ * @param last The last member of the range, not less than first.
+ */
+void add_cset_range(CompressedSet* s, long first, long last);
+
+/**
+ * @brief Remove the members first .. last from a compressed set.
+ * @param s Pointer to the set.
+ * @param first The first member of the range.
+ * @param last The last member of the range, not less than first.
+ */
+void remove_cset_range(CompressedSet* s, long first, long last);
+
+/**
+ * @brief Compare two compressed sets without building any set.
+ *
+ * Chunks present in only one set and chunks whose cardinalities already
+ * decide the answer are never scanned; the first chunk that fails ends it.
+ * @param test The comparison to make.
+ * @param s1 First set.
+ * @param s2 Second set.
+ * @return 1 if the comparison holds, 0 otherwise.
+ */
+int test_csets(SetTest test, const CompressedSet* s1, const CompressedSet* s2);
+
+/**
+ * @brief Count the members two compressed sets share and the members of either.
+ *
+ * Only chunks present in both sets are scanned; the others count by cardinality.
+ * @param s1 First set.
+ * @param s2 Second set.
+ * @param shared Receives the size of the intersection, or NULL.
+ * @param either Receives the size of the union, or NULL.
+ */
+void count_cset_overlap(const CompressedSet* s1, const CompressedSet* s2, long* shared, long* either);
+
+/**
+ * @brief Number of words a dense set needs for the members of a compressed set.
+ * @param s Pointer to the set.
+ * @return The words up to the end of its last container, as converting it to a dense set sizes it.
+ */
+size_t cset_nwords(const CompressedSet* s);
+
+/**
+ * @brief Copy words first .. first + n - 1 of a compressed set's bitmap, without building the rest.
+ *
+ * Only the containers overlapping the words are read.
+ * @param s The compressed set.
+ * @param first The first word.
+ * @param n Number of words.
+ * @param out Array of n words receiving them, zero where the set has no members.
+ */
+void cset_words(const CompressedSet* s, size_t first, size_t n, uint64_t* out);
+
+/**
+ * @brief Convert a dense set to a compressed set.
+ * @param s The dense set.
+ * @param target Pointer to the compressed set receiving the members.
+ */
+void set_to_cset(const Set* s, CompressedSet* target);
+
+/**
+ * @brief Add the members in a run of bitmap words to a compressed set, after its last container.
+ * @param words The bitmap words.
+ * @param first Index of the first word, a multiple of CSET_BITMAP_WORDS past the set's last container.
+ * @param n Number of words.
+ * @param target Pointer to the compressed set.
+ */
+void append_cset_words(const uint64_t* words, size_t first, size_t n, CompressedSet* target);
+
+/**
+ * @brief Number of words serialize_cset writes for a compressed set.
+ * @param s Pointer to the set.
+ * @return The size in 64-bit words.
+ */
+size_t cset_serialized_words(const CompressedSet* s);
+
+/**
+ * @brief Write a compressed set as a flat array of words.
+ *
+ * The layout is the container count, then for each container a header
+ * word (key, type, size), its cardinality and its data padded to a word.
+ * @param s Pointer to the set.
+ * @param out Array of cset_serialized_words(s) words.
+ */
+void serialize_cset(const CompressedSet* s, uint64_t* out);
+
+/**
+ * @brief Rebuild a compressed set written by serialize_cset.
+ * @param in The serialized words.
+ * @param nwords Number of words available.
+ * @param target Pointer to the set receiving the members; left empty on error.
+ * @return 0 on success, -1 if the data is malformed.
+ */
+int deserialize_cset(const uint64_t* in, size_t nwords, CompressedSet* target);
+
+#endif /* CSET_H */
@@ -0,0 +1,616 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "expr.h"
+#include "kernels.h"
+#include "set.h"
+#include "cset.h"
+#include "snapshot.h"
+#include "arena.h"
+
+/* Parser state: the text being read and the expression being built */
+typedef struct {
+    const char *pos;
+    const Registry *registry;
+    Expression *expr;
+    int error;
+} ExprParser;
+
+/* One step of a compiled expression, run on a block of words */
+typedef struct {
+    ExprType type;
+    int set;     /* Index into the dense operand views of an EXPR_SET step */
+} ExprStep;
+
+static void skip_blanks(ExprParser *p) {
+    while (*p->pos == ' ' || *p->pos == '\t' || *p->pos == '\n' || *p->pos == '\v' || *p->pos == '\f' || *p->pos == '\r') {
+        p->pos++;
+    }
+}
+
+static int is_name_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static int add_node(ExprParser *p, ExprType type, int left, int right, int set) {
+    ExprNode *node;
+    if (p->expr->count == EXPR_MAX_NODES) {
+        p->error = 14; /* Expression too long */
+        return -1;
+    }
+    node = &p->expr->nodes[p->expr->count];
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    node->set = set;
+    node->version = NULL;
+    return p->expr->count++;
+}
+
+/* Read a set name and resolve it: the entry id, or -1 with p->error set */
+static int parse_name(ExprParser *p) {
+    const char *start;
+    int id;
+
+    skip_blanks(p);
+    start = p->pos;
+    while (is_name_char(*p->pos)) {
+        p->pos++;
+    }
+    if (p->pos == start) {
+        p->error = *start == '\0' ? 7 : 13; /* Missing operand, or not a name */
+        return -1;
+    }
+    id = find_registry_set(p->registry, start, p->pos - start);
+    if (id < 0) {
+        p->error = 1; /* Invalid set name */
+    }
+    return id;
+}
+
+/* Read an operand: a set name, or NAME@NUMBER for a set in a snapshot */
+static int parse_operand(ExprParser *p) {
+    const char *start;
+    int name_length, node, id;
+    long number;
+
+    skip_blanks(p);
+    start = p->pos;
+    while (is_name_char(*p->pos)) {
+        p->pos++;
+    }
+    if (*p->pos != '@' || p->pos == start) {
+        p->pos = start;
+        id = parse_name(p);
+        return id < 0 ? -1 : add_node(p, EXPR_SET, -1, -1, id);
+    }
+    for (p->pos++; *p->pos >= '0' && *p->pos <= '9'; p->pos++) {
+    }
+    if (split_snapshot_name(start, p->pos - start, &name_length, &number) != 1 || number == 0) {
+        p->error = 18; /* No such snapshot */
+        return -1;
+    }
+    node = add_node(p, EXPR_SET, -1, -1, -1);
+    if (node < 0) {
+        return -1;
+    }
+    p->expr->nodes[node].version = snapshot_set(p->registry, number, start, name_length, &p->error);
+    return p->expr->nodes[node].version != NULL ? node : -1;
+}
+
+static int parse_union(ExprParser *p);
+
+static int parse_unary(ExprParser *p) {
+    int node;
+
+    skip_blanks(p);
+    if (*p->pos == '~') {
+        p->pos++;
+        node = parse_unary(p);
+        return node < 0 ? -1 : add_node(p, EXPR_NOT, node, -1, -1);
+    }
+    if (*p->pos == '(') {
+        p->pos++;
+        node = parse_union(p);
+        if (node < 0) {
+            return -1;
+        }
+        skip_blanks(p);
+        if (*p->pos != ')') {
+            p->error = 13; /* Unbalanced parentheses */
+            return -1;
+        }
+        p->pos++;
+        return node;
+    }
+    return parse_operand(p);
+}
+
+/* & and - bind tighter than ^, which binds tighter than | */
+static int parse_intersect(ExprParser *p) {
+    int left = parse_unary(p);
+    int right;
+    char op;
+
+    while (left >= 0) {
+        skip_blanks(p);
+        op = *p->pos;
+        if (op != '&' && op != '-') {
+            break;
+        }
+        p->pos++;
+        right = parse_unary(p);
+        left = right < 0 ? -1 : add_node(p, op == '&' ? EXPR_AND : EXPR_ANDNOT, left, right, -1);
+    }
+    return left;
+}
+
+static int parse_symdiff(ExprParser *p) {
+    int left = parse_intersect(p);
+    int right;
+
+    while (left >= 0) {
+        skip_blanks(p);
+        if (*p->pos != '^') {
+            break;
+        }
+        p->pos++;
+        right = parse_intersect(p);
+        left = right < 0 ? -1 : add_node(p, EXPR_XOR, left, right, -1);
+    }
+    return left;
+}
+
+static int parse_union(ExprParser *p) {
+    int left = parse_symdiff(p);
+    int right;
+
+    while (left >= 0) {
+        skip_blanks(p);
+        if (*p->pos != '|') {
+            break;
+        }
+        p->pos++;
+        right = parse_symdiff(p);
+        left = right < 0 ? -1 : add_node(p, EXPR_OR, left, right, -1);
+    }
+    return left;
+}
+
+int parse_expression(const char *text, const Registry *registry, Expression *expr) {
+    ExprParser p;
+
+    p.pos = text;
+    p.registry = registry;
+    p.expr = expr;
+    p.error = 0;
+    release_expression(expr);
+
+    expr->target = parse_name(&p);
+    if (expr->target < 0) {
+        return p.error;
+    }
+    skip_blanks(&p);
+    if (*p.pos != '=') {
+        return *p.pos == '\0' ? 7 : 13; /* Missing the expression, or no = after the target */
+    }
+    p.pos++;
+    expr->root = parse_union(&p);
+    if (expr->root < 0) {
+        return p.error;
+    }
+    skip_blanks(&p);
+    if (*p.pos != '\0') {
+        return *p.pos == ')' ? 13 : 8; /* Unbalanced parentheses, or extraneous text */
+    }
+    simplify_expression(expr);
+    return 0;
+}
+
+
+void release_expression(Expression *expr) {
+    int i;
+    for (i = 0; i < expr->count; i++) {
+        release_version(expr->nodes[i].version);
+        expr->nodes[i].version = NULL;
+    }
+    expr->count = 0;
+}
+
+
+/* Whether two EXPR_SET nodes read the same set */
+static int same_operand(const ExprNode *x, const ExprNode *y) {
+    return x->set == y->set && x->version == y->version;
+}
+
+/* Structural equality of two subtrees */
+static int same_tree(const Expression *expr, int a, int b) {
+    const ExprNode *x = &expr->nodes[a];
+    const ExprNode *y = &expr->nodes[b];
+
+    if (x->type != y->type) {
+        return 0;
+    }
+    switch (x->type) {
+        case EXPR_SET:
+            return same_operand(x, y);
+        case EXPR_EMPTY:
+        case EXPR_FULL:
+            return 1;
+        case EXPR_NOT:
+            return same_tree(expr, x->left, y->left);
+        default:
+            return same_tree(expr, x->left, y->left) && same_tree(expr, x->right, y->right);
+    }
+}
+
+/* Whether one subtree is the complement of the other */
+static int complementary(const Expression *expr, int a, int b) {
+    const ExprNode *x = &expr->nodes[a];
+    const ExprNode *y = &expr->nodes[b];
+
+    if (x->type == EXPR_EMPTY || x->type == EXPR_FULL) {
+        return (y->type == EXPR_EMPTY || y->type == EXPR_FULL) && x->type != y->type;
+    }
+    return (x->type == EXPR_NOT && same_tree(expr, x->left, b)) ||
+           (y->type == EXPR_NOT && same_tree(expr, y->left, a));
+}
+
+static int make_constant(Expression *expr, int i, ExprType type) {
+    expr->nodes[i].type = type;
+    return i;
+}
+
+static int make_binary(Expression *expr, int i, ExprType type, int left, int right) {
+    expr->nodes[i].type = type;
+    expr->nodes[i].left = left;
+    expr->nodes[i].right = right;
+    return i;
+}
+
+static int simplify_node(Expression *expr, int i);
+
+/* Negate simplified subtree a, reusing node i for the result */
+static int negate(Expression *expr, int i, int a) {
+    ExprNode *node = &expr->nodes[a];
+
+    if (node->type == EXPR_NOT) {
+        return node->left;
+    }
+    if (node->type == EXPR_EMPTY || node->type == EXPR_FULL) {
+        return make_constant(expr, i, node->type == EXPR_EMPTY ? EXPR_FULL : EXPR_EMPTY);
+    }
+    return make_binary(expr, i, EXPR_NOT, a, -1);
+}
+
+/* Simplify the subtree at node i, reusing its nodes; returns the new root */
+static int simplify_node(Expression *expr, int i) {
+    ExprNode *node = &expr->nodes[i];
+    int l, r;
+    ExprType lt, rt;
+
+    if (node->type == EXPR_SET || node->type == EXPR_EMPTY || node->type == EXPR_FULL) {
+        return i;
+    }
+    if (node->type == EXPR_NOT) {
+        return negate(expr, i, simplify_node(expr, node->left));
+    }
+
+    l = simplify_node(expr, node->left);
+    r = simplify_node(expr, node->right);
+    lt = expr->nodes[l].type;
+    rt = expr->nodes[r].type;
+
+    switch (node->type) {
+        case EXPR_AND:
+            if (lt == EXPR_EMPTY || rt == EXPR_FULL || same_tree(expr, l, r)) {
+                return l;
+            }
+            if (rt == EXPR_EMPTY || lt == EXPR_FULL) {
+                return r;
+            }
+            if (complementary(expr, l, r)) {
+                return make_constant(expr, i, EXPR_EMPTY);
+            }
+            if (lt == EXPR_NOT && rt == EXPR_NOT) {
+                /* ~a & ~b = ~(a | b): one complement instead of two */
+                make_binary(expr, i, EXPR_OR, expr->nodes[l].left, expr->nodes[r].left);
+                return make_binary(expr, l, EXPR_NOT, i, -1);
+            }
+            if (rt == EXPR_NOT) {
+                return make_binary(expr, i, EXPR_ANDNOT, l, expr->nodes[r].left);
+            }
+            if (lt == EXPR_NOT) {
+                return make_binary(expr, i, EXPR_ANDNOT, r, expr->nodes[l].left);
+            }
+            break;
+        case EXPR_OR:
+            if (lt == EXPR_EMPTY || rt == EXPR_FULL) {
+                return r;
+            }
+            if (rt == EXPR_EMPTY || lt == EXPR_FULL || same_tree(expr, l, r)) {
+                return l;
+            }
+            if (complementary(expr, l, r)) {
+                return make_constant(expr, i, EXPR_FULL);
+            }
+            if (lt == EXPR_NOT && rt == EXPR_NOT) {
+                /* ~a | ~b = ~(a & b) */
+                make_binary(expr, i, EXPR_AND, expr->nodes[l].left, expr->nodes[r].left);
+                return make_binary(expr, l, EXPR_NOT, i, -1);
+            }
+            break;
+        case EXPR_XOR:
+            if (lt == EXPR_EMPTY) {
+                return r;
+            }
+            if (rt == EXPR_EMPTY) {
+                return l;
+            }
+            if (same_tree(expr, l, r)) {
+                return make_constant(expr, i, EXPR_EMPTY);
+            }
+            if (complementary(expr, l, r)) {
+                return make_constant(expr, i, EXPR_FULL);
+            }
+            if (lt == EXPR_FULL) {
+                return negate(expr, i, r);
+            }
+            if (rt == EXPR_FULL) {
+                return negate(expr, i, l);
+            }
+            if (lt == EXPR_NOT && rt == EXPR_NOT) {
+                /* ~a ^ ~b = a ^ b */
+                return make_binary(expr, i, EXPR_XOR, expr->nodes[l].left, expr->nodes[r].left);
+            }
+            break;
+        case EXPR_ANDNOT:
+            if (lt == EXPR_EMPTY || rt == EXPR_EMPTY) {
+                return l;
+            }
+            if (rt == EXPR_FULL || same_tree(expr, l, r)) {
+                return make_constant(expr, i, EXPR_EMPTY);
+            }
+            if (complementary(expr, l, r)) {
+                return l;  /* a - ~a = a */
+            }
+            if (lt == EXPR_FULL) {
+                return negate(expr, i, r);
+            }
+            if (rt == EXPR_NOT) {
+                return make_binary(expr, i, EXPR_AND, l, expr->nodes[r].left);
+            }
+            break;
+        default:
+            break;
+    }
+    return make_binary(expr, i, node->type, l, r);
+}
+
+void simplify_expression(Expression *expr) {
+    expr->root = simplify_node(expr, expr->root);
+}
+
+
+/* Add the distinct operands of a subtree to nodes, as the index of a node
+ * reading each; returns the new count */
+static int collect_sets(const Expression *expr, int i, int *nodes, int count) {
+    const ExprNode *node = &expr->nodes[i];
+    int k;
+
+    switch (node->type) {
+        case EXPR_SET:
+            for (k = 0; k < count; k++) {
+                if (same_operand(&expr->nodes[nodes[k]], node)) {
+                    return count;
+                }
+            }
+            nodes[count] = i;
+            return count + 1;
+        case EXPR_EMPTY:
+        case EXPR_FULL:
+            return count;
+        case EXPR_NOT:
+            return collect_sets(expr, node->left, nodes, count);
+        default:
+            count = collect_sets(expr, node->left, nodes, count);
+            return collect_sets(expr, node->right, nodes, count);
+    }
+}
+
+int expression_sets(const Expression *expr, int *ids) {
+    int nodes[EXPR_MAX_NODES];
+    int n = collect_sets(expr, expr->root, nodes, 0);
+    int count = 0, i;
+
+    for (i = 0; i < n; i++) {
+        if (expr->nodes[nodes[i]].version == NULL) {
+            ids[count++] = expr->nodes[nodes[i]].set;
+        }
+    }
+    return count;
+}
+
+/* Emit the subtree in postfix order; returns the stack depth it needs */
+static int compile_node(const Expression *expr, int i, const int *nodes, ExprStep *program, int *length) {
+    const ExprNode *node = &expr->nodes[i];
+    int depth = 1;
+    int right;
+
+    if (node->type == EXPR_NOT) {
+        depth = compile_node(expr, node->left, nodes, program, length);
+    } else if (node->type != EXPR_SET && node->type != EXPR_EMPTY && node->type != EXPR_FULL) {
+        depth = compile_node(expr, node->left, nodes, program, length);
+        right = compile_node(expr, node->right, nodes, program, length) + 1;
+        depth = right > depth ? right : depth;
+    }
+    program[*length].type = node->type;
+    program[*length].set = 0;
+    if (node->type == EXPR_SET) {
+        while (!same_operand(&expr->nodes[nodes[program[*length].set]], node)) {
+            program[*length].set++;
+        }
+    }
+    (*length)++;
+    return depth;
+}
+
+/* Block base .. base + len of an operand, padded with zeros past its end */
+static const uint64_t* load_block(const SetReader *r, size_t base, size_t len, const uint64_t *zeros, uint64_t *pad) {
+    if (r->nwords <= base) {
+        return zeros;
+    }
+    return read_set_words(r, base, len, pad);
+}
+
+/* Run the program over every block of words first .. end - 1; the last step
+ * writes straight into the target's chunks (or into out when target is NULL),
+ * which is safe even when the target is an operand since each block of the
+ * result depends only on the same block of the inputs */
+static void run_program(const ExprStep *program, int length, int depth, const SetReader *readers,
+                        size_t first, size_t end, ChunkedSet *target, uint64_t *out) {
+    const SetKernels *k = set_kernels;
+    const uint64_t *stack[EXPR_MAX_NODES];
+    ArenaMark mark = arena_mark(command_arena());
+    uint64_t *buffers = arena_alloc(command_arena(), (size_t)(depth + length + 2) * EVAL_BLOCK_WORDS * sizeof(uint64_t));
+    uint64_t *zeros = buffers;
+    uint64_t *ones = zeros + EVAL_BLOCK_WORDS;
+    uint64_t *scratch = ones + EVAL_BLOCK_WORDS;      /* One block per stack slot */
+    uint64_t *pads = scratch + (size_t)depth * EVAL_BLOCK_WORDS;  /* One block per step */
+    uint64_t *dst, *result;
+    size_t base, len;
+    int sp, s;
+
+    memset(zeros, 0, EVAL_BLOCK_WORDS * sizeof(uint64_t));
+    memset(ones, 0xff, EVAL_BLOCK_WORDS * sizeof(uint64_t));
+
+    for (base = first; base < end; base += len) {
+        len = end - base < EVAL_BLOCK_WORDS ? end - base : EVAL_BLOCK_WORDS;
+        if (base / SET_CHUNK_WORDS != (base + len - 1) / SET_CHUNK_WORDS) {
+            len = SET_CHUNK_WORDS - base % SET_CHUNK_WORDS;  /* Blocks stay inside one chunk */
+        }
+        /* Made writable first, so an operand that is the target reads the chunk written */
+        result = target != NULL ? writable_words(target, base, len) : out + base;
+        sp = 0;
+        for (s = 0; s < length; s++) {
+            switch (program[s].type) {
+                case EXPR_SET:
+                    stack[sp++] = load_block(&readers[program[s].set], base, len, zeros,
+                                             pads + (size_t)s * EVAL_BLOCK_WORDS);
+                    continue;
+                case EXPR_EMPTY:
+                    stack[sp++] = zeros;
+                    continue;
+                case EXPR_FULL:
+                    stack[sp++] = ones;
+                    continue;
+                default:
+                    break;
+            }
+            /* An operator: pop its operands and push the result */
+            sp -= program[s].type == EXPR_NOT ? 1 : 2;
+            dst = s == length - 1 ? result : scratch + (size_t)sp * EVAL_BLOCK_WORDS;
+            switch (program[s].type) {
+                case EXPR_NOT:
+                    k->xor_words(dst, stack[sp], ones, len);
+                    break;
+                case EXPR_AND:
+                    k->and_words(dst, stack[sp], stack[sp + 1], len);
+                    break;
+                case EXPR_OR:
+                    k->or_words(dst, stack[sp], stack[sp + 1], len);
+                    break;
+                case EXPR_XOR:
+                    k->xor_words(dst, stack[sp], stack[sp + 1], len);
+                    break;
+                default:
+                    k->andnot_words(dst, stack[sp], stack[sp + 1], len);
+                    break;
+            }
+            stack[sp++] = dst;
+        }
+        if (program[length - 1].type == EXPR_SET || program[length - 1].type == EXPR_EMPTY ||
+            program[length - 1].type == EXPR_FULL) {
+            memmove(result, stack[0], len * sizeof(uint64_t));  /* The result is a copy */
+        }
+    }
+    arena_rewind(command_arena(), mark);  /* A view refresh may run many programs in one command */
+}
+
+/* Readers of the operands, which read compressed and snapshot ones a block at
+ * a time; sets n to the words of the largest */
+static void operand_readers(Registry *registry, const Expression *expr, int *nodes, SetReader *readers, size_t *n) {
+    const ExprNode *node;
+    int nsets, i;
+
+    *n = 0;
+    nsets = collect_sets(expr, expr->root, nodes, 0);
+    for (i = 0; i < nsets; i++) {
+        node = &expr->nodes[nodes[i]];
+        open_set_reader(&readers[i], node->version == NULL ? registry_set(registry, node->set) : &node->version->set);
+        *n = readers[i].nwords > *n ? readers[i].nwords : *n;
+    }
+}
+
+void eval_expression(Registry *registry, const Expression *expr) {
+    int nodes[EXPR_MAX_NODES];
+    SetReader readers[EXPR_MAX_NODES];
+    ExprStep program[EXPR_MAX_NODES];
+    StoredSet *target = registry_set(registry, expr->target);
+    ArenaMark mark = arena_mark(command_arena());
+    Set packed_result;
+    ChunkedSet *result = &target->dense;
+    size_t n;
+    int length = 0, depth;
+
+    operand_readers(registry, expr, nodes, readers, &n);
+    depth = compile_node(expr, expr->root, nodes, program, &length);
+
+    if (target->compressed) {
+        /* Read into the containers once the program has run, so it lives in the arena */
+        init_set(&packed_result);
+        packed_result.nwords = n;
+        packed_result.words = arena_alloc(command_arena(), n * sizeof(uint64_t));
+        run_program(program, length, depth, readers, 0, n, NULL, packed_result.words);
+        set_to_cset(&packed_result, &target->packed);
+        arena_rewind(command_arena(), mark);
+        return;
+    }
+    grow_chunked(result, (long)(n * SET_WORD_BITS));  /* Keeps the target's members, so it stays readable as an operand */
+    run_program(program, length, depth, readers, 0, n, result, NULL);
+    if (result->nwords > n) {
+        /* Clear stale high words */
+        remove_chunked_range(result, (long)(n * SET_WORD_BITS), (long)(result->nwords * SET_WORD_BITS) - 1);
+    }
+}
+
+void eval_expression_words(Registry *registry, const Expression *expr, const size_t (*ranges)[2], int nranges) {
+    int nodes[EXPR_MAX_NODES];
+    SetReader readers[EXPR_MAX_NODES];
+    ExprStep program[EXPR_MAX_NODES];
+    StoredSet *target = registry_set(registry, expr->target);
+    ChunkedSet *result = &target->dense;
+    size_t n, first, end;
+    int length = 0, depth, i;
+
+    if (target->compressed) {
+        eval_expression(registry, expr);
+        return;
+    }
+    operand_readers(registry, expr, nodes, readers, &n);
+    depth = compile_node(expr, expr->root, nodes, program, &length);
+
+    /* The same words eval_expression would give: computed up to n, zero above */
+    grow_chunked(result, (long)(n * SET_WORD_BITS));
+    for (i = 0; i < nranges; i++) {
+        first = ranges[i][0];
+        end = ranges[i][1] < result->nwords ? ranges[i][1] : result->nwords;
+        if (first < n) {
+            run_program(program, length, depth, readers, first, end < n ? end : n, result, NULL);
+            first = n;
+        }
+        if (first < end) {
+            remove_chunked_range(result, (long)(first * SET_WORD_BITS), (long)(end * SET_WORD_BITS) - 1);
+        }
+    }
+}
@@ -0,0 +1,112 @@
+#ifndef EXPR_H
+#define EXPR_H
+
+#include "registry.h"
+
+#define EXPR_MAX_NODES 128
+#define EVAL_BLOCK_WORDS 512
+
+/**
+ * @brief Node kinds of an expression tree.
+ */
+typedef enum {
+    EXPR_SET,     /* a named set */
+    EXPR_EMPTY,   /* the empty set */
+    EXPR_FULL,    /* every member of the universe */
+    EXPR_NOT,     /* ~left */
+    EXPR_AND,     /* left & right */
+    EXPR_OR,      /* left | right */
+    EXPR_XOR,     /* left ^ right */
+    EXPR_ANDNOT   /* left - right, i.e. left & ~right */
+} ExprType;
+
+/**
+ * @brief A node of an expression tree; children are indexes into the nodes array.
+ */
+typedef struct {
+    ExprType type;
+    int left;
+    int right;
+    int set;      /* Registry entry id of an EXPR_SET node, -1 for a snapshot operand */
+    struct SetVersion *version;  /* The version a snapshot operand reads */
+} ExprNode;
+
+/**
+ * @brief An assignment TARGET = expression, held without heap allocation.
+ *
+ * The complement ~ is taken within the universe of the largest set the
+ * expression uses.
+ */
+typedef struct {
+    ExprNode nodes[EXPR_MAX_NODES];
+    int count;
+    int root;
+    int target;   /* Registry entry id of the set receiving the result */
+} Expression;
+
+/**
+ * @brief Parse "TARGET = expression" into a tree and simplify it.
+ *
+ * Operators, from tightest to loosest binding: ~ (complement), & and -
+ * (intersection, difference), ^ (symmetric difference), | (union).
+ * Parentheses group as usual. Operands may name a set in a snapshot,
+ * NAME@NUMBER; the expression then holds that version until released.
+ * @param text The text after the eval command name.
+ * @param registry The registry holding the named sets.
+ * @param expr Pointer to the expression to fill.
+ * @return Error number or 0 if valid.
+ */
+int parse_expression(const char *text, const Registry *registry, Expression *expr);
+
+/**
+ * @brief Drop the snapshot versions an expression holds.
+ * @param expr Pointer to the expression; it is left empty.
+ */
+void release_expression(Expression *expr);
+
+/**
+ * @brief Rewrite an expression into an equivalent one with fewer operations.
+ *
+ * Folds the empty and full sets, removes double complements, turns
+ * a & ~b into a single difference and recognizes x & x, x ^ x, x & ~x
+ * and similar patterns.
+ * @param expr Pointer to the expression.
+ */
+void simplify_expression(Expression *expr);
+
+/**
+ * @brief List the distinct live sets an expression reads.
+ * @param expr Pointer to the expression.
+ * @param ids Array of EXPR_MAX_NODES entries receiving the entry ids.
+ * @return Number of sets.
+ */
+int expression_sets(const Expression *expr, int *ids);
+
+/**
+ * @brief Evaluate an expression into its target set.
+ *
+ * The tree is compiled into a stack program that runs over the sets
+ * EVAL_BLOCK_WORDS words at a time using the set kernels, so the result
+ * comes from one streaming pass over the inputs with no full-size
+ * temporaries; compressed and snapshot operands are read through a
+ * SetReader, never expanded. The target may appear in the expression.
+ * @param registry The registry holding the named sets.
+ * @param expr Pointer to the expression.
+ */
+void eval_expression(Registry *registry, const Expression *expr);
+
+/**
+ * @brief Recompute only some words of an expression's target.
+ *
+ * Every word in the ranges ends up as eval_expression would leave it, and
+ * the other words are left alone, so after a change to the operands only
+ * the words it touched need evaluating. A compressed target is evaluated
+ * whole; compressed and snapshot operands are only read in the ranges.
+ * @param registry The registry holding the named sets.
+ * @param expr Pointer to the expression.
+ * @param ranges Word ranges first .. end - 1, as first, end pairs; end may lie past the set.
+ * @param nranges Number of ranges.
+ */
+void eval_expression_words(Registry *registry, const Expression *expr, const size_t (*ranges)[2], int nranges);
+
+#endif /* EXPR_H */
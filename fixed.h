@@ -0,0 +1,125 @@
+#ifndef FIXED_H
+#define FIXED_H
+
+#include <string.h>
+#include "set.h"
+
+/*
+ * Set kernels specialized for bitmaps of a few fixed widths: 128, 256 and
+ * 1024 members. The number of words is a constant in each, so the compiler
+ * unrolls the loop into straight-line vector operations and no call goes
+ * through set_kernels or the thread pool. Sets of other widths keep the
+ * generic kernels: from 4096 members the wider vectors selected at run time
+ * win (see fixed_union in bench.c), and counting needs their popcnt.
+ */
+
+#define FIXED_VECTOR_BYTES 16  /* The vector width every x86-64 CPU has */
+#define FIXED_LANES (FIXED_VECTOR_BYTES / (int)sizeof(uint64_t))
+
+/**
+ * @brief A vector of words, as GCC vector extensions lay it out.
+ */
+typedef uint64_t FixedVector __attribute__((vector_size(FIXED_VECTOR_BYTES)));
+
+/*
+ * dst[i] = a[i] OP b[i] for i < words. Both inputs of a step are loaded
+ * before its store, so dst may be the same array as a or b.
+ */
+#define DEFINE_FIXED_OP(name, words, expr) \
+    static inline void name(uint64_t *dst, const uint64_t *a, const uint64_t *b) { \
+        FixedVector va, vb, vr; \
+        int i; \
+        _Pragma("GCC unroll 8") \
+        for (i = 0; i < (words); i += FIXED_LANES) { \
+            memcpy(&va, a + i, sizeof(va)); \
+            memcpy(&vb, b + i, sizeof(vb)); \
+            vr = expr; \
+            memcpy(dst + i, &vr, sizeof(vr)); \
+        } \
+    }
+
+/* 1 if a[i] OP b[i] is non-zero for some i < words; no early exit at these widths */
+#define DEFINE_FIXED_ANY(name, words, expr) \
+    static inline int name(const uint64_t *a, const uint64_t *b) { \
+        FixedVector va, vb, any = {0}; \
+        int i; \
+        _Pragma("GCC unroll 8") \
+        for (i = 0; i < (words); i += FIXED_LANES) { \
+            memcpy(&va, a + i, sizeof(va)); \
+            memcpy(&vb, b + i, sizeof(vb)); \
+            any |= expr; \
+        } \
+        return (any[0] | any[1]) != 0; \
+    }
+
+#define DEFINE_FIXED_WIDTH(words) \
+    DEFINE_FIXED_OP(fixed_or_##words, words, va | vb) \
+    DEFINE_FIXED_OP(fixed_and_##words, words, va & vb) \
+    DEFINE_FIXED_OP(fixed_andnot_##words, words, va & ~vb) \
+    DEFINE_FIXED_OP(fixed_xor_##words, words, va ^ vb) \
+    DEFINE_FIXED_ANY(fixed_any_and_##words, words, va & vb) \
+    DEFINE_FIXED_ANY(fixed_any_andnot_##words, words, va & ~vb) \
+    DEFINE_FIXED_ANY(fixed_any_xor_##words, words, va ^ vb)
+
+DEFINE_FIXED_WIDTH(2)
+DEFINE_FIXED_WIDTH(4)
+DEFINE_FIXED_WIDTH(16)
+
+#define FIXED_OPERATE_CASE(words) \
+    case words: \
+        switch (op) { \
+            case OP_UNION: fixed_or_##words(dst, a, b); break; \
+            case OP_INTERSECT: fixed_and_##words(dst, a, b); break; \
+            case OP_SUB: fixed_andnot_##words(dst, a, b); break; \
+            case OP_SYMDIFF: fixed_xor_##words(dst, a, b); break; \
+        } \
+        return 1;
+
+#define FIXED_TEST_CASE(words) \
+    case words: \
+        switch (test) { \
+            case TEST_SUBSET: *found = fixed_any_andnot_##words(a, b); break; \
+            case TEST_EQUAL: *found = fixed_any_xor_##words(a, b); break; \
+            case TEST_DISJOINT: *found = fixed_any_and_##words(a, b); break; \
+        } \
+        return 1;
+
+/**
+ * @brief Apply a set operation word-wise when the width has a specialized kernel.
+ * @param op The operation: dst[i] = a[i] OP b[i], with a & ~b for OP_SUB.
+ * @param dst Destination words, may be the same array as a or b.
+ * @param a First operand.
+ * @param b Second operand.
+ * @param n Number of words.
+ * @return 1 if n is 2, 4 or 16 and dst holds the result, 0 otherwise (nothing is written).
+ */
+static inline int fixed_operate(SetOperation op, uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n) {
+    switch (n) {
+        FIXED_OPERATE_CASE(2)
+        FIXED_OPERATE_CASE(4)
+        FIXED_OPERATE_CASE(16)
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Look for a word deciding a set test when the width has a specialized kernel.
+ * @param test The test; found is set if a & ~b (subset), a ^ b (equal) or a & b (disjoint) is non-zero.
+ * @param a First operand.
+ * @param b Second operand.
+ * @param n Number of words.
+ * @param found Receives 1 if such a word exists, 0 otherwise.
+ * @return 1 if n is 2, 4 or 16 and found is set, 0 otherwise.
+ */
+static inline int fixed_test(SetTest test, const uint64_t *a, const uint64_t *b, size_t n, int *found) {
+    switch (n) {
+        FIXED_TEST_CASE(2)
+        FIXED_TEST_CASE(4)
+        FIXED_TEST_CASE(16)
+        default:
+            return 0;
+    }
+}
+
+#endif /* FIXED_H */
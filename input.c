@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+#include "input.h"
+#include "protocol.h"
+
+
+void open_line_reader(LineReader *reader, FILE *file) {
+    reader->file = file;
+    reader->capacity = READ_BLOCK_SIZE + 1;  /* Room for a terminating null */
+    reader->buffer = malloc(reader->capacity);
+    if (reader->buffer == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    reader->start = 0;
+    reader->end = 0;
+    reader->line_number = 0;
+    reader->eof = 0;
+}
+
+char* next_line(LineReader *reader) {
+    char *line, *newline;
+    size_t count;
+
+    while (1) {
+        line = reader->buffer + reader->start;
+        newline = memchr(line, '\n', reader->end - reader->start);
+        if (newline != NULL) {
+            *newline = '\0';
+            if (newline > line && newline[-1] == '\r') {
+                newline[-1] = '\0';  /* Accept CRLF scripts */
+            }
+            reader->start = newline + 1 - reader->buffer;
+            reader->line_number++;
+            return line;
+        }
+        if (reader->eof) {
+            if (reader->start == reader->end) {
+                return NULL;
+            }
+            reader->buffer[reader->end] = '\0';  /* Last line has no newline */
+            reader->start = reader->end;
+            reader->line_number++;
+            return line;
+        }
+
+        /* Keep the partial line at the front and read the next block after it */
+        memmove(reader->buffer, line, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+        if (reader->capacity - reader->end - 1 < READ_BLOCK_SIZE) {
+            char *buffer = realloc(reader->buffer, reader->capacity * 2);
+            if (buffer == NULL) {
+                fprintf(stderr, "Memory reallocation failed\n");
+                exit(1);
+            }
+            reader->buffer = buffer;
+            reader->capacity *= 2;
+        }
+        count = fread(reader->buffer + reader->end, 1, reader->capacity - reader->end - 1, reader->file);
+        if (count == 0) {
+            reader->eof = 1;
+        }
+        reader->end += count;
+    }
+}
+
+const char* long_line_ahead(LineReader *reader, size_t *length) {
+    size_t count;
+
+    while (memchr(reader->buffer + reader->start, '\n', reader->end - reader->start) == NULL) {
+        if (reader->eof || reader->end - reader->start >= READ_BLOCK_SIZE) {
+            break;
+        }
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+        count = fread(reader->buffer + reader->end, 1, reader->capacity - reader->end - 1, reader->file);
+        if (count == 0) {
+            reader->eof = 1;
+        }
+        reader->end += count;
+    }
+    /* A last line with no newline is long too once a block of it is in */
+    if (reader->end - reader->start < READ_BLOCK_SIZE ||
+        memchr(reader->buffer + reader->start, '\n', reader->end - reader->start) != NULL) {
+        return NULL;
+    }
+    *length = reader->end - reader->start;
+    return reader->buffer + reader->start;
+}
+
+const char* next_line_piece(LineReader *reader, size_t *length, int *last) {
+    char *piece, *newline;
+    size_t count;
+
+    if (reader->start == reader->end && !reader->eof) {
+        /* The piece before was the rest of the buffer: refill it from the front */
+        reader->start = 0;
+        count = fread(reader->buffer, 1, reader->capacity - 1, reader->file);
+        if (count == 0) {
+            reader->eof = 1;
+        }
+        reader->end = count;
+    }
+    piece = reader->buffer + reader->start;
+    newline = memchr(piece, '\n', reader->end - reader->start);
+    *length = (newline != NULL ? newline : reader->buffer + reader->end) - piece;
+    *last = newline != NULL || reader->eof;
+    reader->start += *length + (newline != NULL);
+    if (*last) {
+        reader->line_number++;
+    }
+    return piece;
+}
+
+const char* peek_bytes(LineReader *reader, size_t n, size_t *available) {
+    size_t count, capacity;
+    char *buffer;
+
+    while (reader->end - reader->start < n && !reader->eof) {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+        if (reader->capacity - 1 < n) {
+            capacity = reader->capacity;
+            while (capacity - 1 < n) {
+                capacity *= 2;
+            }
+            buffer = realloc(reader->buffer, capacity);
+            if (buffer == NULL) {
+                fprintf(stderr, "Memory reallocation failed\n");
+                exit(1);
+            }
+            reader->buffer = buffer;
+            reader->capacity = capacity;
+        }
+        count = fread(reader->buffer + reader->end, 1, reader->capacity - reader->end - 1, reader->file);
+        if (count == 0) {
+            reader->eof = 1;
+        }
+        reader->end += count;
+    }
+    *available = reader->end - reader->start < n ? reader->end - reader->start : n;
+    return reader->buffer + reader->start;
+}
+
+void skip_bytes(LineReader *reader, size_t n) {
+    reader->start += n;
+}
+
+int next_frame(LineReader *reader, const unsigned char **frame, size_t *length) {
+    const unsigned char *data;
+    size_t available;
+
+    data = (const unsigned char*)peek_bytes(reader, FRAME_HEADER_SIZE, &available);
+    if (available < FRAME_HEADER_SIZE) {
+        return available == 0 ? 0 : -1;
+    }
+    *length = frame_length(data);
+    if (*length > FRAME_MAX_SIZE) {
+        return -1;
+    }
+    data = (const unsigned char*)peek_bytes(reader, FRAME_HEADER_SIZE + *length, &available);
+    if (available < FRAME_HEADER_SIZE + *length) {
+        return -1;
+    }
+    *frame = data + FRAME_HEADER_SIZE;
+    reader->start += FRAME_HEADER_SIZE + *length;
+    reader->line_number++;
+    return 1;
+}
+
+void close_line_reader(LineReader *reader) {
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
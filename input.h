@@ -0,0 +1,93 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdio.h>
+
+#define READ_BLOCK_SIZE (1 << 20)
+
+/**
+ * @brief Splits a stream into lines, reading it in large blocks.
+ */
+typedef struct {
+    FILE *file;
+    char *buffer;
+    size_t capacity;
+    size_t start;      /* First byte not yet returned */
+    size_t end;        /* End of the data read so far */
+    long line_number;  /* Number of the line last returned */
+    int eof;
+} LineReader;
+
+/**
+ * @brief Start reading lines from a stream.
+ * @param reader Pointer to the reader to initialize.
+ * @param file The stream to read from.
+ */
+void open_line_reader(LineReader *reader, FILE *file);
+
+/**
+ * @brief Get the next line, without its line terminator.
+ *
+ * The line lives in the reader's buffer and stays valid until the next call.
+ * @param reader Pointer to the reader.
+ * @return The null-terminated line, or NULL at end of input.
+ */
+char* next_line(LineReader *reader);
+
+/**
+ * @brief Look ahead at the next line if it is longer than one block.
+ *
+ * Reads until the buffer holds the whole next line or a block of it. The
+ * last line of the input counts whether or not it ends with a newline.
+ * @param reader Pointer to the reader.
+ * @param length Receives the number of bytes of the line in the buffer.
+ * @return The start of the line in the buffer, or NULL if the line is
+ *         shorter than a block (or there is none); nothing is consumed.
+ */
+const char* long_line_ahead(LineReader *reader, size_t *length);
+
+/**
+ * @brief Take the next piece of the current line, reading at most a block at a time.
+ *
+ * Lets a caller scan a line of any length without holding all of it: the
+ * piece stays valid until the next call on the reader.
+ * @param reader Pointer to the reader.
+ * @param length Receives the length of the piece, without the line terminator.
+ * @param last Receives 1 if the piece ends the line; the line is then counted as read.
+ * @return The piece, not null-terminated.
+ */
+const char* next_line_piece(LineReader *reader, size_t *length, int *last);
+
+/**
+ * @brief Look ahead at the next bytes of the input, growing the buffer to hold them.
+ * @param reader Pointer to the reader.
+ * @param n Number of bytes wanted.
+ * @param available Receives the number of bytes in the buffer, fewer than n only at end of input.
+ * @return The bytes, valid until the next call on the reader; nothing is consumed.
+ */
+const char* peek_bytes(LineReader *reader, size_t n, size_t *available);
+
+/**
+ * @brief Consume bytes looked at with peek_bytes.
+ * @param reader Pointer to the reader.
+ * @param n Number of bytes, at most those available.
+ */
+void skip_bytes(LineReader *reader, size_t n);
+
+/**
+ * @brief Take the next binary frame (see protocol.h), counting it as a line.
+ * @param reader Pointer to the reader.
+ * @param frame Receives the frame after its length header, valid until the next call on the reader.
+ * @param length Receives the number of bytes in the frame.
+ * @return 1 for a frame, 0 at end of input, -1 if the input ends inside a
+ *         frame or a header gives a length over FRAME_MAX_SIZE.
+ */
+int next_frame(LineReader *reader, const unsigned char **frame, size_t *length);
+
+/**
+ * @brief Release the reader's buffer. The stream is not closed.
+ * @param reader Pointer to the reader.
+ */
+void close_line_reader(LineReader *reader);
+
+#endif /* INPUT_H */
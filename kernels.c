@@ -0,0 +1,309 @@
+#include <string.h>
+#include "kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+
+/* Portable kernels, also used for the tails of the vector kernels */
+
+static void or_scalar(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        dst[i] = a[i] | b[i];
+    }
+}
+
+static void and_scalar(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        dst[i] = a[i] & b[i];
+    }
+}
+
+static void andnot_scalar(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        dst[i] = a[i] & ~b[i];
+    }
+}
+
+static void xor_scalar(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        dst[i] = a[i] ^ b[i];
+    }
+}
+
+static uint64_t count_scalar(const uint64_t *words, size_t n) {
+    uint64_t count = 0;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        count += __builtin_popcountll(words[i]);
+    }
+    return count;
+}
+
+static uint64_t count_and_scalar(const uint64_t *a, const uint64_t *b, size_t n) {
+    uint64_t count = 0;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        count += __builtin_popcountll(a[i] & b[i]);
+    }
+    return count;
+}
+
+static uint64_t count_or_scalar(const uint64_t *a, const uint64_t *b, size_t n) {
+    uint64_t count = 0;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        count += __builtin_popcountll(a[i] | b[i]);
+    }
+    return count;
+}
+
+static void overlap_scalar(const uint64_t *a, const uint64_t *b, size_t n, uint64_t *counts) {
+    size_t i;
+    counts[0] = 0;
+    counts[1] = 0;
+    for (i = 0; i < n; i++) {
+        counts[0] += __builtin_popcountll(a[i] & b[i]);
+        counts[1] += __builtin_popcountll(a[i] | b[i]);
+    }
+}
+
+static int any_and_scalar(const uint64_t *a, const uint64_t *b, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (a[i] & b[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int any_andnot_scalar(const uint64_t *a, const uint64_t *b, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (a[i] & ~b[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int any_xor_scalar(const uint64_t *a, const uint64_t *b, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (a[i] ^ b[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const SetKernels scalar_kernels = {"scalar", or_scalar, and_scalar, andnot_scalar, xor_scalar, count_scalar,
+                                          count_and_scalar, count_or_scalar, overlap_scalar,
+                                          any_and_scalar, any_andnot_scalar, any_xor_scalar};
+
+
+#ifdef KERNELS_X86
+
+/*
+ * Each vector kernel processes `lanes` words per step with unaligned loads and
+ * stores, then hands the remaining words to the scalar kernel. Loads happen
+ * before the store of each step, so dst may alias a or b.
+ */
+#define DEFINE_KERNEL(name, isa, vec, lanes, load, store, expr, tail) \
+    __attribute__((target(isa))) \
+    static void name(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n) { \
+        size_t i = 0; \
+        for (; i + (lanes) <= n; i += (lanes)) { \
+            vec va = load((const vec *)(a + i)); \
+            vec vb = load((const vec *)(b + i)); \
+            store((vec *)(dst + i), expr); \
+        } \
+        tail(dst + i, a + i, b + i, n - i); \
+    }
+
+DEFINE_KERNEL(or_sse2, "sse2", __m128i, 2, _mm_loadu_si128, _mm_storeu_si128, _mm_or_si128(va, vb), or_scalar)
+DEFINE_KERNEL(and_sse2, "sse2", __m128i, 2, _mm_loadu_si128, _mm_storeu_si128, _mm_and_si128(va, vb), and_scalar)
+DEFINE_KERNEL(andnot_sse2, "sse2", __m128i, 2, _mm_loadu_si128, _mm_storeu_si128, _mm_andnot_si128(vb, va), andnot_scalar)
+DEFINE_KERNEL(xor_sse2, "sse2", __m128i, 2, _mm_loadu_si128, _mm_storeu_si128, _mm_xor_si128(va, vb), xor_scalar)
+
+DEFINE_KERNEL(or_avx2, "avx2", __m256i, 4, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_or_si256(va, vb), or_scalar)
+DEFINE_KERNEL(and_avx2, "avx2", __m256i, 4, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_and_si256(va, vb), and_scalar)
+DEFINE_KERNEL(andnot_avx2, "avx2", __m256i, 4, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_andnot_si256(vb, va), andnot_scalar)
+DEFINE_KERNEL(xor_avx2, "avx2", __m256i, 4, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_xor_si256(va, vb), xor_scalar)
+
+DEFINE_KERNEL(or_avx512, "avx512f", __m512i, 8, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_or_si512(va, vb), or_scalar)
+DEFINE_KERNEL(and_avx512, "avx512f", __m512i, 8, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_and_si512(va, vb), and_scalar)
+DEFINE_KERNEL(andnot_avx512, "avx512f", __m512i, 8, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_andnot_si512(vb, va), andnot_scalar)
+DEFINE_KERNEL(xor_avx512, "avx512f", __m512i, 8, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_xor_si512(va, vb), xor_scalar)
+
+/* Hardware popcount with independent accumulators; every AVX2 CPU has it */
+__attribute__((target("popcnt")))
+static uint64_t count_popcnt(const uint64_t *words, size_t n) {
+    uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        c0 += __builtin_popcountll(words[i]);
+        c1 += __builtin_popcountll(words[i + 1]);
+        c2 += __builtin_popcountll(words[i + 2]);
+        c3 += __builtin_popcountll(words[i + 3]);
+    }
+    for (; i < n; i++) {
+        c0 += __builtin_popcountll(words[i]);
+    }
+    return c0 + c1 + c2 + c3;
+}
+
+/* The same with the two input words combined first, never storing the result */
+#define DEFINE_COUNT_PAIR(name, expr) \
+    __attribute__((target("popcnt"))) \
+    static uint64_t name(const uint64_t *a, const uint64_t *b, size_t n) { \
+        uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0; \
+        size_t i = 0; \
+        for (; i + 4 <= n; i += 4) { \
+            c0 += __builtin_popcountll(expr(a[i], b[i])); \
+            c1 += __builtin_popcountll(expr(a[i + 1], b[i + 1])); \
+            c2 += __builtin_popcountll(expr(a[i + 2], b[i + 2])); \
+            c3 += __builtin_popcountll(expr(a[i + 3], b[i + 3])); \
+        } \
+        for (; i < n; i++) { \
+            c0 += __builtin_popcountll(expr(a[i], b[i])); \
+        } \
+        return c0 + c1 + c2 + c3; \
+    }
+
+#define AND_WORD(x, y) ((x) & (y))
+#define OR_WORD(x, y) ((x) | (y))
+
+DEFINE_COUNT_PAIR(count_and_popcnt, AND_WORD)
+DEFINE_COUNT_PAIR(count_or_popcnt, OR_WORD)
+
+__attribute__((target("popcnt")))
+static void overlap_popcnt(const uint64_t *a, const uint64_t *b, size_t n, uint64_t *counts) {
+    uint64_t and0 = 0, and1 = 0, or0 = 0, or1 = 0;
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        and0 += __builtin_popcountll(a[i] & b[i]);
+        or0 += __builtin_popcountll(a[i] | b[i]);
+        and1 += __builtin_popcountll(a[i + 1] & b[i + 1]);
+        or1 += __builtin_popcountll(a[i + 1] | b[i + 1]);
+    }
+    if (i < n) {
+        and0 += __builtin_popcountll(a[i] & b[i]);
+        or0 += __builtin_popcountll(a[i] | b[i]);
+    }
+    counts[0] = and0 + and1;
+    counts[1] = or0 + or1;
+}
+
+/* Whether a vector has a bit set */
+__attribute__((target("sse2")))
+static int nonzero_sse2(__m128i v) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi32(v, _mm_setzero_si128())) != 0xFFFF;
+}
+
+__attribute__((target("avx2")))
+static int nonzero_avx2(__m256i v) {
+    return !_mm256_testz_si256(v, v);
+}
+
+__attribute__((target("avx512f")))
+static int nonzero_avx512(__m512i v) {
+    return _mm512_test_epi64_mask(v, v) != 0;
+}
+
+/*
+ * Test kernels OR four vectors of results together and check them once, so
+ * the early exit costs one branch per four loads of each input.
+ */
+#define DEFINE_ANY(name, isa, vec, lanes, load, or, zero, nonzero, expr, tail) \
+    __attribute__((target(isa))) \
+    static int name(const uint64_t *a, const uint64_t *b, size_t n) { \
+        size_t i = 0, j; \
+        for (; i + 4 * (lanes) <= n; i += 4 * (lanes)) { \
+            vec any = zero(); \
+            for (j = i; j < i + 4 * (lanes); j += (lanes)) { \
+                vec va = load((const vec *)(a + j)); \
+                vec vb = load((const vec *)(b + j)); \
+                any = or(any, expr); \
+            } \
+            if (nonzero(any)) { \
+                return 1; \
+            } \
+        } \
+        return tail(a + i, b + i, n - i); \
+    }
+
+DEFINE_ANY(any_and_sse2, "sse2", __m128i, 2, _mm_loadu_si128, _mm_or_si128, _mm_setzero_si128, nonzero_sse2, _mm_and_si128(va, vb), any_and_scalar)
+DEFINE_ANY(any_andnot_sse2, "sse2", __m128i, 2, _mm_loadu_si128, _mm_or_si128, _mm_setzero_si128, nonzero_sse2, _mm_andnot_si128(vb, va), any_andnot_scalar)
+DEFINE_ANY(any_xor_sse2, "sse2", __m128i, 2, _mm_loadu_si128, _mm_or_si128, _mm_setzero_si128, nonzero_sse2, _mm_xor_si128(va, vb), any_xor_scalar)
+
+DEFINE_ANY(any_and_avx2, "avx2", __m256i, 4, _mm256_loadu_si256, _mm256_or_si256, _mm256_setzero_si256, nonzero_avx2, _mm256_and_si256(va, vb), any_and_scalar)
+DEFINE_ANY(any_andnot_avx2, "avx2", __m256i, 4, _mm256_loadu_si256, _mm256_or_si256, _mm256_setzero_si256, nonzero_avx2, _mm256_andnot_si256(vb, va), any_andnot_scalar)
+DEFINE_ANY(any_xor_avx2, "avx2", __m256i, 4, _mm256_loadu_si256, _mm256_or_si256, _mm256_setzero_si256, nonzero_avx2, _mm256_xor_si256(va, vb), any_xor_scalar)
+
+DEFINE_ANY(any_and_avx512, "avx512f", __m512i, 8, _mm512_loadu_si512, _mm512_or_si512, _mm512_setzero_si512, nonzero_avx512, _mm512_and_si512(va, vb), any_and_scalar)
+DEFINE_ANY(any_andnot_avx512, "avx512f", __m512i, 8, _mm512_loadu_si512, _mm512_or_si512, _mm512_setzero_si512, nonzero_avx512, _mm512_andnot_si512(vb, va), any_andnot_scalar)
+DEFINE_ANY(any_xor_avx512, "avx512f", __m512i, 8, _mm512_loadu_si512, _mm512_or_si512, _mm512_setzero_si512, nonzero_avx512, _mm512_xor_si512(va, vb), any_xor_scalar)
+
+static const SetKernels sse2_kernels = {"sse2", or_sse2, and_sse2, andnot_sse2, xor_sse2, count_scalar,
+                                        count_and_scalar, count_or_scalar, overlap_scalar,
+                                        any_and_sse2, any_andnot_sse2, any_xor_sse2};
+static const SetKernels avx2_kernels = {"avx2", or_avx2, and_avx2, andnot_avx2, xor_avx2, count_popcnt,
+                                        count_and_popcnt, count_or_popcnt, overlap_popcnt,
+                                        any_and_avx2, any_andnot_avx2, any_xor_avx2};
+static const SetKernels avx512_kernels = {"avx512", or_avx512, and_avx512, andnot_avx512, xor_avx512, count_popcnt,
+                                          count_and_popcnt, count_or_popcnt, overlap_popcnt,
+                                          any_and_avx512, any_andnot_avx512, any_xor_avx512};
+
+#endif /* KERNELS_X86 */
+
+
+const SetKernels *set_kernels = &scalar_kernels;
+
+const SetKernels *const *available_kernels(int *count) {
+    static const SetKernels *found[4];
+    static int found_count = 0;
+
+    if (found_count == 0) {
+        found[found_count++] = &scalar_kernels;
+#ifdef KERNELS_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2")) {
+            found[found_count++] = &sse2_kernels;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            found[found_count++] = &avx2_kernels;
+        }
+        if (__builtin_cpu_supports("avx512f")) {
+            found[found_count++] = &avx512_kernels;
+        }
+#endif
+    }
+    *count = found_count;
+    return found;
+}
+
+void select_kernels(void) {
+    int count;
+    const SetKernels *const *found = available_kernels(&count);
+    set_kernels = found[count - 1];  /* The widest supported ISA comes last */
+}
+
+int force_kernels(const char *name) {
+    int count, i;
+    const SetKernels *const *found = available_kernels(&count);
+    for (i = 0; i < count; i++) {
+        if (strcmp(found[i]->name, name) == 0) {
+            set_kernels = found[i];
+            return 0;
+        }
+    }
+    return -1;
+}
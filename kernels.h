@@ -0,0 +1,78 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief A word-wise set kernel: dst[i] = a[i] OP b[i] for i < n.
+ *
+ * dst may be the same array as a or b.
+ */
+typedef void (*word_kernel)(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n);
+
+/**
+ * @brief A counting kernel: the number of bits set in words[0 .. n - 1].
+ */
+typedef uint64_t (*count_kernel)(const uint64_t *words, size_t n);
+
+/**
+ * @brief A fused counting kernel: the number of bits set in a[i] OP b[i] for i < n, with no result words stored.
+ */
+typedef uint64_t (*count_pair_kernel)(const uint64_t *a, const uint64_t *b, size_t n);
+
+/**
+ * @brief Count the bits of a[i] & b[i] into counts[0] and of a[i] | b[i] into counts[1], for i < n, in one pass.
+ */
+typedef void (*overlap_kernel)(const uint64_t *a, const uint64_t *b, size_t n, uint64_t *counts);
+
+/**
+ * @brief A test kernel: 1 if a[i] OP b[i] is non-zero for some i < n, 0 otherwise.
+ *
+ * Returns as soon as a block of words decides the answer.
+ */
+typedef int (*any_kernel)(const uint64_t *a, const uint64_t *b, size_t n);
+
+/**
+ * @brief Implementations of the set kernels for one ISA level.
+ */
+typedef struct {
+    const char *name;
+    word_kernel or_words;      /* union */
+    word_kernel and_words;     /* intersection */
+    word_kernel andnot_words;  /* subtraction: a & ~b */
+    word_kernel xor_words;     /* symmetric difference */
+    count_kernel count_words;  /* cardinality */
+    count_pair_kernel count_and_words;  /* intersection size */
+    count_pair_kernel count_or_words;   /* union size */
+    overlap_kernel overlap_words;       /* both sizes, for similarity */
+    any_kernel any_and_words;     /* not disjoint */
+    any_kernel any_andnot_words;  /* not a subset */
+    any_kernel any_xor_words;     /* not equal */
+} SetKernels;
+
+/**
+ * @brief The kernels used by the set operations (scalar until selected).
+ */
+extern const SetKernels *set_kernels;
+
+/**
+ * @brief Select the fastest kernels the CPU supports.
+ */
+void select_kernels(void);
+
+/**
+ * @brief Force a kernel set by name ("scalar", "sse2", "avx2", "avx512").
+ * @param name The kernel set name.
+ * @return 0 on success, -1 if unknown or not supported by this CPU.
+ */
+int force_kernels(const char *name);
+
+/**
+ * @brief Get the kernel sets available on this CPU, slowest first.
+ * @param count Pointer receiving the number of kernel sets.
+ * @return Array of pointers to the available kernel sets.
+ */
+const SetKernels *const *available_kernels(int *count);
+
+#endif /* KERNELS_H */
@@ -1,8 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "set.h"
+#include "storage.h"
+#include "kernels.h"
+#include "parallel.h"
+#include "input.h"
+#include "parser.h"
+#include "commands.h"
+#include "persist.h"
+#include "stats.h"
+#include "registry.h"
+#include "server.h"
+#include "schedule.h"
+#include "arena.h"
+#include "protocol.h"
+#include "similarity.h"
 #include "validations.h"
 
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
 
 /*
  * File Name: myset.c
@@ -19,140 +37,198 @@
 
 
 
+/* File the statistics are written to at exit, if any */
+static const char *stats_path = NULL;
+
 /**
- * @brief Print error message based on error code.
- * @param error_code The error code to print a message for.
+ * @brief Write the statistics to stats_path; registered with atexit.
  */
-void print_error(int error_code);
+static void dump_stats_at_exit(void) {
+    if (dump_stats_json(&command_stats, stats_path) != 0) {
+        fprintf(stderr, "Cannot write statistics to %s\n", stats_path);
+    }
+}
+
+/**
+ * @brief Run a batch input in the binary protocol, writing a reply frame to stdout for each frame.
+ *
+ * A bad preamble or a malformed frame gets a reply with error 24, and
+ * nothing after it is read.
+ * @param reader The reader, at the preamble.
+ * @param registry The named sets.
+ * @param cmd Parsed command storage.
+ * @return 1 if a stop frame ended the input, 0 otherwise.
+ */
+static int run_frames(LineReader *reader, Registry *registry, ParsedCommand *cmd) {
+    ReplyBuffer reply;
+    const unsigned char *frame;
+    const char *preamble;
+    size_t length;
+    uint64_t clock = stats_now();
+    int stopped = 0, status;
+
+    open_reply_buffer(&reply);
+    preamble = peek_bytes(reader, PROTOCOL_PREAMBLE_SIZE, &length);
+    status = length == PROTOCOL_PREAMBLE_SIZE && preamble[1] == PROTOCOL_VERSION ? 1 : -1;
+    skip_bytes(reader, length);
+    while (!stopped && status == 1 && (status = next_frame(reader, &frame, &length)) == 1) {
+        stopped = run_frame(frame, length, registry, cmd, reader->line_number, &reply, &clock);
+        fwrite(reply.data, 1, reply.length, stdout);
+        clear_reply_buffer(&reply);
+    }
+    if (status < 0) {
+        begin_reply(&reply);
+        fail_reply(24);  /* Malformed frame */
+        end_reply(&reply);
+        fwrite(reply.data, 1, reply.length, stdout);
+    }
+    close_reply_buffer(&reply);
+    return stopped;
+}
 
-int main() {
-    Set sets[MAX_SETS] = {0};
-    Set *result_set;
-    Set set1, set2;
+int main(int argc, char *argv[]) {
+    Registry registry;
+    LineReader reader;
+    Scheduler scheduler;
+    FILE *script = NULL;
+    const char *snapshot = NULL;
+    const char *socket_path = NULL;
+    ParsedCommand cmd = {0};
     char *command_string = NULL;
-    int error, command_type, num_elements;
-    int *elements;
-
-    while (1) {
-        printf("Enter a command: ");
-        read_string(&command_string);
-        
-        printf("%s\n", command_string);
-        
-        manipulate_string(&command_string);
-
-        error = validate_command_name(command_string);
-        if (error != 0) {
-            print_error(error);
-            continue;
-        }
+    char *line;
+    size_t length;
+    int batch = !isatty(STDIN_FILENO);
+    int binary = 0;
+    int similarity = 0;
+    int scheduled = 0;
+    int stopped = 0;
+    uint64_t clock;
+    int i;
 
-        error = check_consecutive_commas(command_string);
-        if (error == 9) {
-            print_error(error);
-            continue;
+    init_stats(&command_stats);
+    select_kernels();
+    init_registry(&registry);
+    for (i = 0; i < MAX_SETS; i++) {
+        create_registry_set(&registry, VALID_SETS[i], strlen(VALID_SETS[i]));
+    }
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) { /* force a kernel set */
+            if (force_kernels(argv[++i]) != 0) {
+                fprintf(stderr, "Kernel set %s is not available\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) { /* threads for large sets */
+            if (set_thread_count(atoi(argv[++i])) != 0) {
+                fprintf(stderr, "Thread count must be 1 - %d\n", PARALLEL_MAX_THREADS);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) { /* snapshot file */
+            snapshot = argv[++i];
+            if (strlen(snapshot) >= PERSIST_PATH_MAX) {
+                fprintf(stderr, "Snapshot file name is too long\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) { /* serve clients on a socket */
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) { /* statistics as JSON at exit */
+            stats_path = argv[++i];
+        } else if (strcmp(argv[i], "-V") == 0) { /* checksum set data on load */
+            set_load_verification(1);
+        } else if (strcmp(argv[i], "-m") == 0) { /* MinHash index for similar */
+            similarity = 1;
+        } else if (strcmp(argv[i], "-p") == 0) { /* run independent batch commands in parallel */
+            scheduled = 1;
+        } else if (strcmp(argv[i], "-b") == 0) { /* batch mode on a terminal */
+            batch = 1;
+        } else if (argv[i][0] != '-' && script == NULL) { /* script file */
+            script = fopen(argv[i], "r");
+            if (script == NULL) {
+                fprintf(stderr, "Cannot open %s\n", argv[i]);
+                return 1;
+            }
+            batch = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-k scalar|sse2|avx2|avx512] [-t threads] [-s snapshot] [-V] [-S socket] [-j stats.json] [-m] [-p] [-b] [script]\n", argv[0]);
+            return 1;
         }
+    }
 
-        command_type = is_valid_command(command_string);
+    if (stats_path != NULL) {
+        atexit(dump_stats_at_exit);  /* Also covers end of input in read_string */
+    }
+    if (snapshot != NULL && access(snapshot, F_OK) == 0 && load_all_sets(&registry, snapshot) != 0) {
+        fprintf(stderr, "Cannot load snapshot %s\n", snapshot);
+        return 1;
+    }
+    if (similarity) {
+        enable_similarity_index(&registry);
+    }
 
-        if (command_type == 1) { /* read_set command */
-            error = validate_read_command(command_string);
-            if (error != 0) {
-                print_error(error);
-                continue;
-            }
-            result_set = &sets[is_valid_set(get_substring(command_string, 9, 13)) - 1];
-            elements = parse_numbers(command_string);
-            if (elements == NULL) {
-                printf("Error parsing numbers.\n");
+    if (socket_path != NULL) {
+        /* Runs until SIGINT or SIGTERM; clients can only end their own connection */
+        stopped = run_server(&registry, socket_path, get_thread_count()) == 0;
+    } else if (batch) {
+        /* No prompt or echo; read in blocks and buffer the results */
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+        open_line_reader(&reader, script != NULL ? script : stdin);
+        line = (char*)peek_bytes(&reader, 1, &length);
+        if (length > 0 && line[0] == PROTOCOL_MAGIC) {
+            binary = 1;
+            scheduled = 0;  /* Frames run in order */
+            stopped = run_frames(&reader, &registry, &cmd);
+        }
+        if (scheduled) {
+            init_scheduler(&scheduler, &registry, get_thread_count());
+        }
+        clock = stats_now();
+        while (!stopped && !binary) {
+            line = (char*)long_line_ahead(&reader, &length);
+            if (line != NULL && is_read_command(line, length)) {
+                if (scheduled) {
+                    run_window(&scheduler);  /* The earlier commands come first */
+                }
+                run_streamed_read(&reader, &registry, &clock);  /* Members go straight into the set */
                 continue;
             }
-            num_elements = count_numbers(elements);
-            read_set(elements, result_set, num_elements);
-            free(elements);
-            continue;
-        } else if (command_type == 2) { /* print_set command */
-            error = validate_print_command(command_string);
-            if (error != 0) {
-                print_error(error);
-                continue;
+            if ((line = next_line(&reader)) == NULL) {
+                break;
             }
-            set1 = sets[is_valid_set(get_substring(command_string, 10, 14)) - 1];
-            print_set(set1);
-            continue;
-        } else if (command_type == 7) { /* stop command */
-            break;
-        } else { /* other set operations */
-            error = validate_general_command(command_string);
-            if (error != 0) {
-                print_error(error);
-                continue;
+            if (scheduled) {
+                stopped = schedule_command(&scheduler, line, reader.line_number, &clock);
+            } else {
+                stopped = run_command(line, &registry, &cmd, reader.line_number, &clock);
             }
+        }
+        if (scheduled) {
+            run_window(&scheduler);
+            free_scheduler(&scheduler);
+        }
+        close_line_reader(&reader);
+        if (script != NULL) {
+            fclose(script);
+        }
+        if (!stopped) {
+            fprintf(binary ? stderr : stdout, "Error: program ended without the stop command\n");  /* Not a frame */
+        }
+    } else {
+        while (!stopped) {
+            printf("Enter a command: ");
+            clock = stats_now();
+            read_string(&command_string);
 
-            if (command_type == 3) { /* union_set */
-                set1 = sets[is_valid_set(get_substring(command_string, 10, 14)) - 1];
-                set2 = sets[is_valid_set(get_substring(command_string, 16, 20)) - 1];
-                result_set = &sets[is_valid_set(get_substring(command_string, 22, 26)) - 1];
-                union_set(set1, set2, result_set);
-            } else if (command_type == 4) { /* intersect_set */
-                set1 = sets[is_valid_set(get_substring(command_string, 14, 18)) - 1];
-                set2 = sets[is_valid_set(get_substring(command_string, 20, 24)) - 1];
-                result_set = &sets[is_valid_set(get_substring(command_string, 26, 30)) - 1];
-                intersect_set(set1, set2, result_set);
-            } else if (command_type == 5) { /* sub_set */
-                set1 = sets[is_valid_set(get_substring(command_string, 8, 12)) - 1];
-                set2 = sets[is_valid_set(get_substring(command_string, 14, 18)) - 1];
-                result_set = &sets[is_valid_set(get_substring(command_string, 20, 24)) - 1];
-                sub_set(set1, set2, result_set);
-            } else if (command_type == 6) { /* symdiff_set */
-                set1 = sets[is_valid_set(get_substring(command_string, 12, 16)) - 1];
-                set2 = sets[is_valid_set(get_substring(command_string, 18, 22)) - 1];
-                result_set = &sets[is_valid_set(get_substring(command_string, 24, 28)) - 1];
-                symdiff_set(set1, set2, result_set);
-            }
+            printf("%s\n", command_string);
+
+            stopped = run_command(command_string, &registry, &cmd, 0, &clock);  /* Also releases command_string */
         }
     }
 
-    free(command_string);
-    return 0;
-}
-
-void print_error(int error_code) {
-    switch (error_code) {
-        case 1:
-            printf("Invalid set name\n");
-            break;
-        case 2:
-            printf("Invalid command name\n");
-            break;
-        case 3:
-            printf("Members out of range (0 - 127)\n");
-            break;
-        case 4:
-            printf("Invalid set member - not an integer\n");
-            break;
-        case 5:
-            printf("List of set members is not terminated correctly\n");
-            break;
-        case 6:
-            printf("Missing space after command name\n");
-            break;
-        case 7:
-            printf("Missing parameter\n");
-            break;
-        case 8:
-            printf("Extraneous text after end of command\n");
-            break;
-        case 9:
-            printf("Multiple consecutive commas\n");
-            break;
-        case 10:
-            printf("Missing comma\n");
-            break;
-        case 11:
-            printf("Illegal comma\n");
-            break;
-        default:
-            break;
+    if (stopped && snapshot != NULL && save_all_sets(&registry, snapshot) != 0) {
+        fprintf(stderr, "Cannot save snapshot %s\n", snapshot);
+        stopped = 0;
     }
-}
\ No newline at end of file
+    stop_thread_pool();
+    free_registry(&registry);
+    free_parsed_command(&cmd);
+    free_arena(command_arena());
+    return stopped ? 0 : 1;
+}
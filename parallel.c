@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "parallel.h"
+
+/* The pool runs one operation at a time; workers wait for a new generation */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;      /* A new operation or shutdown */
+    pthread_cond_t done;      /* The last chunk has finished */
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    int nthreads;             /* Worker threads started */
+    unsigned long generation;
+    int shutdown;
+
+    /* The current operation: a kernel over chunks of words, or tasks when task is set */
+    parallel_task task;
+    void *ctx;
+    word_kernel kernel;
+    uint64_t *dst;
+    const uint64_t *a;
+    const uint64_t *b;
+    size_t n;
+    size_t chunk;             /* Words per chunk, a multiple of PARALLEL_LINE_WORDS */
+    size_t head;              /* Words before dst's first cache line boundary, added to the first chunk */
+    size_t nchunks;
+    size_t next_chunk;
+    size_t pending;           /* Chunks not yet finished */
+} ThreadPool;
+
+static ThreadPool pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+static pthread_mutex_t pool_owner = PTHREAD_MUTEX_INITIALIZER;  /* Held by the thread running an operation */
+static int thread_count = 0;  /* 0 until first asked for */
+static size_t threshold = PARALLEL_MIN_WORDS;
+
+
+int set_thread_count(int threads) {
+    if (threads < 1 || threads > PARALLEL_MAX_THREADS) {
+        return -1;
+    }
+    thread_count = threads;
+    return 0;
+}
+
+
+int get_thread_count(void) {
+    long cpus;
+    if (thread_count == 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpus < 1 ? 1 : cpus > PARALLEL_MAX_THREADS ? PARALLEL_MAX_THREADS : (int)cpus;
+    }
+    return thread_count;
+}
+
+
+void set_parallel_threshold(size_t words) {
+    threshold = words;
+}
+
+
+/* Take chunks of the current operation until none are left; called with the lock held */
+static void run_chunks(void) {
+    size_t c, start, end, len;
+    while (pool.next_chunk < pool.nchunks) {
+        c = pool.next_chunk++;
+        pthread_mutex_unlock(&pool.lock);
+        if (pool.task != NULL) {
+            pool.task(pool.ctx, c);
+        } else {
+            start = c == 0 ? 0 : pool.head + c * pool.chunk;
+            end = pool.head + (c + 1) * pool.chunk;
+            len = (end < pool.n ? end : pool.n) - start;
+            pool.kernel(pool.dst + start, pool.a + start, pool.b + start, len);
+        }
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.pending == 0) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+}
+
+static void* worker(void *arg) {
+    unsigned long seen = 0;
+    (void)arg;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen && !pool.shutdown) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+        }
+        if (pool.shutdown) {
+            break;
+        }
+        seen = pool.generation;
+        run_chunks();
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/* Start workers until there are wanted - 1 of them; the caller is the last thread */
+static void start_workers(int wanted) {
+    while (pool.nthreads < wanted - 1) {
+        if (pthread_create(&pool.threads[pool.nthreads], NULL, worker, NULL) != 0) {
+            fprintf(stderr, "Thread creation failed\n");
+            exit(1);
+        }
+        pool.nthreads++;
+    }
+}
+
+
+/* Hand out the nchunks chunks of the operation set up in pool to the workers
+ * and the caller, and wait for them; called holding pool.lock and pool_owner,
+ * which it releases */
+static void run_operation(int threads, size_t nchunks) {
+    start_workers(threads);
+    pool.nchunks = nchunks;
+    pool.next_chunk = 0;
+    pool.pending = nchunks;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.work);
+
+    run_chunks();  /* The caller works too, then waits for the stragglers */
+    while (pool.pending > 0) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool_owner);
+}
+
+
+void parallel_words(word_kernel kernel, uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n) {
+    int threads = get_thread_count();
+    size_t chunks, chunk, head;
+
+    if (threads <= 1 || n < threshold || n <= PARALLEL_LINE_WORDS || pthread_mutex_trylock(&pool_owner) != 0) {
+        kernel(dst, a, b, n);  /* Small, or the pool is busy with another caller */
+        return;
+    }
+    chunks = (size_t)threads * PARALLEL_CHUNKS_PER_THREAD;
+    chunk = (n + chunks - 1) / chunks;
+    chunk = (chunk + PARALLEL_LINE_WORDS - 1) / PARALLEL_LINE_WORDS * PARALLEL_LINE_WORDS;
+    /* Chunks after the first start on a line of dst, so no two threads write the same line */
+    head = (PARALLEL_LINE_WORDS - (uintptr_t)dst / sizeof(uint64_t) % PARALLEL_LINE_WORDS) % PARALLEL_LINE_WORDS;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.task = NULL;
+    pool.kernel = kernel;
+    pool.dst = dst;
+    pool.a = a;
+    pool.b = b;
+    pool.n = n;
+    pool.chunk = chunk;
+    pool.head = head;
+    run_operation(threads, (n - head + chunk - 1) / chunk);
+}
+
+
+void parallel_tasks(parallel_task task, void *ctx, size_t count, size_t words) {
+    int threads = get_thread_count();
+    size_t i;
+
+    if (threads <= 1 || words < threshold || count <= 1 || pthread_mutex_trylock(&pool_owner) != 0) {
+        for (i = 0; i < count; i++) {
+            task(ctx, i);
+        }
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.task = task;
+    pool.ctx = ctx;
+    run_operation(threads, count);
+}
+
+
+void stop_thread_pool(void) {
+    int i;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < pool.nthreads; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    pool.nthreads = 0;
+    pool.shutdown = 0;
+}
@@ -0,0 +1,76 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kernels.h"
+
+#define PARALLEL_LINE_WORDS 8             /* 64-byte cache line */
+#define PARALLEL_MIN_WORDS (1L << 17)     /* 1 MiB per operand */
+#define PARALLEL_CHUNKS_PER_THREAD 4
+#define PARALLEL_MAX_THREADS 64
+
+/**
+ * @brief Set the number of threads the word kernels may use.
+ *
+ * Threads are started on the first operation that needs them and reused
+ * afterwards. 1 runs everything on the calling thread.
+ * @param threads Number of threads, including the caller (1 .. PARALLEL_MAX_THREADS).
+ * @return 0 on success, -1 if out of range.
+ */
+int set_thread_count(int threads);
+
+/**
+ * @brief Get the number of threads the word kernels may use.
+ * @return The thread count, by default the number of online CPUs.
+ */
+int get_thread_count(void);
+
+/**
+ * @brief Set the smallest operand, in words, that is split across threads.
+ * @param words The threshold; smaller operations run on the calling thread.
+ */
+void set_parallel_threshold(size_t words);
+
+/**
+ * @brief Run a word kernel over n words, split across the thread pool.
+ *
+ * The words are divided into chunks that start on cache line boundaries
+ * of dst (by address, so malloc's alignment does not matter), handed out
+ * to the pool and the calling thread until all are done. Each word is
+ * computed by the same kernel as the serial code, so the result is
+ * identical. Below the threshold, or while another thread is using the
+ * pool, the kernel runs on the calling thread.
+ * @param kernel The kernel to run.
+ * @param dst Destination words, may be the same array as a or b.
+ * @param a First operand.
+ * @param b Second operand.
+ * @param n Number of words.
+ */
+void parallel_words(word_kernel kernel, uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n);
+
+/**
+ * @brief A piece of work split across the thread pool: task i of an operation.
+ */
+typedef void (*parallel_task)(void *ctx, size_t i);
+
+/**
+ * @brief Run task(ctx, i) for i = 0 .. count - 1, split across the thread pool.
+ *
+ * Tasks are handed out one at a time to the pool and the calling thread,
+ * so they must write disjoint memory. As for parallel_words, an operation
+ * below the threshold, or while another thread is using the pool, runs
+ * on the calling thread.
+ * @param task The task.
+ * @param ctx Passed to every task.
+ * @param count Number of tasks.
+ * @param words Size of the whole operation in words, compared with the threshold.
+ */
+void parallel_tasks(parallel_task task, void *ctx, size_t count, size_t words);
+
+/**
+ * @brief Stop the thread pool threads.
+ */
+void stop_thread_pool(void);
+
+#endif /* PARALLEL_H */
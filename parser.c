@@ -0,0 +1,1064 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parser.h"
+#include "protocol.h"
+#include "arena.h"
+#include "persist.h"
+#include "set.h"
+#include "snapshot.h"
+#include "view.h"
+
+/* Token kinds produced by next_token */
+#define TOKEN_END 0
+#define TOKEN_WORD 1
+#define TOKEN_COMMA 2
+
+#define STREAM_BATCH_SIZE 4096  /* Members of a streamed read_set buffered before setting their bits */
+
+typedef struct {
+    const char *pos;    /* Next character to scan */
+    const char *start;  /* Current word */
+    int length;
+} Scanner;
+
+static int is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+static int next_token(Scanner *sc) {
+    while (is_blank(*sc->pos)) {
+        sc->pos++;
+    }
+    if (*sc->pos == '\0') {
+        return TOKEN_END;
+    }
+    if (*sc->pos == ',') {
+        sc->pos++;
+        return TOKEN_COMMA;
+    }
+    sc->start = sc->pos;
+    while (*sc->pos != '\0' && *sc->pos != ',' && !is_blank(*sc->pos)) {
+        sc->pos++;
+    }
+    sc->length = sc->pos - sc->start;
+    return TOKEN_WORD;
+}
+
+/* manipulate_string reports commas separated only by whitespace before any
+ * other argument error, so the error paths check the rest of the line */
+static int consecutive_commas(const char *pos) {
+    int comma = 0;
+    for (; *pos != '\0'; pos++) {
+        if (*pos == ',') {
+            if (comma) {
+                return 1;
+            }
+            comma = 1;
+        } else if (!is_blank(*pos)) {
+            comma = 0;
+        }
+    }
+    return 0;
+}
+
+static int argument_error(const Scanner *sc, int error) {
+    return consecutive_commas(sc->pos) ? 9 : error;
+}
+
+static const struct {
+    const char *name;
+    int length;
+    Opcode opcode;
+} commands[] = {
+    {"read_set", 8, CMD_READ_SET},
+    {"print_set", 9, CMD_PRINT_SET},
+    {"union_set", 9, CMD_UNION_SET},
+    {"intersect_set", 13, CMD_INTERSECT_SET},
+    {"sub_set", 7, CMD_SUB_SET},
+    {"symdiff_set", 11, CMD_SYMDIFF_SET},
+    {"stop", 4, CMD_STOP},
+    {"compress_set", 12, CMD_COMPRESS_SET},
+    {"decompress_set", 14, CMD_DECOMPRESS_SET},
+    {"create_set", 10, CMD_CREATE_SET},
+    {"drop_set", 8, CMD_DROP_SET},
+    {"count_set", 9, CMD_COUNT_SET},
+    {"contains_set", 12, CMD_CONTAINS_SET},
+    {"eval", 4, CMD_EVAL},
+    {"save_set", 8, CMD_SAVE_SET},
+    {"load_set", 8, CMD_LOAD_SET},
+    {"save_all", 8, CMD_SAVE_ALL},
+    {"load_all", 8, CMD_LOAD_ALL},
+    {"stats", 5, CMD_STATS},
+    {"snapshot", 8, CMD_SNAPSHOT},
+    {"drop_snapshot", 13, CMD_DROP_SNAPSHOT},
+    {"subset_set", 10, CMD_SUBSET_SET},
+    {"equal_set", 9, CMD_EQUAL_SET},
+    {"disjoint_set", 12, CMD_DISJOINT_SET},
+    {"intersect_count", 15, CMD_INTERSECT_COUNT},
+    {"union_count", 11, CMD_UNION_COUNT},
+    {"jaccard_set", 11, CMD_JACCARD_SET},
+    {"similar_exact", 13, CMD_SIMILAR_EXACT},  /* Before similar, which is a prefix of it */
+    {"similar", 7, CMD_SIMILAR},
+    {"add_range", 9, CMD_ADD_RANGE},
+    {"remove_range", 12, CMD_REMOVE_RANGE},
+    {"define_view", 11, CMD_DEFINE_VIEW},
+    {"drop_view", 9, CMD_DROP_VIEW},
+    {"set_id", 6, CMD_SET_ID},
+    {"rank", 4, CMD_RANK},
+    {"select", 6, CMD_SELECT}
+};
+
+static int find_command(const char *word, int length) {
+    int i;
+    for (i = 0; i < (int)(sizeof(commands) / sizeof(commands[0])); i++) {
+        if (length >= commands[i].length && memcmp(word, commands[i].name, commands[i].length) == 0) {
+            if (length == commands[i].length) {
+                return commands[i].opcode;
+            }
+            return commands[i].opcode == CMD_STOP ? -8 : -6;  /* Text glued to a command name */
+        }
+    }
+    return -2; /* Unknown command name */
+}
+
+const char* command_name(Opcode opcode) {
+    int i;
+    for (i = 0; i < (int)(sizeof(commands) / sizeof(commands[0])); i++) {
+        if (commands[i].opcode == opcode) {
+            return commands[i].name;
+        }
+    }
+    return "invalid";
+}
+
+/* Parse a set member: 0 if valid, -1 for the terminator, or an error number */
+static int parse_member(const char *word, int length, int *value) {
+    long number = 0;
+    int i = 0;
+
+    if (length == 2 && word[0] == '-' && word[1] == '1') {
+        return -1;
+    }
+    if (word[0] == '-') {
+        i = 1;
+        if (length == 1) {
+            return 4; /* Invalid set member */
+        }
+    }
+    for (; i < length; i++) {
+        if (word[i] < '0' || word[i] > '9') {
+            return 4; /* Invalid set member */
+        }
+        if (number <= SET_MAX_MEMBER) {
+            number = number * 10 + (word[i] - '0');
+        }
+    }
+    if (word[0] == '-' || number > SET_MAX_MEMBER) {
+        return 3; /* Not in range */
+    }
+    *value = (int)number;
+    return 0;
+}
+
+/* Parse a member or a range FIRST-LAST: 0 if valid, -1 for the terminator,
+ * or an error number; a single member is a range of one */
+static int parse_range(const char *word, int length, int *first, int *last) {
+    const char *dash = length > 1 ? memchr(word + 1, '-', length - 1) : NULL;
+    int left, right;
+
+    if (dash == NULL) {
+        left = parse_member(word, length, first);
+        *last = *first;
+        return left;
+    }
+    left = parse_member(word, dash - word, first);
+    right = dash + 1 < word + length && dash[1] != '-' ? parse_member(dash + 1, word + length - dash - 1, last) : 4;
+    if (left == 4 || right == 4) {
+        return 4; /* Invalid set member */
+    }
+    if (left != 0 || right != 0) {
+        return 3; /* Not in range */
+    }
+    return *first <= *last ? 0 : 19; /* Invalid range */
+}
+
+static void push_range(ParsedCommand *cmd, int first, int last) {
+    if (2 * cmd->nranges == cmd->range_capacity) {
+        int capacity = cmd->range_capacity > 0 ? cmd->range_capacity * 2 : 16;
+        int *ranges = realloc(cmd->ranges, capacity * sizeof(int));
+        if (ranges == NULL) {
+            fprintf(stderr, "Memory reallocation failed\n");
+            exit(1);
+        }
+        cmd->ranges = ranges;
+        cmd->range_capacity = capacity;
+    }
+    cmd->ranges[2 * cmd->nranges] = first;
+    cmd->ranges[2 * cmd->nranges + 1] = last;
+    cmd->nranges++;
+}
+
+static void push_member(ParsedCommand *cmd, int value) {
+    if (cmd->count == cmd->capacity) {
+        int capacity = cmd->capacity > 0 ? cmd->capacity * 2 : 64;
+        int *members = realloc(cmd->members, capacity * sizeof(int));
+        if (members == NULL) {
+            fprintf(stderr, "Memory reallocation failed\n");
+            exit(1);
+        }
+        cmd->members = members;
+        cmd->capacity = capacity;
+    }
+    cmd->members[cmd->count++] = value;
+}
+
+static int parse_read(Scanner *sc, ParsedCommand *cmd) {
+    int token, result, value, last;
+
+    for (;;) {
+        token = next_token(sc);
+        if (token == TOKEN_END) {
+            return 5; /* List ends after a comma */
+        }
+        if (token == TOKEN_COMMA) {
+            return 9; /* Multiple consecutive commas */
+        }
+        result = parse_range(sc->start, sc->length, &value, &last);
+        if (result == -1) {
+            return next_token(sc) == TOKEN_END ? 0 : argument_error(sc, 8);
+        }
+        if (result != 0) {
+            return argument_error(sc, result);
+        }
+        if (value == last) {
+            push_member(cmd, value);
+        } else {
+            push_range(cmd, value, last);
+        }
+        token = next_token(sc);
+        if (token == TOKEN_END) {
+            return 5; /* Not terminated by -1 */
+        }
+        if (token != TOKEN_COMMA) {
+            return argument_error(sc, 10); /* Missing comma */
+        }
+    }
+}
+
+/* Resolve the current word as set operand i; the first sources operands may
+ * name a set in a snapshot, NAME@NUMBER */
+static int resolve_set(Scanner *sc, const Registry *registry, ParsedCommand *cmd, int i, int sources) {
+    int name_length, error = 0;
+    long number;
+
+    if (i < sources && split_snapshot_name(sc->start, sc->length, &name_length, &number) != 0) {
+        if (name_length <= 0) {
+            return argument_error(sc, 1); /* Invalid set name */
+        }
+        cmd->sets[i] = -1;
+        cmd->versions[i] = number > 0 ? snapshot_set(registry, number, sc->start, name_length, &error) : NULL;
+        return cmd->versions[i] != NULL ? 0 : argument_error(sc, number > 0 ? error : 18);
+    }
+    cmd->sets[i] = find_registry_set(registry, sc->start, sc->length);
+    return cmd->sets[i] < 0 ? argument_error(sc, 1) : 0; /* Invalid set name */
+}
+
+/* Parse the comma separated set names of every command but read_set */
+static int parse_sets(Scanner *sc, const Registry *registry, ParsedCommand *cmd, int expected, int sources) {
+    int error;
+    int token = TOKEN_WORD;
+
+    while (cmd->nsets < expected) {
+        token = next_token(sc);
+        if (token == TOKEN_END) {
+            return 7; /* Missing parameter */
+        }
+        if (token == TOKEN_COMMA) {
+            return 9; /* Multiple consecutive commas */
+        }
+        error = resolve_set(sc, registry, cmd, cmd->nsets, sources);
+        if (error != 0) {
+            return error;
+        }
+        cmd->nsets++;
+        token = next_token(sc);
+        if (token == TOKEN_END) {
+            return cmd->nsets == expected ? 0 : 7;
+        }
+        if (cmd->nsets == expected) {
+            return argument_error(sc, 8); /* Extraneous text */
+        }
+        if (token != TOKEN_COMMA) {
+            return argument_error(sc, 10); /* Missing comma */
+        }
+    }
+    return 0;
+}
+
+/* Parse a set and a number: contains_set, and similar with the number of
+ * sets wanted; or with ranges, a set and a range for add_range and remove_range */
+static int parse_contains(Scanner *sc, const Registry *registry, ParsedCommand *cmd, int sources, int ranges) {
+    int token, result, value, last;
+
+    token = next_token(sc);
+    if (token == TOKEN_END) {
+        return 7; /* Missing parameter */
+    }
+    result = resolve_set(sc, registry, cmd, 0, sources);
+    if (result != 0) {
+        return result;
+    }
+    cmd->nsets = 1;
+    token = next_token(sc);
+    if (token == TOKEN_END) {
+        return 7; /* Missing the number */
+    }
+    if (token != TOKEN_COMMA) {
+        return argument_error(sc, 10); /* Missing comma */
+    }
+    token = next_token(sc);
+    if (token == TOKEN_END) {
+        return 7; /* Missing the number */
+    }
+    if (token == TOKEN_COMMA) {
+        return 9; /* Multiple consecutive commas */
+    }
+    if (ranges) {
+        result = parse_range(sc->start, sc->length, &value, &last);
+    } else {
+        result = parse_member(sc->start, sc->length, &value);
+    }
+    if (result != 0) {
+        return argument_error(sc, result == -1 ? 3 : result);
+    }
+    if (ranges) {
+        push_range(cmd, value, last);
+    } else {
+        push_member(cmd, value);
+    }
+    return next_token(sc) == TOKEN_END ? 0 : argument_error(sc, 8);
+}
+
+/* Parse the snapshot number of drop_snapshot */
+static int parse_snapshot_number(Scanner *sc, ParsedCommand *cmd) {
+    int token = next_token(sc);
+    int result, value;
+
+    if (token == TOKEN_END) {
+        return 7; /* Missing parameter */
+    }
+    if (token == TOKEN_COMMA) {
+        return 9; /* Multiple consecutive commas */
+    }
+    result = parse_member(sc->start, sc->length, &value);
+    if (result != 0 || value == 0) {
+        return argument_error(sc, 18); /* No such snapshot */
+    }
+    push_member(cmd, value);
+    return next_token(sc) == TOKEN_END ? 0 : argument_error(sc, 8);
+}
+
+/* Parse the file name that ends save and load commands */
+static int parse_file(Scanner *sc, ParsedCommand *cmd) {
+    int token = next_token(sc);
+
+    if (token == TOKEN_END) {
+        return 7; /* Missing parameter */
+    }
+    if (token == TOKEN_COMMA) {
+        return 9; /* Multiple consecutive commas */
+    }
+    if (sc->length >= PERSIST_PATH_MAX) {
+        return argument_error(sc, 15); /* File name too long to open */
+    }
+    cmd->name = sc->start;
+    cmd->name_length = sc->length;
+    return next_token(sc) == TOKEN_END ? 0 : argument_error(sc, 8);
+}
+
+static int parse_set_and_file(Scanner *sc, const Registry *registry, ParsedCommand *cmd) {
+    int token = next_token(sc);
+
+    if (token == TOKEN_END) {
+        return 7; /* Missing parameter */
+    }
+    cmd->sets[0] = find_registry_set(registry, sc->start, sc->length);
+    if (cmd->sets[0] < 0) {
+        return argument_error(sc, 1); /* Invalid set name */
+    }
+    cmd->nsets = 1;
+    token = next_token(sc);
+    if (token == TOKEN_END) {
+        return 7; /* Missing the file name */
+    }
+    if (token != TOKEN_COMMA) {
+        return argument_error(sc, 10); /* Missing comma */
+    }
+    return parse_file(sc, cmd);
+}
+
+/* Drop the snapshot versions the previous command read */
+static void release_parsed_versions(ParsedCommand *cmd) {
+    int i;
+    for (i = 0; i < 3; i++) {
+        release_version(cmd->versions[i]);
+        cmd->versions[i] = NULL;
+    }
+    release_expression(&cmd->expr);
+}
+
+/* Views change only through their sources; 20 if a command would write one */
+static int check_written_view(const Registry *registry, const ParsedCommand *cmd) {
+    int id;
+
+    switch (cmd->opcode) {
+        case CMD_READ_SET:
+        case CMD_LOAD_SET:
+        case CMD_ADD_RANGE:
+        case CMD_REMOVE_RANGE:
+            id = cmd->sets[0];
+            break;
+        case CMD_UNION_SET:
+        case CMD_INTERSECT_SET:
+        case CMD_SUB_SET:
+        case CMD_SYMDIFF_SET:
+            id = cmd->sets[2];
+            break;
+        case CMD_EVAL:
+            id = cmd->expr.target;
+            break;
+        default:
+            return 0;
+    }
+    return find_view(registry, id) != NULL ? 20 : 0;
+}
+
+/* Parse what follows the command name */
+static int parse_arguments(Scanner *sc, const Registry *registry, ParsedCommand *cmd) {
+    int token, error;
+
+    switch (cmd->opcode) {
+        case CMD_STOP:
+        case CMD_STATS:
+        case CMD_SNAPSHOT:
+            return next_token(sc) == TOKEN_END ? 0 : 8;
+        case CMD_DROP_SNAPSHOT:
+            return parse_snapshot_number(sc, cmd);
+        case CMD_READ_SET:
+            token = next_token(sc);
+            if (token == TOKEN_END) {
+                return 7; /* Missing parameter */
+            }
+            cmd->sets[0] = find_registry_set(registry, sc->start, sc->length);
+            if (cmd->sets[0] < 0) {
+                return argument_error(sc, 1); /* Invalid set name */
+            }
+            cmd->nsets = 1;
+            token = next_token(sc);
+            if (token == TOKEN_END) {
+                return 5; /* No members and no terminator */
+            }
+            if (token != TOKEN_COMMA) {
+                return argument_error(sc, 10); /* Missing comma */
+            }
+            return parse_read(sc, cmd);
+        case CMD_CREATE_SET:
+            token = next_token(sc);
+            if (token == TOKEN_END) {
+                return 7; /* Missing parameter */
+            }
+            if (!is_valid_set_name(sc->start, sc->length)) {
+                return argument_error(sc, 1); /* Invalid set name */
+            }
+            if (find_registry_set(registry, sc->start, sc->length) >= 0) {
+                return argument_error(sc, 12); /* Set already exists */
+            }
+            cmd->name = sc->start;
+            cmd->name_length = sc->length;
+            return next_token(sc) == TOKEN_END ? 0 : argument_error(sc, 8);
+        case CMD_CONTAINS_SET:
+        case CMD_RANK:
+        case CMD_SELECT:
+            return parse_contains(sc, registry, cmd, 1, 0);
+        case CMD_SIMILAR:
+        case CMD_SIMILAR_EXACT:
+            return parse_contains(sc, registry, cmd, 0, 0);
+        case CMD_ADD_RANGE:
+        case CMD_REMOVE_RANGE:
+            return parse_contains(sc, registry, cmd, 0, 1);
+        case CMD_EVAL:
+            return parse_expression(sc->pos, registry, &cmd->expr);
+        case CMD_DEFINE_VIEW:
+            error = parse_expression(sc->pos, registry, &cmd->expr);
+            return error == 0 ? check_view(registry, &cmd->expr) : error;
+        case CMD_DROP_VIEW:
+            error = parse_sets(sc, registry, cmd, 1, 0);
+            return error == 0 && find_view(registry, cmd->sets[0]) == NULL ? 21 : error;
+        case CMD_SAVE_SET:
+        case CMD_LOAD_SET:
+            return parse_set_and_file(sc, registry, cmd);
+        case CMD_SAVE_ALL:
+        case CMD_LOAD_ALL:
+            return parse_file(sc, cmd);
+        case CMD_PRINT_SET:
+        case CMD_COUNT_SET:
+            return parse_sets(sc, registry, cmd, 1, 1);
+        case CMD_COMPRESS_SET:
+        case CMD_DECOMPRESS_SET:
+        case CMD_DROP_SET:
+        case CMD_SET_ID:
+            return parse_sets(sc, registry, cmd, 1, 0);
+        case CMD_SUBSET_SET:
+        case CMD_EQUAL_SET:
+        case CMD_DISJOINT_SET:
+        case CMD_INTERSECT_COUNT:
+        case CMD_UNION_COUNT:
+        case CMD_JACCARD_SET:
+            return parse_sets(sc, registry, cmd, 2, 2);
+        default:
+            return parse_sets(sc, registry, cmd, 3, 2);  /* The target is always a live set */
+    }
+}
+
+int parse_command(const char *line, const Registry *registry, ParsedCommand *cmd) {
+    Scanner sc;
+    int token, opcode, error;
+
+    sc.pos = line;
+    release_parsed_versions(cmd);
+    cmd->nsets = 0;
+    cmd->count = 0;
+    cmd->nranges = 0;
+    cmd->bitmap = NULL;
+
+    token = next_token(&sc);
+    if (token != TOKEN_WORD) {
+        return token == TOKEN_COMMA ? 11 : 2; /* Nothing before a comma, or an empty line */
+    }
+    if (*sc.pos == ',') {
+        return 11; /* Illegal comma in the command name */
+    }
+    opcode = find_command(sc.start, sc.length);
+    if (opcode < 0) {
+        return -opcode;
+    }
+    cmd->opcode = opcode;
+    while (is_blank(*sc.pos)) {
+        sc.pos++;
+    }
+    if (*sc.pos == ',') {
+        return 11; /* Illegal comma after the command name */
+    }
+    error = parse_arguments(&sc, registry, cmd);
+    return error == 0 ? check_written_view(registry, cmd) : error;
+}
+
+/* ---- Binary frames ---- */
+
+/* Decode a varint no greater than limit: 0, 7 at the end of the frame, 24
+ * if malformed, or error if too large */
+static int frame_value(const unsigned char **pos, const unsigned char *end, uint64_t limit, int error, uint64_t *value) {
+    if (*pos == end) {
+        return 7; /* Missing parameter */
+    }
+    if (get_varint(pos, end, value) != 0) {
+        return 24; /* Malformed frame */
+    }
+    return *value <= limit ? 0 : error;
+}
+
+/* Decode the registry entry ids of the set operands */
+static int frame_sets(const unsigned char **pos, const unsigned char *end, const Registry *registry,
+                      ParsedCommand *cmd, int expected) {
+    uint64_t id;
+    int error;
+
+    while (cmd->nsets < expected) {
+        error = frame_value(pos, end, INT_MAX, 1, &id);
+        if (error != 0) {
+            return error;
+        }
+        if ((int)id >= registry->next_id || !registry_entry(registry, (int)id)->in_use) {
+            return 1; /* Invalid set name */
+        }
+        cmd->sets[cmd->nsets++] = (int)id;
+    }
+    return 0;
+}
+
+/* Decode read_set's members, as gaps or as a bitmap */
+static int frame_read(const unsigned char **pos, const unsigned char *end, const Registry *registry, ParsedCommand *cmd) {
+    uint64_t gap, first;
+    long previous = -1;
+    int encoding;
+    int error = frame_sets(pos, end, registry, cmd, 1);
+
+    if (error != 0) {
+        return error;
+    }
+    if (*pos == end) {
+        return 7; /* Missing the encoding */
+    }
+    encoding = *(*pos)++;
+    if (encoding == FRAME_BITMAP) {
+        error = frame_value(pos, end, (SET_MAX_MEMBER + 1UL) / SET_WORD_BITS, 3, &first);
+        if (error != 0) {
+            return error;
+        }
+        if ((end - *pos) % sizeof(uint64_t) != 0) {
+            return 24; /* Malformed frame */
+        }
+        cmd->bitmap = *pos;
+        cmd->bitmap_first = first;
+        cmd->bitmap_words = (end - *pos) / sizeof(uint64_t);
+        *pos = end;
+        return first + cmd->bitmap_words <= (SET_MAX_MEMBER + 1UL) / SET_WORD_BITS ? 0 : 3;
+    }
+    if (encoding != FRAME_MEMBERS) {
+        return 24; /* Malformed frame */
+    }
+    while (*pos < end) {
+        error = frame_value(pos, end, SET_MAX_MEMBER, 3, &gap);
+        if (error != 0) {
+            return error;
+        }
+        if (previous + 1 + (long)gap > SET_MAX_MEMBER) {
+            return 3; /* Not in range */
+        }
+        previous += 1 + (long)gap;
+        push_member(cmd, (int)previous);
+    }
+    return 0;
+}
+
+/* Decode the payload after the opcode */
+static int frame_arguments(const unsigned char **pos, const unsigned char *end, const Registry *registry,
+                           ParsedCommand *cmd) {
+    uint64_t value, last;
+    int error;
+
+    switch (cmd->opcode) {
+        case CMD_STOP:
+        case CMD_STATS:
+        case CMD_SNAPSHOT:
+            return 0;
+        case CMD_DROP_SNAPSHOT:
+            error = frame_value(pos, end, SET_MAX_MEMBER, 18, &value);
+            if (error == 0 && value == 0) {
+                error = 18; /* No such snapshot */
+            }
+            if (error == 0) {
+                push_member(cmd, (int)value);
+            }
+            return error;
+        case CMD_READ_SET:
+            return frame_read(pos, end, registry, cmd);
+        case CMD_CONTAINS_SET:
+        case CMD_RANK:
+        case CMD_SELECT:
+        case CMD_SIMILAR:
+        case CMD_SIMILAR_EXACT:
+            error = frame_sets(pos, end, registry, cmd, 1);
+            if (error == 0) {
+                error = frame_value(pos, end, SET_MAX_MEMBER, 3, &value);
+            }
+            if (error == 0) {
+                push_member(cmd, (int)value);
+            }
+            return error;
+        case CMD_ADD_RANGE:
+        case CMD_REMOVE_RANGE:
+            error = frame_sets(pos, end, registry, cmd, 1);
+            if (error == 0) {
+                error = frame_value(pos, end, SET_MAX_MEMBER, 3, &value);
+            }
+            if (error == 0) {
+                error = frame_value(pos, end, SET_MAX_MEMBER, 3, &last);
+            }
+            if (error == 0 && value > last) {
+                error = 19; /* Invalid range */
+            }
+            if (error == 0) {
+                push_range(cmd, (int)value, (int)last);
+            }
+            return error;
+        case CMD_DROP_VIEW:
+            error = frame_sets(pos, end, registry, cmd, 1);
+            return error == 0 && find_view(registry, cmd->sets[0]) == NULL ? 21 : error;
+        case CMD_PRINT_SET:
+        case CMD_COUNT_SET:
+        case CMD_COMPRESS_SET:
+        case CMD_DECOMPRESS_SET:
+        case CMD_DROP_SET:
+        case CMD_SET_ID:
+            return frame_sets(pos, end, registry, cmd, 1);
+        case CMD_SUBSET_SET:
+        case CMD_EQUAL_SET:
+        case CMD_DISJOINT_SET:
+        case CMD_INTERSECT_COUNT:
+        case CMD_UNION_COUNT:
+        case CMD_JACCARD_SET:
+            return frame_sets(pos, end, registry, cmd, 2);
+        case CMD_UNION_SET:
+        case CMD_INTERSECT_SET:
+        case CMD_SUB_SET:
+        case CMD_SYMDIFF_SET:
+            return frame_sets(pos, end, registry, cmd, 3);
+        default:
+            return 25; /* Names, files and expressions travel as text */
+    }
+}
+
+int parse_frame(const unsigned char *frame, size_t length, const Registry *registry, ParsedCommand *cmd) {
+    const unsigned char *pos = frame + 1, *end = frame + length;
+    int error;
+
+    if (length > 0 && frame[0] == FRAME_TEXT) {
+        return parse_command(arena_strndup(command_arena(), (const char*)pos, length - 1), registry, cmd);
+    }
+    release_parsed_versions(cmd);
+    cmd->nsets = 0;
+    cmd->count = 0;
+    cmd->nranges = 0;
+    cmd->bitmap = NULL;
+    if (length == 0) {
+        return 24; /* Malformed frame */
+    }
+    if (frame[0] >= OPCODE_LIMIT) {
+        return 2; /* Invalid command name */
+    }
+    cmd->opcode = frame[0];
+    error = frame_arguments(&pos, end, registry, cmd);
+    if (error == 0 && pos != end) {
+        error = 24; /* Trailing bytes */
+    }
+    return error == 0 ? check_written_view(registry, cmd) : error;
+}
+
+/* ---- read_set lines too long to hold in memory ---- */
+
+/* A line taken from a LineReader piece by piece */
+typedef struct {
+    LineReader *reader;
+    const char *pos;
+    const char *end;
+    int last;        /* The current piece ends the line */
+    size_t length;   /* Bytes of the line taken so far */
+} LineStream;
+
+/* Load the next piece once the current one is used up; '\0' at the end of the line */
+static char stream_refill(LineStream *ls) {
+    size_t length;
+    while (ls->pos == ls->end) {
+        if (ls->last) {
+            return '\0';
+        }
+        ls->pos = next_line_piece(ls->reader, &length, &ls->last);
+        ls->end = ls->pos + length;
+        ls->length += length;
+    }
+    return *ls->pos;
+}
+
+/* The next character without taking it, '\0' at the end of the line */
+static char stream_peek(LineStream *ls) {
+    return ls->pos < ls->end ? *ls->pos : stream_refill(ls);
+}
+
+/* next_token without keeping the word, which the caller then takes */
+static int stream_token(LineStream *ls) {
+    char c;
+    while (is_blank(c = stream_peek(ls))) {
+        ls->pos++;
+    }
+    if (c == '\0') {
+        return TOKEN_END;
+    }
+    if (c == ',') {
+        ls->pos++;
+        return TOKEN_COMMA;
+    }
+    return TOKEN_WORD;
+}
+
+static void stream_skip_word(LineStream *ls) {
+    char c;
+    while ((c = stream_peek(ls)) != '\0' && c != ',' && !is_blank(c)) {
+        ls->pos++;
+    }
+}
+
+/* argument_error for a stream: consecutive_commas over the rest of the line */
+static int stream_argument_error(LineStream *ls, int error) {
+    int comma = 0;
+    char c;
+    while ((c = stream_peek(ls)) != '\0') {
+        if (c == ',') {
+            if (comma) {
+                return 9;
+            }
+            comma = 1;
+        } else if (!is_blank(c)) {
+            comma = 0;
+        }
+        ls->pos++;
+    }
+    return error;
+}
+
+/* parse_range on a word taken from the stream */
+static int stream_range(LineStream *ls, int *first, int *last) {
+    const char *p;
+    long number[2] = {0, 0};  /* Before and after the dash of a range */
+    int length[2] = {0, 0};
+    int part = 0, negative = 0, invalid = 0;
+    char c;
+
+    if (stream_peek(ls) == '-') {
+        negative = 1;
+        length[0] = 1;
+        ls->pos++;
+    }
+    /* Scan a piece at a time; a word may continue in the next piece */
+    while (stream_peek(ls) != '\0') {
+        for (p = ls->pos; p < ls->end; p++) {
+            c = *p;
+            if (c >= '0' && c <= '9') {
+                if (number[part] <= SET_MAX_MEMBER) {
+                    number[part] = number[part] * 10 + (c - '0');
+                }
+                length[part]++;
+            } else if (c == ',' || c == '\0' || is_blank(c)) {
+                break;
+            } else if (c == '-' && part == 0 && length[0] > 0) {
+                part = 1;
+            } else {
+                invalid = 1;
+                length[part]++;
+            }
+        }
+        ls->pos = p;
+        if (p < ls->end) {
+            break;
+        }
+    }
+    if (part == 0) {
+        if (negative && length[0] == 2 && number[0] == 1 && !invalid) {
+            return -1;
+        }
+        if (invalid || (negative && length[0] == 1)) {
+            return 4; /* Invalid set member */
+        }
+    } else if (invalid || (negative && length[0] == 1) || length[1] == 0) {
+        return 4; /* Invalid set member */
+    }
+    if (negative || number[0] > SET_MAX_MEMBER || number[1] > SET_MAX_MEMBER) {
+        return 3; /* Not in range */
+    }
+    *first = (int)number[0];
+    *last = part == 0 ? *first : (int)number[1];
+    return *first <= *last ? 0 : 19; /* Invalid range */
+}
+
+/* Members parsed but not yet in the bitmap, set in a tight loop so the
+ * cache misses of one batch overlap */
+typedef struct {
+    int members[STREAM_BATCH_SIZE];
+    int count;
+    uint64_t *words;     /* Bitmap sized for the largest member so far */
+    size_t capacity;
+    long largest;
+} StreamBitmap;
+
+/* Make the bitmap hold the largest member so far */
+static void stream_reserve(StreamBitmap *b) {
+    size_t n = (size_t)b->largest / SET_WORD_BITS + 1;
+    uint64_t *grown;
+
+    if (n > b->capacity) {
+        /* Grow by an eighth at least: large reallocs are remapped, not copied,
+         * and doubling would zero pages the set never uses */
+        n = b->capacity + b->capacity / 8 > n ? b->capacity + b->capacity / 8 : n;
+        grown = realloc(b->words, n * sizeof(uint64_t));
+        if (grown == NULL) {
+            fprintf(stderr, "Memory reallocation failed\n");
+            exit(1);
+        }
+        memset(grown + b->capacity, 0, (n - b->capacity) * sizeof(uint64_t));
+        b->words = grown;
+        b->capacity = n;
+    }
+}
+
+static void stream_flush(StreamBitmap *b) {
+    int i, x;
+
+    if (b->count == 0) {
+        return;
+    }
+    stream_reserve(b);
+    for (i = 0; i < b->count; i++) {
+        x = b->members[i];
+        b->words[x / SET_WORD_BITS] |= (uint64_t)1 << (x % SET_WORD_BITS);
+    }
+    b->count = 0;
+}
+
+static void stream_add(StreamBitmap *b, int value) {
+    if (b->count == STREAM_BATCH_SIZE) {
+        stream_flush(b);
+    }
+    b->members[b->count++] = value;
+    b->largest = value > b->largest ? value : b->largest;
+}
+
+/* Ranges go in at once, a word at a time; pending members can wait */
+static void stream_add_range(StreamBitmap *b, int first, int last) {
+    Set view;
+
+    b->largest = last > b->largest ? last : b->largest;
+    stream_reserve(b);
+    init_set(&view);
+    view.words = b->words;
+    view.nwords = b->capacity;
+    add_range(&view, first, last);
+}
+
+/* The read_set arguments: parse_command and parse_read on the stream */
+static int stream_read_arguments(LineStream *ls, const Registry *registry, int *id, StreamBitmap *bitmap) {
+    char name[SET_NAME_MAX];
+    int length = 0, token, result, value, last;
+    char c;
+
+    if (stream_token(ls) == TOKEN_END) {
+        return 7; /* Missing parameter */
+    }
+    while ((c = stream_peek(ls)) != '\0' && c != ',' && !is_blank(c)) {
+        if (length < SET_NAME_MAX) {
+            name[length] = c;
+        }
+        length++;
+        ls->pos++;
+    }
+    *id = length < SET_NAME_MAX ? find_registry_set(registry, name, length) : -1;
+    if (*id < 0) {
+        return stream_argument_error(ls, 1); /* Invalid set name */
+    }
+    token = stream_token(ls);
+    if (token == TOKEN_END) {
+        return 5; /* No members and no terminator */
+    }
+    if (token != TOKEN_COMMA) {
+        stream_skip_word(ls);
+        return stream_argument_error(ls, 10); /* Missing comma */
+    }
+
+    for (;;) {
+        token = stream_token(ls);
+        if (token == TOKEN_END) {
+            return 5; /* List ends after a comma */
+        }
+        if (token == TOKEN_COMMA) {
+            return 9; /* Multiple consecutive commas */
+        }
+        result = stream_range(ls, &value, &last);
+        if (result == -1) {
+            if (stream_token(ls) == TOKEN_END) {
+                return 0;
+            }
+            stream_skip_word(ls);
+            return stream_argument_error(ls, 8);
+        }
+        if (result != 0) {
+            return stream_argument_error(ls, result);
+        }
+        if (value == last) {
+            stream_add(bitmap, value);
+        } else {
+            stream_add_range(bitmap, value, last);
+        }
+        token = stream_token(ls);
+        if (token == TOKEN_END) {
+            return 5; /* Not terminated by -1 */
+        }
+        if (token != TOKEN_COMMA) {
+            stream_skip_word(ls);
+            return stream_argument_error(ls, 10); /* Missing comma */
+        }
+    }
+}
+
+int is_read_command(const char *text, size_t length) {
+    size_t i = 0;
+    while (i < length && is_blank(text[i])) {
+        i++;
+    }
+    return length - i > 8 && memcmp(text + i, "read_set", 8) == 0 && is_blank(text[i + 8]);
+}
+
+int stream_read_command(LineReader *reader, const Registry *registry, int *id, Set *members, size_t *line_length) {
+    LineStream ls;
+    StreamBitmap *bitmap = calloc(1, sizeof(StreamBitmap));
+    uint64_t *grown;
+    size_t n;
+    int error;
+
+    if (bitmap == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    bitmap->largest = -1;
+    ls.reader = reader;
+    ls.pos = NULL;
+    ls.end = NULL;
+    ls.last = 0;
+    ls.length = 0;
+
+    stream_token(&ls);
+    stream_skip_word(&ls);  /* read_set, as checked by is_read_command */
+    while (is_blank(stream_peek(&ls))) {
+        ls.pos++;
+    }
+    if (stream_peek(&ls) == ',') {
+        error = 11; /* Illegal comma after the command name */
+    } else {
+        error = stream_read_arguments(&ls, registry, id, bitmap);
+    }
+    if (error == 0 && find_view(registry, *id) != NULL) {
+        error = 20; /* Views change only through their sources */
+    }
+    while (!ls.last) {  /* Take whatever the error left of the line */
+        ls.pos = ls.end;
+        stream_peek(&ls);
+    }
+    *line_length = ls.length;
+
+    init_set(members);
+    if (error == 0 && bitmap->largest >= 0) {
+        stream_flush(bitmap);
+        /* Trim to the words read_set would have grown the set to */
+        n = (size_t)bitmap->largest / SET_WORD_BITS + 1;
+        if (n < bitmap->capacity && (grown = realloc(bitmap->words, n * sizeof(uint64_t))) != NULL) {
+            bitmap->words = grown;
+        }
+        members->words = bitmap->words;
+        members->nwords = n;
+    } else {
+        free(bitmap->words);
+    }
+    free(bitmap);
+    return error;
+}
+
+void free_parsed_command(ParsedCommand *cmd) {
+    release_parsed_versions(cmd);
+    free(cmd->members);
+    free(cmd->ranges);
+    cmd->members = NULL;
+    cmd->count = 0;
+    cmd->capacity = 0;
+    cmd->ranges = NULL;
+    cmd->nranges = 0;
+    cmd->range_capacity = 0;
+}
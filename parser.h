@@ -0,0 +1,144 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include "registry.h"
+#include "expr.h"
+#include "input.h"
+
+/**
+ * @brief Command opcodes, numbered as returned by is_valid_command.
+ */
+typedef enum {
+    CMD_READ_SET = 1,
+    CMD_PRINT_SET,
+    CMD_UNION_SET,
+    CMD_INTERSECT_SET,
+    CMD_SUB_SET,
+    CMD_SYMDIFF_SET,
+    CMD_STOP,
+    CMD_COMPRESS_SET,
+    CMD_DECOMPRESS_SET,
+    CMD_CREATE_SET,
+    CMD_DROP_SET,
+    CMD_COUNT_SET,
+    CMD_CONTAINS_SET,
+    CMD_EVAL,
+    CMD_SAVE_SET,
+    CMD_LOAD_SET,
+    CMD_SAVE_ALL,
+    CMD_LOAD_ALL,
+    CMD_STATS,
+    CMD_SNAPSHOT,
+    CMD_DROP_SNAPSHOT,
+    CMD_SUBSET_SET,
+    CMD_EQUAL_SET,
+    CMD_DISJOINT_SET,
+    CMD_INTERSECT_COUNT,
+    CMD_UNION_COUNT,
+    CMD_JACCARD_SET,
+    CMD_SIMILAR,
+    CMD_SIMILAR_EXACT,
+    CMD_ADD_RANGE,
+    CMD_REMOVE_RANGE,
+    CMD_DEFINE_VIEW,
+    CMD_DROP_VIEW,
+    CMD_SET_ID,
+    CMD_RANK,
+    CMD_SELECT
+} Opcode;
+
+#define OPCODE_LIMIT (CMD_SELECT + 1)  /* One past the largest opcode */
+
+/**
+ * @brief A validated command.
+ *
+ * The members and ranges buffers belong to the caller and are reused by
+ * every parse, growing only when a command lists more than any before it.
+ * A zero-initialized ParsedCommand is ready for use.
+ */
+typedef struct {
+    Opcode opcode;
+    int sets[3];   /* Registry entry ids in command order, -1 for a snapshot operand */
+    struct SetVersion *versions[3];  /* The version read by a snapshot operand, NULL for live sets */
+    int nsets;
+    const char *name;  /* create_set: the new name; save and load: the file name; pointing into the line */
+    int name_length;
+    int *members;  /* read_set members without the -1 terminator, or the number of contains_set, similar, rank or select */
+    int count;
+    int capacity;
+    int *ranges;   /* read_set ranges FIRST-LAST and the range of add_range and remove_range, as first, last pairs */
+    int nranges;
+    int range_capacity;
+    const unsigned char *bitmap;  /* read_set from a frame: little-endian words of members, pointing into the frame; or NULL */
+    size_t bitmap_first;  /* Index of the first of them */
+    size_t bitmap_words;
+    Expression expr;  /* eval: the assignment to evaluate; define_view: the view's definition */
+} ParsedCommand;
+
+/**
+ * @brief Tokenize and validate a raw command line in a single pass.
+ *
+ * Whitespace is handled like manipulate_string does, and the error codes
+ * are those of print_error. Set names are resolved through the registry,
+ * and commands writing the members of a view are rejected.
+ * @param line The command line; it is not modified.
+ * @param registry The registry holding the named sets.
+ * @param cmd Pointer to the command to fill.
+ * @return Error number or 0 if valid.
+ */
+int parse_command(const char *line, const Registry *registry, ParsedCommand *cmd);
+
+/**
+ * @brief Decode and validate a binary command frame.
+ *
+ * The frame's first byte is the opcode, FRAME_TEXT for a command line
+ * (parsed like parse_command, from a copy in the command arena). The
+ * payload of the other opcodes holds varints: set operands as registry
+ * entry ids, and numbers; read_set's members follow an encoding byte, as
+ * gaps (FRAME_MEMBERS) or as a bitmap (FRAME_BITMAP). See README.md.
+ * @param frame The frame after its length header.
+ * @param length Bytes in the frame.
+ * @param registry The registry holding the sets.
+ * @param cmd Pointer to the command to fill; a bitmap points into frame.
+ * @return Error number, as for parse_command, or 0 if valid.
+ */
+int parse_frame(const unsigned char *frame, size_t length, const Registry *registry, ParsedCommand *cmd);
+
+/**
+ * @brief Check whether text starts a read_set command.
+ * @param text The start of a line.
+ * @param length Number of bytes available.
+ * @return 1 if the first word is read_set, followed by a blank.
+ */
+int is_read_command(const char *text, size_t length);
+
+/**
+ * @brief Validate a read_set line straight from a reader, setting each member's bit as it is read.
+ *
+ * The line is scanned a block at a time and never held whole, and no
+ * list of members is built, so the memory used is that of the result's
+ * bitmap. The errors are those parse_command reports for the same line,
+ * including reading into a view.
+ * @param reader The reader, positioned at a line for which is_read_command holds; the whole line is taken.
+ * @param registry The registry holding the named sets.
+ * @param id Receives the registry entry id of the set.
+ * @param members Receives the members, sized like read_set sizes a set; empty on error.
+ * @param line_length Receives the length of the line.
+ * @return Error number or 0 if valid.
+ */
+int stream_read_command(LineReader *reader, const Registry *registry, int *id, Set *members, size_t *line_length);
+
+/**
+ * @brief Get the name of a command.
+ * @param opcode The opcode.
+ * @return The command name.
+ */
+const char* command_name(Opcode opcode);
+
+/**
+ * @brief Release the members and ranges buffers of a parsed command.
+ * @param cmd Pointer to the command.
+ */
+void free_parsed_command(ParsedCommand *cmd);
+
+#endif /* PARSER_H */
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "persist.h"
+
+/* Error numbers, as printed by print_error */
+#define ERROR_FILE 15        /* Cannot read or write the file */
+#define ERROR_BAD_FILE 16    /* Not a valid set file */
+#define ERROR_NOT_IN_FILE 17 /* The set is not in the file */
+
+/* Checksums are built up a run of words at a time: checksum_start(seed),
+ * then checksum_more for each run in order */
+static uint64_t checksum_start(uint64_t seed) {
+    return seed ^ 0x9e3779b97f4a7c15ULL;
+}
+
+static uint64_t checksum_more(uint64_t hash, const uint64_t *words, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        hash = (hash ^ words[i]) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+static uint64_t checksum_words(const uint64_t *words, size_t n, uint64_t seed) {
+    return checksum_more(checksum_start(seed), words, n);
+}
+
+/* Whether loading checksums the data of every set, not just the directory */
+static int verify_data = 0;
+
+void set_load_verification(int verify) {
+    verify_data = verify;
+}
+
+static uint64_t page_align(uint64_t bytes) {
+    return (bytes + PERSIST_PAGE_SIZE - 1) / PERSIST_PAGE_SIZE * PERSIST_PAGE_SIZE;
+}
+
+static void* persist_alloc(size_t size) {
+    void *ptr = calloc(1, size > 0 ? size : 1);
+    if (ptr == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+/* Checksum the words saved for a set, and write them to file unless it is
+ * NULL; dense sets go a chunk at a time, so they are never made contiguous */
+static int put_set_data(const StoredSet *s, FILE *file, uint64_t *nwords, uint64_t *checksum) {
+    const ChunkedSet *dense = &s->dense;
+    const uint64_t *words;
+    uint64_t *packed;
+    size_t i, n;
+    int ok = 1;
+
+    if (s->compressed) {
+        *nwords = cset_serialized_words(&s->packed);
+        packed = persist_alloc(*nwords * sizeof(uint64_t));
+        serialize_cset(&s->packed, packed);
+        *checksum = checksum_words(packed, *nwords, *nwords);
+        ok = file == NULL || fwrite(packed, sizeof(uint64_t), *nwords, file) == *nwords;
+        free(packed);
+        return ok;
+    }
+    *nwords = dense->nwords;
+    *checksum = checksum_start(*nwords);
+    for (i = 0; ok && i < dense->nchunks; i++) {
+        n = dense->nwords - i * SET_CHUNK_WORDS < SET_CHUNK_WORDS ? dense->nwords - i * SET_CHUNK_WORDS : SET_CHUNK_WORDS;
+        words = chunked_words(dense, i * SET_CHUNK_WORDS, n, NULL);  /* A whole chunk is read in place */
+        *checksum = checksum_more(*checksum, words, n);
+        ok = file == NULL || fwrite(words, sizeof(uint64_t), n, file) == n;
+    }
+    return ok;
+}
+
+static int write_padding(FILE *file, uint64_t bytes) {
+    static const char zeros[PERSIST_PAGE_SIZE];
+    return bytes == 0 || fwrite(zeros, 1, bytes, file) == bytes;
+}
+
+
+int save_sets(const Registry *registry, const int *ids, int count, const char *path) {
+    char temp[PERSIST_PATH_MAX + 8];
+    FileHeader header;
+    FileEntry *entries = persist_alloc(count * sizeof(FileEntry));
+    const RegistryEntry *entry;
+    uint64_t nwords, checksum, offset;
+    FILE *file;
+    int i, ok;
+
+    /* Lay out the directory, then every set on its own pages */
+    offset = page_align(sizeof(FileHeader) + count * sizeof(FileEntry));
+    for (i = 0; i < count; i++) {
+        entry = registry_entry(registry, ids[i]);
+        memcpy(entries[i].name, entry->name, entry->length);
+        entries[i].name_length = entry->length;
+        entries[i].compressed = entry->set.compressed;
+        put_set_data(&entry->set, NULL, &nwords, &checksum);
+        entries[i].offset = offset;
+        entries[i].nwords = nwords;
+        entries[i].checksum = checksum;
+        offset = page_align(offset + nwords * sizeof(uint64_t));
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PERSIST_MAGIC, sizeof(header.magic));
+    header.version = PERSIST_VERSION;
+    header.count = count;
+    header.directory_checksum = checksum_words((const uint64_t*)entries, count * sizeof(FileEntry) / sizeof(uint64_t), count);
+
+    /* Write a temporary file and rename it, so mappings of the old file stay valid */
+    sprintf(temp, "%s.tmp", path);
+    file = fopen(temp, "wb");
+    if (file == NULL) {
+        free(entries);
+        return ERROR_FILE;
+    }
+    ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+         fwrite(entries, sizeof(FileEntry), count, file) == (size_t)count;
+    offset = sizeof(header) + count * sizeof(FileEntry);
+    for (i = 0; ok && i < count; i++) {
+        entry = registry_entry(registry, ids[i]);
+        ok = write_padding(file, entries[i].offset - offset) && put_set_data(&entry->set, file, &nwords, &checksum);
+        offset = entries[i].offset + nwords * sizeof(uint64_t);
+    }
+    ok = write_padding(file, page_align(offset) - offset) && ok;
+    ok = fclose(file) == 0 && ok;
+    free(entries);
+    if (!ok || rename(temp, path) != 0) {
+        remove(temp);
+        return ERROR_FILE;
+    }
+    return 0;
+}
+
+
+int save_all_sets(const Registry *registry, const char *path) {
+    int *ids = persist_alloc(registry->count * sizeof(int));
+    int id, count = 0, error;
+
+    for (id = 0; id < registry->next_id; id++) {
+        if (registry_entry(registry, id)->in_use) {
+            ids[count++] = id;
+        }
+    }
+    error = save_sets(registry, ids, count, path);
+    free(ids);
+    return error;
+}
+
+
+/* Map a set file and check its header and directory; the caller owns one reference */
+static int map_file(const char *path, SetMapping **mapping) {
+    const FileHeader *header;
+    const FileEntry *entries;
+    struct stat st;
+    void *base;
+    uint64_t size;
+    uint32_t i;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return ERROR_FILE;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return ERROR_FILE;
+    }
+    size = (uint64_t)st.st_size;
+    if (size < sizeof(FileHeader)) {
+        close(fd);
+        return ERROR_BAD_FILE;
+    }
+    /* Private and writable: sets may be changed in place without touching the file */
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return ERROR_FILE;
+    }
+
+    header = base;
+    entries = (const FileEntry*)(header + 1);
+    if (memcmp(header->magic, PERSIST_MAGIC, sizeof(header->magic)) != 0 || header->version != PERSIST_VERSION ||
+        header->count > (size - sizeof(FileHeader)) / sizeof(FileEntry) ||
+        header->directory_checksum != checksum_words((const uint64_t*)entries,
+                                                     header->count * sizeof(FileEntry) / sizeof(uint64_t), header->count)) {
+        munmap(base, size);
+        return ERROR_BAD_FILE;
+    }
+    for (i = 0; i < header->count; i++) {
+        if (entries[i].offset % PERSIST_PAGE_SIZE != 0 || entries[i].offset > size ||
+            entries[i].nwords > (size - entries[i].offset) / sizeof(uint64_t) || entries[i].compressed > 1 ||
+            !is_valid_set_name(entries[i].name, entries[i].name_length)) {
+            munmap(base, size);
+            return ERROR_BAD_FILE;
+        }
+    }
+
+    *mapping = persist_alloc(sizeof(SetMapping));
+    (*mapping)->base = base;
+    (*mapping)->length = size;
+    (*mapping)->refs = 1;
+    return 0;
+}
+
+/* Decode an entry into packed if it is compressed, verifying its checksum
+ * first with set_load_verification; a dense entry's words are not read */
+static int decode_entry(const SetMapping *mapping, const FileEntry *entry, CompressedSet *packed) {
+    const uint64_t *words = (const uint64_t*)((const char*)mapping->base + entry->offset);
+
+    init_cset(packed);
+    if (verify_data && checksum_words(words, entry->nwords, entry->nwords) != entry->checksum) {
+        return ERROR_BAD_FILE;
+    }
+    if (entry->compressed && deserialize_cset(words, entry->nwords, packed) != 0) {
+        return ERROR_BAD_FILE;
+    }
+    return 0;
+}
+
+/* Replace a set with a decoded directory entry: dense sets point into the
+ * mapping, compressed ones take over packed */
+static void install_entry(SetMapping *mapping, const FileEntry *entry, CompressedSet *packed, StoredSet *s) {
+    free_stored_set(s);
+    if (entry->compressed) {
+        s->compressed = 1;
+        s->packed = *packed;
+        init_cset(packed);
+    } else if (entry->nwords > 0) {
+        map_chunked(&s->dense, mapping, (uint64_t*)((char*)mapping->base + entry->offset), entry->nwords);
+    }
+}
+
+
+int load_set(Registry *registry, int id, const char *path) {
+    const RegistryEntry *target = registry_entry(registry, id);
+    const FileHeader *header;
+    const FileEntry *entries, *entry = NULL;
+    SetMapping *mapping;
+    CompressedSet packed;
+    uint32_t i;
+    int error = map_file(path, &mapping);
+
+    if (error != 0) {
+        return error;
+    }
+    header = mapping->base;
+    entries = (const FileEntry*)(header + 1);
+    for (i = 0; i < header->count; i++) {
+        if (entries[i].name_length == (uint32_t)target->length &&
+            memcmp(entries[i].name, target->name, target->length) == 0) {
+            entry = &entries[i];
+        }
+    }
+    if (entry == NULL && header->count == 1) {
+        entry = &entries[0];
+    }
+    if (entry == NULL) {
+        error = ERROR_NOT_IN_FILE;
+    } else if ((error = decode_entry(mapping, entry, &packed)) == 0) {
+        install_entry(mapping, entry, &packed, registry_set(registry, id));
+    }
+    release_mapping(mapping);
+    return error;
+}
+
+
+int load_all_sets(Registry *registry, const char *path) {
+    const FileHeader *header;
+    const FileEntry *entries;
+    CompressedSet *packed;
+    SetMapping *mapping;
+    uint32_t i;
+    int id, error = map_file(path, &mapping);
+
+    if (error != 0) {
+        return error;
+    }
+    header = mapping->base;
+    entries = (const FileEntry*)(header + 1);
+    packed = persist_alloc(header->count * sizeof(CompressedSet));
+    /* Check everything loading checks before changing any set */
+    for (i = 0; i < header->count && error == 0; i++) {
+        error = decode_entry(mapping, &entries[i], &packed[i]);
+    }
+    for (i = 0; i < header->count; i++) {
+        if (error == 0) {
+            id = find_registry_set(registry, entries[i].name, entries[i].name_length);
+            if (id < 0) {
+                id = create_registry_set(registry, entries[i].name, entries[i].name_length);
+            }
+            install_entry(mapping, &entries[i], &packed[i], registry_set(registry, id));
+        }
+        free_cset(&packed[i]);
+    }
+    free(packed);
+    release_mapping(mapping);
+    return error;
+}
@@ -0,0 +1,96 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stdint.h>
+#include "registry.h"
+
+#define PERSIST_MAGIC "MYSETDB"
+#define PERSIST_VERSION 1
+#define PERSIST_PAGE_SIZE 4096
+#define PERSIST_PATH_MAX 4096
+
+/**
+ * @brief The first bytes of a set file.
+ *
+ * The header and the directory of FileEntry records fill the first pages;
+ * the data of every set starts on its own page so dense sets can be used
+ * straight from a mapping of the file.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;               /* Directory entries */
+    uint64_t directory_checksum;  /* Checksum of the directory entries */
+    uint64_t reserved;
+} FileHeader;
+
+/**
+ * @brief The directory entry of one set in a set file.
+ */
+typedef struct {
+    char name[SET_NAME_MAX];
+    uint32_t name_length;
+    uint32_t compressed;   /* 1 for serialize_cset data, 0 for dense words */
+    uint64_t offset;       /* Page aligned */
+    uint64_t nwords;       /* Length of the data in words */
+    uint64_t checksum;     /* Checksum of the data */
+} FileEntry;
+
+/**
+ * @brief Write sets to a file, replacing it atomically.
+ * @param registry Pointer to the registry.
+ * @param ids Entry ids of the sets to save.
+ * @param count Number of sets.
+ * @param path The file name.
+ * @return Error number or 0 on success.
+ */
+int save_sets(const Registry *registry, const int *ids, int count, const char *path);
+
+/**
+ * @brief Write every set in the registry to a file.
+ * @param registry Pointer to the registry.
+ * @param path The file name.
+ * @return Error number or 0 on success.
+ */
+int save_all_sets(const Registry *registry, const char *path);
+
+/**
+ * @brief Choose whether loading verifies the checksum of every set's data.
+ *
+ * Off by default: loading then checks the header and the directory, whose
+ * checksum covers every set's name, place and length, and decodes the
+ * compressed sets, but never reads a dense set's words, so it costs the
+ * same however large the sets are. Damage inside a dense set's words then
+ * goes unnoticed. On, loading reads all the data first and rejects a file
+ * with any damaged set.
+ * @param verify 1 to verify the data, 0 to check only the directory.
+ */
+void set_load_verification(int verify);
+
+/**
+ * @brief Load one set from a file.
+ *
+ * The file is mapped rather than read, and a dense set uses the mapped
+ * words directly. Takes the entry with the set's own name, or the only
+ * entry of a single-set file, and checks it as set_load_verification says.
+ * @param registry Pointer to the registry.
+ * @param id Entry id of the set to replace.
+ * @param path The file name.
+ * @return Error number or 0 on success.
+ */
+int load_set(Registry *registry, int id, const char *path);
+
+/**
+ * @brief Load every set in a file, creating sets that do not exist.
+ *
+ * The directory is checked, compressed sets decoded and, with
+ * set_load_verification, every entry's data checksum verified before any
+ * set is replaced, so a file failing those checks leaves the registry as
+ * it was. Dense sets then use the mapped words directly, like load_set.
+ * @param registry Pointer to the registry.
+ * @param path The file name.
+ * @return Error number or 0 on success.
+ */
+int load_all_sets(Registry *registry, const char *path);
+
+#endif /* PERSIST_H */
@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "protocol.h"
+#include "set.h"
+
+static _Thread_local ReplyBuffer *current_reply = NULL;
+
+
+size_t put_varint(unsigned char *out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+int get_varint(const unsigned char **pos, const unsigned char *end, uint64_t *value) {
+    const unsigned char *p = *pos;
+    uint64_t result = 0;
+    int shift;
+
+    for (shift = 0; p < end && shift < 7 * VARINT_MAX_SIZE; shift += 7) {
+        result |= (uint64_t)(*p & 0x7f) << shift;
+        if ((*p++ & 0x80) == 0) {
+            *pos = p;
+            *value = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+size_t frame_length(const unsigned char *header) {
+    return (size_t)header[0] | (size_t)header[1] << 8 | (size_t)header[2] << 16 | (size_t)header[3] << 24;
+}
+
+size_t complete_frames(const unsigned char *data, size_t length, int *malformed) {
+    size_t used = 0, n;
+
+    *malformed = 0;
+    while (length - used >= FRAME_HEADER_SIZE) {
+        n = frame_length(data + used);
+        if (n > FRAME_MAX_SIZE) {
+            *malformed = 1;
+            break;
+        }
+        if (length - used - FRAME_HEADER_SIZE < n) {
+            break;
+        }
+        used += FRAME_HEADER_SIZE + n;
+    }
+    return used;
+}
+
+void open_reply_buffer(ReplyBuffer *r) {
+    r->data = NULL;
+    r->length = 0;
+    r->start = 0;
+    r->status = 0;
+    r->stream = open_memstream(&r->data, &r->length);
+    if (r->stream == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+}
+
+void begin_reply(ReplyBuffer *r) {
+    static const char header[REPLY_HEADER_SIZE] = {0};
+
+    fflush(r->stream);
+    r->start = r->length;
+    r->status = 0;
+    fwrite(header, 1, REPLY_HEADER_SIZE, r->stream);
+    set_output_stream(r->stream);
+    set_output_binary(1);
+    current_reply = r;
+}
+
+void end_reply(ReplyBuffer *r) {
+    unsigned char *header;
+    size_t n;
+
+    fflush(r->stream);
+    header = (unsigned char*)r->data + r->start;
+    n = r->length - r->start - FRAME_HEADER_SIZE;
+    header[0] = (unsigned char)n;
+    header[1] = (unsigned char)(n >> 8);
+    header[2] = (unsigned char)(n >> 16);
+    header[3] = (unsigned char)(n >> 24);
+    header[4] = (unsigned char)r->status;
+    set_output_binary(0);
+    set_output_stream(NULL);
+    current_reply = NULL;
+}
+
+void fail_reply(int error_code) {
+    if (current_reply != NULL && current_reply->status == 0) {
+        current_reply->status = error_code;
+    }
+}
+
+void clear_reply_buffer(ReplyBuffer *r) {
+    fseeko(r->stream, 0, SEEK_SET);
+    fflush(r->stream);
+}
+
+void close_reply_buffer(ReplyBuffer *r) {
+    fclose(r->stream);
+    free(r->data);
+    r->data = NULL;
+    r->length = 0;
+}
@@ -0,0 +1,103 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTOCOL_MAGIC 0        /* First byte of a binary stream; no command line starts with it */
+#define PROTOCOL_VERSION 1      /* Second byte */
+#define PROTOCOL_PREAMBLE_SIZE 2
+#define FRAME_HEADER_SIZE 4     /* Little-endian length of the rest of the frame */
+#define FRAME_MAX_SIZE (1u << 29)  /* Room for a bitmap of every member */
+#define FRAME_TEXT 0            /* Opcode of a frame holding a command line */
+#define FRAME_MEMBERS 0         /* read_set encoding: each member as a varint gap from the one before */
+#define FRAME_BITMAP 1          /* read_set encoding: a varint first word, then raw little-endian words */
+#define REPLY_HEADER_SIZE 5     /* Little-endian length of the rest, then the error code or 0 */
+#define VARINT_MAX_SIZE 10
+
+/**
+ * @brief Reply frames built in memory.
+ *
+ * Output of a command between begin_reply and end_reply goes to stream
+ * in binary form (see set_output_binary), after a header that end_reply
+ * fills in.
+ */
+typedef struct {
+    FILE *stream;   /* A memory stream over data */
+    char *data;     /* Valid after the stream is flushed */
+    size_t length;
+    size_t start;   /* Offset of the reply being written */
+    int status;     /* Error code of the reply being written, or 0 */
+} ReplyBuffer;
+
+/**
+ * @brief Encode an unsigned varint: 7 bits a byte, low bits first, the high bit set on all but the last.
+ * @param out Room for VARINT_MAX_SIZE bytes.
+ * @param value The value.
+ * @return Bytes written.
+ */
+size_t put_varint(unsigned char *out, uint64_t value);
+
+/**
+ * @brief Decode an unsigned varint.
+ * @param pos Pointer to the next byte, advanced past the varint.
+ * @param end One past the last byte available.
+ * @param value Receives the value.
+ * @return 0 on success, -1 if the varint runs past end or is too long.
+ */
+int get_varint(const unsigned char **pos, const unsigned char *end, uint64_t *value);
+
+/**
+ * @brief Read the length in a frame header.
+ * @param header FRAME_HEADER_SIZE bytes.
+ * @return Bytes of the frame after the header.
+ */
+size_t frame_length(const unsigned char *header);
+
+/**
+ * @brief Measure the complete frames at the start of a buffer.
+ * @param data The buffer.
+ * @param length Bytes in the buffer.
+ * @param malformed Set to 1 if the frame after them is longer than FRAME_MAX_SIZE, 0 otherwise.
+ * @return Bytes of the complete frames.
+ */
+size_t complete_frames(const unsigned char *data, size_t length, int *malformed);
+
+/**
+ * @brief Start an empty reply buffer.
+ * @param r The buffer.
+ */
+void open_reply_buffer(ReplyBuffer *r);
+
+/**
+ * @brief Start a reply: the calling thread's output goes to it, in binary, until end_reply.
+ * @param r The buffer.
+ */
+void begin_reply(ReplyBuffer *r);
+
+/**
+ * @brief Finish the reply begun last, filling in its header.
+ * @param r The buffer.
+ */
+void end_reply(ReplyBuffer *r);
+
+/**
+ * @brief Give the reply being written an error code; the first one stays.
+ * @param error_code The error, as numbered by print_error.
+ */
+void fail_reply(int error_code);
+
+/**
+ * @brief Forget the replies in a buffer once they have been sent on.
+ * @param r The buffer.
+ */
+void clear_reply_buffer(ReplyBuffer *r);
+
+/**
+ * @brief Release a reply buffer.
+ * @param r The buffer.
+ */
+void close_reply_buffer(ReplyBuffer *r);
+
+#endif /* PROTOCOL_H */
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "rank.h"
+#include "kernels.h"
+
+
+/* Position of the (k+1)-th lowest bit of word, which has more than k bits set */
+static int select_bit(uint64_t word, long k) {
+    while (k-- > 0) {
+        word &= word - 1;  /* Drop the lowest bit */
+    }
+    return __builtin_ctzll(word);
+}
+
+
+void build_rank_directory(RankDirectory* d, const ChunkedSet* s) {
+    size_t nblocks = (s->nwords + RANK_BLOCK_WORDS - 1) / RANK_BLOCK_WORDS;
+    const SetChunk *chunk;
+    uint32_t *counts;
+    size_t b, w, n;
+
+    if (d->counts == NULL || d->nblocks != nblocks) {
+        counts = realloc(d->counts, (nblocks + 1) * sizeof(uint32_t));
+        if (counts == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        d->counts = counts;
+        d->nblocks = nblocks;
+    }
+    d->counts[0] = 0;
+    for (b = 0; b < nblocks; b++) {
+        w = b * RANK_BLOCK_WORDS;  /* Superblocks never straddle chunks */
+        n = s->nwords - w;
+        chunk = s->chunks[w / SET_CHUNK_WORDS];
+        d->counts[b + 1] = d->counts[b] + (chunk == NULL ? 0 :
+            (uint32_t)set_kernels->count_words(chunk->words + w % SET_CHUNK_WORDS, n < RANK_BLOCK_WORDS ? n : RANK_BLOCK_WORDS));
+    }
+    d->nwords = s->nwords;
+    d->built = 1;
+}
+
+
+int rank_directory_ready(const RankDirectory* d, const ChunkedSet* s) {
+    return d->built && d->nwords == s->nwords;
+}
+
+
+/* Members of the chunk of s holding word w, 0 if it has none */
+static long chunk_count(const ChunkedSet* s, size_t w) {
+    const SetChunk *chunk = s->chunks[w / SET_CHUNK_WORDS];
+    return chunk != NULL ? (long)set_kernels->count_words(chunk->words, chunk->size) : 0;
+}
+
+
+long rank_chunked(const ChunkedSet* s, const RankDirectory* d, long x) {
+    size_t w = (size_t)x / SET_WORD_BITS;
+    size_t start, i;
+    const SetChunk *chunk;
+    long count = 0;
+
+    if (w >= s->nwords) {
+        return d != NULL ? (long)d->counts[d->nblocks] : count_chunked(s);
+    }
+    if (d != NULL) {
+        start = w / RANK_BLOCK_WORDS * RANK_BLOCK_WORDS;
+        count = d->counts[w / RANK_BLOCK_WORDS];
+    } else {
+        start = w / SET_CHUNK_WORDS * SET_CHUNK_WORDS;
+        for (i = 0; i < start; i += SET_CHUNK_WORDS) {
+            count += chunk_count(s, i);
+        }
+    }
+    if ((chunk = s->chunks[w / SET_CHUNK_WORDS]) == NULL) {
+        return count;
+    }
+    count += (long)set_kernels->count_words(chunk->words + start % SET_CHUNK_WORDS, w - start);
+    return count + __builtin_popcountll(chunk->words[w % SET_CHUNK_WORDS] & (((uint64_t)1 << (x % SET_WORD_BITS)) - 1));
+}
+
+
+long select_chunked(const ChunkedSet* s, const RankDirectory* d, long k) {
+    size_t low = 0, high, mid, w = 0;
+    const SetChunk *chunk;
+    uint64_t word;
+    long bits;
+
+    if (d != NULL) {
+        if (k >= (long)d->counts[d->nblocks]) {
+            return -1;
+        }
+        /* The last superblock with fewer than k + 1 members before it */
+        high = d->nblocks;
+        while (high - low > 1) {
+            mid = low + (high - low) / 2;
+            if ((long)d->counts[mid] <= k) {
+                low = mid;
+            } else {
+                high = mid;
+            }
+        }
+        k -= d->counts[low];
+        w = low * RANK_BLOCK_WORDS;
+    } else {
+        for (; w < s->nwords && k >= (bits = chunk_count(s, w)); w += SET_CHUNK_WORDS) {
+            k -= bits;  /* Whole chunks before the member */
+        }
+    }
+    for (; w < s->nwords; w++) {
+        chunk = s->chunks[w / SET_CHUNK_WORDS];
+        word = chunk != NULL ? chunk->words[w % SET_CHUNK_WORDS] : 0;
+        bits = __builtin_popcountll(word);
+        if (k < bits) {
+            return (long)(w * SET_WORD_BITS) + select_bit(word, k);
+        }
+        k -= bits;
+    }
+    return -1;
+}
+
+
+void free_rank_directory(RankDirectory* d) {
+    free(d->counts);
+    d->counts = NULL;
+    d->nblocks = 0;
+    d->nwords = 0;
+    d->built = 0;
+}
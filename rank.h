@@ -0,0 +1,64 @@
+#ifndef RANK_H
+#define RANK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "chunked.h"
+
+#define RANK_BLOCK_WORDS 8  /* Words per superblock: a cache line, and 32 bits of counts per 512 of bitmap */
+
+/**
+ * @brief Popcount prefix sums over the superblocks of a chunked set.
+ *
+ * counts[i] is the number of members in the words before superblock i,
+ * so rank reads one count and at most RANK_BLOCK_WORDS words, and select
+ * binary searches the counts. The directory takes 1/16 of the bitmap's
+ * memory. A zero-initialized RankDirectory is valid and not built.
+ */
+typedef struct {
+    uint32_t *counts;  /* nblocks + 1 entries; members never exceed 2^31 */
+    size_t nblocks;
+    size_t nwords;     /* Words of the set it was built for */
+    int built;         /* 0 once the set has changed */
+} RankDirectory;
+
+/**
+ * @brief Build a rank directory for a set, reusing its storage.
+ * @param d Pointer to the directory.
+ * @param s The set.
+ */
+void build_rank_directory(RankDirectory* d, const ChunkedSet* s);
+
+/**
+ * @brief Check whether a rank directory describes a set.
+ * @param d Pointer to the directory.
+ * @param s The set.
+ * @return 1 if it was built for the set and the set has not changed since, 0 otherwise.
+ */
+int rank_directory_ready(const RankDirectory* d, const ChunkedSet* s);
+
+/**
+ * @brief Count the members of a set below a number.
+ * @param s Pointer to the set.
+ * @param d A directory ready for s (see rank_directory_ready), or NULL to count the chunks below x.
+ * @param x The number.
+ * @return The number of members less than x.
+ */
+long rank_chunked(const ChunkedSet* s, const RankDirectory* d, long x);
+
+/**
+ * @brief Find the member with a given number of members below it.
+ * @param s Pointer to the set.
+ * @param d A directory ready for s, or NULL to skip whole chunks by their counts.
+ * @param k Position of the member, 0 for the smallest.
+ * @return The member, or -1 if the set has k members or fewer.
+ */
+long select_chunked(const ChunkedSet* s, const RankDirectory* d, long k);
+
+/**
+ * @brief Release the storage of a rank directory and leave it not built.
+ * @param d Pointer to the directory.
+ */
+void free_rank_directory(RankDirectory* d);
+
+#endif /* RANK_H */
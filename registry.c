@@ -0,0 +1,211 @@
+#include <string.h>
+#include "registry.h"
+#include "snapshot.h"
+#include "similarity.h"
+#include "view.h"
+
+#define INITIAL_TABLE_SIZE 64
+
+
+static void* registry_alloc(size_t size) {
+    void *ptr = calloc(1, size);
+    if (ptr == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+/* FNV-1a */
+static uint64_t hash_name(const char *name, int length) {
+    uint64_t hash = 14695981039346656037ULL;
+    int i;
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+RegistryEntry* registry_entry(const Registry *registry, int id) {
+    return &registry->slabs[id / REGISTRY_SLAB_SIZE][id % REGISTRY_SLAB_SIZE];
+}
+
+StoredSet* registry_set(const Registry *registry, int id) {
+    return &registry_entry(registry, id)->set;
+}
+
+/* Insert an id into a table known to have room and not to contain it.
+ * Returns 1 if an empty slot was used, 0 if a tombstone was reused. */
+static int insert_id(int *table, size_t table_size, uint64_t hash, int id) {
+    size_t mask = table_size - 1;
+    size_t slot = hash & mask;
+    int was_empty;
+    while (table[slot] > 0) {
+        slot = (slot + 1) & mask;
+    }
+    was_empty = table[slot] == 0;
+    table[slot] = id + 1;
+    return was_empty;
+}
+
+/* Rebuild the table, dropping tombstones and doubling when mostly full */
+static void rehash(Registry *registry) {
+    size_t table_size = registry->table_size;
+    int *table;
+    size_t i;
+    int id;
+
+    while (registry->count * 2 >= table_size) {
+        table_size *= 2;
+    }
+    table = registry_alloc(table_size * sizeof(int));
+    for (i = 0; i < registry->table_size; i++) {
+        if (registry->table[i] > 0) {
+            id = registry->table[i] - 1;
+            insert_id(table, table_size, registry_entry(registry, id)->hash, id);
+        }
+    }
+    free(registry->table);
+    registry->table = table;
+    registry->table_size = table_size;
+    registry->occupied = registry->count;
+}
+
+void init_registry(Registry *registry) {
+    registry->slabs = NULL;
+    registry->nslabs = 0;
+    registry->next_id = 0;
+    registry->free_head = -1;
+    registry->table_size = INITIAL_TABLE_SIZE;
+    registry->table = registry_alloc(registry->table_size * sizeof(int));
+    registry->count = 0;
+    registry->occupied = 0;
+    registry->snapshots = create_snapshot_list();
+    registry->similarity = NULL;
+    registry->views = NULL;
+}
+
+void free_registry(Registry *registry) {
+    int id, i;
+    for (id = 0; id < registry->next_id; id++) {
+        if (registry_entry(registry, id)->in_use) {
+            free_stored_set(registry_set(registry, id));
+            free_rank_directory(&registry_entry(registry, id)->rank);
+            pthread_rwlock_destroy(&registry_entry(registry, id)->lock);
+        }
+    }
+    free_snapshot_list(registry->snapshots);
+    free_similarity_index(registry->similarity);
+    free_view_list(registry->views);
+    for (i = 0; i < registry->nslabs; i++) {
+        free(registry->slabs[i]);
+    }
+    free(registry->slabs);
+    free(registry->table);
+    registry->slabs = NULL;
+    registry->nslabs = 0;
+    registry->next_id = 0;
+    registry->free_head = -1;
+    registry->table = NULL;
+    registry->table_size = 0;
+    registry->count = 0;
+    registry->occupied = 0;
+    registry->snapshots = NULL;
+    registry->similarity = NULL;
+    registry->views = NULL;
+}
+
+int is_valid_set_name(const char *name, int length) {
+    int i;
+    if (length <= 0 || length >= SET_NAME_MAX || (name[0] >= '0' && name[0] <= '9')) {
+        return 0;
+    }
+    for (i = 0; i < length; i++) {
+        char c = name[i];
+        if (!((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int find_registry_set(const Registry *registry, const char *name, int length) {
+    uint64_t hash = hash_name(name, length);
+    size_t mask = registry->table_size - 1;
+    size_t slot = hash & mask;
+    RegistryEntry *entry;
+
+    while (registry->table[slot] != 0) {
+        if (registry->table[slot] > 0) {
+            entry = registry_entry(registry, registry->table[slot] - 1);
+            if (entry->hash == hash && entry->length == length && memcmp(entry->name, name, length) == 0) {
+                return registry->table[slot] - 1;
+            }
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+int create_registry_set(Registry *registry, const char *name, int length) {
+    RegistryEntry *entry;
+    int id;
+
+    if (find_registry_set(registry, name, length) >= 0) {
+        return -1;
+    }
+    if ((registry->occupied + 1) * 4 >= registry->table_size * 3) {
+        rehash(registry);
+    }
+
+    if (registry->free_head >= 0) {
+        id = registry->free_head;  /* Reuse a dropped entry */
+        registry->free_head = registry_entry(registry, id)->next_free;
+    } else {
+        id = registry->next_id++;
+        if (id / REGISTRY_SLAB_SIZE == registry->nslabs) {  /* Add a slab */
+            RegistryEntry **slabs = realloc(registry->slabs, (registry->nslabs + 1) * sizeof(RegistryEntry*));
+            if (slabs == NULL) {
+                fprintf(stderr, "Memory reallocation failed\n");
+                exit(1);
+            }
+            registry->slabs = slabs;
+            registry->slabs[registry->nslabs++] = registry_alloc(REGISTRY_SLAB_SIZE * sizeof(RegistryEntry));
+        }
+    }
+
+    entry = registry_entry(registry, id);
+    memset(entry, 0, sizeof(RegistryEntry));
+    memcpy(entry->name, name, length);
+    entry->length = length;
+    entry->hash = hash_name(name, length);
+    entry->in_use = 1;
+    entry->next_free = -1;
+    pthread_rwlock_init(&entry->lock, NULL);
+
+    registry->occupied += insert_id(registry->table, registry->table_size, entry->hash, id);
+    registry->count++;
+    return id;
+}
+
+void drop_registry_set(Registry *registry, int id) {
+    RegistryEntry *entry = registry_entry(registry, id);
+    size_t mask = registry->table_size - 1;
+    size_t slot = entry->hash & mask;
+
+    while (registry->table[slot] != id + 1) {
+        slot = (slot + 1) & mask;
+    }
+    registry->table[slot] = -1;  /* Tombstone keeps later probes intact */
+    registry->count--;
+
+    forget_set_views(registry, id);
+    unindex_set(registry, id);
+    free_stored_set(&entry->set);
+    free_rank_directory(&entry->rank);
+    pthread_rwlock_destroy(&entry->lock);
+    entry->in_use = 0;
+    entry->next_free = registry->free_head;
+    registry->free_head = id;
+}
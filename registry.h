@@ -0,0 +1,106 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "storage.h"
+
+#define SET_NAME_MAX 64
+#define REGISTRY_SLAB_SIZE 1024
+
+/**
+ * @brief A named set. Entries live in slabs and never move once created.
+ */
+typedef struct {
+    char name[SET_NAME_MAX];
+    int length;
+    uint64_t hash;
+    int in_use;
+    int next_free;   /* Next recycled entry id, or -1 */
+    pthread_rwlock_t lock;  /* Held by server commands reading or writing the set */
+    StoredSet set;
+    RankDirectory rank;  /* Built by the first rank or select after the set changes */
+} RegistryEntry;
+
+/**
+ * @brief Named sets indexed by an open addressing hash table.
+ */
+typedef struct {
+    RegistryEntry **slabs;
+    int nslabs;
+    int next_id;      /* Entries handed out so far, including dropped ones */
+    int free_head;    /* First recycled entry id, or -1 */
+    int *table;       /* Entry id + 1, 0 if empty, -1 for a dropped entry */
+    size_t table_size;
+    size_t count;     /* Live sets */
+    size_t occupied;  /* Table slots that are not empty */
+    struct SnapshotList *snapshots;
+    struct SimilarityIndex *similarity;  /* NULL unless enabled */
+    struct ViewList *views;  /* NULL until a view is defined */
+} Registry;
+
+/**
+ * @brief Initialize an empty registry.
+ * @param registry Pointer to the registry.
+ */
+void init_registry(Registry *registry);
+
+/**
+ * @brief Free every set in the registry and the registry itself.
+ * @param registry Pointer to the registry.
+ */
+void free_registry(Registry *registry);
+
+/**
+ * @brief Check whether a name can be used for a set.
+ *
+ * Names start with a letter or underscore, continue with letters, digits
+ * or underscores, and are shorter than SET_NAME_MAX.
+ * @param name The name, not necessarily null-terminated.
+ * @param length Length of the name.
+ * @return 1 if valid, 0 otherwise.
+ */
+int is_valid_set_name(const char *name, int length);
+
+/**
+ * @brief Look up a set by name.
+ * @param registry Pointer to the registry.
+ * @param name The name, not necessarily null-terminated.
+ * @param length Length of the name.
+ * @return The entry id, or -1 if there is no such set.
+ */
+int find_registry_set(const Registry *registry, const char *name, int length);
+
+/**
+ * @brief Create an empty dense set.
+ * @param registry Pointer to the registry.
+ * @param name The name, not necessarily null-terminated.
+ * @param length Length of the name.
+ * @return The new entry id, or -1 if the name is taken.
+ */
+int create_registry_set(Registry *registry, const char *name, int length);
+
+/**
+ * @brief Drop a set and free its storage.
+ * @param registry Pointer to the registry.
+ * @param id The entry id of the set.
+ */
+void drop_registry_set(Registry *registry, int id);
+
+/**
+ * @brief Get a registry entry by id.
+ * @param registry Pointer to the registry.
+ * @param id The entry id.
+ * @return Pointer to the entry.
+ */
+RegistryEntry* registry_entry(const Registry *registry, int id);
+
+/**
+ * @brief Get the set of a registry entry by id.
+ * @param registry Pointer to the registry.
+ * @param id The entry id.
+ * @return Pointer to the set.
+ */
+StoredSet* registry_set(const Registry *registry, int id);
+
+#endif /* REGISTRY_H */
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "schedule.h"
+#include "arena.h"
+#include "stats.h"
+
+
+static void* schedule_alloc(size_t size) {
+    void *ptr = calloc(1, size);
+    if (ptr == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+/* Commands that need the whole registry, read every set or touch files */
+static int runs_alone(const Registry *registry, const ParsedCommand *cmd) {
+    switch (cmd->opcode) {
+        case CMD_STOP:
+        case CMD_STATS:      /* Counts every command before it */
+        case CMD_SAVE_SET:
+        case CMD_LOAD_SET:   /* A file may be saved and loaded again */
+            return 1;
+        default:
+            return is_structural(registry, cmd);
+    }
+}
+
+/* 1 if one of the commands writes a set the other uses; both lists are sorted by id */
+static int conflicts(const ScheduledCommand *a, const ScheduledCommand *b) {
+    int i = 0, j = 0;
+
+    while (i < a->nsets && j < b->nsets) {
+        if (a->sets[i].id < b->sets[j].id) {
+            i++;
+        } else if (a->sets[i].id > b->sets[j].id) {
+            j++;
+        } else if (a->sets[i].write || b->sets[j].write) {
+            return 1;
+        } else {
+            i++;
+            j++;
+        }
+    }
+    return 0;
+}
+
+/* Take a ready command, the newest of our own or else the oldest of another
+ * thread; -1 if none. Called with the lock held. */
+static int take_ready(Scheduler *s, int self) {
+    ReadyDeque *d = &s->ready[self];
+    int k;
+
+    if (d->tail > d->head) {
+        s->nready--;
+        return d->items[--d->tail];
+    }
+    for (k = 1; k < s->threads; k++) {
+        d = &s->ready[(self + k) % s->threads];
+        if (d->tail > d->head) {
+            s->nready--;
+            return d->items[d->head++];
+        }
+    }
+    return -1;
+}
+
+/* Run command i with the lock released, then make ready the commands that
+ * waited only for it. Called with the lock held. */
+static void run_scheduled(Scheduler *s, int self, int i) {
+    ScheduledCommand *c = &s->window[i];
+    ReadyDeque *own = &s->ready[self];
+    FILE *out;
+    uint64_t start;
+    int j;
+
+    pthread_mutex_unlock(&s->lock);
+    out = open_memstream(&c->output, &c->output_length);
+    if (out == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    set_output_stream(out);
+    start = stats_now();
+    execute_command(s->registry, &c->cmd, c->line);
+    reset_arena(command_arena());
+    c->ns[STAGE_EXECUTE] = stats_now() - start;
+    set_output_stream(NULL);
+    fclose(out);
+    record_command(&command_stats, c->cmd.opcode, c->ns, c->length);
+    pthread_mutex_lock(&s->lock);
+
+    for (j = i + 1; j < s->count; j++) {
+        if ((s->window[j].waits_for[i / 64] >> (i % 64) & 1) && --s->window[j].pending == 0) {
+            own->items[own->tail++] = j;
+            s->nready++;
+        }
+    }
+    s->finished++;
+    pthread_cond_broadcast(&s->changed);
+}
+
+static void* worker(void *arg) {
+    Scheduler *s = ((void**)arg)[0];
+    int self = (int)(long)((void**)arg)[1];
+    int i;
+
+    free(arg);
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (s->nready == 0 && !s->shutdown) {
+            pthread_cond_wait(&s->changed, &s->lock);
+        }
+        if (s->shutdown) {
+            break;
+        }
+        if ((i = take_ready(s, self)) >= 0) {
+            run_scheduled(s, self, i);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    free_arena(command_arena());
+    release_stats_shard(&command_stats);
+    return NULL;
+}
+
+static void start_workers(Scheduler *s) {
+    void **arg;
+
+    for (; s->started < s->threads - 1; s->started++) {
+        arg = schedule_alloc(2 * sizeof(void*));
+        arg[0] = s;
+        arg[1] = (void*)(long)(s->started + 1);
+        if (pthread_create(&s->workers[s->started], NULL, worker, arg) != 0) {
+            free(arg);
+            break;  /* The calling thread and those started run everything */
+        }
+    }
+}
+
+
+void init_scheduler(Scheduler *s, Registry *registry, int threads) {
+    s->registry = registry;
+    s->window = schedule_alloc(SCHEDULE_WINDOW * sizeof(ScheduledCommand));
+    s->count = 0;
+    s->threads = threads;
+    s->started = 0;
+    s->ready = schedule_alloc(threads * sizeof(ReadyDeque));
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->changed, NULL);
+    s->nready = 0;
+    s->runnable = 0;
+    s->finished = 0;
+    s->shutdown = 0;
+}
+
+int schedule_command(Scheduler *s, const char *command_string, long line, uint64_t *clock) {
+    ScheduledCommand *c = &s->window[s->count];
+    uint64_t start = stats_now();
+    int i, stop;
+
+    /* Only commands that run alone change names, so parsing ahead of the window is safe */
+    c->error = parse_command(command_string, s->registry, &c->cmd);
+    memset(c->ns, 0, sizeof(c->ns));
+    c->ns[STAGE_READ] = start - *clock;
+    *clock = stats_now();
+    c->ns[STAGE_PARSE] = *clock - start;
+    c->line = line;
+    c->length = strlen(command_string);
+    c->nsets = 0;
+    c->pending = 0;
+    memset(c->waits_for, 0, sizeof(c->waits_for));
+
+    if (c->error != 0) {
+        record_command(&command_stats, 0, c->ns, c->length);
+    } else if (runs_alone(s->registry, &c->cmd)) {
+        run_window(s);
+        start = stats_now();
+        stop = execute_command(s->registry, &c->cmd, line);
+        reset_arena(command_arena());
+        *clock = stats_now();
+        c->ns[STAGE_EXECUTE] = *clock - start;
+        record_command(&command_stats, c->cmd.opcode, c->ns, c->length);
+        return stop;
+    } else {
+        c->nsets = command_sets(&c->cmd, c->sets);
+        for (i = 0; i < s->count; i++) {
+            if (conflicts(&s->window[i], c)) {
+                c->waits_for[i / 64] |= 1ULL << (i % 64);
+                c->pending++;
+            }
+        }
+    }
+    if (++s->count == SCHEDULE_WINDOW) {
+        run_window(s);
+    }
+    return 0;
+}
+
+void run_window(Scheduler *s) {
+    ScheduledCommand *c;
+    int i, spread = 0;
+
+    pthread_mutex_lock(&s->lock);
+    s->nready = 0;
+    s->runnable = 0;
+    s->finished = 0;
+    for (i = 0; i < s->threads; i++) {
+        s->ready[i].head = 0;
+        s->ready[i].tail = 0;
+    }
+    /* Deal the commands that wait for nothing out to the threads */
+    for (i = 0; i < s->count; i++) {
+        c = &s->window[i];
+        if (c->error == 0) {
+            s->runnable++;
+            if (c->pending == 0) {
+                s->ready[spread].items[s->ready[spread].tail++] = i;
+                spread = (spread + 1) % s->threads;
+                s->nready++;
+            }
+        }
+    }
+    if (s->nready > 1) {
+        start_workers(s);
+        pthread_cond_broadcast(&s->changed);
+    }
+    while (s->finished < s->runnable) {
+        if ((i = take_ready(s, 0)) >= 0) {
+            run_scheduled(s, 0, i);
+        } else {
+            pthread_cond_wait(&s->changed, &s->lock);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    for (i = 0; i < s->count; i++) {
+        c = &s->window[i];
+        if (c->error != 0) {
+            print_error(c->error, c->line);
+        } else {
+            fwrite(c->output, 1, c->output_length, stdout);
+            free(c->output);
+            c->output = NULL;
+        }
+    }
+    s->count = 0;
+}
+
+void free_scheduler(Scheduler *s) {
+    int i;
+
+    pthread_mutex_lock(&s->lock);
+    s->shutdown = 1;
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+    for (i = 0; i < s->started; i++) {
+        pthread_join(s->workers[i], NULL);
+    }
+    for (i = 0; i < SCHEDULE_WINDOW; i++) {
+        free_parsed_command(&s->window[i].cmd);
+    }
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->changed);
+    free(s->window);
+    free(s->ready);
+}
@@ -0,0 +1,106 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "commands.h"
+#include "parallel.h"
+#include "stats.h"
+
+#define SCHEDULE_WINDOW 256  /* Commands parsed ahead before the window runs */
+#define SCHEDULE_WORDS (SCHEDULE_WINDOW / 64)
+
+/**
+ * @brief A command of the window, the commands it waits for and its output.
+ */
+typedef struct {
+    ParsedCommand cmd;
+    int error;                /* Parse error, printed in the command's place */
+    long line;
+    size_t length;            /* Of the line, for the statistics */
+    uint64_t ns[STAGE_COUNT];
+    SetAccess sets[EXPR_MAX_NODES + 1];
+    int nsets;
+    uint64_t waits_for[SCHEDULE_WORDS];  /* Earlier commands of the window touching the same sets */
+    int pending;              /* Of those, the ones not finished yet */
+    char *output;
+    size_t output_length;
+} ScheduledCommand;
+
+/**
+ * @brief Commands ready to run, owned by one thread.
+ *
+ * The owner pushes and takes at the tail, so the commands a command made
+ * ready run next on the thread that has their sets in cache; idle threads
+ * steal the oldest command at the head.
+ */
+typedef struct {
+    int items[SCHEDULE_WINDOW];
+    int head;
+    int tail;
+} ReadyDeque;
+
+/**
+ * @brief Runs a batch of commands in parallel where they touch different sets.
+ *
+ * Commands are parsed into a window. Each waits for the earlier commands
+ * of the window that write a set it uses or use a set it writes, so every
+ * set sees its reads and writes in script order, and the output of each
+ * command is collected and printed in script order: the results are those
+ * of running the script one command at a time.
+ */
+typedef struct {
+    Registry *registry;
+    ScheduledCommand *window;
+    int count;
+    int threads;              /* Including the thread calling run_window */
+    int started;              /* Worker threads running */
+    pthread_t workers[PARALLEL_MAX_THREADS];
+    ReadyDeque *ready;        /* One per thread; index 0 is the calling thread's */
+    pthread_mutex_t lock;     /* Guards the deques and the counts below */
+    pthread_cond_t changed;   /* A command became ready, the window finished, or shutdown */
+    int nready;
+    int runnable;             /* Commands of the window without a parse error */
+    int finished;
+    int shutdown;
+} Scheduler;
+
+/**
+ * @brief Initialize a scheduler.
+ *
+ * Worker threads are started when a window first has independent commands.
+ * @param s The scheduler.
+ * @param registry The named sets the commands operate on.
+ * @param threads Number of threads, including the caller (1 .. PARALLEL_MAX_THREADS).
+ */
+void init_scheduler(Scheduler *s, Registry *registry, int threads);
+
+/**
+ * @brief Parse a command into the window, running the window when it is full.
+ *
+ * Commands that must run alone (see is_structural), stop, stats and the
+ * file commands end the window: the commands before them are run and
+ * printed, then they run at once.
+ * @param s The scheduler.
+ * @param command_string The raw command line.
+ * @param line Line of the script the command is on.
+ * @param clock As for run_command.
+ * @return 1 if the command was stop, 0 otherwise.
+ */
+int schedule_command(Scheduler *s, const char *command_string, long line, uint64_t *clock);
+
+/**
+ * @brief Run the commands of the window and print their output in order.
+ * @param s The scheduler.
+ */
+void run_window(Scheduler *s);
+
+/**
+ * @brief Stop the worker threads and release the scheduler.
+ *
+ * Commands still in the window are not run.
+ * @param s The scheduler.
+ */
+void free_scheduler(Scheduler *s);
+
+#endif /* SCHEDULE_H */
@@ -0,0 +1,600 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+#include "commands.h"
+#include "parser.h"
+#include "parallel.h"
+#include "stats.h"
+#include "arena.h"
+#include "protocol.h"
+
+/* A connection. Its buffers are shared by the epoll thread and the one
+ * worker running its commands, under lock. */
+typedef struct Client {
+    int fd;
+    pthread_mutex_t lock;
+    char *in;               /* Received bytes not yet taken by a worker */
+    size_t in_length;
+    size_t in_capacity;
+    char *out;              /* Replies not yet sent */
+    size_t out_length;
+    size_t out_capacity;
+    size_t out_sent;
+    long line_number;       /* Only touched by the worker holding the client */
+    int binary;             /* 1 if the client began with the binary preamble, 0 for text, -1 until known */
+    int bad_preamble;       /* It began with the preamble of another version */
+    int busy;               /* Queued for, or held by, a worker */
+    int eof;                /* The client closed its end, or the connection failed */
+    int stopped;            /* The client sent stop */
+    int closed;             /* Closed during this round of events, freed after it */
+    uint32_t events;        /* What epoll waits for */
+    struct Client *next;    /* Next in the job queue, the done list or the closed list */
+    struct Client *prev_open, *next_open;  /* Neighbours among the open clients */
+} Client;
+
+typedef struct {
+    Registry *registry;
+    pthread_rwlock_t registry_lock;
+    int epoll_fd;
+    int listen_fd;
+    int wake_fd;            /* eventfd: a worker finished a client */
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_ready;
+    Client *queue_head;     /* Clients with commands to run */
+    Client *queue_tail;
+    Client *done;           /* Clients a worker has finished with */
+    Client *open;           /* Every open client, owned by the epoll thread */
+    Client *closed;         /* Clients to free after the current round of events */
+    int shutdown;
+} Server;
+
+static Server server;
+static volatile sig_atomic_t stop_requested = 0;
+static int listen_marker, wake_marker;  /* epoll data for the non-client descriptors */
+
+
+static void* server_alloc(size_t size) {
+    void *ptr = calloc(1, size);
+    if (ptr == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static void append(char **buffer, size_t *length, size_t *capacity, const char *data, size_t n) {
+    char *grown;
+    if (*length + n + 1 > *capacity) {
+        *capacity = (*length + n + 1) * 2;
+        grown = realloc(*buffer, *capacity);
+        if (grown == NULL) {
+            fprintf(stderr, "Memory reallocation failed\n");
+            exit(1);
+        }
+        *buffer = grown;
+    }
+    memcpy(*buffer + *length, data, n);
+    *length += n;
+}
+
+static void on_signal(int signal) {
+    (void)signal;
+    stop_requested = 1;
+}
+
+
+/* ---- Command execution ---- */
+
+/* Parse a command line, or a frame from a binary client */
+static int parse_request(const char *request, size_t length, int binary, ParsedCommand *cmd) {
+    if (binary) {
+        return parse_frame((const unsigned char*)request, length, server.registry, cmd);
+    }
+    return parse_command(request, server.registry, cmd);
+}
+
+/* Run one command line or frame under the locks it needs; returns 1 for stop */
+static int serve_command(const char *request, size_t length, int binary, ParsedCommand *cmd, long line_number) {
+    SetAccess locks[EXPR_MAX_NODES + 1];
+    RegistryEntry *entry;
+    uint64_t ns[STAGE_COUNT] = {0};
+    uint64_t start = stats_now(), parsed;
+    int error, nlocks = 0, stop, i;
+
+    pthread_rwlock_rdlock(&server.registry_lock);
+    error = parse_request(request, length, binary, cmd);
+    if (error == 0 && is_structural(server.registry, cmd)) {
+        /* Names may change while the lock is upgraded, so parse again */
+        pthread_rwlock_unlock(&server.registry_lock);
+        pthread_rwlock_wrlock(&server.registry_lock);
+        error = parse_request(request, length, binary, cmd);
+    }
+    parsed = stats_now();
+    ns[STAGE_PARSE] = parsed - start;
+    if (error != 0) {
+        pthread_rwlock_unlock(&server.registry_lock);
+        print_error(error, line_number);
+        record_command(&command_stats, 0, ns, length);
+        reset_arena(command_arena());
+        return 0;
+    }
+
+    if (!is_structural(server.registry, cmd)) {
+        nlocks = command_sets(cmd, locks);
+    }
+    for (i = 0; i < nlocks; i++) {
+        entry = registry_entry(server.registry, locks[i].id);
+        if (locks[i].write) {
+            pthread_rwlock_wrlock(&entry->lock);
+        } else {
+            pthread_rwlock_rdlock(&entry->lock);
+        }
+    }
+    stop = execute_command(server.registry, cmd, line_number);
+    for (i = nlocks - 1; i >= 0; i--) {
+        pthread_rwlock_unlock(&registry_entry(server.registry, locks[i].id)->lock);
+    }
+    pthread_rwlock_unlock(&server.registry_lock);
+
+    reset_arena(command_arena());
+
+    ns[STAGE_EXECUTE] = stats_now() - parsed;
+    record_command(&command_stats, cmd->opcode, ns, length);
+    return stop;
+}
+
+/* Bytes of the complete frames a binary client has sent; malformed is set
+ * if the frame after them is, or the client ended inside it. Called under its lock. */
+static size_t complete_client_frames(const Client *c, int *malformed) {
+    size_t length;
+
+    if (c->bad_preamble) {
+        *malformed = 1;
+        return 0;
+    }
+    length = complete_frames((const unsigned char*)c->in, c->in_length, malformed);
+    *malformed |= c->eof && length < c->in_length;
+    return length;
+}
+
+/* Run the frames of a batch, one reply frame each */
+static int serve_frames(Client *c, char *batch, size_t length, int malformed, ParsedCommand *cmd, ReplyBuffer *reply) {
+    char *frame;
+    size_t n;
+    int stopped = 0;
+
+    for (frame = batch; frame < batch + length && !stopped; frame += FRAME_HEADER_SIZE + n) {
+        n = frame_length((const unsigned char*)frame);
+        begin_reply(reply);
+        stopped = serve_command(frame + FRAME_HEADER_SIZE, n, 1, cmd, ++c->line_number);
+        end_reply(reply);
+    }
+    if (malformed && !stopped) {  /* Nothing after it can be framed */
+        begin_reply(reply);
+        fail_reply(24);
+        end_reply(reply);
+        stopped = 1;
+    }
+    return stopped;
+}
+
+/* Run every complete line or frame a client has sent, collecting the replies */
+static void process_client(Client *c, ParsedCommand *cmd, ReplyBuffer *reply) {
+    char *batch, *line, *newline;
+    size_t length = 0;
+    int stopped = 0, malformed = 0;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->binary > 0) {
+        length = complete_client_frames(c, &malformed);
+    } else {
+        while (length < c->in_length) {
+            newline = memchr(c->in + length, '\n', c->in_length - length);
+            if (newline == NULL) {
+                break;
+            }
+            length = newline + 1 - c->in;
+        }
+    }
+    batch = server_alloc(length + 1);
+    memcpy(batch, c->in, length);
+    memmove(c->in, c->in + length, c->in_length - length);
+    c->in_length -= length;
+    pthread_mutex_unlock(&c->lock);
+
+    if (c->binary > 0) {
+        stopped = serve_frames(c, batch, length, malformed, cmd, reply);
+    } else {
+        set_output_stream(reply->stream);
+        for (line = batch; line < batch + length && !stopped; line = newline + 1) {
+            newline = memchr(line, '\n', batch + length - line);
+            *newline = '\0';
+            if (newline > line && newline[-1] == '\r') {
+                newline[-1] = '\0';
+            }
+            stopped = serve_command(line, strlen(line), 0, cmd, ++c->line_number);
+            fputs(SERVER_REPLY_END, reply->stream);
+        }
+        set_output_stream(NULL);
+        fflush(reply->stream);
+    }
+    free(batch);
+
+    pthread_mutex_lock(&c->lock);
+    append(&c->out, &c->out_length, &c->out_capacity, reply->data, reply->length);
+    c->stopped |= stopped;
+    pthread_mutex_unlock(&c->lock);
+    clear_reply_buffer(reply);
+}
+
+static void* worker(void *arg) {
+    ParsedCommand cmd = {0};
+    ReplyBuffer reply;
+    uint64_t one = 1;
+    Client *c;
+    (void)arg;
+
+    open_reply_buffer(&reply);
+    for (;;) {
+        pthread_mutex_lock(&server.queue_lock);
+        while (server.queue_head == NULL && !server.shutdown) {
+            pthread_cond_wait(&server.queue_ready, &server.queue_lock);
+        }
+        if (server.queue_head == NULL) {
+            pthread_mutex_unlock(&server.queue_lock);
+            break;
+        }
+        c = server.queue_head;
+        server.queue_head = c->next;
+        if (server.queue_head == NULL) {
+            server.queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&server.queue_lock);
+
+        process_client(c, &cmd, &reply);
+
+        /* Hand the client back; the epoll thread sends the replies */
+        pthread_mutex_lock(&server.queue_lock);
+        c->next = server.done;
+        server.done = c;
+        pthread_mutex_unlock(&server.queue_lock);
+        if (write(server.wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("eventfd");
+        }
+    }
+    free_parsed_command(&cmd);
+    close_reply_buffer(&reply);
+    free_arena(command_arena());
+    release_stats_shard(&command_stats);
+    return NULL;
+}
+
+
+/* ---- Connections, all on the epoll thread ---- */
+
+/* Tell a binary client by the first byte it sends, and take its preamble; called under its lock */
+static void detect_protocol(Client *c) {
+    size_t n = c->in_length < PROTOCOL_PREAMBLE_SIZE ? c->in_length : PROTOCOL_PREAMBLE_SIZE;
+
+    c->binary = c->in[0] == PROTOCOL_MAGIC;
+    if (c->binary) {
+        c->bad_preamble = n < PROTOCOL_PREAMBLE_SIZE || c->in[1] != PROTOCOL_VERSION;
+        memmove(c->in, c->in + n, c->in_length - n);
+        c->in_length -= n;
+    }
+}
+
+/* Queue a client that has a complete command and no worker; called under its lock */
+static void schedule_client(Client *c) {
+    int malformed;
+
+    if (c->busy || c->stopped) {
+        return;
+    }
+    if (c->binary < 0 && c->in_length > 0 &&
+        (c->in[0] != PROTOCOL_MAGIC || c->in_length >= PROTOCOL_PREAMBLE_SIZE || c->eof)) {
+        detect_protocol(c);
+    }
+    if (c->binary > 0) {
+        if (complete_client_frames(c, &malformed) == 0 && !malformed) {
+            return;
+        }
+    } else {
+        if (c->eof && c->in_length > 0 && c->in[c->in_length - 1] != '\n') {
+            append(&c->in, &c->in_length, &c->in_capacity, "\n", 1);  /* Last command without a newline */
+        }
+        if (c->in_length == 0 || memchr(c->in, '\n', c->in_length) == NULL) {
+            return;
+        }
+    }
+    c->busy = 1;
+    c->next = NULL;
+    pthread_mutex_lock(&server.queue_lock);
+    if (server.queue_tail != NULL) {
+        server.queue_tail->next = c;
+    } else {
+        server.queue_head = c;
+    }
+    server.queue_tail = c;
+    pthread_cond_signal(&server.queue_ready);
+    pthread_mutex_unlock(&server.queue_lock);
+}
+
+/* Wait for input until end of file, and for room to write while replies are pending */
+static void watch_client(Client *c) {
+    struct epoll_event event;
+    event.events = (c->eof ? 0 : EPOLLIN) | (c->out_length > 0 ? EPOLLOUT : 0);
+    if (event.events == c->events) {
+        return;
+    }
+    event.data.ptr = c;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+    c->events = event.events;
+}
+
+/* Send as much of the pending replies as the socket takes */
+static void flush_client(Client *c) {
+    ssize_t sent;
+
+    pthread_mutex_lock(&c->lock);
+    while (c->out_sent < c->out_length) {
+        sent = send(c->fd, c->out + c->out_sent, c->out_length - c->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                c->eof = 1;  /* The client is gone; drop what it did not read */
+                c->out_sent = c->out_length;
+            }
+            break;
+        }
+        c->out_sent += sent;
+    }
+    if (c->out_sent == c->out_length) {
+        c->out_sent = 0;
+        c->out_length = 0;
+    }
+    watch_client(c);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Close a client once nothing is left to do for it */
+static void close_if_done(Client *c) {
+    pthread_mutex_lock(&c->lock);
+    if (c->closed || c->busy || c->out_length > 0 || !(c->eof || c->stopped)) {
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+    c->closed = 1;
+    pthread_mutex_unlock(&c->lock);
+    if (c->prev_open != NULL) {
+        c->prev_open->next_open = c->next_open;
+    } else {
+        server.open = c->next_open;
+    }
+    if (c->next_open != NULL) {
+        c->next_open->prev_open = c->prev_open;
+    }
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->next = server.closed;  /* Later events of this round may still name it */
+    server.closed = c;
+}
+
+static void free_closed_clients(void) {
+    Client *c;
+    while ((c = server.closed) != NULL) {
+        server.closed = c->next;
+        pthread_mutex_destroy(&c->lock);
+        free(c->in);
+        free(c->out);
+        free(c);
+    }
+}
+
+static void read_client(Client *c) {
+    char buffer[SERVER_READ_SIZE];
+    ssize_t count;
+
+    for (;;) {
+        count = recv(c->fd, buffer, sizeof(buffer), 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                pthread_mutex_lock(&c->lock);
+                c->eof = 1;
+                watch_client(c);
+                pthread_mutex_unlock(&c->lock);
+            }
+            break;
+        }
+        pthread_mutex_lock(&c->lock);
+        append(&c->in, &c->in_length, &c->in_capacity, buffer, count);
+        pthread_mutex_unlock(&c->lock);
+    }
+    pthread_mutex_lock(&c->lock);
+    schedule_client(c);
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void accept_clients(void) {
+    struct epoll_event event;
+    Client *c;
+    int fd;
+
+    while ((fd = accept4(server.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        c = server_alloc(sizeof(Client));
+        c->fd = fd;
+        c->binary = -1;
+        c->events = EPOLLIN;
+        pthread_mutex_init(&c->lock, NULL);
+        c->next_open = server.open;
+        if (server.open != NULL) {
+            server.open->prev_open = c;
+        }
+        server.open = c;
+        event.events = EPOLLIN;
+        event.data.ptr = c;
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+/* Take back the clients workers have finished: send replies, run what arrived meanwhile */
+static void collect_done(void) {
+    uint64_t count;
+    Client *c, *next;
+
+    if (read(server.wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("eventfd");
+    }
+    pthread_mutex_lock(&server.queue_lock);
+    c = server.done;
+    server.done = NULL;
+    pthread_mutex_unlock(&server.queue_lock);
+    for (; c != NULL; c = next) {
+        next = c->next;
+        pthread_mutex_lock(&c->lock);
+        c->busy = 0;
+        schedule_client(c);
+        pthread_mutex_unlock(&c->lock);
+        flush_client(c);
+        close_if_done(c);
+    }
+}
+
+static int open_socket(const char *path) {
+    struct sockaddr_un address;
+    int fd;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SERVER_BACKLOG) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+int run_server(Registry *registry, const char *path, int workers) {
+    struct epoll_event events[SERVER_MAX_EVENTS], event;
+    struct sigaction action;
+    pthread_t *threads;
+    Client *c;
+    int i, n;
+
+    memset(&server, 0, sizeof(server));
+    server.registry = registry;
+    server.listen_fd = open_socket(path);
+    if (server.listen_fd < 0) {
+        return -1;
+    }
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server.epoll_fd < 0 || server.wake_fd < 0) {
+        perror("epoll");
+        close(server.listen_fd);
+        unlink(path);
+        return -1;
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = &listen_marker;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event);
+    event.data.ptr = &wake_marker;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.wake_fd, &event);
+
+    /* No SA_RESTART, so a signal ends epoll_wait */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    pthread_rwlock_init(&server.registry_lock, NULL);
+    pthread_mutex_init(&server.queue_lock, NULL);
+    pthread_cond_init(&server.queue_ready, NULL);
+    get_thread_count();  /* Settle the kernel thread count before workers read it */
+    threads = server_alloc(workers * sizeof(pthread_t));
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+            fprintf(stderr, "Thread creation failed\n");
+            exit(1);
+        }
+    }
+
+    while (!stop_requested) {
+        n = epoll_wait(server.epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == &listen_marker) {
+                accept_clients();
+            } else if (events[i].data.ptr == &wake_marker) {
+                collect_done();
+            } else {
+                c = events[i].data.ptr;
+                if (c->closed) {
+                    continue;
+                }
+                if ((events[i].events & (EPOLLHUP | EPOLLERR)) && c->eof) {
+                    /* Hung up for good: stop reporting it until the worker is done */
+                    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+                } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    read_client(c);
+                }
+                if (events[i].events & EPOLLOUT) {
+                    flush_client(c);
+                }
+                close_if_done(c);
+            }
+        }
+        free_closed_clients();
+    }
+
+    /* Let the workers finish what they hold, then stop them */
+    pthread_mutex_lock(&server.queue_lock);
+    server.shutdown = 1;
+    pthread_cond_broadcast(&server.queue_ready);
+    pthread_mutex_unlock(&server.queue_lock);
+    for (i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    while (server.open != NULL) {  /* Replies not yet sent are dropped */
+        c = server.open;
+        c->busy = 0;
+        c->eof = 1;
+        c->out_length = 0;
+        close_if_done(c);
+    }
+    free_closed_clients();
+    close(server.listen_fd);
+    close(server.wake_fd);
+    close(server.epoll_fd);
+    unlink(path);
+    pthread_rwlock_destroy(&server.registry_lock);
+    return 0;
+}
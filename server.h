@@ -0,0 +1,35 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "registry.h"
+
+#define SERVER_BACKLOG 128
+#define SERVER_READ_SIZE 65536
+#define SERVER_MAX_EVENTS 64
+#define SERVER_REPLY_END ".\n"   /* Ends the reply to every command */
+
+/**
+ * @brief Serve the command grammar to local clients until SIGINT or SIGTERM.
+ *
+ * One epoll thread accepts connections on a Unix domain socket and moves
+ * bytes; worker threads run the commands. A client may send any number of
+ * newline-terminated commands without waiting: they run in order, and the
+ * output of each (possibly empty) is followed by a line holding a single
+ * dot. stop closes the connection after the replies before it. A client
+ * whose first byte is PROTOCOL_MAGIC speaks the binary protocol instead:
+ * after the preamble it sends frames and gets one reply frame for each,
+ * with no dot; a malformed frame gets error 24 and closes the connection.
+ *
+ * Commands on different clients run in parallel. Set names are resolved
+ * under a shared registry lock, held exclusively only by create_set,
+ * drop_set, save_all, load_all, snapshot and drop_snapshot. Each set has a
+ * reader/writer lock, so commands that only read a set, like print_set,
+ * never wait for each other; snapshot versions are read without locks.
+ * @param registry The named sets to serve.
+ * @param path Path of the socket; an existing file there is replaced.
+ * @param workers Number of worker threads.
+ * @return 0 after a clean shutdown, -1 if the socket cannot be set up.
+ */
+int run_server(Registry *registry, const char *path, int workers);
+
+#endif /* SERVER_H */
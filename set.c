@@ -1,77 +1,401 @@
+#include <string.h>
+#include <sys/mman.h>
 #include "set.h"
+#include "kernels.h"
+#include "fixed.h"
+#include "parallel.h"
+#include "protocol.h"
+
+
+/* Command output of this thread; NULL means stdout */
+static _Thread_local FILE *thread_output = NULL;
+static _Thread_local int thread_binary = 0;
+
+
+/* Number of words needed to hold members 0 .. universe - 1 */
+static size_t words_for(long universe) {
+    return (size_t)(universe + SET_WORD_BITS - 1) / SET_WORD_BITS;
+}
+
+/* Storage to write an n-word result into: the target's own words when they
+ * are large enough (word-wise operations are safe in place), otherwise a
+ * fresh buffer so inputs sharing the target's words stay readable */
+static uint64_t* result_words(Set* target, size_t n) {
+    uint64_t *words;
+    if (target->nwords >= n) {
+        return target->words;
+    }
+    words = malloc(n * sizeof(uint64_t));
+    if (words == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return words;
+}
+
+/* Install an n-word result produced into words by result_words */
+static void commit_result(Set* target, uint64_t* words, size_t n) {
+    if (words != target->words) {
+        free(target->words);
+        target->words = words;
+        target->nwords = n;
+    } else if (target->nwords > n) {
+        memset(words + n, 0, (target->nwords - n) * sizeof(uint64_t));  /* Clear stale high words */
+    }
+}
 
 
 void init_set(Set* s) {
-    int i;
-    for (i = 0; i < 16; i++) {
-        s->members[i] = 0;  /* Set each member to 0 */
+    s->words = NULL;
+    s->nwords = 0;
+}
+
+
+void create_set(Set* s, long universe) {
+    init_set(s);
+    grow_set(s, universe);
+}
+
+
+void grow_set(Set* s, long universe) {
+    size_t n = words_for(universe);
+    uint64_t *words;
+    if (n <= s->nwords) {
+        return;
+    }
+    words = realloc(s->words, n * sizeof(uint64_t));
+    if (words == NULL) {
+        fprintf(stderr, "Memory reallocation failed\n");
+        exit(1);
+    }
+    memset(words + s->nwords, 0, (n - s->nwords) * sizeof(uint64_t));  /* New members start absent */
+    s->words = words;
+    s->nwords = n;
+}
+
+
+void clear_set(Set* s) {
+    if (s->nwords > 0) {
+        memset(s->words, 0, s->nwords * sizeof(uint64_t));
+    }
+}
+
+
+/* Set (fill = 1) or clear the bits first .. last, a word at a time */
+static void fill_range(uint64_t* words, long first, long last, int fill) {
+    size_t w1 = (size_t)first / SET_WORD_BITS, w2 = (size_t)last / SET_WORD_BITS;
+    uint64_t head = ~(uint64_t)0 << (first % SET_WORD_BITS);               /* Bits from first up */
+    uint64_t tail = ~(uint64_t)0 >> (SET_WORD_BITS - 1 - last % SET_WORD_BITS);  /* Bits up to last */
+
+    if (w1 == w2) {
+        head &= tail;
+    }
+    words[w1] = fill ? words[w1] | head : words[w1] & ~head;
+    if (w2 > w1) {
+        memset(words + w1 + 1, fill ? 0xFF : 0, (w2 - w1 - 1) * sizeof(uint64_t));
+        words[w2] = fill ? words[w2] | tail : words[w2] & ~tail;
+    }
+}
+
+
+void add_range(Set* s, long first, long last) {
+    grow_set(s, last + 1);
+    fill_range(s->words, first, last, 1);
+}
+
+
+void remove_range(Set* s, long first, long last) {
+    long universe = (long)(s->nwords * SET_WORD_BITS);
+    if (first < universe) {
+        fill_range(s->words, first, last < universe ? last : universe - 1, 0);
+    }
+}
+
+
+void free_set(Set* s) {
+    free(s->words);
+    init_set(s);
+}
+
+
+void release_mapping(SetMapping* mapping) {
+    /* Chunks of one load_all are released by the threads writing their sets */
+    if (__atomic_sub_fetch(&mapping->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap(mapping->base, mapping->length);
+        free(mapping);
     }
 }
 
 
 void read_set(int* ptr, Set* s, int n) {
-    int* p = ptr;
-    int index;
+    int max = -1;
     int x;
     int i;
-    init_set(s);  /* Initialize the set before adding elements */
     for (i = 0; i < n; i++) {
-        x = *p;  /* Get the current element */
-        index = x % 8;  /* Calculate the bit position */
-        s->members[x / 8] |= (1 << index);  /* Set the corresponding bit */
-        p++;  /* Move to the next element */
+        if (ptr[i] > max) {
+            max = ptr[i];  /* Size the set once for the largest member */
+        }
+    }
+    grow_set(s, (long)max + 1);
+    clear_set(s);  /* Start from an empty set before adding elements */
+    for (i = 0; i < n; i++) {
+        x = ptr[i];
+        s->words[x / SET_WORD_BITS] |= (uint64_t)1 << (x % SET_WORD_BITS);  /* Set the corresponding bit */
+    }
+}
+
+
+
+void init_print_buffer(PrintBuffer* out) {
+    out->length = 0;
+    out->last = -1;
+}
+
+
+void print_member(PrintBuffer* out, long member) {
+    char digits[24];
+    int n = 0;
+
+    if (out->length > PRINT_BUFFER_SIZE - (int)sizeof(digits)) {
+        flush_print_buffer(out);
+    }
+    if (thread_binary) {
+        out->length += put_varint((unsigned char*)out->data + out->length, (uint64_t)(member - out->last - 1));
+        out->last = member;
+        return;
     }
+    do {
+        digits[n++] = (char)('0' + member % 10);  /* Least significant first */
+        member /= 10;
+    } while (member > 0);
+    while (n > 0) {
+        out->data[out->length++] = digits[--n];
+    }
+    out->data[out->length++] = ' ';
 }
 
 
+void end_print_buffer(PrintBuffer* out) {
+    if (!thread_binary) {
+        out->data[out->length++] = '\n';
+    }
+    flush_print_buffer(out);
+}
+
+
+void flush_print_buffer(PrintBuffer* out) {
+    fwrite(out->data, 1, out->length, output_stream());
+    out->length = 0;
+}
+
+
+FILE* output_stream(void) {
+    return thread_output != NULL ? thread_output : stdout;
+}
+
+
+void set_output_stream(FILE* out) {
+    thread_output = out;
+}
+
+
+void set_output_binary(int binary) {
+    thread_binary = binary;
+}
+
+
+int output_binary(void) {
+    return thread_binary;
+}
+
 
 void print_set(Set s) {
-    int i, j;
-    for (i = 0; i < 16; i++) {
-        for (j = 0; j < 8; j++) {
-            if (s.members[i] & (1 << j)) {  /* Check if the bit is set */
-                printf("%d ", i * 8 + j);  /* Print the element */
-            }
+    PrintBuffer out;
+    long x;
+
+    init_print_buffer(&out);
+    for (x = next_member(&s, 0); x >= 0; x = next_member(&s, x + 1)) {
+        print_member(&out, x);
+    }
+    end_print_buffer(&out);
+}
+
+
+long count_set(const Set* s) {
+    return (long)set_kernels->count_words(s->words, s->nwords);
+}
+
+
+int contains_set(const Set* s, long x) {
+    size_t w = (size_t)x / SET_WORD_BITS;
+    return x >= 0 && w < s->nwords && ((s->words[w] >> (x % SET_WORD_BITS)) & 1);
+}
+
+
+long next_member(const Set* s, long from) {
+    size_t w = (size_t)from / SET_WORD_BITS;
+    uint64_t word;
+
+    if (from < 0) {
+        from = 0;
+        w = 0;
+    }
+    if (w >= s->nwords) {
+        return -1;
+    }
+    word = s->words[w] & (~(uint64_t)0 << (from % SET_WORD_BITS));  /* Drop members below from */
+    while (word == 0) {
+        if (++w >= s->nwords) {
+            return -1;
         }
+        word = s->words[w];
     }
-    printf("\n");
+    return (long)(w * SET_WORD_BITS + __builtin_ctzll(word));
 }
 
 
 
-void union_set(Set s1, Set s2, Set* target) {
-    int i;
-    init_set(target);  /* Initialize the target set */
-    for (i = 0; i < 16; i++) {
-        target->members[i] = s1.members[i] | s2.members[i];  /* Perform bitwise OR */
+void union_sets(const Set* s1, const Set* s2, Set* target) {
+    size_t common = s1->nwords < s2->nwords ? s1->nwords : s2->nwords;
+    const Set *longer = s1->nwords > s2->nwords ? s1 : s2;
+    size_t n = longer->nwords;
+    uint64_t *words = result_words(target, n);
+    if (!fixed_operate(OP_UNION, words, s1->words, s2->words, common)) {
+        parallel_words(set_kernels->or_words, words, s1->words, s2->words, common);  /* Perform bitwise OR */
     }
+    if (words != longer->words && n > common) {
+        memcpy(words + common, longer->words + common, (n - common) * sizeof(uint64_t));  /* Members only the longer set can hold */
+    }
+    commit_result(target, words, n);
 }
 
 
 
-void intersect_set(Set s1, Set s2, Set* target) {
-    int i;
-    init_set(target);  /* Initialize the target set */
-    for (i = 0; i < 16; i++) {
-        target->members[i] = s1.members[i] & s2.members[i];  /* Perform bitwise AND */
+void intersect_sets(const Set* s1, const Set* s2, Set* target) {
+    size_t n = s1->nwords < s2->nwords ? s1->nwords : s2->nwords;
+    uint64_t *words = result_words(target, n);
+    if (!fixed_operate(OP_INTERSECT, words, s1->words, s2->words, n)) {
+        parallel_words(set_kernels->and_words, words, s1->words, s2->words, n);  /* Perform bitwise AND */
     }
+    commit_result(target, words, n);
 }
 
 
 
-void sub_set(Set s1, Set s2, Set* target) {
-    Set intersected;
-    int i;
-    intersect_set(s1, s2, &intersected);  /* Find the intersection */
-    for (i = 0; i < 16; i++) {
-        target->members[i] = s1.members[i] ^ intersected.members[i];  /* Perform bitwise XOR */
+void sub_sets(const Set* s1, const Set* s2, Set* target) {
+    size_t common = s1->nwords < s2->nwords ? s1->nwords : s2->nwords;
+    size_t n = s1->nwords;
+    uint64_t *words = result_words(target, n);
+    if (!fixed_operate(OP_SUB, words, s1->words, s2->words, common)) {
+        parallel_words(set_kernels->andnot_words, words, s1->words, s2->words, common);  /* Keep bits of s1 missing from s2 */
+    }
+    if (words != s1->words && n > common) {
+        memcpy(words + common, s1->words + common, (n - common) * sizeof(uint64_t));  /* Beyond s2 nothing is removed */
+    }
+    commit_result(target, words, n);
+}
+
+
+void symdiff_sets(const Set* s1, const Set* s2, Set* target) {
+    size_t common = s1->nwords < s2->nwords ? s1->nwords : s2->nwords;
+    const Set *longer = s1->nwords > s2->nwords ? s1 : s2;
+    size_t n = longer->nwords;
+    uint64_t *words = result_words(target, n);
+    if (!fixed_operate(OP_SYMDIFF, words, s1->words, s2->words, common)) {
+        parallel_words(set_kernels->xor_words, words, s1->words, s2->words, common);  /* Perform bitwise XOR */
     }
+    if (words != longer->words && n > common) {
+        memcpy(words + common, longer->words + common, (n - common) * sizeof(uint64_t));  /* Members only the longer set can hold */
+    }
+    commit_result(target, words, n);
+}
+
+
+
+void operate_sets(SetOperation op, const Set* s1, const Set* s2, Set* target) {
+    switch (op) {
+        case OP_UNION:
+            union_sets(s1, s2, target);
+            break;
+        case OP_INTERSECT:
+            intersect_sets(s1, s2, target);
+            break;
+        case OP_SUB:
+            sub_sets(s1, s2, target);
+            break;
+        case OP_SYMDIFF:
+            symdiff_sets(s1, s2, target);
+            break;
+    }
+}
+
+
+
+int test_sets(SetTest test, const Set* s1, const Set* s2) {
+    size_t common = s1->nwords < s2->nwords ? s1->nwords : s2->nwords;
+    const Set *longer = s1->nwords > s2->nwords ? s1 : s2;
+    const uint64_t *rest;
+    int found;
+
+    switch (test) {
+        case TEST_SUBSET:
+            rest = s1->words + common;  /* Members of s1 beyond s2 must not exist */
+            if (!fixed_test(test, s1->words, s2->words, common, &found)) {
+                found = set_kernels->any_andnot_words(s1->words, s2->words, common);
+            }
+            return !found && !set_kernels->any_and_words(rest, rest, s1->nwords - common);
+        case TEST_EQUAL:
+            rest = longer->words + common;
+            if (!fixed_test(test, s1->words, s2->words, common, &found)) {
+                found = set_kernels->any_xor_words(s1->words, s2->words, common);
+            }
+            return !found && !set_kernels->any_and_words(rest, rest, longer->nwords - common);
+        case TEST_DISJOINT:
+            if (!fixed_test(test, s1->words, s2->words, common, &found)) {
+                found = set_kernels->any_and_words(s1->words, s2->words, common);
+            }
+            return !found;
+    }
+    return 0;
+}
+
+
+void count_overlap(const Set* s1, const Set* s2, long* shared, long* either) {
+    size_t common = s1->nwords < s2->nwords ? s1->nwords : s2->nwords;
+    const Set *longer = s1->nwords > s2->nwords ? s1 : s2;
+    uint64_t counts[2];
+
+    if (shared != NULL && either != NULL) {
+        set_kernels->overlap_words(s1->words, s2->words, common, counts);
+        *shared = (long)counts[0];
+        *either = (long)counts[1];
+    } else if (shared != NULL) {
+        *shared = (long)set_kernels->count_and_words(s1->words, s2->words, common);
+    } else if (either != NULL) {
+        *either = (long)set_kernels->count_or_words(s1->words, s2->words, common);
+    }
+    if (either != NULL) {
+        *either += (long)set_kernels->count_words(longer->words + common, longer->nwords - common);  /* Members only the longer set can hold */
+    }
+}
+
+
+
+void union_set(Set s1, Set s2, Set* target) {
+    union_sets(&s1, &s2, target);
+}
+
+
+void intersect_set(Set s1, Set s2, Set* target) {
+    intersect_sets(&s1, &s2, target);
+}
+
+
+void sub_set(Set s1, Set s2, Set* target) {
+    sub_sets(&s1, &s2, target);
 }
 
 
 void symdiff_set(Set s1, Set s2, Set* target) {
-    Set intersected;
-    intersect_set(s1, s2, &intersected);  /* Find the intersection */
-    union_set(s1, s2, target);  /* Find the union */
-    sub_set(*target, intersected, target);  /* Subtract the intersection from the union */
+    symdiff_sets(&s1, &s2, target);
 }
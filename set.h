@@ -3,22 +3,118 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 
-#define SET_SIZE 16
+#define SET_WORD_BITS 64
+#define SET_MAX_MEMBER INT_MAX
+#define PRINT_BUFFER_SIZE 4096
 
 /**
- * @brief Structure representing a set of integers.
+ * @brief A private file mapping shared by the sets loaded from one file.
  */
 typedef struct {
-    char members[SET_SIZE];
+    void *base;
+    size_t length;
+    int refs;      /* Chunks whose words point into the mapping; updated atomically */
+} SetMapping;
+
+/**
+ * @brief Structure representing a set of non-negative integers.
+ *
+ * The set is a bitmap stored as 64-bit words: member x is bit x % 64 of
+ * word x / 64. The universe is nwords * 64 and grows on demand, so a
+ * zero-initialized Set is a valid empty set.
+ */
+typedef struct {
+    uint64_t *words;
+    size_t nwords;
 } Set;
 
 /**
- * @brief Initialize a set.
+ * @brief Members formatted for output, written out in blocks.
+ */
+typedef struct {
+    char data[PRINT_BUFFER_SIZE];
+    int length;
+    long last;  /* The member appended last, -1 before the first; binary output writes the gaps */
+} PrintBuffer;
+
+/**
+ * @brief The binary set operations, in command order.
+ */
+typedef enum {
+    OP_UNION,
+    OP_INTERSECT,
+    OP_SUB,
+    OP_SYMDIFF
+} SetOperation;
+
+/**
+ * @brief The yes/no comparisons of two sets.
+ */
+typedef enum {
+    TEST_SUBSET,    /* every member of the first set is in the second */
+    TEST_EQUAL,
+    TEST_DISJOINT   /* no member is in both */
+} SetTest;
+
+/**
+ * @brief Initialize a set as empty, without allocating storage.
  * @param s Pointer to the set to be initialized.
  */
 void init_set(Set* s);
 
+/**
+ * @brief Initialize an empty set able to hold members 0 .. universe - 1.
+ * @param s Pointer to the set to be initialized.
+ * @param universe Number of members the set can hold without growing.
+ */
+void create_set(Set* s, long universe);
+
+/**
+ * @brief Grow a set so it can hold members 0 .. universe - 1.
+ * @param s Pointer to the set to grow. Existing members are kept.
+ * @param universe Required universe size.
+ */
+void grow_set(Set* s, long universe);
+
+/**
+ * @brief Remove all members from a set, keeping its storage.
+ * @param s Pointer to the set to be cleared.
+ */
+void clear_set(Set* s);
+
+/**
+ * @brief Add the members first .. last to a set.
+ *
+ * Whole words are filled with memset; only the two end words are masked.
+ * @param s Pointer to the set; it grows to hold last.
+ * @param first The first member of the range.
+ * @param last The last member of the range, not less than first.
+ */
+void add_range(Set* s, long first, long last);
+
+/**
+ * @brief Remove the members first .. last from a set, a word at a time.
+ * @param s Pointer to the set.
+ * @param first The first member of the range.
+ * @param last The last member of the range, not less than first.
+ */
+void remove_range(Set* s, long first, long last);
+
+/**
+ * @brief Release the storage of a set and leave it empty.
+ * @param s Pointer to the set to be freed.
+ */
+void free_set(Set* s);
+
+/**
+ * @brief Drop a reference to a file mapping, unmapping it after the last one.
+ * @param mapping The mapping.
+ */
+void release_mapping(SetMapping* mapping);
+
 /**
  * @brief Read integers into a set.
  * @param ptr Pointer to the array of integers to be read.
@@ -33,6 +129,151 @@ void read_set(int* ptr, Set* s, int n);
  */
 void print_set(Set s);
 
+/**
+ * @brief Count the members of a set.
+ * @param s Pointer to the set.
+ * @return The number of members.
+ */
+long count_set(const Set* s);
+
+/**
+ * @brief Check whether a number is a member of a set.
+ * @param s Pointer to the set.
+ * @param x The number to look for.
+ * @return 1 if x is a member, 0 otherwise.
+ */
+int contains_set(const Set* s, long x);
+
+/**
+ * @brief Find the smallest member not below a number.
+ *
+ * Skips empty words and finds the bit with count-trailing-zeros, so
+ * iterating with next_member(s, x + 1) costs O(members + words skipped).
+ * @param s Pointer to the set.
+ * @param from The number to start from.
+ * @return The member, or -1 if there is none.
+ */
+long next_member(const Set* s, long from);
+
+/**
+ * @brief Start printing a list of members.
+ * @param out Pointer to the buffer.
+ */
+void init_print_buffer(PrintBuffer* out);
+
+/**
+ * @brief Append a member and its separating space to a print buffer.
+ *
+ * In binary output the member is written as a varint, its distance from
+ * the member before minus one, so members must come in increasing order.
+ * @param out Pointer to the buffer, flushed to output_stream() when full.
+ * @param member The member to append.
+ */
+void print_member(PrintBuffer* out, long member);
+
+/**
+ * @brief End a list of members with a newline (none in binary output) and write it out.
+ * @param out Pointer to the buffer.
+ */
+void end_print_buffer(PrintBuffer* out);
+
+/**
+ * @brief Write out a print buffer and empty it.
+ * @param out Pointer to the buffer.
+ */
+void flush_print_buffer(PrintBuffer* out);
+
+/**
+ * @brief Get the stream this thread writes command output to.
+ * @return The stream set by set_output_stream, stdout by default.
+ */
+FILE* output_stream(void);
+
+/**
+ * @brief Send this thread's command output to a stream.
+ * @param out The stream, or NULL for stdout.
+ */
+void set_output_stream(FILE* out);
+
+/**
+ * @brief Choose whether this thread writes results as text or in the binary protocol.
+ * @param binary 1 for binary replies (see protocol.h), 0 for text.
+ */
+void set_output_binary(int binary);
+
+/**
+ * @brief Check whether this thread writes results in the binary protocol.
+ * @return 1 if it does, 0 for text.
+ */
+int output_binary(void);
+
+/**
+ * @brief Perform union operation on two sets in a single pass.
+ *
+ * The pointer-based operations never copy their inputs and only allocate
+ * when the target has to grow; target may be the same set as s1 or s2.
+ * @param s1 First set.
+ * @param s2 Second set.
+ * @param target Pointer to the set to store the result.
+ */
+void union_sets(const Set* s1, const Set* s2, Set* target);
+
+/**
+ * @brief Perform intersection operation on two sets in a single pass.
+ * @param s1 First set.
+ * @param s2 Second set.
+ * @param target Pointer to the set to store the result, may alias s1 or s2.
+ */
+void intersect_sets(const Set* s1, const Set* s2, Set* target);
+
+/**
+ * @brief Perform set subtraction in a single pass.
+ * @param s1 First set (minuend).
+ * @param s2 Second set (subtrahend).
+ * @param target Pointer to the set to store the result, may alias s1 or s2.
+ */
+void sub_sets(const Set* s1, const Set* s2, Set* target);
+
+/**
+ * @brief Perform symmetric difference on two sets in a single pass.
+ * @param s1 First set.
+ * @param s2 Second set.
+ * @param target Pointer to the set to store the result, may alias s1 or s2.
+ */
+void symdiff_sets(const Set* s1, const Set* s2, Set* target);
+
+/**
+ * @brief Perform a binary set operation selected at runtime.
+ * @param op The operation to perform.
+ * @param s1 First set.
+ * @param s2 Second set.
+ * @param target Pointer to the set to store the result, may alias s1 or s2.
+ */
+void operate_sets(SetOperation op, const Set* s1, const Set* s2, Set* target);
+
+/**
+ * @brief Compare two sets in a single pass, without building any set.
+ *
+ * The scan stops at the first block of words that decides the answer.
+ * @param test The comparison to make.
+ * @param s1 First set.
+ * @param s2 Second set.
+ * @return 1 if the comparison holds, 0 otherwise.
+ */
+int test_sets(SetTest test, const Set* s1, const Set* s2);
+
+/**
+ * @brief Count the members two sets share and the members of either, in a single pass.
+ *
+ * Counting is fused with the word-wise AND and OR, so no set is built.
+ * A count that is not needed is not computed.
+ * @param s1 First set.
+ * @param s2 Second set.
+ * @param shared Receives the size of the intersection, or NULL.
+ * @param either Receives the size of the union, or NULL.
+ */
+void count_overlap(const Set* s1, const Set* s2, long* shared, long* either);
+
 /**
  * @brief Perform union operation on two sets.
  * @param s1 First set.
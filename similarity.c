@@ -0,0 +1,379 @@
+#include <string.h>
+#include "similarity.h"
+#include "arena.h"
+
+#define INITIAL_CAPACITY 1024
+#define DENSIFY_STEP 0x9E3779B9u  /* Sets a borrowed value apart from the bin it came from */
+
+
+static void* similarity_alloc(size_t size) {
+    void *ptr = calloc(1, size > 0 ? size : 1);
+    if (ptr == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static void* similarity_realloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (ptr == NULL) {
+        fprintf(stderr, "Memory reallocation failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+/* splitmix64 finalizer: every input bit affects every output bit */
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+
+/* ---- Signatures ---- */
+
+static void clear_signature(uint32_t *signature) {
+    memset(signature, 0xFF, MINHASH_BINS * sizeof(uint32_t));  /* Every bin MINHASH_EMPTY */
+}
+
+static void add_member(uint32_t *signature, long x) {
+    uint64_t hash = mix((uint64_t)x);
+    uint32_t value = (uint32_t)hash >> 1;  /* Never MINHASH_EMPTY */
+    uint32_t *bin = &signature[hash >> (64 - MINHASH_BIN_BITS)];
+    if (value < *bin) {
+        *bin = value;
+    }
+}
+
+static void sign_stored_set(const StoredSet *s, uint32_t *signature) {
+    const SetChunk *chunk;
+    const Container *c;
+    uint64_t word;
+    long base, x;
+    size_t k, w;
+    int i, j;
+
+    clear_signature(signature);
+    if (!s->compressed) {
+        for (k = 0; k < s->dense.nchunks; k++) {
+            if ((chunk = s->dense.chunks[k]) == NULL) {
+                continue;
+            }
+            for (w = 0; w < chunk->size; w++) {
+                for (word = chunk->words[w]; word != 0; word &= word - 1) {
+                    add_member(signature, (long)((k * SET_CHUNK_WORDS + w) * SET_WORD_BITS) + __builtin_ctzll(word));
+                }
+            }
+        }
+        return;
+    }
+    for (i = 0; i < s->packed.count; i++) {
+        c = &s->packed.containers[i];
+        base = (long)c->key << CSET_CHUNK_BITS;
+        if (c->type == CONTAINER_ARRAY) {
+            for (j = 0; j < c->size; j++) {
+                add_member(signature, base + c->data.array[j]);
+            }
+        } else if (c->type == CONTAINER_RUN) {
+            for (j = 0; j < c->size; j++) {
+                for (x = c->data.runs[j].start; x <= (long)c->data.runs[j].start + c->data.runs[j].length; x++) {
+                    add_member(signature, base + x);
+                }
+            }
+        } else {
+            for (j = 0; j < CSET_BITMAP_WORDS; j++) {
+                for (word = c->data.bitmap[j]; word != 0; word &= word - 1) {
+                    add_member(signature, base + j * 64 + __builtin_ctzll(word));
+                }
+            }
+        }
+    }
+}
+
+/* Fill the empty bins with the value of the next non-empty bin, wrapping
+ * around, stepped by the distance; 0 if every bin is empty */
+static int densify(const uint32_t *signature, uint32_t *dense) {
+    uint32_t value = 0;
+    int last = MINHASH_BINS - 1;
+    int i, step, distance = 0;
+
+    while (last >= 0 && signature[last] == MINHASH_EMPTY) {
+        last--;
+    }
+    if (last < 0) {
+        return 0;
+    }
+    for (step = 0; step < MINHASH_BINS; step++) {  /* Right to left from the last non-empty bin */
+        i = (last - step + MINHASH_BINS) % MINHASH_BINS;
+        if (signature[i] != MINHASH_EMPTY) {
+            value = signature[i];
+            distance = 0;
+            dense[i] = value;
+        } else {
+            dense[i] = value + (uint32_t)++distance * DENSIFY_STEP;
+        }
+    }
+    return 1;
+}
+
+static uint64_t band_key(const uint32_t *dense, int band) {
+    uint64_t key = (uint64_t)band;
+    int r;
+    for (r = 0; r < LSH_ROWS; r++) {
+        key = mix(key ^ dense[band * LSH_ROWS + r]) + r;
+    }
+    return key;
+}
+
+/* The fraction of equal bins estimates the Jaccard similarity */
+static double estimate(const uint32_t *a, const uint32_t *b) {
+    int i, equal = 0;
+    for (i = 0; i < MINHASH_BINS; i++) {
+        equal += a[i] == b[i];
+    }
+    return (double)equal / MINHASH_BINS;
+}
+
+
+/* ---- LSH tables; called under the index lock ---- */
+
+static int* bucket(SimilarityIndex *index, int band, uint64_t key) {
+    return &index->heads[(size_t)band * index->nbuckets + (key & (index->nbuckets - 1))];
+}
+
+static void file_set(SimilarityIndex *index, int id) {
+    uint32_t dense[MINHASH_BINS];
+    int *head;
+    int b;
+
+    if (!densify(index->signatures[id], dense)) {
+        return;  /* An empty set is similar to nothing */
+    }
+    for (b = 0; b < LSH_BANDS; b++) {
+        index->keys[id][b] = band_key(dense, b);
+        head = bucket(index, b, index->keys[id][b]);
+        index->next[id][b] = *head;
+        *head = id;
+    }
+    index->filed[id] = 1;
+}
+
+static void unfile_set(SimilarityIndex *index, int id) {
+    int *link;
+    int b;
+
+    if (!index->filed[id]) {
+        return;
+    }
+    for (b = 0; b < LSH_BANDS; b++) {
+        link = bucket(index, b, index->keys[id][b]);
+        while (*link != id) {
+            link = &index->next[*link][b];
+        }
+        *link = index->next[id][b];
+    }
+    index->filed[id] = 0;
+}
+
+/* Make room for ids up to id, with one bucket per id in every table */
+static void reserve_ids(SimilarityIndex *index, int id) {
+    int capacity = index->capacity;
+    int i;
+
+    if (id < capacity) {
+        return;
+    }
+    while (capacity <= id) {
+        capacity = capacity > 0 ? capacity * 2 : INITIAL_CAPACITY;
+    }
+    index->signatures = similarity_realloc(index->signatures, capacity * sizeof(*index->signatures));
+    index->keys = similarity_realloc(index->keys, capacity * sizeof(*index->keys));
+    index->next = similarity_realloc(index->next, capacity * sizeof(*index->next));
+    index->filed = similarity_realloc(index->filed, capacity * sizeof(int));
+    index->seen = similarity_realloc(index->seen, capacity * sizeof(int));
+    for (i = index->capacity; i < capacity; i++) {
+        clear_signature(index->signatures[i]);
+        index->filed[i] = 0;
+        index->seen[i] = 0;
+    }
+
+    /* Refile everything into the larger tables */
+    free(index->heads);
+    index->nbuckets = capacity;
+    index->heads = similarity_alloc((size_t)LSH_BANDS * capacity * sizeof(int));
+    memset(index->heads, 0xFF, (size_t)LSH_BANDS * capacity * sizeof(int));
+    index->capacity = capacity;
+    for (i = 0; i < capacity; i++) {
+        if (index->filed[i]) {
+            index->filed[i] = 0;
+            file_set(index, i);
+        }
+    }
+}
+
+static void store_signature(SimilarityIndex *index, int id, const uint32_t *signature) {
+    pthread_mutex_lock(&index->lock);
+    reserve_ids(index, id);
+    unfile_set(index, id);
+    memcpy(index->signatures[id], signature, MINHASH_BINS * sizeof(uint32_t));
+    file_set(index, id);
+    pthread_mutex_unlock(&index->lock);
+}
+
+
+/* ---- Public interface ---- */
+
+void enable_similarity_index(Registry *registry) {
+    SimilarityIndex *index = similarity_alloc(sizeof(SimilarityIndex));
+    int id;
+
+    pthread_mutex_init(&index->lock, NULL);
+    reserve_ids(index, 0);
+    registry->similarity = index;
+    for (id = 0; id < registry->next_id; id++) {
+        if (registry_entry(registry, id)->in_use) {
+            index_set(registry, id);
+        }
+    }
+}
+
+void free_similarity_index(SimilarityIndex *index) {
+    if (index == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&index->lock);
+    free(index->signatures);
+    free(index->keys);
+    free(index->next);
+    free(index->filed);
+    free(index->seen);
+    free(index->heads);
+    free(index);
+}
+
+void index_set(const Registry *registry, int id) {
+    uint32_t signature[MINHASH_BINS];
+
+    if (registry->similarity != NULL) {
+        sign_stored_set(registry_set(registry, id), signature);  /* Hash outside the lock */
+        store_signature(registry->similarity, id, signature);
+    }
+}
+
+void index_member_list(const Registry *registry, int id, const int *members, int n) {
+    uint32_t signature[MINHASH_BINS];
+    int i;
+
+    if (registry->similarity != NULL) {
+        clear_signature(signature);
+        for (i = 0; i < n; i++) {
+            add_member(signature, members[i]);
+        }
+        store_signature(registry->similarity, id, signature);
+    }
+}
+
+void index_union(const Registry *registry, int target, int a, int b) {
+    SimilarityIndex *index = registry->similarity;
+    uint32_t signature[MINHASH_BINS];
+    int i;
+
+    if (index == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&index->lock);
+    reserve_ids(index, a > b ? a : b);
+    for (i = 0; i < MINHASH_BINS; i++) {
+        signature[i] = index->signatures[a][i] < index->signatures[b][i] ? index->signatures[a][i] : index->signatures[b][i];
+    }
+    pthread_mutex_unlock(&index->lock);
+    store_signature(index, target, signature);
+}
+
+void unindex_set(const Registry *registry, int id) {
+    SimilarityIndex *index = registry->similarity;
+
+    if (index == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&index->lock);
+    if (id < index->capacity) {
+        unfile_set(index, id);
+        clear_signature(index->signatures[id]);  /* The id may come back as a new, empty set */
+    }
+    pthread_mutex_unlock(&index->lock);
+}
+
+/* Most similar first, ties by registry id */
+static int compare_similar(const void *a, const void *b) {
+    const SimilarSet *x = a, *y = b;
+    if (x->similarity != y->similarity) {
+        return x->similarity > y->similarity ? -1 : 1;
+    }
+    return x->id - y->id;
+}
+
+/* The sets sharing a band with a set, with their estimated similarity */
+static int lsh_candidates(SimilarityIndex *index, int id, SimilarSet *candidates) {
+    uint32_t dense[MINHASH_BINS], other[MINHASH_BINS];
+    uint64_t key;
+    int count = 0;
+    int b, j;
+
+    pthread_mutex_lock(&index->lock);
+    if (id < index->capacity && densify(index->signatures[id], dense)) {
+        index->queries++;
+        for (b = 0; b < LSH_BANDS; b++) {
+            key = band_key(dense, b);
+            for (j = *bucket(index, b, key); j >= 0; j = index->next[j][b]) {
+                if (j != id && index->keys[j][b] == key && index->seen[j] != index->queries) {
+                    index->seen[j] = index->queries;
+                    densify(index->signatures[j], other);
+                    candidates[count].id = j;
+                    candidates[count++].similarity = estimate(dense, other);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&index->lock);
+    return count;
+}
+
+int find_similar_sets(const Registry *registry, int id, int k, int exact, SimilarSet *results) {
+    ArenaMark mark = arena_mark(command_arena());
+    SimilarSet *candidates = arena_alloc(command_arena(), registry->next_id * sizeof(SimilarSet));
+    long shared, either;
+    int count = 0, found = 0;
+    int i;
+
+    if (registry->similarity != NULL) {
+        count = lsh_candidates(registry->similarity, id, candidates);
+    } else {
+        exact = 1;
+        for (i = 0; i < registry->next_id; i++) {
+            if (i != id && registry_entry(registry, i)->in_use) {
+                candidates[count++].id = i;
+            }
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (exact) {
+            count_stored_overlap(registry_set(registry, id), registry_set(registry, candidates[i].id), &shared, &either);
+            candidates[i].similarity = shared > 0 ? (double)shared / either : 0;
+        }
+        if (candidates[i].similarity > 0) {
+            candidates[found++] = candidates[i];
+        }
+    }
+    qsort(candidates, found, sizeof(SimilarSet), compare_similar);
+    if (found > k) {
+        found = k;
+    }
+    memcpy(results, candidates, found * sizeof(SimilarSet));
+    arena_rewind(command_arena(), mark);
+    return found;
+}
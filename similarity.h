@@ -0,0 +1,110 @@
+#ifndef SIMILARITY_H
+#define SIMILARITY_H
+
+#include <pthread.h>
+#include "registry.h"
+
+#define MINHASH_BIN_BITS 7
+#define MINHASH_BINS (1 << MINHASH_BIN_BITS)  /* Signature length; bins of one-permutation MinHash */
+#define LSH_BANDS 64   /* Of two bins each: sets with similarity 0.3 share a band 99.8% of the time */
+#define LSH_ROWS (MINHASH_BINS / LSH_BANDS)
+#define MINHASH_EMPTY UINT32_MAX  /* A bin no member hashed into */
+
+/**
+ * @brief MinHash signatures of the sets and the LSH tables over them.
+ *
+ * Each member is hashed once; the top bits of the hash pick one of
+ * MINHASH_BINS bins and the bin keeps the smallest remaining bits, so the
+ * signature of a union is the bin-wise minimum of the signatures. For
+ * banding, empty bins borrow the next non-empty bin's value. Every band of
+ * LSH_ROWS bins is hashed into its own table; sets sharing any band key
+ * are candidates for each other.
+ */
+typedef struct SimilarityIndex {
+    pthread_mutex_t lock;          /* Guards everything below */
+    int capacity;                  /* Registry ids with room in the arrays */
+    uint32_t (*signatures)[MINHASH_BINS];  /* Per id, without the empty bins filled */
+    uint64_t (*keys)[LSH_BANDS];   /* Per id, the band keys it is filed under */
+    int (*next)[LSH_BANDS];        /* Per id, the next id in the same bucket, or -1 */
+    int *filed;                    /* Per id, 1 if it is in the tables */
+    int *seen;                     /* Per id, the last query that made it a candidate */
+    int queries;
+    int *heads;                    /* LSH_BANDS tables of nbuckets first ids, -1 if empty */
+    int nbuckets;
+} SimilarityIndex;
+
+/**
+ * @brief A set found by find_similar_sets.
+ */
+typedef struct {
+    int id;
+    double similarity;  /* Jaccard similarity, or its MinHash estimate */
+} SimilarSet;
+
+/**
+ * @brief Build the similarity index of a registry from its current sets.
+ *
+ * From then on the registry keeps the index up to date as sets are created
+ * and dropped; after changing a set's members call index_set or one of the
+ * faster variants.
+ * @param registry The registry, without an index yet.
+ */
+void enable_similarity_index(Registry *registry);
+
+/**
+ * @brief Release a similarity index.
+ * @param index The index, or NULL.
+ */
+void free_similarity_index(SimilarityIndex *index);
+
+/**
+ * @brief Recompute the signature of a set from its members.
+ * @param registry The registry; nothing is done if it has no index.
+ * @param id Registry entry id of the set.
+ */
+void index_set(const Registry *registry, int id);
+
+/**
+ * @brief Compute the signature of a set from the members it was just read from.
+ * @param registry The registry; nothing is done if it has no index.
+ * @param id Registry entry id of the set.
+ * @param members The members, in any order and possibly repeated.
+ * @param n Number of members.
+ */
+void index_member_list(const Registry *registry, int id, const int *members, int n);
+
+/**
+ * @brief Give a set that was just made the union of two sets the signature of their union.
+ *
+ * The bin-wise minimum of the two signatures, with no member hashed.
+ * @param registry The registry; nothing is done if it has no index.
+ * @param target Registry entry id of the union, may be a or b.
+ * @param a Registry entry id of the first input.
+ * @param b Registry entry id of the second input.
+ */
+void index_union(const Registry *registry, int target, int a, int b);
+
+/**
+ * @brief Take a set out of the index; called when it is dropped.
+ * @param registry The registry; nothing is done if it has no index.
+ * @param id Registry entry id of the set.
+ */
+void unindex_set(const Registry *registry, int id);
+
+/**
+ * @brief Find the sets most similar to a set, most similar first.
+ *
+ * With an index, the candidates are the sets sharing an LSH band with the
+ * set, ranked by their estimated similarity or, if exact, by their Jaccard
+ * similarity. Without one every set is a candidate and the ranking is
+ * always exact. Sets sharing no member are left out, as is the set itself.
+ * @param registry The registry.
+ * @param id Registry entry id of the set.
+ * @param k The number of sets wanted.
+ * @param exact 1 to rank the candidates by Jaccard similarity.
+ * @param results Receives up to k sets; room for min(k, live sets) is enough.
+ * @return The number of sets found.
+ */
+int find_similar_sets(const Registry *registry, int id, int k, int exact, SimilarSet *results);
+
+#endif /* SIMILARITY_H */
@@ -0,0 +1,160 @@
+#include <string.h>
+#include "snapshot.h"
+
+
+static void* snapshot_alloc(size_t size) {
+    void *ptr = calloc(1, size > 0 ? size : 1);
+    if (ptr == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static void free_snapshot(Snapshot *s) {
+    int i;
+    for (i = 0; i < s->nslots; i++) {
+        release_version(s->slots[i]);
+    }
+    free(s->slots);
+    free(s);
+}
+
+
+SnapshotList* create_snapshot_list(void) {
+    SnapshotList *list = snapshot_alloc(sizeof(SnapshotList));
+    pthread_mutex_init(&list->lock, NULL);
+    return list;
+}
+
+void free_snapshot_list(SnapshotList *list) {
+    Snapshot *s;
+    while ((s = list->head) != NULL) {
+        list->head = s->next;
+        free_snapshot(s);
+    }
+    pthread_mutex_destroy(&list->lock);
+    free(list);
+}
+
+long take_snapshot(Registry *registry) {
+    SnapshotList *list = registry->snapshots;
+    Snapshot *s = snapshot_alloc(sizeof(Snapshot));
+    RegistryEntry *entry;
+    SetVersion *v;
+    int id;
+
+    s->nslots = registry->next_id;
+    s->slots = snapshot_alloc(s->nslots * sizeof(SetVersion*));
+    for (id = 0; id < s->nslots; id++) {
+        entry = registry_entry(registry, id);
+        if (!entry->in_use) {
+            continue;
+        }
+        /* Dense sets only gain a reference per chunk; no words are copied */
+        v = snapshot_alloc(sizeof(SetVersion));
+        v->refs = 1;
+        memcpy(v->name, entry->name, entry->length);
+        v->length = entry->length;
+        share_stored_set(&entry->set, &v->set);
+        s->slots[id] = v;
+    }
+    pthread_mutex_lock(&list->lock);
+    s->number = ++list->count;
+    s->next = list->head;
+    list->head = s;
+    pthread_mutex_unlock(&list->lock);
+    return s->number;
+}
+
+int drop_snapshot(Registry *registry, long number) {
+    SnapshotList *list = registry->snapshots;
+    Snapshot **link, *s;
+
+    pthread_mutex_lock(&list->lock);
+    for (link = &list->head; *link != NULL && (*link)->number != number; link = &(*link)->next) {
+    }
+    s = *link;
+    if (s == NULL) {
+        pthread_mutex_unlock(&list->lock);
+        return 18; /* No such snapshot */
+    }
+    *link = s->next;
+    pthread_mutex_unlock(&list->lock);
+    free_snapshot(s);
+    return 0;
+}
+
+int split_snapshot_name(const char *word, int length, int *name_length, long *number) {
+    const char *at = memchr(word, '@', length);
+    const char *end = word + length;
+    const char *digit;
+
+    if (at == NULL) {
+        return 0;
+    }
+    if (at + 1 == end || end - at > 18) {
+        return -1;
+    }
+    *number = 0;
+    for (digit = at + 1; digit < end; digit++) {
+        if (*digit < '0' || *digit > '9') {
+            return -1;
+        }
+        *number = *number * 10 + (*digit - '0');
+    }
+    *name_length = at - word;
+    return 1;
+}
+
+/* The snapshot with a number; called under the list lock */
+static Snapshot* find_snapshot(const SnapshotList *list, long number) {
+    Snapshot *s;
+    for (s = list->head; s != NULL && s->number != number; s = s->next) {
+    }
+    return s;
+}
+
+/* Whether a version is of the set with a name */
+static int version_named(const SetVersion *v, const char *name, int length) {
+    return v != NULL && v->length == length && memcmp(v->name, name, length) == 0;
+}
+
+SetVersion* snapshot_set(const Registry *registry, long number, const char *name, int length, int *error) {
+    SnapshotList *list = registry->snapshots;
+    int id = find_registry_set(registry, name, length);
+    SetVersion *v = NULL;
+    Snapshot *s;
+    int i;
+
+    pthread_mutex_lock(&list->lock);
+    s = find_snapshot(list, number);
+    if (s == NULL) {
+        *error = 18; /* No such snapshot */
+    } else {
+        if (id >= 0 && id < s->nslots && version_named(s->slots[id], name, length)) {
+            v = s->slots[id];
+        }
+        /* The name belonged to a set since dropped, or to none */
+        for (i = 0; i < s->nslots && v == NULL; i++) {
+            if (version_named(s->slots[i], name, length)) {
+                v = s->slots[i];
+            }
+        }
+        if (v != NULL) {
+            __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+        } else {
+            *error = 1; /* Invalid set name */
+        }
+    }
+    pthread_mutex_unlock(&list->lock);
+    return v;
+}
+
+void release_version(SetVersion *v) {
+    if (v == NULL || __atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    free_stored_set(&v->set);
+    free(v);
+}
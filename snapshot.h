@@ -0,0 +1,100 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <pthread.h>
+#include "registry.h"
+
+/**
+ * @brief An immutable, reference-counted copy of a set as it was when a snapshot was taken.
+ *
+ * A dense set shares its chunks with the live set, which copies a chunk
+ * only when it writes it; a compressed set is copied whole.
+ */
+typedef struct SetVersion {
+    int refs;
+    char name[SET_NAME_MAX];
+    int length;
+    StoredSet set;
+} SetVersion;
+
+/**
+ * @brief The versions of all sets frozen by one snapshot command.
+ */
+typedef struct Snapshot {
+    long number;
+    int nslots;               /* Registry ids handed out when it was taken */
+    SetVersion **slots;       /* Version per registry id, NULL if no set had the id */
+    struct Snapshot *next;
+} Snapshot;
+
+/**
+ * @brief The snapshots a registry holds.
+ */
+typedef struct SnapshotList {
+    pthread_mutex_t lock;     /* Guards the list */
+    Snapshot *head;           /* Newest first */
+    long count;               /* Snapshots taken so far, the number of the newest */
+} SnapshotList;
+
+/**
+ * @brief Allocate an empty snapshot list.
+ * @return The list.
+ */
+SnapshotList* create_snapshot_list(void);
+
+/**
+ * @brief Release a snapshot list and every snapshot in it.
+ * @param list The list.
+ */
+void free_snapshot_list(SnapshotList *list);
+
+/**
+ * @brief Freeze the current contents of every set.
+ *
+ * Dense sets cost a reference per chunk, so no bitmap words are copied;
+ * writers copy a chunk the first time they change it afterwards. Must not
+ * run while a command writes a set, as for any structural command.
+ * @param registry The registry.
+ * @return The number of the new snapshot.
+ */
+long take_snapshot(Registry *registry);
+
+/**
+ * @brief Release a snapshot; versions in use by running commands stay valid.
+ * @param registry The registry.
+ * @param number The snapshot number.
+ * @return 0 on success, 18 if there is no such snapshot.
+ */
+int drop_snapshot(Registry *registry, long number);
+
+/**
+ * @brief Split a set operand of the form NAME@NUMBER, naming a set in a snapshot.
+ * @param word The operand.
+ * @param length Length of the operand.
+ * @param name_length Receives the length of the name part.
+ * @param number Receives the snapshot number.
+ * @return 1 for a snapshot operand, 0 for a plain name, -1 if the number is malformed.
+ */
+int split_snapshot_name(const char *word, int length, int *name_length, long *number);
+
+/**
+ * @brief Get the version of a set in a snapshot.
+ *
+ * Takes no set lock: the version never changes, and reading it afterwards
+ * needs no lock either.
+ * @param registry The registry.
+ * @param number The snapshot number.
+ * @param name The set name.
+ * @param length Length of the name.
+ * @param error Receives 18 if there is no such snapshot, 1 if the set did not exist in it.
+ * @return A reference to the version, released with release_version, or NULL on error.
+ */
+SetVersion* snapshot_set(const Registry *registry, long number, const char *name, int length, int *error);
+
+/**
+ * @brief Drop a reference to a version, freeing it after the last one.
+ * @param v The version, or NULL.
+ */
+void release_version(SetVersion *v);
+
+#endif /* SNAPSHOT_H */
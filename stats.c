@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+
+static const char *stage_names[STAGE_COUNT] = {"read", "parse", "execute"};
+
+Stats command_stats;
+
+static unsigned long stats_epoch = 0;
+static _Thread_local StatsShard *thread_shard = NULL;
+static _Thread_local unsigned long thread_epoch = 0;
+
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+void init_stats(Stats *stats) {
+    memset(stats, 0, sizeof(Stats));
+    pthread_mutex_init(&stats->lock, NULL);
+    stats->epoch = __atomic_add_fetch(&stats_epoch, 1, __ATOMIC_RELAXED);
+    stats->start_ns = stats_now();
+}
+
+
+void free_stats(Stats *stats) {
+    StatsShard *shard, *next;
+
+    for (shard = stats->shards; shard != NULL; shard = next) {
+        next = shard->next;
+        free(shard);
+    }
+    stats->shards = NULL;
+    pthread_mutex_destroy(&stats->lock);
+}
+
+
+/* The calling thread's shard: one a finished thread released, or a new one */
+static StatsShard* own_shard(Stats *stats) {
+    StatsShard *shard;
+
+    if (thread_epoch != stats->epoch) {
+        pthread_mutex_lock(&stats->lock);
+        for (shard = stats->shards; shard != NULL && shard->in_use; shard = shard->next) {
+            /* Find a free shard */
+        }
+        if (shard == NULL) {
+            shard = calloc(1, sizeof(StatsShard));
+            if (shard == NULL) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+            shard->next = stats->shards;
+            stats->shards = shard;
+        }
+        shard->in_use = 1;
+        pthread_mutex_unlock(&stats->lock);
+        thread_shard = shard;
+        thread_epoch = stats->epoch;
+    }
+    return thread_shard;
+}
+
+
+void release_stats_shard(Stats *stats) {
+    if (thread_epoch == stats->epoch) {
+        pthread_mutex_lock(&stats->lock);
+        thread_shard->in_use = 0;
+        pthread_mutex_unlock(&stats->lock);
+        thread_shard = NULL;
+        thread_epoch = 0;
+    }
+}
+
+
+static int bucket_of(uint64_t ns) {
+    int bucket = 63 - __builtin_clzll(ns | 1);  /* floor(log2(ns)) */
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+/* Only the owning thread writes a counter, so a relaxed store of the new value is enough for readers */
+#define BUMP(counter, delta) __atomic_store_n(&(counter), (counter) + (delta), __ATOMIC_RELAXED)
+
+void record_command(Stats *stats, int opcode, const uint64_t ns[STAGE_COUNT], size_t bytes) {
+    StatsShard *shard = own_shard(stats);
+    LatencyStats *s;
+    int stage;
+
+    for (stage = 0; stage < STAGE_COUNT; stage++) {
+        if (stage == STAGE_EXECUTE && opcode == 0) {
+            break;  /* Nothing ran */
+        }
+        s = &shard->stages[opcode][stage];
+        BUMP(s->count, 1);
+        BUMP(s->total_ns, ns[stage]);
+        if (ns[stage] > s->max_ns) {
+            __atomic_store_n(&s->max_ns, ns[stage], __ATOMIC_RELAXED);
+        }
+        BUMP(s->buckets[bucket_of(ns[stage])], 1);
+    }
+    BUMP(shard->input_bytes, bytes);
+}
+
+
+/* The counters of every thread added up; the caller frees the result */
+static StatsShard* merge_shards(Stats *stats) {
+    StatsShard *merged = calloc(1, sizeof(StatsShard)), *shard;
+    const LatencyStats *from;
+    LatencyStats *to;
+    uint64_t max;
+    int op, stage, b;
+
+    if (merged == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&stats->lock);
+    for (shard = stats->shards; shard != NULL; shard = shard->next) {
+        for (op = 0; op < OPCODE_LIMIT; op++) {
+            for (stage = 0; stage < STAGE_COUNT; stage++) {
+                from = &shard->stages[op][stage];
+                to = &merged->stages[op][stage];
+                to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+                to->total_ns += __atomic_load_n(&from->total_ns, __ATOMIC_RELAXED);
+                max = __atomic_load_n(&from->max_ns, __ATOMIC_RELAXED);
+                if (max > to->max_ns) {
+                    to->max_ns = max;
+                }
+                for (b = 0; b < STATS_BUCKETS; b++) {
+                    to->buckets[b] += __atomic_load_n(&from->buckets[b], __ATOMIC_RELAXED);
+                }
+            }
+        }
+        merged->input_bytes += __atomic_load_n(&shard->input_bytes, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats->lock);
+    return merged;
+}
+
+
+/* Upper bound of the bucket holding the given fraction of the samples */
+static uint64_t percentile(const LatencyStats *s, double fraction) {
+    uint64_t rank = (uint64_t)(s->count * fraction);
+    uint64_t seen = 0;
+    int b;
+
+    for (b = 0; b < STATS_BUCKETS; b++) {
+        seen += s->buckets[b];
+        if (seen > rank) {
+            break;
+        }
+    }
+    if (b >= STATS_BUCKETS - 1) {
+        return s->max_ns;
+    }
+    return ((uint64_t)2 << b) - 1 < s->max_ns ? ((uint64_t)2 << b) - 1 : s->max_ns;
+}
+
+/* Commands counted and total time, over every command type */
+static void totals(const StatsShard *counts, uint64_t *commands, uint64_t *errors, uint64_t *busy_ns) {
+    int op, stage;
+
+    *commands = 0;
+    *busy_ns = 0;
+    *errors = counts->stages[0][STAGE_READ].count;
+    for (op = 0; op < OPCODE_LIMIT; op++) {
+        *commands += counts->stages[op][STAGE_READ].count;
+        for (stage = 0; stage < STAGE_COUNT; stage++) {
+            *busy_ns += counts->stages[op][stage].total_ns;
+        }
+    }
+}
+
+void print_stats(Stats *stats, FILE *out) {
+    StatsShard *counts = merge_shards(stats);
+    const LatencyStats *s;
+    uint64_t commands, errors, busy_ns;
+    double elapsed = (stats_now() - stats->start_ns) / 1e9;
+    int op, stage;
+
+    totals(counts, &commands, &errors, &busy_ns);
+    fprintf(out, "commands %llu, errors %llu, input %llu bytes, elapsed %.3f s, busy %.3f s, %.0f commands/s\n",
+            (unsigned long long)commands, (unsigned long long)errors, (unsigned long long)counts->input_bytes,
+            elapsed, busy_ns / 1e9, elapsed > 0 ? commands / elapsed : 0);
+    fprintf(out, "%-15s %-8s %10s %12s %12s %12s %12s\n", "command", "stage", "count", "mean_ns", "p50_ns", "p99_ns", "max_ns");
+    for (op = 0; op < OPCODE_LIMIT; op++) {
+        for (stage = 0; stage < STAGE_COUNT; stage++) {
+            s = &counts->stages[op][stage];
+            if (s->count == 0) {
+                continue;
+            }
+            fprintf(out, "%-15s %-8s %10llu %12llu %12llu %12llu %12llu\n", command_name(op), stage_names[stage],
+                    (unsigned long long)s->count, (unsigned long long)(s->total_ns / s->count),
+                    (unsigned long long)percentile(s, 0.5), (unsigned long long)percentile(s, 0.99),
+                    (unsigned long long)s->max_ns);
+        }
+    }
+    free(counts);
+}
+
+
+int dump_stats_json(Stats *stats, const char *path) {
+    StatsShard *counts;
+    const LatencyStats *s;
+    uint64_t commands, errors, busy_ns;
+    FILE *out = fopen(path, "w");
+    int op, stage, b, first_op = 1, last;
+
+    if (out == NULL) {
+        return -1;
+    }
+    counts = merge_shards(stats);
+    totals(counts, &commands, &errors, &busy_ns);
+    fprintf(out, "{\n  \"commands\": %llu,\n  \"errors\": %llu,\n  \"input_bytes\": %llu,\n"
+            "  \"elapsed_ns\": %llu,\n  \"busy_ns\": %llu,\n  \"histogram_buckets\": \"log2 ns\",\n  \"by_command\": {",
+            (unsigned long long)commands, (unsigned long long)errors, (unsigned long long)counts->input_bytes,
+            (unsigned long long)(stats_now() - stats->start_ns), (unsigned long long)busy_ns);
+    for (op = 0; op < OPCODE_LIMIT; op++) {
+        if (counts->stages[op][STAGE_READ].count == 0) {
+            continue;
+        }
+        fprintf(out, "%s\n    \"%s\": {", first_op ? "" : ",", command_name(op));
+        first_op = 0;
+        for (stage = 0; stage < STAGE_COUNT; stage++) {
+            s = &counts->stages[op][stage];
+            fprintf(out, "%s\n      \"%s\": {\"count\": %llu, \"total_ns\": %llu, \"max_ns\": %llu, "
+                    "\"p50_ns\": %llu, \"p99_ns\": %llu, \"histogram\": [",
+                    stage == 0 ? "" : ",", stage_names[stage], (unsigned long long)s->count,
+                    (unsigned long long)s->total_ns, (unsigned long long)s->max_ns,
+                    (unsigned long long)percentile(s, 0.5), (unsigned long long)percentile(s, 0.99));
+            for (last = STATS_BUCKETS - 1; last > 0 && s->buckets[last] == 0; last--) {
+                /* Trim empty high buckets */
+            }
+            for (b = 0; b <= last; b++) {
+                fprintf(out, "%s%llu", b == 0 ? "" : ", ", (unsigned long long)s->buckets[b]);
+            }
+            fprintf(out, "]}");
+        }
+        fprintf(out, "\n    }");
+    }
+    fprintf(out, "\n  }\n}\n");
+    free(counts);
+    return fclose(out) == 0 ? 0 : -1;
+}
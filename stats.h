@@ -0,0 +1,115 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "parser.h"
+
+#define STATS_BUCKETS 48   /* Bucket b counts latencies of 2^b .. 2^(b+1) - 1 ns */
+
+/**
+ * @brief The stages a command goes through.
+ *
+ * Trimming, validation and parsing are one pass of parse_command, so
+ * they are measured together as the parse stage.
+ */
+typedef enum {
+    STAGE_READ,     /* Reading the line */
+    STAGE_PARSE,    /* parse_command */
+    STAGE_EXECUTE,  /* Running the command, including its output */
+    STAGE_COUNT
+} Stage;
+
+/**
+ * @brief Latency counters and a log2 histogram of one stage of one command.
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_BUCKETS];
+} LatencyStats;
+
+/**
+ * @brief Counters of every stage of every command type, as recorded by one thread.
+ *
+ * Row 0 holds the lines that failed to parse; the other rows are indexed
+ * by opcode.
+ */
+typedef struct StatsShard {
+    LatencyStats stages[OPCODE_LIMIT][STAGE_COUNT];
+    uint64_t input_bytes;
+    int in_use;  /* Owned by a thread; guarded by the Stats lock */
+    struct StatsShard *next;
+} StatsShard;
+
+/**
+ * @brief The counters of a process: one shard per thread that recorded a command.
+ *
+ * A thread only ever adds to its own shard, so recording takes no lock;
+ * print_stats and dump_stats_json add the shards up. A thread that exits
+ * releases its shard, and the next new thread continues counting in it.
+ */
+typedef struct {
+    StatsShard *shards;
+    pthread_mutex_t lock;  /* Guards the shard list */
+    unsigned long epoch;   /* Tells threads a shard cached for an earlier Stats is stale */
+    uint64_t start_ns;
+} Stats;
+
+/**
+ * @brief The counters of this process, always collected.
+ */
+extern Stats command_stats;
+
+/**
+ * @brief Read the monotonic clock.
+ * @return Nanoseconds since an arbitrary point.
+ */
+uint64_t stats_now(void);
+
+/**
+ * @brief Reset the counters and start the elapsed time.
+ * @param stats Pointer to the counters.
+ */
+void init_stats(Stats *stats);
+
+/**
+ * @brief Release the shards of the counters, once no thread records into them.
+ * @param stats Pointer to the counters.
+ */
+void free_stats(Stats *stats);
+
+/**
+ * @brief Add the stage latencies of one command to the calling thread's shard.
+ * @param stats Pointer to the counters.
+ * @param opcode The command's opcode, or 0 if it failed to parse.
+ * @param ns Latency of each stage in nanoseconds; stages past a failed parse are 0.
+ * @param bytes Length of the command line.
+ */
+void record_command(Stats *stats, int opcode, const uint64_t ns[STAGE_COUNT], size_t bytes);
+
+/**
+ * @brief Hand the calling thread's shard to the next thread that records; called as a thread exits.
+ * @param stats Pointer to the counters.
+ */
+void release_stats_shard(Stats *stats);
+
+/**
+ * @brief Print the counters as a table, one row per command and stage.
+ * @param stats Pointer to the counters.
+ * @param out The stream to print to.
+ */
+void print_stats(Stats *stats, FILE *out);
+
+/**
+ * @brief Write the counters, including the histograms, as JSON.
+ * @param stats Pointer to the counters.
+ * @param path The file name.
+ * @return 0 on success, -1 if the file cannot be written.
+ */
+int dump_stats_json(Stats *stats, const char *path);
+
+#endif /* STATS_H */
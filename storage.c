@@ -0,0 +1,261 @@
+#include <string.h>
+#include "storage.h"
+#include "arena.h"
+
+
+void read_stored_set(int* ptr, StoredSet* s, int n) {
+    if (s->compressed) {
+        read_cset(ptr, &s->packed, n);
+    } else {
+        read_chunked(ptr, &s->dense, n);
+    }
+}
+
+
+void read_stored_bitmap(StoredSet* s, const unsigned char* words, size_t first, size_t n) {
+    static const unsigned char zero[sizeof(uint64_t)] = {0};
+    ArenaMark mark = arena_mark(command_arena());
+    Set members;
+
+    /* Size the set to its largest member, as read_set does */
+    while (n > 0 && memcmp(words + (n - 1) * sizeof(uint64_t), zero, sizeof(uint64_t)) == 0) {
+        n--;
+    }
+    /* The words only pass through on the way into chunks or containers */
+    init_set(&members);
+    if (n > 0) {
+        members.nwords = first + n;
+        members.words = arena_alloc(command_arena(), members.nwords * sizeof(uint64_t));
+        memset(members.words, 0, first * sizeof(uint64_t));
+        memcpy(members.words + first, words, n * sizeof(uint64_t));
+    }
+    if (s->compressed) {
+        set_to_cset(&members, &s->packed);
+    } else {
+        assign_chunked(&s->dense, &members);
+    }
+    arena_rewind(command_arena(), mark);
+}
+
+
+void assign_stored_set(StoredSet* s, Set* members) {
+    if (s->compressed) {
+        set_to_cset(members, &s->packed);
+    } else {
+        assign_chunked(&s->dense, members);
+    }
+    free_set(members);
+}
+
+
+void add_stored_range(StoredSet* s, long first, long last) {
+    if (s->compressed) {
+        add_cset_range(&s->packed, first, last);
+    } else {
+        add_chunked_range(&s->dense, first, last);
+    }
+}
+
+
+void remove_stored_range(StoredSet* s, long first, long last) {
+    if (s->compressed) {
+        remove_cset_range(&s->packed, first, last);
+    } else {
+        remove_chunked_range(&s->dense, first, last);
+    }
+}
+
+
+void print_stored_set(const StoredSet* s) {
+    if (s->compressed) {
+        print_cset(&s->packed);
+    } else {
+        print_chunked(&s->dense);
+    }
+}
+
+
+long count_stored_set(const StoredSet* s) {
+    return s->compressed ? count_cset(&s->packed) : count_chunked(&s->dense);
+}
+
+
+int contains_stored_set(const StoredSet* s, long x) {
+    return s->compressed ? contains_cset(&s->packed, x) : contains_chunked(&s->dense, x);
+}
+
+
+/* The directory to answer from for a dense set, built if it is out of date */
+static const RankDirectory* ready_directory(const StoredSet* s, RankDirectory* d) {
+    if (d != NULL && !rank_directory_ready(d, &s->dense)) {
+        build_rank_directory(d, &s->dense);
+    }
+    return d;
+}
+
+
+long rank_stored_set(const StoredSet* s, RankDirectory* d, long x) {
+    return s->compressed ? rank_cset(&s->packed, x) : rank_chunked(&s->dense, ready_directory(s, d), x);
+}
+
+
+long select_stored_set(const StoredSet* s, RankDirectory* d, long k) {
+    return s->compressed ? select_cset(&s->packed, k) : select_chunked(&s->dense, ready_directory(s, d), k);
+}
+
+
+/* Dense members of a compressed set, into an empty chunked set */
+static void cset_to_chunked(const CompressedSet* s, ChunkedSet* target) {
+    size_t first, n, chunk;
+    int i = 0;
+
+    grow_chunked(target, (long)(cset_nwords(s) * SET_WORD_BITS));
+    while (i < s->count) {
+        /* Only chunks with containers get words */
+        chunk = (size_t)s->containers[i].key * CSET_BITMAP_WORDS / SET_CHUNK_WORDS;
+        first = chunk * SET_CHUNK_WORDS;
+        n = target->nwords - first < SET_CHUNK_WORDS ? target->nwords - first : SET_CHUNK_WORDS;
+        cset_words(s, first, n, writable_words(target, first, n));
+        while (i < s->count && (size_t)s->containers[i].key * CSET_BITMAP_WORDS / SET_CHUNK_WORDS == chunk) {
+            i++;
+        }
+    }
+}
+
+/* Compressed members of a chunked set, replacing the target's */
+static void chunked_to_cset(const ChunkedSet* s, CompressedSet* target) {
+    size_t i, n;
+
+    free_cset(target);
+    for (i = 0; i < s->nchunks; i++) {
+        if (s->chunks[i] != NULL) {
+            n = s->chunks[i]->size;
+            append_cset_words(s->chunks[i]->words, i * SET_CHUNK_WORDS, n, target);
+        }
+    }
+}
+
+
+void operate_stored_sets(SetOperation op, const StoredSet* s1, const StoredSet* s2, StoredSet* target) {
+    const StoredSet *inputs[2] = {s1, s2};
+    ChunkedSet dense[2] = {{0}};
+    CompressedSet packed[2] = {{0}};
+    const ChunkedSet *dense_in[2];
+    const CompressedSet *packed_in[2];
+    int i;
+
+    /* Bring both inputs into the target's storage kind */
+    for (i = 0; i < 2; i++) {
+        if (inputs[i]->compressed == target->compressed) {
+            dense_in[i] = &inputs[i]->dense;
+            packed_in[i] = &inputs[i]->packed;
+        } else if (target->compressed) {
+            chunked_to_cset(&inputs[i]->dense, &packed[i]);
+            packed_in[i] = &packed[i];
+        } else {
+            cset_to_chunked(&inputs[i]->packed, &dense[i]);
+            dense_in[i] = &dense[i];
+        }
+    }
+
+    if (target->compressed) {
+        operate_csets(op, packed_in[0], packed_in[1], &target->packed);
+    } else {
+        operate_chunked(op, dense_in[0], dense_in[1], &target->dense);
+    }
+
+    for (i = 0; i < 2; i++) {
+        free_chunked(&dense[i]);
+        free_cset(&packed[i]);
+    }
+}
+
+
+/* Point at the compressed form of s, converting a dense set into scratch */
+static const CompressedSet* packed_form(const StoredSet* s, CompressedSet* scratch) {
+    if (s->compressed) {
+        return &s->packed;
+    }
+    chunked_to_cset(&s->dense, scratch);
+    return scratch;
+}
+
+
+int test_stored_sets(SetTest test, const StoredSet* s1, const StoredSet* s2) {
+    CompressedSet packed[2] = {{0}};
+    int result;
+
+    if (!s1->compressed && !s2->compressed) {
+        return test_chunked(test, &s1->dense, &s2->dense);
+    }
+    result = test_csets(test, packed_form(s1, &packed[0]), packed_form(s2, &packed[1]));
+    free_cset(&packed[0]);
+    free_cset(&packed[1]);
+    return result;
+}
+
+
+void count_stored_overlap(const StoredSet* s1, const StoredSet* s2, long* shared, long* either) {
+    CompressedSet packed[2] = {{0}};
+
+    if (!s1->compressed && !s2->compressed) {
+        count_chunked_overlap(&s1->dense, &s2->dense, shared, either);
+        return;
+    }
+    count_cset_overlap(packed_form(s1, &packed[0]), packed_form(s2, &packed[1]), shared, either);
+    free_cset(&packed[0]);
+    free_cset(&packed[1]);
+}
+
+
+void convert_stored_set(StoredSet* s, int compressed) {
+    if (s->compressed == compressed) {
+        return;
+    }
+    if (compressed) {
+        chunked_to_cset(&s->dense, &s->packed);
+        free_chunked(&s->dense);
+    } else {
+        cset_to_chunked(&s->packed, &s->dense);
+        free_cset(&s->packed);
+    }
+    s->compressed = compressed;
+}
+
+
+void share_stored_set(const StoredSet* s, StoredSet* copy) {
+    free_stored_set(copy);
+    copy->compressed = s->compressed;
+    if (s->compressed) {
+        copy_cset(&s->packed, &copy->packed);
+    } else {
+        share_chunked(&s->dense, &copy->dense);
+    }
+}
+
+
+size_t stored_set_words(const StoredSet* s) {
+    return s->compressed ? cset_nwords(&s->packed) : s->dense.nwords;
+}
+
+
+void open_set_reader(SetReader* reader, const StoredSet* set) {
+    reader->set = set;
+    reader->nwords = stored_set_words(set);
+}
+
+
+const uint64_t* read_set_words(const SetReader* reader, size_t first, size_t n, uint64_t* buffer) {
+    if (reader->set->compressed) {
+        cset_words(&reader->set->packed, first, n, buffer);
+        return buffer;
+    }
+    return chunked_words(&reader->set->dense, first, n, buffer);  /* Looked up now: the set may have grown since */
+}
+
+
+void free_stored_set(StoredSet* s) {
+    free_chunked(&s->dense);
+    free_cset(&s->packed);
+    s->compressed = 0;
+}
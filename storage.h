@@ -0,0 +1,197 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "set.h"
+#include "chunked.h"
+#include "cset.h"
+#include "rank.h"
+
+/**
+ * @brief A set kept either as a dense bitmap in shared chunks or as a compressed set.
+ *
+ * A zero-initialized StoredSet is a valid empty dense set.
+ */
+typedef struct {
+    int compressed;        /* 1 if packed holds the members, 0 for dense */
+    ChunkedSet dense;
+    CompressedSet packed;
+} StoredSet;
+
+/**
+ * @brief Reads the words of a stored set a window at a time.
+ *
+ * A window inside one chunk of a dense set is read in place, and a
+ * compressed set only decodes the containers it overlaps.
+ */
+typedef struct {
+    const StoredSet *set;
+    size_t nwords;         /* Words up to the last one that can hold a member */
+} SetReader;
+
+/**
+ * @brief Read integers into a stored set, keeping its storage kind.
+ * @param ptr Pointer to the array of integers to be read.
+ * @param s Pointer to the set to store the integers.
+ * @param n Number of integers to read.
+ */
+void read_stored_set(int* ptr, StoredSet* s, int n);
+
+/**
+ * @brief Replace the members of a stored set with those of a bitmap, as read_stored_set does.
+ * @param s Pointer to the stored set.
+ * @param words The bitmap's words, in the byte order of the host, not necessarily aligned.
+ * @param first Index of the first word; members below first * SET_WORD_BITS are absent.
+ * @param n Number of words.
+ */
+void read_stored_bitmap(StoredSet* s, const unsigned char* words, size_t first, size_t n);
+
+/**
+ * @brief Replace the members of a stored set with those of a dense set, as read_stored_set does.
+ * @param s Pointer to the stored set.
+ * @param members The new members; freed, and the set left empty.
+ */
+void assign_stored_set(StoredSet* s, Set* members);
+
+/**
+ * @brief Add the members first .. last to a stored set, keeping its storage kind.
+ * @param s Pointer to the set.
+ * @param first The first member of the range.
+ * @param last The last member of the range, not less than first.
+ */
+void add_stored_range(StoredSet* s, long first, long last);
+
+/**
+ * @brief Remove the members first .. last from a stored set.
+ * @param s Pointer to the set.
+ * @param first The first member of the range.
+ * @param last The last member of the range, not less than first.
+ */
+void remove_stored_range(StoredSet* s, long first, long last);
+
+/**
+ * @brief Print the contents of a stored set.
+ * @param s The set to be printed.
+ */
+void print_stored_set(const StoredSet* s);
+
+/**
+ * @brief Count the members of a stored set.
+ * @param s Pointer to the set.
+ * @return The number of members.
+ */
+long count_stored_set(const StoredSet* s);
+
+/**
+ * @brief Check whether a number is a member of a stored set.
+ * @param s Pointer to the set.
+ * @param x The number to look for.
+ * @return 1 if x is a member, 0 otherwise.
+ */
+int contains_stored_set(const StoredSet* s, long x);
+
+/**
+ * @brief Count the members of a stored set below a number.
+ *
+ * A dense set is answered from a rank directory, built first if the set
+ * changed since it last was; a compressed set from its chunk cardinalities.
+ * @param s Pointer to the set.
+ * @param d The set's rank directory, or NULL to count without one.
+ * @param x The number.
+ * @return The number of members less than x.
+ */
+long rank_stored_set(const StoredSet* s, RankDirectory* d, long x);
+
+/**
+ * @brief Find the member of a stored set with a given number of members below it.
+ * @param s Pointer to the set.
+ * @param d The set's rank directory, as for rank_stored_set, or NULL.
+ * @param k Position of the member, 0 for the smallest.
+ * @return The member, or -1 if the set has k members or fewer.
+ */
+long select_stored_set(const StoredSet* s, RankDirectory* d, long k);
+
+/**
+ * @brief Perform a binary operation on stored sets.
+ *
+ * The operation runs in the target's storage kind; inputs stored the other
+ * way are converted first.
+ * @param op The operation to perform.
+ * @param s1 First set.
+ * @param s2 Second set.
+ * @param target Pointer to the set to store the result, may alias s1 or s2.
+ */
+void operate_stored_sets(SetOperation op, const StoredSet* s1, const StoredSet* s2, StoredSet* target);
+
+/**
+ * @brief Compare two stored sets without building a result set.
+ *
+ * Two dense sets are compared chunk by chunk; when either set is compressed,
+ * a dense input is compressed first and the sets are compared by chunk.
+ * @param test The comparison to make.
+ * @param s1 First set.
+ * @param s2 Second set.
+ * @return 1 if the comparison holds, 0 otherwise.
+ */
+int test_stored_sets(SetTest test, const StoredSet* s1, const StoredSet* s2);
+
+/**
+ * @brief Count the members two stored sets share and the members of either.
+ * @param s1 First set.
+ * @param s2 Second set.
+ * @param shared Receives the size of the intersection, or NULL.
+ * @param either Receives the size of the union, or NULL.
+ */
+void count_stored_overlap(const StoredSet* s1, const StoredSet* s2, long* shared, long* either);
+
+/**
+ * @brief Switch a stored set between dense and compressed storage.
+ * @param s Pointer to the set to convert.
+ * @param compressed 1 for compressed storage, 0 for dense.
+ */
+void convert_stored_set(StoredSet* s, int compressed);
+
+/**
+ * @brief Copy a stored set for a snapshot.
+ *
+ * A dense set shares its chunks with the copy, so this costs a reference
+ * per chunk and the first write to a chunk afterwards copies it. A
+ * compressed set has no shared storage and is copied whole.
+ * @param s The set to copy.
+ * @param copy Pointer to the set receiving the copy; its previous contents are released.
+ */
+void share_stored_set(const StoredSet* s, StoredSet* copy);
+
+/**
+ * @brief Number of words a stored set needs as an operand of a dense operation.
+ * @param s Pointer to the set.
+ * @return Its words, or for a compressed set the words up to the end of its last container.
+ */
+size_t stored_set_words(const StoredSet* s);
+
+/**
+ * @brief Prepare to read a stored set.
+ * @param reader Pointer to the reader.
+ * @param set The set.
+ */
+void open_set_reader(SetReader* reader, const StoredSet* set);
+
+/**
+ * @brief Get words first .. first + n - 1 of the set a reader reads.
+ *
+ * A dense set is read as it is at the time of the call, so it may be the
+ * target of the operation reading it.
+ * @param reader The reader.
+ * @param first The first word.
+ * @param n Number of words, at least 1.
+ * @param buffer Array of n words the words are copied into when they cannot be read in place.
+ * @return The words, zero past the end of the set; valid until the set changes.
+ */
+const uint64_t* read_set_words(const SetReader* reader, size_t first, size_t n, uint64_t* buffer);
+
+/**
+ * @brief Release the storage of a stored set and leave it empty and dense.
+ * @param s Pointer to the set to be freed.
+ */
+void free_stored_set(StoredSet* s);
+
+#endif /* STORAGE_H */
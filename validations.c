@@ -1,36 +1,31 @@
+#include <errno.h>
 #include "validations.h"
+#include "set.h"
+#include "arena.h"
 
 const char *VALID_SETS[MAX_SETS] = {"SETA", "SETB", "SETC", "SETD", "SETE", "SETF"};
 const char *VALID_COMMANDS[] = {"read_set", "print_set", "union_set", "intersect_set", "sub_set", "symdiff_set", "stop"};
 
 void read_string(char **str) {
+    Arena *arena = command_arena();
     int ch;
-    int size = 1; /* Initial minimum size */
+    int size = INITIAL_SIZE; /* Initial size */
     int length = 0;
 
-    *str = malloc(size * sizeof(char));
-    if (*str == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
-    }
+    *str = arena_alloc(arena, size * sizeof(char));
 
     while ((ch = getchar()) != '\n' && ch != EOF) {
         (*str)[length++] = ch;
 
         /* Check if more memory is needed */
         if (length >= size) {
-            size *= 2; /* Double the size */
-            char *temp = realloc(*str, size * sizeof(char));
-            if (temp == NULL) {
-                fprintf(stderr, "Memory reallocation failed\n");
-                free(*str);
-                exit(1);
-            }
-            *str = temp;
+            *str = arena_grow(arena, *str, size, size * 2); /* Double the size, in place while the block has room */
+            size *= 2;
         }
     }
 
     if (ch == EOF) {
+        (*str)[length] = '\0';
         manipulate_string(str);
         if (strcmp("stop", *str) != 0) {
             printf("Error: program ended without the stop command"); 
@@ -61,26 +56,11 @@ void manipulate_string(char **str) {
     /* Calculate new length after trimming */
     int new_length = end - start + 1;
 
-    /* Allocate memory for the new string */
-    char *temp = malloc((new_length + 1) * sizeof(char));
-    if (temp == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
-    }
-
     /* Copy the trimmed string */
-    strncpy(temp, &input[start], new_length);
-    temp[new_length] = '\0';
-
-    /* Free the old string memory */
-    free(*str);
+    char *temp = arena_strndup(command_arena(), &input[start], new_length);
 
     /* Handle duplicate whitespace and add space after commas */
-    char *result = malloc((2 * new_length + 1) * sizeof(char)); /* Allocate conservatively */
-    if (result == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1);
-    }
+    char *result = arena_alloc(command_arena(), (2 * new_length + 1) * sizeof(char)); /* Allocate conservatively */
 
     int j = 0, i = 0;
     int comma_found = 0;
@@ -114,16 +94,7 @@ void manipulate_string(char **str) {
     }
 
     result[j] = '\0';
-
-    /* Reallocate the string to the exact size */
-    *str = realloc(result, (j + 1) * sizeof(char));
-    if (*str == NULL) {
-        fprintf(stderr, "Memory reallocation failed\n");
-        free(result);
-        exit(1);
-    }
-
-    free(temp);
+    *str = result;
 }
 
 int check_consecutive_commas(const char *str) {
@@ -280,18 +251,21 @@ int validate_read_command(const char* command) {
 }
 
 int validate_print_command(const char* command) {
-    int valid_set = is_valid_set(get_substring(command, 10, 14)); /* Validate the set name */
+    const char *param = strchr(command, ' ');
+    int length;
 
-    if (!valid_set) {
-        return 1; /* Invalid set name */
+    if (param == NULL) {
+        return 7; /* Missing parameter */
     }
+    param++;
+    length = strcspn(param, " ,");
 
-    if (strlen(command) > 14) {
-        return 8; /* Extraneous text after end of command */
+    if (!is_valid_set(get_substring(param, 0, length))) { /* Validate the set name */
+        return 1; /* Invalid set name */
     }
 
-    if (strlen(command) == 9) {
-        return 7; /* Missing parameter */
+    if (param[length] != '\0') {
+        return 8; /* Extraneous text after end of command */
     }
 
     return 0; /* Command is valid */
@@ -352,11 +326,12 @@ int is_number_in_range(const char *str) {
         }
     }
 
-    /* Convert the string to an integer */
-    int num = atoi(str);
+    /* Convert the string to an integer, saturating on overflow */
+    errno = 0;
+    long num = strtol(str, NULL, 10);
 
-    /* Check if the number is within the range 0 to 127 */
-    return (num >= 0 && num <= 127);
+    /* Check if the number is within the range 0 to SET_MAX_MEMBER */
+    return (errno != ERANGE && num >= 0 && num <= SET_MAX_MEMBER);
 }
 
 char* get_substring(const char* str, int start, int end) {
@@ -365,20 +340,8 @@ char* get_substring(const char* str, int start, int end) {
         return NULL; /* Return NULL for invalid input */
     }
 
-    int len = end - start;
-    char* substr = (char*)malloc((len + 1) * sizeof(char)); /* Allocate memory for the substring */
-
-    /* Check if memory allocation was successful */
-    if (substr == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1); /* Exit if memory allocation failed */
-    }
-
-    /* Copy the substring */
-    strncpy(substr, str + start, len);
-    substr[len] = '\0'; /* Null-terminate the substring */
-
-    return substr;
+    /* Copy the substring; it goes when the command ends */
+    return arena_strndup(command_arena(), str + start, end - start);
 }
 
 int* parse_numbers(const char* str) {
@@ -409,15 +372,11 @@ int* parse_numbers(const char* str) {
     count++; /* Account for the last number */
 
     /* Allocate memory for the numbers */
-    int* numbers = (int*)malloc((count + 1) * sizeof(int)); /* +1 for the terminator */
-    if (numbers == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        return NULL;
-    }
+    int* numbers = arena_alloc(command_arena(), (count + 1) * sizeof(int)); /* +1 for the terminator */
 
     /* Tokenize the string and convert the tokens to integers */
     char* token;
-    char* rest = strdup(numbers_start); /* Create a copy of the numbers string */
+    char* rest = arena_strndup(command_arena(), numbers_start, strlen(numbers_start)); /* Create a copy of the numbers string */
     int index = 0;
     token = strtok(rest, ", ");
     while (token != NULL) {
@@ -425,7 +384,6 @@ int* parse_numbers(const char* str) {
         token = strtok(NULL, ", ");
     }
     numbers[index] = -1; /* Add terminator */
-    free(rest); /* Free the temporary copy of the numbers string */
 
     return numbers;
 }
@@ -460,7 +418,7 @@ int is_valid_command(const char *command) {
     cmd[i] = '\0'; /* Null-terminate the command buffer */
 
     /* Check if the command matches any of the valid commands */
-    for (int j = 0; j < 7; j++) {
+    for (int j = 0; j < (int)(sizeof(VALID_COMMANDS) / sizeof(VALID_COMMANDS[0])); j++) {
         if (strcmp(cmd, VALID_COMMANDS[j]) == 0) {
             return j + 1; /* Return the index of the valid command */
         }
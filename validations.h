@@ -10,15 +10,17 @@
 #define MAX_COMMAND_LENGTH 100
 #define INITIAL_SIZE 100
 
+extern const char *VALID_SETS[MAX_SETS];
+
 /**
- * @brief Read a string from standard input with dynamic allocation.
- * @param str Pointer to the string to be allocated and filled.
+ * @brief Read a string from standard input into command_arena().
+ * @param str Pointer to the string to be allocated and filled; valid until the arena is reset.
  */
 void read_string(char **str);
 
 /**
  * @brief Manipulate a string by trimming whitespace and ensuring proper comma spacing.
- * @param str Pointer to the string to be manipulated.
+ * @param str Pointer to the string to be manipulated; receives a copy in command_arena().
  */
 void manipulate_string(char **str);
 
@@ -65,7 +67,7 @@ int validate_print_command(const char* command);
 int validate_general_command(const char* command);
 
 /**
- * @brief Check if a number is within the range 0 to 127.
+ * @brief Check if a number is within the range 0 to SET_MAX_MEMBER.
  * @param str The string representation of the number.
  * @return 1 if in range, 0 otherwise.
  */
@@ -76,14 +78,14 @@ int is_number_in_range(const char *str);
  * @param str The original string.
  * @param start The starting index.
  * @param end The ending index.
- * @return The extracted substring.
+ * @return The extracted substring, in command_arena(), or NULL for an invalid range.
  */
 char* get_substring(const char* str, int start, int end);
 
 /**
  * @brief Parse numbers from a string based on valid set names.
  * @param str The string to parse.
- * @return Array of parsed numbers.
+ * @return Array of parsed numbers, in command_arena(), or NULL if no set name is found.
  */
 int* parse_numbers(const char* str);
 
@@ -0,0 +1,275 @@
+#include <string.h>
+#include "view.h"
+#include "snapshot.h"
+#include "similarity.h"
+
+#define INITIAL_CAPACITY 8
+
+
+static void* view_realloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (ptr == NULL) {
+        fprintf(stderr, "Memory reallocation failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static int reads_set(const View *v, int id) {
+    int i;
+    for (i = 0; i < v->nsources; i++) {
+        if (v->sources[i] == id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Add words first .. end - 1 to the stale ranges of a view, merging the
+ * ranges it meets, then the closest two if there are too many */
+static void add_dirty(View *v, size_t first, size_t end) {
+    size_t gap, closest = SIZE_MAX;
+    int i, n = 0, merge = 0;
+
+    for (i = 0; i < v->ndirty; i++) {
+        if (v->dirty[i][1] < first || v->dirty[i][0] > end) {
+            v->dirty[n][0] = v->dirty[i][0];
+            v->dirty[n++][1] = v->dirty[i][1];
+        } else {
+            first = v->dirty[i][0] < first ? v->dirty[i][0] : first;
+            end = v->dirty[i][1] > end ? v->dirty[i][1] : end;
+        }
+    }
+    for (i = n; i > 0 && v->dirty[i - 1][0] > first; i--) {
+        v->dirty[i][0] = v->dirty[i - 1][0];
+        v->dirty[i][1] = v->dirty[i - 1][1];
+    }
+    v->dirty[i][0] = first;
+    v->dirty[i][1] = end;
+    v->ndirty = n + 1;
+
+    if (v->ndirty > VIEW_DIRTY_RANGES) {
+        for (i = 1; i < v->ndirty; i++) {
+            gap = v->dirty[i][0] - v->dirty[i - 1][1];
+            if (gap < closest) {
+                closest = gap;
+                merge = i;
+            }
+        }
+        v->dirty[merge - 1][1] = v->dirty[merge][1];
+        for (i = merge + 1; i < v->ndirty; i++) {
+            v->dirty[i - 1][0] = v->dirty[i][0];
+            v->dirty[i - 1][1] = v->dirty[i][1];
+        }
+        v->ndirty--;
+    }
+}
+
+static void remove_view(ViewList *list, View *v) {
+    *v = list->views[--list->count];
+}
+
+/* 1 if set id is target or a view reading it, directly or through other views */
+static int depends_on(const Registry *registry, int id, int target) {
+    View *v;
+    int i;
+
+    if (id == target) {
+        return 1;
+    }
+    v = find_view(registry, id);
+    for (i = 0; v != NULL && i < v->nsources; i++) {
+        if (depends_on(registry, v->sources[i], target)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Words a set gained or lost as an operand change the complement */
+static void mark_universe(Registry *registry, int id, size_t before, size_t after) {
+    if (before < after) {
+        mark_set_changed(registry, id, before, after);
+    } else {
+        mark_set_changed(registry, id, after, before);
+    }
+}
+
+
+void free_view_list(ViewList *list) {
+    if (list == NULL) {
+        return;
+    }
+    free(list->views);
+    free(list);
+}
+
+View* find_view(const Registry *registry, int id) {
+    ViewList *list = registry->views;
+    int i;
+
+    for (i = 0; list != NULL && i < list->count; i++) {
+        if (list->views[i].expr.target == id) {
+            return &list->views[i];
+        }
+    }
+    return NULL;
+}
+
+int in_view(const Registry *registry, int id) {
+    ViewList *list = registry->views;
+    int i;
+
+    for (i = 0; list != NULL && i < list->count; i++) {
+        if (list->views[i].expr.target == id || reads_set(&list->views[i], id)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int check_view(const Registry *registry, const Expression *expr) {
+    int ids[EXPR_MAX_NODES];
+    int n, i;
+
+    for (i = 0; i < expr->count; i++) {
+        if (expr->nodes[i].type == EXPR_SET && expr->nodes[i].version != NULL) {
+            return 22; /* A snapshot never changes, so views do not read them */
+        }
+    }
+    n = expression_sets(expr, ids);
+    for (i = 0; i < n; i++) {
+        if (depends_on(registry, ids[i], expr->target)) {
+            return 23;
+        }
+    }
+    return 0;
+}
+
+void define_view(Registry *registry, const Expression *expr) {
+    ViewList *list = registry->views;
+    View *v = find_view(registry, expr->target);
+
+    if (v == NULL) {
+        if (list == NULL) {
+            list = view_realloc(NULL, sizeof(ViewList));
+            list->views = NULL;
+            list->count = 0;
+            list->capacity = 0;
+            registry->views = list;
+        }
+        if (list->count == list->capacity) {
+            list->capacity = list->capacity > 0 ? list->capacity * 2 : INITIAL_CAPACITY;
+            list->views = view_realloc(list->views, list->capacity * sizeof(View));
+        }
+        v = &list->views[list->count++];
+    }
+    v->expr = *expr;
+    v->nsources = expression_sets(expr, v->sources);
+    v->ndirty = 0;
+    eval_expression(registry, &v->expr);
+}
+
+void drop_view(Registry *registry, int id) {
+    refresh_set(registry, id);
+    remove_view(registry->views, find_view(registry, id));
+}
+
+void forget_set_views(Registry *registry, int id) {
+    ViewList *list = registry->views;
+    View *v;
+    int i;
+
+    if (list == NULL) {
+        return;
+    }
+    /* Backwards, since dropping a view moves the last one into its place */
+    for (i = list->count - 1; i >= 0; i--) {
+        if (reads_set(&list->views[i], id)) {
+            drop_view(registry, list->views[i].expr.target);
+        }
+    }
+    v = find_view(registry, id);
+    if (v != NULL) {
+        remove_view(list, v);
+    }
+}
+
+void refresh_set(Registry *registry, int id) {
+    View *v = find_view(registry, id);
+    int i;
+
+    if (v == NULL || v->ndirty == 0) {
+        return;
+    }
+    for (i = 0; i < v->nsources; i++) {
+        refresh_set(registry, v->sources[i]);
+    }
+    registry_entry(registry, id)->rank.built = 0;
+    eval_expression_words(registry, &v->expr, (const size_t (*)[2])v->dirty, v->ndirty);
+    v->ndirty = 0;
+    index_set(registry, id);
+}
+
+void refresh_all_views(Registry *registry) {
+    ViewList *list = registry->views;
+    int i;
+
+    for (i = 0; list != NULL && i < list->count; i++) {
+        refresh_set(registry, list->views[i].expr.target);
+    }
+}
+
+void mark_set_changed(Registry *registry, int id, size_t first, size_t end) {
+    ViewList *list = registry->views;
+    int i;
+
+    if (first >= end) {
+        return;
+    }
+    /* A view's words change where its sources did, so its own readers are marked too */
+    for (i = 0; list != NULL && i < list->count; i++) {
+        if (reads_set(&list->views[i], id)) {
+            add_dirty(&list->views[i], first, end);
+            mark_set_changed(registry, list->views[i].expr.target, first, end);
+        }
+    }
+}
+
+void capture_span(const StoredSet *s, SetSpan *span) {
+    const CompressedSet *c = &s->packed;
+
+    span->nwords = stored_set_words(s);
+    if (s->compressed) {
+        span->first = c->count > 0 ? (size_t)c->containers[0].key * CSET_BITMAP_WORDS : 0;
+        span->end = span->nwords;
+        return;
+    }
+    chunked_span(&s->dense, &span->first, &span->end);
+}
+
+void mark_set_rewritten(Registry *registry, int id, const SetSpan *before) {
+    SetSpan after;
+
+    if (registry->views == NULL) {
+        return;
+    }
+    capture_span(registry_set(registry, id), &after);
+    if (before->first == before->end) {
+        mark_set_changed(registry, id, after.first, after.end);
+    } else if (after.first == after.end) {
+        mark_set_changed(registry, id, before->first, before->end);
+    } else {
+        mark_set_changed(registry, id, before->first < after.first ? before->first : after.first,
+                         before->end > after.end ? before->end : after.end);
+    }
+    mark_universe(registry, id, before->nwords, after.nwords);
+}
+
+void mark_range_changed(Registry *registry, int id, const SetSpan *before, long first, long last) {
+    if (registry->views == NULL) {
+        return;
+    }
+    mark_set_changed(registry, id, (size_t)first / SET_WORD_BITS, (size_t)last / SET_WORD_BITS + 1);
+    mark_universe(registry, id, before->nwords, stored_set_words(registry_set(registry, id)));
+}
@@ -0,0 +1,151 @@
+#ifndef VIEW_H
+#define VIEW_H
+
+#include "expr.h"
+
+#define VIEW_DIRTY_RANGES 8  /* Past this many, the closest two ranges are merged */
+
+/**
+ * @brief A set defined by an expression over other sets, kept up to date.
+ *
+ * Changes to the sources only mark the words they touched; the target is
+ * brought up to date when it is next read, by evaluating the expression
+ * over those words alone.
+ */
+typedef struct {
+    Expression expr;    /* expr.target is the set the view defines */
+    int sources[EXPR_MAX_NODES];  /* The distinct sets the expression reads */
+    int nsources;
+    size_t dirty[VIEW_DIRTY_RANGES + 1][2];  /* Stale words first .. end - 1, sorted and disjoint; one spare */
+    int ndirty;
+} View;
+
+/**
+ * @brief The views of a registry.
+ */
+typedef struct ViewList {
+    View *views;
+    int count;
+    int capacity;
+} ViewList;
+
+/**
+ * @brief Where the members of a set lie, to tell which words a write changed.
+ */
+typedef struct {
+    size_t first;   /* First word holding a member; first == end for an empty set */
+    size_t end;     /* One past the last word holding a member */
+    size_t nwords;  /* Words the set spans as an expression operand */
+} SetSpan;
+
+/**
+ * @brief Release the views of a registry.
+ * @param list The views, or NULL.
+ */
+void free_view_list(ViewList *list);
+
+/**
+ * @brief Find the view defining a set.
+ * @param registry The registry.
+ * @param id Registry entry id of the set.
+ * @return Pointer to the view, or NULL if the set is not a view.
+ */
+View* find_view(const Registry *registry, int id);
+
+/**
+ * @brief Check whether a set is a view or is read by one.
+ * @param registry The registry.
+ * @param id Registry entry id of the set.
+ * @return 1 if it is, 0 otherwise.
+ */
+int in_view(const Registry *registry, int id);
+
+/**
+ * @brief Check that an expression can define its target as a view.
+ * @param registry The registry.
+ * @param expr The parsed expression.
+ * @return 0 if it can, 22 if it reads a snapshot, 23 if the target would depend on itself.
+ */
+int check_view(const Registry *registry, const Expression *expr);
+
+/**
+ * @brief Define a set as a view, or redefine it, and evaluate it.
+ *
+ * The sources must be up to date; see refresh_set.
+ * @param registry The registry.
+ * @param expr An expression that passed check_view.
+ */
+void define_view(Registry *registry, const Expression *expr);
+
+/**
+ * @brief Make a view an ordinary set again, holding its current members.
+ * @param registry The registry.
+ * @param id Registry entry id of the view.
+ */
+void drop_view(Registry *registry, int id);
+
+/**
+ * @brief Take a set that is being dropped out of the views.
+ *
+ * Views reading it are brought up to date and become ordinary sets; if it
+ * is a view, its definition goes.
+ * @param registry The registry.
+ * @param id Registry entry id of the set.
+ */
+void forget_set_views(Registry *registry, int id);
+
+/**
+ * @brief Bring a view up to date before it is read.
+ *
+ * The views it reads are refreshed first, then only its stale words are
+ * evaluated. Nothing is done for an ordinary or up to date set.
+ * @param registry The registry.
+ * @param id Registry entry id of the set.
+ */
+void refresh_set(Registry *registry, int id);
+
+/**
+ * @brief Bring every view up to date.
+ * @param registry The registry.
+ */
+void refresh_all_views(Registry *registry);
+
+/**
+ * @brief Mark words of a set as changed in the views that depend on it.
+ * @param registry The registry.
+ * @param id Registry entry id of the set written.
+ * @param first The first word changed.
+ * @param end One past the last word changed; SIZE_MAX for every word.
+ */
+void mark_set_changed(Registry *registry, int id, size_t first, size_t end);
+
+/**
+ * @brief Record where the members of a set lie before it is written.
+ * @param s The set.
+ * @param span Receives the span.
+ */
+void capture_span(const StoredSet *s, SetSpan *span);
+
+/**
+ * @brief Mark the words a write may have changed, from the spans before and after it.
+ *
+ * Words outside both spans held no member before or after, so only the
+ * words from the lower first to the higher end changed, along with the
+ * words the set gained or lost as an operand.
+ * @param registry The registry.
+ * @param id Registry entry id of the set written.
+ * @param before The span captured before the write.
+ */
+void mark_set_rewritten(Registry *registry, int id, const SetSpan *before);
+
+/**
+ * @brief Mark the words a range of members covers, and those the set grew by.
+ * @param registry The registry.
+ * @param id Registry entry id of the set written.
+ * @param before The span captured before the write.
+ * @param first The first member of the range.
+ * @param last The last member of the range.
+ */
+void mark_range_changed(Registry *registry, int id, const SetSpan *before, long first, long last);
+
+#endif /* VIEW_H */